@@ -0,0 +1,166 @@
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/queue.h"
+
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "fs_worker.h"
+
+/***********************************
+ *   PRIVATE DATA
+ ***********************************/
+
+static QueueHandle_t fs_worker_queue = NULL;
+static TaskHandle_t fs_worker_task_handle = NULL;
+
+/***********************************
+ *   PRIVATE FUNCTIONS PROTOTYPE
+ **********************************/
+
+static void fs_worker_task(void *arg);
+static void fs_worker_execute(fs_worker_req_t *req);
+
+/***********************************
+ *   PUBLIC FUNCTIONS
+ **********************************/
+
+/**
+ * The function `fs_worker_init` starts the task that runs the file operations, pinned to
+ * FS_WORKER_TASK_CORE so the card transfers do not compete with the network stack. Until it runs,
+ * requests are executed by the caller.
+ */
+bool fs_worker_init(void)
+{
+    if (fs_worker_task_handle != NULL)
+        return true;
+
+    fs_worker_queue = xQueueCreate(FS_WORKER_QUEUE_LEN, sizeof(fs_worker_req_t *));
+    if (fs_worker_queue == NULL)
+    {
+        ESP_LOGE(FS_WORKER_TAG, "No memory for the queue");
+        return false;
+    }
+    if (xTaskCreatePinnedToCore(fs_worker_task, "fs_worker", FS_WORKER_TASK_STACK, NULL, FS_WORKER_TASK_PRIO,
+                                &fs_worker_task_handle, FS_WORKER_TASK_CORE) != pdPASS)
+    {
+        ESP_LOGE(FS_WORKER_TAG, "No memory for the task");
+        vQueueDelete(fs_worker_queue);
+        fs_worker_queue = NULL;
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The function `fs_worker_submit` hands a request to the worker task and returns at once, unless
+ * FS_WORKER_QUEUE_LEN requests are already waiting. The request must not be pending already.
+ */
+void fs_worker_submit(fs_worker_req_t *req)
+{
+    req->result = -1;
+    req->err = 0;
+    req->wait_ms = 0;
+    req->run_ms = 0;
+    req->queued_us = esp_timer_get_time();
+    atomic_store(&req->pending, true);
+
+    if (fs_worker_queue == NULL)
+    {
+        fs_worker_execute(req);
+        return;
+    }
+    xQueueSend(fs_worker_queue, &req, portMAX_DELAY);
+}
+
+bool fs_worker_busy(fs_worker_req_t *req)
+{
+    return atomic_load(&req->pending);
+}
+
+/**
+ * The function `fs_worker_wait` blocks the caller until the request completed. The worker notifies the
+ * waiting task once `pending` is cleared; a notification left over from an earlier wait only costs
+ * one more check of `pending`.
+ */
+void fs_worker_wait(fs_worker_req_t *req)
+{
+    atomic_store(&req->waiter, xTaskGetCurrentTaskHandle());
+    while (atomic_load(&req->pending))
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    atomic_store(&req->waiter, NULL);
+}
+
+/***********************************
+ *   PRIVATE FUNCTIONS
+ ***********************************/
+
+static void fs_worker_task(void *arg)
+{
+    fs_worker_req_t *req;
+
+    for (;;)
+    {
+        if (xQueueReceive(fs_worker_queue, &req, portMAX_DELAY) == pdTRUE)
+            fs_worker_execute(req);
+    }
+}
+
+/**
+ * The function `fs_worker_execute` runs one request, records how long it waited and ran, then
+ * releases it to the caller: `pending` is cleared before the callback, so the callback may submit
+ * the same request again.
+ */
+static void fs_worker_execute(fs_worker_req_t *req)
+{
+    int64_t start = esp_timer_get_time();
+    size_t count;
+
+    req->wait_ms = (uint32_t)((start - req->queued_us) / 1000);
+    errno = 0;
+    switch (req->op)
+    {
+        case E_FS_WORKER_READ:
+            count = fread(req->buf, 1, req->size, req->fp);
+            req->result = (int32_t)count;
+            if (count < req->size && ferror(req->fp))
+                req->err = errno ? errno : EIO;
+            break;
+
+        case E_FS_WORKER_WRITE:
+            count = fwrite(req->buf, 1, req->size, req->fp);
+            req->result = (int32_t)count;
+            if (count < req->size)
+                req->err = errno ? errno : EIO;
+            break;
+
+        case E_FS_WORKER_CLOSE:
+            req->result = fclose(req->fp) == 0 ? 0 : -1;
+            req->fp = NULL;
+            break;
+
+        default:
+            errno = EINVAL;
+            break;
+    }
+    if (req->result < 0 && req->err == 0)
+        req->err = errno ? errno : EIO;
+    req->run_ms = (uint32_t)((esp_timer_get_time() - start) / 1000);
+
+    fs_worker_cb_t cb = req->cb;
+    void *arg = req->arg;
+    atomic_store(&req->pending, false);
+    TaskHandle_t waiter = atomic_load(&req->waiter);
+    if (waiter)
+        xTaskNotifyGive(waiter);
+    if (cb)
+        cb(req, arg);
+}
@@ -0,0 +1,85 @@
+#ifndef FS_WORKER_H_
+#define FS_WORKER_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdatomic.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+
+#define FS_WORKER_QUEUE_LEN             8       // requests waiting at most, fs_worker_submit() blocks beyond
+#define FS_WORKER_TASK_STACK            4096
+#define FS_WORKER_TASK_PRIO             5
+#define FS_WORKER_TASK_CORE             1       // away from the WiFi and lwIP tasks on core 0
+
+#define FS_WORKER_TAG                   "[fs_worker]"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+typedef enum
+{
+    E_FS_WORKER_READ = 0,       // fp, buf, size -> result: bytes read
+    E_FS_WORKER_WRITE,          // fp, buf, size -> result: bytes written
+    E_FS_WORKER_CLOSE           // fp -> result: 0
+} fs_worker_op_t;
+
+typedef struct fs_worker_req fs_worker_req_t;
+
+// Called by the worker task once the request completed, must not block
+typedef void (*fs_worker_cb_t)(fs_worker_req_t *req, void *arg);
+
+/*
+ * One operation on a file the caller opened: opening, stat() and directory listing stay with the
+ * caller, only the data transfers and the close go through the worker. The caller owns the request
+ * and everything it points to until it completed; the same request is submitted again for the next
+ * operation. `result` is -1 on failure with `err` holding errno, read and write also report a short
+ * count that way.
+ */
+struct fs_worker_req
+{
+    fs_worker_op_t  op;
+    FILE            *fp;
+    void            *buf;
+    uint32_t        size;
+    fs_worker_cb_t  cb;         // NULL to poll fs_worker_busy() instead
+    void            *arg;
+    int32_t         result;
+    int             err;
+    uint32_t        wait_ms;    // queued before the worker took it
+    uint32_t        run_ms;     // spent in the file system
+    int64_t         queued_us;
+    atomic_bool     pending;    // submitted and not completed yet
+    _Atomic(TaskHandle_t) waiter; // task blocked in fs_worker_wait(), notified on completion
+};
+
+/**********************
+ *   PUBLIC FUNCTIONS
+ **********************/
+
+bool fs_worker_init(void);
+void fs_worker_submit(fs_worker_req_t *req);
+bool fs_worker_busy(fs_worker_req_t *req);
+void fs_worker_wait(fs_worker_req_t *req);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FS_WORKER_H_ */
@@ -2,6 +2,8 @@
  *      INCLUDES
  *********************/
 
+#include <sys/stat.h>
+
 #include "lwip/sockets.h"
 #include "lwip/dns.h"
 #include "lwip/netdb.h"
@@ -12,8 +14,12 @@
 #include "esp_log.h"
 
 #include "ftp.h"
+#include "ftp_delta.h"
+#include "fs_worker.h"
+#include "journal.h"
 #include "sd_card.h"
 #include "tusb_msc_storage.h"
+#include "tusb.h"
 
 /***********************************
  *      DEFINES
@@ -21,6 +27,11 @@
 
 #define FTP_TAG  "[Ftp]"
 
+#define FTP_VIEW_REFUSED    "Read-only while the USB host has the card"
+#define FTP_NO_CARD         "No SD card"
+#define FTP_PATH_TOO_LONG   "Path too long"
+#define FTP_BENCH_BUSY      "Benchmark in progress"
+
 /***********************************
  *           DATA
  ***********************************/
@@ -28,8 +39,6 @@
 char ftp_user[FTP_USER_PASS_LEN_MAX + 1];
 char ftp_pass[FTP_USER_PASS_LEN_MAX + 1];
 
-extern SemaphoreHandle_t sem_sd_card;
-
 /***********************************
  *   PRIVATE DATA
  ***********************************/
@@ -46,7 +55,7 @@ static const ftp_cmd_t ftp_cmd_table[] =
     { "LIST" }, { "RETR" }, { "STOR" }, { "DELE" },
     { "RMD"	}, { "MKD"	}, { "RNFR" }, { "RNTO" },
     { "NOOP" }, { "QUIgT" }, { "APPE" }, { "NLST" }, 
-    { "AUTH" } 
+    { "AUTH" }, { "SITE" }, { "AVBL" }, { "ALLO" }
 };
 
 int ftp_buff_size = CONFIG_MICROPY_FTPSERVER_BUFFER_SIZE;
@@ -54,6 +63,36 @@ int ftp_timeout = FTP_CMD_TIMEOUT_MS;
 
 static uint8_t ftp_stop = 0;
 
+static ftp_delta_t ftp_delta = {0};
+static char ftp_delta_basis[FTP_DELTA_PATH_MAX];
+
+static journal_cursor_t ftp_changes = {0};
+static journal_find_t ftp_find = {0};
+static char ftp_rx_path[128];               // file being received by STOR/APPE, journaled on close
+static journal_event_t ftp_rx_event;
+static uint64_t ftp_allo_size = 0;          // announced by ALLO for the next STOR/APPE
+static bool ftp_view = false;               // the card is read through the read-only view
+static uint8_t ftp_bench_lun = FTP_CARD_LUN;    // storage measured by SITE BENCH
+static bool ftp_bench_fat = false;
+static bool ftp_bench_meta = false;
+static bool ftp_bench_format = false;  // SITE FORMAT: benchmark, format, benchmark again
+static tinyusb_msc_bench_result_t ftp_bench_results[TINYUSB_MSC_BENCH_RESULTS_MAX];
+static size_t ftp_bench_count = 0;
+static tinyusb_msc_bench_result_t ftp_bench_before[TINYUSB_MSC_BENCH_RESULTS_MAX];    // SITE FORMAT, old volume
+static size_t ftp_bench_before_count = 0;
+static tinyusb_msc_format_info_t ftp_bench_info;    // layout of the volume SITE FORMAT made
+static bool ftp_bench_formatted = false;
+static tinyusb_msc_meta_bench_result_t ftp_bench_meta_results[2];
+static esp_err_t ftp_bench_err = ESP_OK;
+static atomic_bool ftp_bench_running = false;   // the benchmark task has not finished, it holds the storage
+static fs_worker_req_t ftp_io = {0};        // file block being read or written by the storage worker
+static bool ftp_io_issued = false;          // ftp_io submitted, its result not taken yet
+static bool ftp_io_closing = false;         // the received file is being closed by the worker
+static bool ftp_io_eof = false;             // the client closed the data connection of a STOR/APPE
+static uint8_t ftp_io_half = 0;             // dBuffer half the network side uses
+static uint32_t ftp_io_len = 0;             // bytes received into that half
+static uint32_t ftp_io_ms = 0;              // time spent in the card during the transfer
+
 /***********************************
  *   PRIVATE FUNCTIONS PROTOTYPE
  **********************************/
@@ -63,9 +102,10 @@ static uint8_t ftp_stop = 0;
 static bool ftp_open_file(const char *path, const char *mode);
 static void ftp_close_files_dir(void);
 static void ftp_close_filesystem_on_error(void);
-static ftp_result_t ftp_read_file(char *filebuf, uint32_t desiredsize,
-                                  uint32_t *actualsize);
-static ftp_result_t ftp_write_file(char *filebuf, uint32_t size);
+static uint32_t ftp_io_half_size(void);
+static uint8_t *ftp_io_buffer(uint8_t half);
+static void ftp_io_start(fs_worker_op_t op, uint8_t half, uint32_t size);
+static bool ftp_io_collect(void);
 static ftp_result_t ftp_open_dir_for_listing(const char *path);
 static int ftp_get_eplf_item(char *dest, uint32_t destsize, struct dirent *de);
 static ftp_result_t ftp_list_dir(char *list, uint32_t maxlistsize,
@@ -78,7 +118,7 @@ static bool ftp_create_listening_socket(int32_t *sd, uint32_t port, uint8_t back
 static ftp_result_t ftp_wait_for_connection(int32_t l_sd, int32_t *n_sd, uint32_t *ip_addr);
 static void ftp_send_reply(uint32_t status, char *message);
 static void ftp_send_list(uint32_t datasize);
-static void ftp_send_file_data(uint32_t datasize);
+static void ftp_send_file_data(const uint8_t *data, uint32_t datasize);
 static ftp_result_t ftp_recv_non_blocking(int32_t sd, void *buff, int32_t Maxlen, int32_t *rxLen);
 
 // ******** Directory Function **************************
@@ -92,11 +132,43 @@ static void remove_fname_from_path(char *pwd, char *fname);
 static void ftp_pop_param(char **str, char *param, bool stop_on_space, bool stop_on_newline);
 static ftp_cmd_index_t ftp_pop_command(char **str);
 static void ftp_get_param_and_open_child(char **bufptr);
+static void ftp_pop_word(char **str, char *word, uint32_t size);
 
 // ******** Ftp command processing **************************
 
 static void ftp_process_cmd(void);
+static void ftp_process_site(char **bufptr);
+static void ftp_site_sums(char **bufptr);
+static void ftp_site_delta(char **bufptr);
+static void ftp_site_changes(char **bufptr);
+static void ftp_site_find(char **bufptr);
+static bool ftp_parse_range(const char *word, bool is_time, uint64_t *min, uint64_t *max);
+static bool ftp_parse_time(const char *str, bool end, uint32_t *t);
+static void ftp_journal_rx_begin(const char *fullname);
+static bool ftp_space_check(const char *fullname, uint64_t size, bool replace);
+static uint64_t ftp_file_size(const char *fullname, const struct stat *st);
+static void ftp_site_df(void);
+static void ftp_site_mscstat(char **bufptr);
+static uint32_t ftp_mscstat_list(char *list, uint32_t maxlistsize);
+static void ftp_site_bench(char **bufptr);
+static void ftp_site_format(char **bufptr);
+static bool ftp_bench_start(void);
+static void ftp_bench_task(void *arg);
+static void ftp_format_run(void);
+static uint32_t ftp_bench_list(char *list, uint32_t maxlistsize);
+static uint32_t ftp_format_list(char *list, uint32_t maxlistsize);
+static uint32_t ftp_bench_print(char *list, uint32_t maxlistsize, uint32_t len, const char *label,
+                                const tinyusb_msc_bench_result_t *results, size_t count, bool writes_only);
+static void ftp_close_delta(void);
 static void ftp_wait_for_enabled(void);
+static const char *ftp_root(void);
+static bool ftp_cmd_uses_storage(ftp_cmd_index_t cmd);
+static bool ftp_cmd_writes(ftp_cmd_index_t cmd);
+static bool ftp_storage_acquire(bool write);
+static void ftp_storage_continue(void);
+static void ftp_storage_release(void);
+static void ftp_storage_drop_view(void);
+static void ftp_storage_card_check(void);
 
 // **********************************
 
@@ -182,6 +254,7 @@ bool ftp_init(void)
  */
 void ftp_deinit(void)
 {
+    fs_worker_wait(&ftp_io);
     if (ftp_path)
         free(ftp_path);
     if (ftp_cmd_buffer)
@@ -215,9 +288,12 @@ int ftp_run (uint32_t elapsed)
 	ftp_data.ctimeout += elapsed;
 	ftp_data.time += elapsed;
 
-    if ((ftp_data.state != E_FTP_STE_READY))
+    ftp_storage_card_check();
+    ftp_storage_drop_view();
+    if ((ftp_data.state != E_FTP_STE_READY) && sd_card_is_attached() && !fs_worker_busy(&ftp_io) &&
+        !atomic_load(&ftp_bench_running))
     {
-        tinyusb_msc_storage_mount(MOUNT_POINT);
+        ftp_storage_continue();
     }
     
 	switch (ftp_data.state) {
@@ -271,68 +347,223 @@ int ftp_run (uint32_t elapsed)
 			}
 			break;
 		case E_FTP_STE_CONTINUE_FILE_TX:
-			// read and send the next block from the file
+			// send the block the storage worker read while it reads the next one into the other half
 			{
-				uint32_t readsize;
-				ftp_result_t result;
 				ftp_data.ctimeout = 0;
-				result = ftp_read_file ((char *)ftp_data.dBuffer, ftp_buff_size, &readsize);
-				if (result == E_FTP_RESULT_FAILED) {
+				if (!ftp_io_collect())
+					break;
+				if (ftp_io.err != 0) {
+					ftp_close_files_dir();
 					ftp_send_reply(451, NULL);
 					ftp_data.state = E_FTP_STE_END_TRANSFER;
+					ESP_LOGW(FTP_TAG, "Error reading file (%d)", ftp_io.err);
+					break;
 				}
-				else {
-					if (readsize > 0) {
-						ftp_send_file_data(readsize);
-						ftp_data.total += readsize;
-						ESP_LOGI(FTP_TAG, "Sent %"PRIu32", total: %"PRIu32, readsize, ftp_data.total);
-					}
-					if (result == E_FTP_RESULT_OK) {
-						ftp_send_reply(226, NULL);
-						ftp_data.state = E_FTP_STE_END_TRANSFER;
-						ESP_LOGI(FTP_TAG, "File sent (%"PRIu32" bytes in %"PRIu32" msec).", ftp_data.total, ftp_data.time);
-					}
+				uint32_t readsize = ftp_io.result;
+				uint8_t half = ftp_io_half;
+				// a short block is the end of the file, an empty one the end of a file sized in whole blocks
+				bool last = readsize < ftp_io_half_size();
+				if (!last) {
+					ftp_io_half ^= 1;
+					ftp_io_start(E_FS_WORKER_READ, ftp_io_half, ftp_io_half_size());
+				}
+				if (readsize > 0) {
+					ftp_send_file_data(ftp_io_buffer(half), readsize);
+					ftp_data.total += readsize;
+					ESP_LOGI(FTP_TAG, "Sent %"PRIu32", total: %"PRIu64, readsize, ftp_data.total);
+				}
+				if (last) {
+					ftp_close_files_dir();
+					ftp_send_reply(226, NULL);
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+					ESP_LOGI(FTP_TAG, "File sent (%"PRIu64" bytes in %"PRIu32" msec, %"PRIu32" msec in the card).",
+					         ftp_data.total, ftp_data.time, ftp_io_ms);
 				}
 			}
 			break;
 		case E_FTP_STE_CONTINUE_FILE_RX:
-            int32_t len;
-            ftp_result_t result = E_FTP_RESULT_OK;
-
-            ESP_LOGI(FTP_TAG, "ftp_buff_size=%d", ftp_buff_size);
-            result = ftp_recv_non_blocking(ftp_data.d_sd, ftp_data.dBuffer, ftp_buff_size, &len);
-            if (result == E_FTP_RESULT_OK) {
-                // block of data received
-                ftp_data.dtimeout = 0;
-                ftp_data.ctimeout = 0;
-                // save received data to file
-                if (E_FTP_RESULT_OK != ftp_write_file ((char *)ftp_data.dBuffer, len)) {
-                    ftp_send_reply(451, NULL);
-                    ftp_data.state = E_FTP_STE_END_TRANSFER;
-                    ESP_LOGW(FTP_TAG, "Error writing to file");
+            // receive into one half while the storage worker writes the other
+            {
+                uint32_t half_size = ftp_io_half_size();
+                ftp_result_t result = E_FTP_RESULT_CONTINUE;
+                int32_t len;
+
+                if (ftp_io_collect()) {
+                    if (ftp_io.err != 0) {
+                        ftp_io_closing = false;
+                        ftp_close_files_dir();
+                        ftp_send_reply(451, NULL);
+                        ftp_data.state = E_FTP_STE_END_TRANSFER;
+                        ESP_LOGW(FTP_TAG, "Error writing to file (%d)", ftp_io.err);
+                        break;
+                    }
+                    if (ftp_io_closing) {
+                        // File received and closed by the worker, journal it
+                        ftp_io_closing = false;
+                        ftp_close_files_dir();
+                        ftp_send_reply(226, NULL);
+                        ftp_data.state = E_FTP_STE_END_TRANSFER;
+                        ESP_LOGI(FTP_TAG, "File received (%"PRIu64" bytes in %"PRIu32" msec, %"PRIu32" msec in the card).",
+                                 ftp_data.total, ftp_data.time, ftp_io_ms);
+                        break;
+                    }
                 }
-                else {
+                if (ftp_io_closing)
+                    break;
+
+                while (!ftp_io_eof && (ftp_io_len < half_size)) {
+                    result = ftp_recv_non_blocking(ftp_data.d_sd, ftp_io_buffer(ftp_io_half) + ftp_io_len,
+                                                   half_size - ftp_io_len, &len);
+                    if (result != E_FTP_RESULT_OK)
+                        break;
+                    ftp_io_len += len;
                     ftp_data.total += len;
-                    ESP_LOGI(FTP_TAG, "Received %"PRIu32", total: %"PRIu32, len, ftp_data.total);
+                    ftp_data.dtimeout = 0;
+                    ftp_data.ctimeout = 0;
                 }
-            }
-            else if (result == E_FTP_RESULT_CONTINUE) {
-                // nothing received
-                if (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS) {
+                if (result == E_FTP_RESULT_FAILED)
+                    ftp_io_eof = true;
+
+                if (ftp_io_issued) {
+                    // the worker still writes the other half, the client is held back by TCP meanwhile
+                    ftp_data.dtimeout = 0;
+                }
+                else if ((ftp_io_len == half_size) || (ftp_io_eof && (ftp_io_len > 0))) {
+                    ftp_io_start(E_FS_WORKER_WRITE, ftp_io_half, ftp_io_len);
+                    ESP_LOGI(FTP_TAG, "Received %"PRIu32", total: %"PRIu64, ftp_io_len, ftp_data.total);
+                    ftp_io_half ^= 1;
+                    ftp_io_len = 0;
+                }
+                else if (ftp_io_eof) {
+                    // everything written, the close flushes the file and its directory entry
+                    ftp_io_closing = true;
+                    ftp_io_start(E_FS_WORKER_CLOSE, 0, 0);
+                    ftp_data.fp = NULL;
+                }
+                else if (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS) {
                     ftp_close_files_dir();
                     ftp_send_reply(426, NULL);
                     ftp_data.state = E_FTP_STE_END_TRANSFER;
                     ESP_LOGW(FTP_TAG, "Receiving to file timeout");
                 }
             }
-            else {
-                // File received (E_FTP_RESULT_FAILED)
-                ftp_close_files_dir();
-                ftp_send_reply(226, NULL);
-                ftp_data.state = E_FTP_STE_END_TRANSFER;
-                ESP_LOGI(FTP_TAG, "File received (%"PRIu32" bytes in %"PRIu32" msec).", ftp_data.total, ftp_data.time);
-                break;
-            }
+			break;
+		case E_FTP_STE_CONTINUE_SUMS:
+			// send the checksums of the next blocks
+			{
+				uint32_t listsize = 0;
+				ftp_result_t sums_res = ftp_delta_sums_next(&ftp_delta, (char *)ftp_data.dBuffer, ftp_buff_size, &listsize);
+				if (listsize > 0) ftp_send_list(listsize);
+				if (sums_res == E_FTP_RESULT_OK) {
+					ftp_close_delta();
+					ftp_send_reply(226, NULL);
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+				}
+				else if (sums_res == E_FTP_RESULT_FAILED) {
+					ftp_send_reply(451, NULL);
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+				}
+				ftp_data.ctimeout = 0;
+			}
+			break;
+		case E_FTP_STE_CONTINUE_DELTA_RX:
+			// apply the next piece of the delta stream
+			{
+				int32_t rxlen;
+				ftp_result_t rx_res = ftp_recv_non_blocking(ftp_data.d_sd, ftp_data.dBuffer, ftp_buff_size, &rxlen);
+				if (rx_res == E_FTP_RESULT_OK) {
+					ftp_data.dtimeout = 0;
+					ftp_data.ctimeout = 0;
+					ftp_data.total += rxlen;
+					if (ftp_delta_apply_feed(&ftp_delta, ftp_data.dBuffer, rxlen) == E_FTP_RESULT_FAILED) {
+						ftp_send_reply(451, NULL);
+						ftp_data.state = E_FTP_STE_END_TRANSFER;
+						ESP_LOGW(FTP_TAG, "Error applying delta");
+					}
+				}
+				else if (rx_res == E_FTP_RESULT_CONTINUE) {
+					if (ftp_data.dtimeout > FTP_DATA_TIMEOUT_MS) {
+						ftp_send_reply(426, NULL);
+						ftp_data.state = E_FTP_STE_END_TRANSFER;
+						ESP_LOGW(FTP_TAG, "Receiving delta timeout");
+					}
+				}
+				else {
+					// delta stream complete, swap the rebuilt file in
+					uint64_t written = ftp_delta.written;
+					journal_event_t event = (ftp_delta.basis == NULL) ? E_JOURNAL_CREATE : E_JOURNAL_MODIFY;
+					if (ftp_delta_apply_finish(&ftp_delta, MOUNT_POINT, ftp_delta_basis)) {
+						journal_record(event, ftp_delta_basis + strlen(MOUNT_POINT), NULL);
+						ftp_send_reply(226, NULL);
+						ESP_LOGI(FTP_TAG, "Delta applied (%"PRIu64" bytes received, %"PRIu64" bytes written in %"PRIu32" msec).",
+								 ftp_data.total, written, ftp_data.time);
+					}
+					else {
+						ftp_send_reply(451, NULL);
+					}
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+				}
+			}
+			break;
+		case E_FTP_STE_CONTINUE_CHANGES:
+			// send the next journal events
+			{
+				uint32_t listsize = 0;
+				journal_result_t changes_res = journal_changes_next(&ftp_changes, (char *)ftp_data.dBuffer, ftp_buff_size, &listsize);
+				if (listsize > 0) ftp_send_list(listsize);
+				if (changes_res == E_JOURNAL_RESULT_OK) {
+					ftp_send_reply(226, NULL);
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+				}
+				else if (changes_res == E_JOURNAL_RESULT_FAILED) {
+					ftp_send_reply(451, NULL);
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+				}
+				ftp_data.ctimeout = 0;
+			}
+			break;
+		case E_FTP_STE_CONTINUE_FIND:
+			// send the next entries matching the search
+			{
+				uint32_t listsize = 0;
+				journal_result_t find_res = journal_find_next(&ftp_find, (char *)ftp_data.dBuffer, ftp_buff_size, &listsize);
+				if (listsize > 0) ftp_send_list(listsize);
+				if (find_res != E_JOURNAL_RESULT_CONTINUE) {
+					journal_find_close(&ftp_find);
+					ftp_send_reply((find_res == E_JOURNAL_RESULT_OK) ? 226 : 451, NULL);
+					ftp_data.state = E_FTP_STE_END_TRANSFER;
+				}
+				ftp_data.ctimeout = 0;
+			}
+			break;
+		case E_FTP_STE_CONTINUE_MSCSTAT:
+			// send the USB storage statistics
+			{
+				uint32_t listsize = ftp_mscstat_list((char *)ftp_data.dBuffer, ftp_buff_size);
+				if (listsize > 0) ftp_send_list(listsize);
+				ftp_send_reply(226, NULL);
+				ftp_data.state = E_FTP_STE_END_TRANSFER;
+				ftp_data.ctimeout = 0;
+			}
+			break;
+		case E_FTP_STE_CONTINUE_BENCH:
+			// wait for the benchmark task, then send the results
+			{
+				ftp_data.ctimeout = 0;
+				ftp_data.dtimeout = 0;
+				if (atomic_load(&ftp_bench_running))
+					break;
+				uint32_t listsize = ftp_bench_format ? ftp_format_list((char *)ftp_data.dBuffer, ftp_buff_size)
+				                                     : ftp_bench_list((char *)ftp_data.dBuffer, ftp_buff_size);
+				if (listsize > 0) ftp_send_list(listsize);
+				if (ftp_bench_err == ESP_OK)
+					ftp_send_reply(226, NULL);
+				else if (ftp_bench_err == ESP_ERR_INVALID_STATE)
+					ftp_send_reply(450, "Storage in use");
+				else
+					ftp_send_reply(451, NULL);
+				ftp_data.state = E_FTP_STE_END_TRANSFER;
+			}
 			break;
 		default:
 			break;
@@ -381,7 +612,7 @@ int ftp_run (uint32_t elapsed)
 
     if ((ftp_data.state != E_FTP_STE_READY))
     {
-        tinyusb_msc_storage_unmount();
+        ftp_storage_release();
     }
 
 	//xSemaphoreGive(ftp_mutex);
@@ -513,7 +744,7 @@ bool ftp_stop_requested()
  *
  * @param path The `path` parameter in the `ftp_open_file` function is a pointer to a string that
  * represents the file path or filename that you want to open or operate on. It is used to construct
- * the full path to the file by concatenating it with the `MOUNT_POINT` variable.
+ * the full path to the file by concatenating it with the root returned by `ftp_root`.
  * @param mode The `mode` parameter in the `ftp_open_file` function specifies the mode in which the
  * file should be opened. It is a string that indicates how the file should be accessed. Some common
  * modes include:
@@ -525,7 +756,7 @@ static bool ftp_open_file(const char *path, const char *mode)
 {
     ESP_LOGI(FTP_TAG, "ftp_open_file: path=[%s]", path);
     char fullname[128];
-    strcpy(fullname, MOUNT_POINT);
+    strcpy(fullname, ftp_root());
     strcat(fullname, path);
     ESP_LOGI(FTP_TAG, "ftp_open_file: fullname=[%s]", fullname);
     ftp_data.fp = fopen(fullname, mode);
@@ -535,19 +766,35 @@ static bool ftp_open_file(const char *path, const char *mode)
         return false;
     }
     ftp_data.e_open = E_FTP_FILE_OPEN;
+    ftp_io_issued = false;
+    ftp_io_closing = false;
+    ftp_io_eof = false;
+    ftp_io_half = 0;
+    ftp_io_len = 0;
+    ftp_io_ms = 0;
     return true;
 }
 
 /**
  * The function `ftp_close_files_dir` closes either a file or a directory based on the current state of
- * the FTP data.
+ * the FTP data. A block still being read or written by the storage worker is waited for first; a
+ * received file the worker already closed is only journaled.
  */
 static void ftp_close_files_dir(void)
 {
+    fs_worker_wait(&ftp_io);
+    ftp_close_delta();
+    journal_find_close(&ftp_find);
     if (ftp_data.e_open == E_FTP_FILE_OPEN)
     {
-        fclose(ftp_data.fp);
+        if (ftp_data.fp)
+            fclose(ftp_data.fp);
         ftp_data.fp = NULL;
+        if (ftp_rx_path[0] != '\0')
+        {
+            journal_record(ftp_rx_event, ftp_rx_path, NULL);
+            ftp_rx_path[0] = '\0';
+        }
     }
     else if (ftp_data.e_open == E_FTP_DIR_OPEN)
     {
@@ -577,67 +824,48 @@ static void ftp_close_filesystem_on_error(void)
 }
 
 /**
- * The function `ftp_read_file` reads a file into a buffer and returns the result based on the desired
- * and actual sizes.
- *
- * @param filebuf The `filebuf` parameter is a pointer to a buffer where the data read from the FTP
- * file will be stored.
- * @param desiredsize The `desiredsize` parameter in the `ftp_read_file` function represents the size
- * of data that the caller wants to read from the file. It indicates the number of bytes that the
- * caller intends to read from the file into the `filebuf` buffer.
- * @param actualsize The `actualsize` parameter in the `ftp_read_file` function is a pointer to a
- * `uint32_t` variable. This parameter is used to store the actual size of the data read from the file
- * into the `filebuf` buffer. The function updates the value pointed to by `actual
- *
- * @return The function `ftp_read_file` returns a value of type `ftp_result_t`, which is either
- * `E_FTP_RESULT_CONTINUE`, `E_FTP_RESULT_FAILED`, or `E_FTP_RESULT_OK` based on the conditions within
- * the function.
+ * The function `ftp_io_half_size` returns the size of one half of the data buffer: during a file
+ * transfer the storage worker reads or writes one half while the other is sent or received.
  */
-static ftp_result_t ftp_read_file(char *filebuf, uint32_t desiredsize, uint32_t *actualsize)
+static uint32_t ftp_io_half_size(void)
 {
-    ftp_result_t result = E_FTP_RESULT_CONTINUE;
-    *actualsize = fread(filebuf, 1, desiredsize, ftp_data.fp);
-    if (*actualsize == 0)
-    {
-        ftp_close_files_dir();
-        result = E_FTP_RESULT_FAILED;
-    }
-    else if (*actualsize < desiredsize)
-    {
-        ftp_close_files_dir();
-        result = E_FTP_RESULT_OK;
-    }
-    return result;
+    return (uint32_t)ftp_buff_size / 2;
+}
+
+static uint8_t *ftp_io_buffer(uint8_t half)
+{
+    return ftp_data.dBuffer + half * ftp_io_half_size();
 }
 
 /**
- * The function `ftp_write_file` writes a file buffer to an FTP server and returns a result indicating
- * success or failure.
- *
- * @param filebuf The `filebuf` parameter in the `ftp_write_file` function is a pointer to a buffer
- * containing the data that needs to be written to a file.
- * @param size The `size` parameter in the `ftp_write_file` function represents the size of the data to
- * be written to the file. It is of type `uint32_t`, which is an unsigned 32-bit integer. This
- * parameter specifies the number of bytes to be written from the `filebuf`
+ * The function `ftp_io_start` hands the next operation on the open file to the storage worker; the
+ * FTP task goes on with the network and picks the result up with `ftp_io_collect`.
+ */
+static void ftp_io_start(fs_worker_op_t op, uint8_t half, uint32_t size)
+{
+    ftp_io.op = op;
+    ftp_io.fp = ftp_data.fp;
+    ftp_io.buf = ftp_io_buffer(half);
+    ftp_io.size = size;
+    ftp_io.cb = NULL;
+    ftp_io_issued = true;
+    fs_worker_submit(&ftp_io);
+}
+
+/**
+ * The function `ftp_io_collect` takes the result of the operation started by `ftp_io_start`.
  *
- * @return The function `ftp_write_file` is returning a variable of type `ftp_result_t`, which is
- * either `E_FTP_RESULT_OK` if the write operation was successful, or `E_FTP_RESULT_FAILED` if it was
- * not successful.
+ * @return true once the operation completed, its result is in `ftp_io`; false while it runs or when
+ * nothing was started.
  */
-static ftp_result_t ftp_write_file(char *filebuf, uint32_t size)
+static bool ftp_io_collect(void)
 {
-    ftp_result_t result = E_FTP_RESULT_FAILED;
-    uint32_t actualsize = fwrite(filebuf, 1, size, ftp_data.fp);
+    if (!ftp_io_issued || fs_worker_busy(&ftp_io))
+        return false;
 
-    if (actualsize == size)
-    {
-        result = E_FTP_RESULT_OK;
-    }
-    else
-    {
-        ftp_close_files_dir();
-    }
-    return result;
+    ftp_io_issued = false;
+    ftp_io_ms += ftp_io.run_ms;
+    return true;
 }
 
 /**
@@ -646,14 +874,14 @@ static ftp_result_t ftp_write_file(char *filebuf, uint32_t size)
  *
  * @param path The `path` parameter in the `ftp_open_dir_for_listing` function represents the directory
  * path that you want to open for listing. It is a string containing the directory path relative to the
- * `MOUNT_POINT` directory.
+ * `ftp_root` directory.
  *
  * @return E_FTP_RESULT_CONTINUE
  */
 static ftp_result_t ftp_open_dir_for_listing(const char *path)
 {
     char fullname[128];
-    strcpy(fullname, MOUNT_POINT);
+    strcpy(fullname, ftp_root());
     strcat(fullname, path);
 
     if (ftp_data.dp)
@@ -662,8 +890,8 @@ static ftp_result_t ftp_open_dir_for_listing(const char *path)
         ftp_data.dp = NULL;
     }
 
-    ESP_LOGI(FTP_TAG, "ftp_open_dir_for_listing path=[%s] MOUNT_POINT=[%s]",
-             path, MOUNT_POINT);
+    ESP_LOGI(FTP_TAG, "ftp_open_dir_for_listing path=[%s] root=[%s]",
+             path, ftp_root());
     ESP_LOGI(FTP_TAG, "ftp_open_dir_for_listing: %s", fullname);
 
     ftp_data.dp = opendir(fullname); // Open the directory
@@ -706,18 +934,18 @@ static int ftp_get_eplf_item (char *dest, uint32_t destsize, struct dirent *de)
 
 	// Get full file path needed for stat function
 	char fullname[128];
-	strcpy(fullname, MOUNT_POINT);
+	strcpy(fullname, ftp_root());
 	strcat(fullname, ftp_path);
 	if (fullname[strlen(fullname)-1] != '/') strcat(fullname, "/");
 	strcat(fullname, de->d_name);
 
 	struct stat buf;
 	int res = stat(fullname, &buf);
-	ESP_LOGI(FTP_TAG, "ftp_get_eplf_item res=%d buf.st_size=%ld", res, buf.st_size);
+	uint64_t size = (res < 0) ? 0 : ftp_file_size(fullname, &buf);
+	ESP_LOGI(FTP_TAG, "ftp_get_eplf_item res=%d size=%" PRIu64, res, size);
 	
     if (res < 0) 
     {
-		buf.st_size = 0;
 		buf.st_mtime = 946684800; // Jan 1, 2000
 	}
 
@@ -736,7 +964,7 @@ static int ftp_get_eplf_item (char *dest, uint32_t destsize, struct dirent *de)
 	while (addsize >= destsize) 
     {
 		if (ftp_nlist) addsize = snprintf(dest, destsize, "%s\r\n", de->d_name);
-		else addsize = snprintf(dest, destsize, "%srw-rw-rw-   1 root  root %9"PRIu32" %s %s\r\n", type, (uint32_t)buf.st_size, str_time, de->d_name);
+		else addsize = snprintf(dest, destsize, "%srw-rw-rw-   1 root  root %9"PRIu64" %s %s\r\n", type, size, str_time, de->d_name);
 		if (addsize >= destsize) 
         {
 			ESP_LOGW(FTP_TAG, "Buffer too small, reallocating [%d > %"PRIi32"]", ftp_buff_size, ftp_buff_size + (addsize - destsize) + 64);
@@ -1088,11 +1316,13 @@ static void ftp_send_list(uint32_t datasize)
 /**
  * The function `ftp_send_file_data` sends file data over FTP with error handling and timeout.
  *
+ * @param data The `data` parameter points to the half of the data buffer holding the block read from
+ * the file.
  * @param datasize The `datasize` parameter in the `ftp_send_file_data` function represents the size of
  * the data to be sent over FTP (File Transfer Protocol). It is of type `uint32_t`, which is an
  * unsigned 32-bit integer. This parameter specifies the amount of data to be sent in
  */
-static void ftp_send_file_data(uint32_t datasize)
+static void ftp_send_file_data(const uint8_t *data, uint32_t datasize)
 {
     ftp_result_t result;
     uint32_t timeout = 200;
@@ -1102,7 +1332,7 @@ static void ftp_send_file_data(uint32_t datasize)
 
     while (1)
     {
-        result = send(ftp_data.d_sd, ftp_data.dBuffer, datasize, 0);
+        result = send(ftp_data.d_sd, data, datasize, 0);
         if (result == datasize)
         {
             vTaskDelay(1);
@@ -1362,6 +1592,24 @@ static void ftp_get_param_and_open_child(char **bufptr)
     ftp_data.closechild = true;
 }
 
+/**
+ * The function `ftp_pop_word` extracts the next space separated word of a command into `word`,
+ * truncating it to `size` - 1 characters, and skips the spaces that follow it.
+ */
+static void ftp_pop_word(char **str, char *word, uint32_t size)
+{
+    uint32_t len = 0;
+    while ((**str != '\0') && (**str != ' ') && (**str != '\r') && (**str != '\n'))
+    {
+        if (len < size - 1)
+            word[len++] = **str;
+        (*str)++;
+    }
+    word[len] = '\0';
+    while (**str == ' ')
+        (*str)++;
+}
+
 // ******** Ftp command processing **************************
 
 /**
@@ -1408,20 +1656,27 @@ static void ftp_process_cmd(void)
         }
         char fullname[128];
         char fullname2[128];
-        strcpy(fullname, MOUNT_POINT);
-        strcpy(fullname2, MOUNT_POINT);
 
         printf("ftp cmd: %d\r\n", cmd);
 
-        if ((cmd == E_FTP_CMD_LIST) || 
-            (cmd == E_FTP_CMD_NLST) || 
-            (cmd == E_FTP_CMD_CWD) ||
-            (cmd ==E_FTP_CMD_RMD) ||
-            (cmd == E_FTP_CMD_DELE) ||
-            (cmd == E_FTP_CMD_STOR))
+        if (ftp_cmd_uses_storage(cmd) && !sd_card_is_attached())
+        {
+            ftp_send_reply(450, FTP_NO_CARD);
+            return;
+        }
+        // a session started after the benchmark's one was dropped must not mount the card under it
+        if (ftp_cmd_uses_storage(cmd) && atomic_load(&ftp_bench_running))
+        {
+            ftp_send_reply(450, FTP_BENCH_BUSY);
+            return;
+        }
+        if (ftp_cmd_uses_storage(cmd) && !ftp_storage_acquire(ftp_cmd_writes(cmd)))
         {
-            tinyusb_msc_storage_mount(MOUNT_POINT);
+            ftp_send_reply(550, FTP_VIEW_REFUSED);
+            return;
         }
+        strcpy(fullname, ftp_root());
+        strcpy(fullname2, ftp_root());
         
         switch (cmd)
         {
@@ -1501,7 +1756,7 @@ static void ftp_process_cmd(void)
             if (res == 0)
             {
                 // send the file size
-                snprintf((char *)ftp_data.dBuffer, ftp_buff_size, "%" PRIu32, (uint32_t)buf.st_size);
+                snprintf((char *)ftp_data.dBuffer, ftp_buff_size, "%" PRIu64, ftp_file_size(fullname, &buf));
                 ftp_send_reply(213, (char *)ftp_data.dBuffer);
             }
             else
@@ -1604,6 +1859,7 @@ static void ftp_process_cmd(void)
             {
                 if (ftp_open_file(ftp_path, "rb"))
                 {
+                    ftp_io_start(E_FS_WORKER_READ, 0, ftp_io_half_size());
                     ftp_data.state = E_FTP_STE_CONTINUE_FILE_TX;
                     vTaskDelay(20 / portTICK_PERIOD_MS);
                     ftp_send_reply(150, NULL);
@@ -1626,6 +1882,16 @@ static void ftp_process_cmd(void)
             ftp_get_param_and_open_child(&bufptr);
             if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/'))
             {
+                strcat(fullname, ftp_path);
+                bool fits = ftp_space_check(fullname, ftp_allo_size, false);
+                ftp_allo_size = 0;
+                if (!fits)
+                {
+                    ftp_data.state = E_FTP_STE_END_TRANSFER;
+                    ftp_send_reply(552, NULL);
+                    break;
+                }
+                ftp_journal_rx_begin(fullname);
                 if (ftp_open_file(ftp_path, "ab"))
                 {
                     ftp_data.state = E_FTP_STE_CONTINUE_FILE_RX;
@@ -1634,6 +1900,7 @@ static void ftp_process_cmd(void)
                 }
                 else
                 {
+                    ftp_rx_path[0] = '\0';
                     ftp_data.state = E_FTP_STE_END_TRANSFER;
                     ftp_send_reply(550, NULL);
                 }
@@ -1651,6 +1918,16 @@ static void ftp_process_cmd(void)
             if ((strlen(ftp_path) > 0) && (ftp_path[strlen(ftp_path) - 1] != '/'))
             {
                 ESP_LOGI(FTP_TAG, "E_FTP_CMD_STOR ftp_path=[%s]", ftp_path);
+                strcat(fullname, ftp_path);
+                bool fits = ftp_space_check(fullname, ftp_allo_size, true);
+                ftp_allo_size = 0;
+                if (!fits)
+                {
+                    ftp_data.state = E_FTP_STE_END_TRANSFER;
+                    ftp_send_reply(552, NULL);
+                    break;
+                }
+                ftp_journal_rx_begin(fullname);
                 if (ftp_open_file(ftp_path, "wb"))
                 {
                     ftp_data.state = E_FTP_STE_CONTINUE_FILE_RX;
@@ -1659,6 +1936,7 @@ static void ftp_process_cmd(void)
                 }
                 else
                 {
+                    ftp_rx_path[0] = '\0';
                     ftp_data.state = E_FTP_STE_END_TRANSFER;
                     ftp_send_reply(550, NULL);
                 }
@@ -1681,6 +1959,7 @@ static void ftp_process_cmd(void)
                 // if (unlink(ftp_path) == 0) {
                 if (unlink(fullname) == 0)
                 {
+                    journal_record(E_JOURNAL_DELETE, ftp_path, NULL);
                     vTaskDelay(20 / portTICK_PERIOD_MS);
                     ftp_send_reply(250, NULL);
                 }
@@ -1702,6 +1981,7 @@ static void ftp_process_cmd(void)
                 // if (rmdir(ftp_path) == 0) {
                 if (rmdir(fullname) == 0)
                 {
+                    journal_record(E_JOURNAL_DELETE, ftp_path, NULL);
                     vTaskDelay(20 / portTICK_PERIOD_MS);
                     ftp_send_reply(250, NULL);
                 }
@@ -1722,6 +2002,7 @@ static void ftp_process_cmd(void)
 
                 if (mkdir(fullname, 0755) == 0)
                 {
+                    journal_record(E_JOURNAL_CREATE, ftp_path, NULL);
                     vTaskDelay(20 / portTICK_PERIOD_MS);
                     ftp_send_reply(250, NULL);
                 }
@@ -1762,6 +2043,7 @@ static void ftp_process_cmd(void)
             // if (rename((char *)ftp_data.dBuffer, ftp_path) == 0) {
             if (rename(fullname, fullname2) == 0)
             {
+                journal_record(E_JOURNAL_RENAME, (char *)ftp_data.dBuffer, ftp_path);
                 ftp_send_reply(250, NULL);
             }
             else
@@ -1775,20 +2057,45 @@ static void ftp_process_cmd(void)
         case E_FTP_CMD_QUIT:
             ftp_send_reply(221, NULL);
             break;
+        case E_FTP_CMD_SITE:
+            ftp_process_site(&bufptr);
+            break;
+        case E_FTP_CMD_AVBL:
+        {
+            uint64_t free_bytes;
+            if (tinyusb_msc_storage_get_free_space_lun(FTP_CARD_LUN, NULL, &free_bytes) == ESP_OK)
+            {
+                snprintf((char *)ftp_data.dBuffer, ftp_buff_size, "%" PRIu64, free_bytes);
+                ftp_send_reply(213, (char *)ftp_data.dBuffer);
+            }
+            else
+            {
+                ftp_send_reply(450, "Free space is being counted");
+            }
+            break;
+        }
+        case E_FTP_CMD_ALLO:
+            ftp_pop_param(&bufptr, ftp_scratch_buffer, true, true);
+            ftp_allo_size = strtoull(ftp_scratch_buffer, NULL, 10);
+            if (ftp_space_check(NULL, ftp_allo_size, false))
+            {
+                ftp_send_reply(200, NULL);
+            }
+            else
+            {
+                ftp_allo_size = 0;
+                ftp_send_reply(552, NULL);
+            }
+            break;
         default:
             // command not implemented
             ftp_send_reply(502, NULL);
             break;
         }
 
-        if ((cmd == E_FTP_CMD_LIST) || 
-            (cmd == E_FTP_CMD_NLST) || 
-            (cmd == E_FTP_CMD_CWD) ||
-            (cmd ==E_FTP_CMD_RMD) ||
-            (cmd == E_FTP_CMD_DELE) ||
-            (cmd == E_FTP_CMD_STOR))
+        if (ftp_cmd_uses_storage(cmd))
         {
-            tinyusb_msc_storage_unmount();
+            ftp_storage_release();
         }
 
         if (ftp_data.closechild)
@@ -1810,6 +2117,669 @@ static void ftp_process_cmd(void)
     }
 }
 
+/**
+ * The function `ftp_process_site` dispatches the SITE sub-commands:
+ * - SITE SUMS <blocksize> <path>: list "<index> <adler32> <md5>" for every block of a file through
+ *   the data connection, so a client can compute a delta against its local copy.
+ * - SITE DELTA <blocksize> <path>: receive a delta stream (see ftp_delta.h) through the data
+ *   connection, rebuild the file from the old copy plus literals, then replace the old copy.
+ * - SITE CHANGES <since-seq>: list the change journal events after `since-seq` through the data
+ *   connection (see journal.h).
+ * - SITE FIND <pattern> [SIZE <min>-<max>] [MTIME <from>-<to>]: list the files matching a name
+ *   pattern, size and modification time range from the on-card index (see journal.h).
+ * - SITE DF: report the size, used and free space of the card in bytes.
+ * - SITE MSCSTAT [RESET]: list the USB mass storage command counts, latency histograms, SD card
+ *   queue waits and last commands through the data connection, or clear them.
+ * - SITE BENCH [<lun>] [FAT|META]: measure the sequential and random throughput, IOPS and latency
+ *   of a storage, raw or through FatFs, or the FatFs file creation and listing times without and
+ *   with the metadata cache, and list the results through the data connection.
+ * - SITE FORMAT <lun>: format a storage with its clusters aligned to the erase unit of the card,
+ *   and list the FatFs write throughput before and after, and the new layout, through the data
+ *   connection. Everything on the storage is lost, the LUN must be given.
+ */
+static void ftp_process_site(char **bufptr)
+{
+    char subcmd[FTP_SITE_WORD_SIZE_MAX];
+
+    ftp_pop_word(bufptr, subcmd, sizeof(subcmd));
+    stoupper(subcmd);
+    ESP_LOGI(FTP_TAG, "SITE %s", subcmd);
+
+    // DELTA writes the card, CHANGES and FIND read the journal of the read-write mount
+    if (ftp_view && strcmp(subcmd, "SUMS") && strcmp(subcmd, "DF") && strcmp(subcmd, "MSCSTAT"))
+        ftp_send_reply(550, FTP_VIEW_REFUSED);
+    else if (!strcmp(subcmd, "SUMS"))
+        ftp_site_sums(bufptr);
+    else if (!strcmp(subcmd, "DELTA"))
+        ftp_site_delta(bufptr);
+    else if (!strcmp(subcmd, "CHANGES"))
+        ftp_site_changes(bufptr);
+    else if (!strcmp(subcmd, "FIND"))
+        ftp_site_find(bufptr);
+    else if (!strcmp(subcmd, "DF"))
+        ftp_site_df();
+    else if (!strcmp(subcmd, "MSCSTAT"))
+        ftp_site_mscstat(bufptr);
+    else if (!strcmp(subcmd, "BENCH"))
+        ftp_site_bench(bufptr);
+    else if (!strcmp(subcmd, "FORMAT"))
+        ftp_site_format(bufptr);
+    else
+        ftp_send_reply(502, NULL);
+}
+
+static void ftp_site_sums(char **bufptr)
+{
+    char word[FTP_SITE_WORD_SIZE_MAX];
+    char fullname[FTP_DELTA_PATH_MAX];
+
+    ftp_pop_word(bufptr, word, sizeof(word));
+    uint32_t blocksize = strtoul(word, NULL, 10);
+    ftp_get_param_and_open_child(bufptr);
+    if (snprintf(fullname, sizeof(fullname), "%s%s", ftp_root(), ftp_path) >= (int)sizeof(fullname))
+    {
+        ftp_send_reply(553, FTP_PATH_TOO_LONG);
+        return;
+    }
+
+    if (ftp_delta_sums_begin(&ftp_delta, fullname, blocksize))
+    {
+        ftp_data.state = E_FTP_STE_CONTINUE_SUMS;
+        ftp_send_reply(150, NULL);
+    }
+    else
+    {
+        ftp_send_reply(550, NULL);
+    }
+}
+
+static void ftp_site_delta(char **bufptr)
+{
+    char word[FTP_SITE_WORD_SIZE_MAX];
+
+    ftp_data.total = 0;
+    ftp_data.time = 0;
+    ftp_pop_word(bufptr, word, sizeof(word));
+    uint32_t blocksize = strtoul(word, NULL, 10);
+    ftp_get_param_and_open_child(bufptr);
+    if ((strlen(ftp_path) == 0) || (ftp_path[strlen(ftp_path) - 1] == '/'))
+    {
+        ftp_send_reply(550, NULL);
+        return;
+    }
+    if (snprintf(ftp_delta_basis, sizeof(ftp_delta_basis), "%s%s", MOUNT_POINT, ftp_path) >= (int)sizeof(ftp_delta_basis))
+    {
+        ftp_send_reply(553, FTP_PATH_TOO_LONG);
+        return;
+    }
+    ftp_delta_recover(MOUNT_POINT);
+
+    if (ftp_delta_apply_begin(&ftp_delta, MOUNT_POINT, ftp_delta_basis, blocksize))
+    {
+        ftp_data.state = E_FTP_STE_CONTINUE_DELTA_RX;
+        ftp_send_reply(150, NULL);
+    }
+    else
+    {
+        ftp_send_reply(550, NULL);
+    }
+}
+
+static void ftp_site_changes(char **bufptr)
+{
+    char word[FTP_SITE_WORD_SIZE_MAX];
+
+    ftp_pop_word(bufptr, word, sizeof(word));
+    if (journal_reconcile_busy())
+    {
+        // the changes of the USB host are not all in the journal yet
+        journal_reconcile_start();
+        ftp_send_reply(450, "Reconcile in progress");
+        return;
+    }
+    journal_changes_begin(&ftp_changes, strtoul(word, NULL, 10));
+    ftp_data.state = E_FTP_STE_CONTINUE_CHANGES;
+    ftp_send_reply(150, NULL);
+}
+
+/**
+ * The function `ftp_site_find` parses a search. Either end of a range may be left out; times are
+ * unix seconds or local YYYYMMDD[HHMMSS], a date alone as the upper end includes that whole day.
+ */
+static void ftp_site_find(char **bufptr)
+{
+    journal_query_t q = { .size_max = UINT64_MAX, .mtime_max = UINT32_MAX };
+    char word[FTP_SITE_WORD_SIZE_MAX * 2];  // "YYYYMMDDHHMMSS-YYYYMMDDHHMMSS"
+    uint64_t mtime_min = 0;
+    uint64_t mtime_max = UINT32_MAX;
+    bool ok = true;
+
+    ftp_pop_word(bufptr, q.glob, sizeof(q.glob));
+    if (q.glob[0] == '\0')
+        strcpy(q.glob, "*");
+
+    while (ok && (**bufptr != '\0') && (**bufptr != '\r') && (**bufptr != '\n'))
+    {
+        ftp_pop_word(bufptr, word, sizeof(word));
+        stoupper(word);
+        if (!strcmp(word, "SIZE"))
+        {
+            ftp_pop_word(bufptr, word, sizeof(word));
+            ok = ftp_parse_range(word, false, &q.size_min, &q.size_max);
+        }
+        else if (!strcmp(word, "MTIME"))
+        {
+            ftp_pop_word(bufptr, word, sizeof(word));
+            ok = ftp_parse_range(word, true, &mtime_min, &mtime_max);
+            q.mtime_min = (uint32_t)mtime_min;
+            q.mtime_max = (uint32_t)mtime_max;
+        }
+        else
+        {
+            ok = false;
+        }
+    }
+
+    if (!ok)
+        ftp_send_reply(501, NULL);
+    else if (journal_reconcile_busy())
+    {
+        journal_reconcile_start();
+        ftp_send_reply(450, "Reconcile in progress");
+    }
+    else if (journal_find_begin(&ftp_find, &q))
+    {
+        ftp_data.state = E_FTP_STE_CONTINUE_FIND;
+        ftp_send_reply(150, NULL);
+    }
+    else if (journal_reconcile_busy())
+        ftp_send_reply(450, "Index rebuild in progress");
+    else
+        ftp_send_reply(550, NULL);
+}
+
+static bool ftp_parse_range(const char *word, bool is_time, uint64_t *min, uint64_t *max)
+{
+    const char *dash = strchr(word, '-');
+    char low[FTP_SITE_WORD_SIZE_MAX * 2];
+    uint32_t t;
+
+    if (dash == NULL)
+        return false;
+    strlcpy(low, word, MIN((size_t)(dash - word) + 1, sizeof(low)));
+    if (low[0] != '\0')
+    {
+        if (!is_time)
+            *min = strtoull(low, NULL, 10);
+        else if (ftp_parse_time(low, false, &t))
+            *min = t;
+        else
+            return false;
+    }
+    if (dash[1] != '\0')
+    {
+        if (!is_time)
+            *max = strtoull(dash + 1, NULL, 10);
+        else if (ftp_parse_time(dash + 1, true, &t))
+            *max = t;
+        else
+            return false;
+    }
+    return (*min <= *max);
+}
+
+static bool ftp_parse_time(const char *str, bool end, uint32_t *t)
+{
+    struct tm tm_info = {0};
+    size_t len = strlen(str);
+
+    if ((len != 8) && (len != 14))
+    {
+        *t = strtoul(str, NULL, 10);
+        return true;
+    }
+    if (sscanf(str, "%4d%2d%2d", &tm_info.tm_year, &tm_info.tm_mon, &tm_info.tm_mday) != 3)
+        return false;
+    if ((len == 14) && (sscanf(str + 8, "%2d%2d%2d", &tm_info.tm_hour, &tm_info.tm_min, &tm_info.tm_sec) != 3))
+        return false;
+    if ((len == 8) && end)
+    {
+        tm_info.tm_hour = 23;
+        tm_info.tm_min = 59;
+        tm_info.tm_sec = 59;
+    }
+    tm_info.tm_year -= 1900;
+    tm_info.tm_mon -= 1;
+    tm_info.tm_isdst = -1;
+    time_t v = mktime(&tm_info);
+    if (v < 0)
+        return false;
+    *t = (uint32_t)v;
+    return true;
+}
+
+/**
+ * The function `ftp_journal_rx_begin` remembers the file a STOR or APPE is about to write, and
+ * whether it exists yet, so that closing the file journals it as created or modified.
+ */
+static void ftp_journal_rx_begin(const char *fullname)
+{
+    struct stat buf;
+
+    ftp_rx_event = (stat(fullname, &buf) == 0) ? E_JOURNAL_MODIFY : E_JOURNAL_CREATE;
+    strlcpy(ftp_rx_path, ftp_path, sizeof(ftp_rx_path));
+}
+
+/**
+ * The function `ftp_space_check` tells whether an upload fits on the card before any data moves:
+ * `size` (announced by ALLO, 0 if unknown, then at least one byte is needed) must not exceed the
+ * free space. The file a STOR replaces is released first, so its size counts as free. Free space
+ * comes from the storage cache; as long as it is not known the upload is let through and a full
+ * card is still caught by the failing write.
+ */
+static bool ftp_space_check(const char *fullname, uint64_t size, bool replace)
+{
+    uint64_t needed = (size > 0) ? size : 1;
+    uint64_t free_bytes;
+    struct stat buf;
+
+    if (tinyusb_msc_storage_get_free_space_lun(FTP_CARD_LUN, NULL, &free_bytes) != ESP_OK)
+        return true;
+    if (replace && (stat(fullname, &buf) == 0))
+        free_bytes += ftp_file_size(fullname, &buf);
+    return (needed <= free_bytes);
+}
+
+/**
+ * The function `ftp_file_size` gives the size of the file `fullname`, which stat() returned `st`
+ * for. `st_size` is a 32-bit `off_t`: it turns negative above 2 GB, which the cast undoes up to the
+ * 4 GB a FAT file can hold. Only an exFAT file can be larger, its size is read through FatFs.
+ */
+static uint64_t ftp_file_size(const char *fullname, const struct stat *st)
+{
+#if FF_FS_EXFAT
+    uint64_t size;
+
+    if (tinyusb_msc_storage_get_file_size(fullname, &size) == ESP_OK)
+        return size;
+#endif
+    return (uint32_t)st->st_size;
+}
+
+static void ftp_site_df(void)
+{
+    uint64_t total_bytes;
+    uint64_t free_bytes;
+
+    if (tinyusb_msc_storage_get_free_space_lun(FTP_CARD_LUN, &total_bytes, &free_bytes) != ESP_OK)
+    {
+        ftp_send_reply(450, "Free space is being counted");
+        return;
+    }
+    snprintf((char *)ftp_data.dBuffer, ftp_buff_size, "total=%" PRIu64 " used=%" PRIu64 " free=%" PRIu64,
+             total_bytes, total_bytes - free_bytes, free_bytes);
+    ftp_send_reply(200, (char *)ftp_data.dBuffer);
+}
+
+static void ftp_site_mscstat(char **bufptr)
+{
+    char word[FTP_SITE_WORD_SIZE_MAX];
+
+    ftp_pop_word(bufptr, word, sizeof(word));
+    stoupper(word);
+    if (!strcmp(word, "RESET"))
+    {
+        tinyusb_msc_storage_reset_latency_stats();
+        ftp_send_reply(200, NULL);
+    }
+    else if (word[0] != '\0')
+    {
+        ftp_send_reply(501, NULL);
+    }
+    else
+    {
+        ftp_data.state = E_FTP_STE_CONTINUE_MSCSTAT;
+        ftp_send_reply(150, NULL);
+    }
+}
+
+/**
+ * The function `ftp_mscstat_list` formats the statistics of every LUN and command kind, one line of
+ * totals in microseconds followed by the total, storage and USB histograms. Bucket i of a histogram
+ * counts the commands that took 2^i to 2^(i+1) - 1 microseconds. The metadata cache counters of
+ * each LUN mounted on the application come next, then the SD card I/O queue counters with the
+ * average and longest waits of the host and background requests in microseconds, then the trace of
+ * the last commands, oldest first.
+ *
+ * @return The number of characters written to `list`.
+ */
+static uint32_t ftp_mscstat_list(char *list, uint32_t maxlistsize)
+{
+    static const char *kind_names[TINYUSB_MSC_CMD_KINDS] = { "READ10", "WRITE10", "TUR", "OTHER" };
+#if CONFIG_TINYUSB_MSC_TRACE_DEPTH
+    static tinyusb_msc_trace_entry_t trace[CONFIG_TINYUSB_MSC_TRACE_DEPTH];
+#endif
+    tinyusb_msc_latency_stats_t st;
+    tinyusb_msc_meta_cache_stats_t meta;
+    tinyusb_msc_io_stats_t io;
+    uint32_t len = 0;
+
+#define FTP_MSCSTAT_PRINTF(...) \
+    len += snprintf(list + len, (len < maxlistsize) ? maxlistsize - len : 0, __VA_ARGS__)
+
+    for (uint8_t lun = 0; lun < tinyusb_msc_storage_get_lun_count(); lun++)
+    {
+        for (tinyusb_msc_cmd_kind_t kind = 0; kind < TINYUSB_MSC_CMD_KINDS; kind++)
+        {
+            tinyusb_msc_storage_get_latency_stats(lun, kind, &st);
+            if (st.commands == 0)
+                continue;
+            FTP_MSCSTAT_PRINTF("lun %u %s commands=%" PRIu32 " failed=%" PRIu32 " bytes=%" PRIu64
+                               " avg=%" PRIu64 " storage=%" PRIu64 " usb=%" PRIu64 " max=%" PRIu32 "\r\n",
+                               lun, kind_names[kind], st.commands, st.failed, st.bytes, st.total_us / st.commands,
+                               st.storage_us / st.commands, st.usb_us / st.commands, st.total_max_us);
+            const struct { const char *name; const uint32_t *hist; } hists[] =
+            {
+                { "total", st.total_hist }, { "storage", st.storage_hist }, { "usb", st.usb_hist }
+            };
+            for (int i = 0; i < 3; i++)
+            {
+                FTP_MSCSTAT_PRINTF("lun %u %s %s", lun, kind_names[kind], hists[i].name);
+                for (int b = 0; b < TINYUSB_MSC_LATENCY_BUCKETS; b++)
+                    FTP_MSCSTAT_PRINTF(" %" PRIu32, hists[i].hist[b]);
+                FTP_MSCSTAT_PRINTF("\r\n");
+            }
+        }
+    }
+
+    for (uint8_t lun = 0; lun < tinyusb_msc_storage_get_lun_count(); lun++)
+    {
+        tinyusb_msc_storage_get_meta_cache_stats(lun, &meta);
+        if (meta.hits + meta.misses + meta.writes == 0)
+            continue;
+        FTP_MSCSTAT_PRINTF("lun %u meta hits=%" PRIu32 " misses=%" PRIu32 " writes=%" PRIu32 " absorbed=%" PRIu32
+                           " flushed=%" PRIu32 " evictions=%" PRIu32 " invalidations=%" PRIu32 " dirty=%" PRIu32 "\r\n",
+                           lun, meta.hits, meta.misses, meta.writes, meta.absorbed, meta.flushed, meta.evictions,
+                           meta.invalidations, meta.dirty_sectors);
+    }
+
+    for (uint8_t lun = 0; lun < tinyusb_msc_storage_get_lun_count(); lun++)
+    {
+        tinyusb_msc_storage_get_io_stats(lun, &io);
+        const tinyusb_msc_io_class_stats_t *host = &io.cls[TINYUSB_MSC_IO_HOST];
+        const tinyusb_msc_io_class_stats_t *bg = &io.cls[TINYUSB_MSC_IO_BACKGROUND];
+        const uint32_t requests = host->requests + bg->requests;
+        if (requests == 0)
+            continue;
+        FTP_MSCSTAT_PRINTF("lun %u io transfers=%" PRIu32 " merged=%" PRIu32 " expired=%" PRIu32 " starved=%" PRIu32
+                           " depth=%" PRIu32 " depth_max=%" PRIu32 " depth_avg=%" PRIu64 " host=%" PRIu32 " host_wait=%" PRIu64
+                           " host_wait_max=%" PRIu32 " background=%" PRIu32 " background_wait=%" PRIu64
+                           " background_wait_max=%" PRIu32 "\r\n",
+                           lun, io.transfers, io.merged, io.expired, io.starved, io.depth, io.depth_max,
+                           io.depth_sum / requests, host->requests, host->requests ? host->wait_us / host->requests : 0,
+                           host->wait_max_us, bg->requests, bg->requests ? bg->wait_us / bg->requests : 0,
+                           bg->wait_max_us);
+    }
+
+#if CONFIG_TINYUSB_MSC_TRACE_DEPTH
+    size_t count = tinyusb_msc_storage_get_trace(trace, CONFIG_TINYUSB_MSC_TRACE_DEPTH);
+    for (size_t i = 0; i < count; i++)
+    {
+        FTP_MSCSTAT_PRINTF("trace %" PRIu32 " lun %u op=0x%02x lba=%" PRIu32 " bytes=%" PRIu32 " status=%u total=%" PRIu32
+                           " storage=%" PRIu32 " usb=%" PRIu32 "\r\n", trace[i].start_us, trace[i].lun, trace[i].opcode,
+                           trace[i].lba, trace[i].bytes, trace[i].status, trace[i].total_us, trace[i].storage_us,
+                           trace[i].usb_us);
+    }
+#endif
+
+#undef FTP_MSCSTAT_PRINTF
+
+    return MIN(len, maxlistsize - 1);
+}
+
+static void ftp_site_bench(char **bufptr)
+{
+    char word[FTP_SITE_WORD_SIZE_MAX];
+    char *end;
+
+    ftp_bench_lun = FTP_CARD_LUN;
+    ftp_bench_fat = false;
+    ftp_bench_meta = false;
+    ftp_bench_format = false;
+    ftp_pop_word(bufptr, word, sizeof(word));
+    if ((word[0] >= '0') && (word[0] <= '9'))
+    {
+        unsigned long lun = strtoul(word, &end, 10);
+        if ((*end != '\0') || (lun >= tinyusb_msc_storage_get_lun_count()))
+        {
+            ftp_send_reply(501, NULL);
+            return;
+        }
+        ftp_bench_lun = (uint8_t)lun;
+        ftp_pop_word(bufptr, word, sizeof(word));
+    }
+    stoupper(word);
+    if (!strcmp(word, "FAT"))
+    {
+        ftp_bench_fat = true;
+    }
+    else if (!strcmp(word, "META"))
+    {
+        ftp_bench_meta = true;
+    }
+    else if (word[0] != '\0')
+    {
+        ftp_send_reply(501, NULL);
+        return;
+    }
+    if (!ftp_bench_start())
+    {
+        ftp_send_reply(451, NULL);
+        return;
+    }
+    ftp_data.state = E_FTP_STE_CONTINUE_BENCH;
+    ftp_send_reply(150, NULL);
+}
+
+static void ftp_site_format(char **bufptr)
+{
+    char word[FTP_SITE_WORD_SIZE_MAX];
+    char *end;
+
+    ftp_pop_word(bufptr, word, sizeof(word));
+    unsigned long lun = strtoul(word, &end, 10);
+    if ((word[0] < '0') || (word[0] > '9') || (*end != '\0') || (lun >= tinyusb_msc_storage_get_lun_count()))
+    {
+        ftp_send_reply(501, NULL);
+        return;
+    }
+    ftp_bench_lun = (uint8_t)lun;
+    ftp_bench_fat = true;
+    ftp_bench_meta = false;
+    ftp_bench_format = true;
+    if (!ftp_bench_start())
+    {
+        ftp_send_reply(451, NULL);
+        return;
+    }
+    ftp_data.state = E_FTP_STE_CONTINUE_BENCH;
+    ftp_send_reply(150, NULL);
+}
+
+/**
+ * The function `ftp_bench_start` runs the benchmark chosen by SITE BENCH, or the format of SITE
+ * FORMAT, on a task of its own, so that the FTP task keeps serving the network during the run, about
+ * 14 s for a benchmark with the default settings.
+ * The session waits in E_FTP_STE_CONTINUE_BENCH and lists the results once the task ended.
+ *
+ * @return false if the task could not be created.
+ */
+static bool ftp_bench_start(void)
+{
+    atomic_store(&ftp_bench_running, true);
+    if (xTaskCreatePinnedToCore(ftp_bench_task, "ftp_bench", FTP_BENCH_TASK_STACK, NULL, FTP_BENCH_TASK_PRIO,
+                                NULL, FTP_BENCH_TASK_CORE) != pdPASS)
+    {
+        ESP_LOGE(FTP_TAG, "No memory for the benchmark task");
+        atomic_store(&ftp_bench_running, false);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The function `ftp_bench_task` measures the storage chosen by SITE BENCH into `ftp_bench_results`,
+ * or `ftp_bench_meta_results` for the metadata benchmark, or runs SITE FORMAT, then ends. The raw
+ * tests need the card unmounted, the read-write mount of the FTP server is released first; the next
+ * command mounts it again.
+ */
+static void ftp_bench_task(void *arg)
+{
+    const tinyusb_msc_bench_config_t config = { .fat = ftp_bench_fat };
+
+    ftp_bench_count = 0;
+    if (ftp_bench_format)
+    {
+        ftp_format_run();
+    }
+    else if (ftp_bench_meta)
+    {
+        ftp_bench_err = tinyusb_msc_storage_benchmark_meta(ftp_bench_lun, 0, ftp_bench_meta_results);
+    }
+    else
+    {
+        if (!ftp_bench_fat && (ftp_bench_lun == FTP_CARD_LUN))
+            tinyusb_msc_storage_release(FTP_CARD_LUN, FTP_STORAGE_USER);
+        ftp_bench_err = tinyusb_msc_storage_benchmark(ftp_bench_lun, &config, ftp_bench_results,
+                                                      TINYUSB_MSC_BENCH_RESULTS_MAX, &ftp_bench_count);
+    }
+    atomic_store(&ftp_bench_running, false);
+    vTaskDelete(NULL);
+}
+
+/**
+ * The function `ftp_bench_list` formats the results of the benchmark task, one line per test: the
+ * transfer size in bytes, the transfers timed, KB/s, IOPS and the latency percentiles in
+ * microseconds. The metadata benchmark gives one line per run, uncached then cached: the files
+ * created and the create, list and delete times in microseconds, with the cache hits and the window
+ * reads that went to the storage.
+ *
+ * @return The number of characters written to `list`.
+ */
+static uint32_t ftp_bench_list(char *list, uint32_t maxlistsize)
+{
+    uint32_t len = 0;
+
+    if (ftp_bench_meta)
+    {
+        const tinyusb_msc_meta_bench_result_t *meta = ftp_bench_meta_results;
+        for (int i = 0; (ftp_bench_err == ESP_OK) && (i < 2); i++)
+            len += snprintf(list + len, (len < maxlistsize) ? maxlistsize - len : 0,
+                            "lun %u meta %s files=%" PRIu32 " create=%" PRIu32 " list=%" PRIu32 " delete=%" PRIu32
+                            " hits=%" PRIu32 " misses=%" PRIu32 "\r\n",
+                            ftp_bench_lun, meta[i].cached ? "cached" : "uncached", meta[i].files, meta[i].create_us,
+                            meta[i].list_us, meta[i].delete_us, meta[i].hits, meta[i].misses);
+        return MIN(len, maxlistsize - 1);
+    }
+    len = ftp_bench_print(list, maxlistsize, len, ftp_bench_fat ? "fat" : "raw", ftp_bench_results, ftp_bench_count,
+                          false);
+    return MIN(len, maxlistsize - 1);
+}
+
+/**
+ * The function `ftp_format_run` formats the storage chosen by SITE FORMAT between two runs of the
+ * FatFs write tests, from 4 KB to 32 KB, on the benchmark task. A card that fails the first run,
+ * unformatted or corrupted, is formatted all the same. The read-write mount of the FTP server is
+ * released, the next command mounts the new volume.
+ */
+static void ftp_format_run(void)
+{
+    const tinyusb_msc_bench_config_t config = { .fat = true, .block_min = 4096, .block_max = 32768 };
+
+    ftp_bench_formatted = false;
+    if (tinyusb_msc_storage_benchmark(ftp_bench_lun, &config, ftp_bench_before, TINYUSB_MSC_BENCH_RESULTS_MAX,
+                                      &ftp_bench_before_count) != ESP_OK)
+        ftp_bench_before_count = 0;
+    // the mount made at boot is given up as well, nothing may hold the storage being formatted
+    tinyusb_msc_storage_release(ftp_bench_lun, FTP_STORAGE_USER);
+    tinyusb_msc_storage_unmount_lun(ftp_bench_lun);
+    ftp_bench_err = tinyusb_msc_storage_format(ftp_bench_lun, &ftp_bench_info);
+    if (ftp_bench_err != ESP_OK)
+        return;
+    ftp_bench_formatted = true;
+    if (ftp_bench_lun == FTP_CARD_LUN)
+        journal_reset();
+    ftp_bench_err = tinyusb_msc_storage_benchmark(ftp_bench_lun, &config, ftp_bench_results,
+                                                  TINYUSB_MSC_BENCH_RESULTS_MAX, &ftp_bench_count);
+    if (ftp_bench_lun != FTP_CARD_LUN)
+        tinyusb_msc_storage_unmount_lun(ftp_bench_lun);
+}
+
+/**
+ * The function `ftp_format_list` gives the "before" and "after" lines of ftp_bench_list() for the
+ * run of ftp_format_run(), with the layout in between: the erase unit and cluster size in bytes, and
+ * the first sector of the partition, the FAT and the data area.
+ *
+ * @return The number of characters written to `list`.
+ */
+static uint32_t ftp_format_list(char *list, uint32_t maxlistsize)
+{
+    const tinyusb_msc_format_info_t *info = &ftp_bench_info;
+    uint32_t len = 0;
+
+    len = ftp_bench_print(list, maxlistsize, len, "before", ftp_bench_before, ftp_bench_before_count, true);
+    if (!ftp_bench_formatted)
+        return MIN(len, maxlistsize - 1);
+    len += snprintf(list + len, (len < maxlistsize) ? maxlistsize - len : 0,
+                    "lun %u format type=%s erase_unit=%" PRIu32 " cluster=%" PRIu32 " partition=%" PRIu32
+                    " fat=%" PRIu32 " data=%" PRIu32 "\r\n", ftp_bench_lun,
+                    (info->fat_type == FS_EXFAT) ? "exFAT" : (info->fat_type == FS_FAT32) ? "FAT32" :
+                    (info->fat_type == FS_FAT16) ? "FAT16" : "FAT12", info->erase_unit, info->cluster_size,
+                    info->partition_lba, info->fat_lba, info->data_lba);
+    len = ftp_bench_print(list, maxlistsize, len, "after", ftp_bench_results, ftp_bench_count, true);
+    return MIN(len, maxlistsize - 1);
+}
+
+/**
+ * The function `ftp_bench_print` appends a line per benchmark result to `list`, which holds `len`
+ * characters, each tagged with `label`; `writes_only` leaves out the read tests.
+ *
+ * @return The number of characters in `list`.
+ */
+static uint32_t ftp_bench_print(char *list, uint32_t maxlistsize, uint32_t len, const char *label,
+                                const tinyusb_msc_bench_result_t *results, size_t count, bool writes_only)
+{
+    static const char *kind_names[TINYUSB_MSC_BENCH_KINDS] = { "SEQREAD", "SEQWRITE", "RANDREAD", "RANDWRITE" };
+
+    for (size_t i = 0; i < count; i++)
+    {
+        const tinyusb_msc_bench_result_t *r = &results[i];
+        if (writes_only && (r->kind != TINYUSB_MSC_BENCH_SEQ_WRITE) && (r->kind != TINYUSB_MSC_BENCH_RAND_WRITE))
+            continue;
+        len += snprintf(list + len, (len < maxlistsize) ? maxlistsize - len : 0,
+                        "lun %u %s %s block=%" PRIu32 " ops=%" PRIu32 " kbps=%" PRIu32 " iops=%" PRIu32
+                        " p50=%" PRIu32 " p90=%" PRIu32 " p99=%" PRIu32 " max=%" PRIu32 "\r\n",
+                        ftp_bench_lun, label, kind_names[r->kind], r->block_size, r->ops,
+                        r->kbps, r->iops, r->p50_us, r->p90_us, r->p99_us, r->max_us);
+    }
+    return len;
+}
+
+/**
+ * The function `ftp_close_delta` aborts a running SUMS or DELTA transfer. An unfinished rebuilt file
+ * is removed, the original file is left untouched.
+ */
+static void ftp_close_delta(void)
+{
+    if (!ftp_delta_active(&ftp_delta))
+        return;
+
+    if (ftp_delta.out != NULL)
+        ftp_delta_apply_abort(&ftp_delta, MOUNT_POINT);
+    else
+        ftp_delta_close(&ftp_delta);
+}
+
 /**
  * The function `ftp_wait_for_enabled` checks if the telnet service has been enabled and updates the
  * FTP state accordingly.
@@ -1821,4 +2791,140 @@ static void ftp_wait_for_enabled(void)
     {
         ftp_data.state = E_FTP_STE_START;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * The function `ftp_root` returns the path the card is reached at: the read-write mount point, or
+ * the read-only view while the USB host has the card.
+ */
+static const char *ftp_root(void)
+{
+    return ftp_view ? FTP_HOST_VIEW_MOUNT_POINT : MOUNT_POINT;
+}
+
+static bool ftp_cmd_uses_storage(ftp_cmd_index_t cmd)
+{
+    switch (cmd)
+    {
+    case E_FTP_CMD_LIST:
+    case E_FTP_CMD_NLST:
+    case E_FTP_CMD_CWD:
+    case E_FTP_CMD_SIZE:
+    case E_FTP_CMD_MDTM:
+    case E_FTP_CMD_RETR:
+    case E_FTP_CMD_SITE:
+        return true;
+    default:
+        return ftp_cmd_writes(cmd);
+    }
+}
+
+static bool ftp_cmd_writes(ftp_cmd_index_t cmd)
+{
+    switch (cmd)
+    {
+    case E_FTP_CMD_RMD:
+    case E_FTP_CMD_DELE:
+    case E_FTP_CMD_STOR:
+    case E_FTP_CMD_APPE:
+    case E_FTP_CMD_MKD:
+    case E_FTP_CMD_RNFR:
+    case E_FTP_CMD_RNTO:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/**
+ * The function `ftp_storage_acquire` makes the card available to a command. While the USB host has
+ * the card, the command reads it through the read-only view and commands that write are refused,
+ * so the host never loses the volume. Otherwise the card is mounted read-write.
+ *
+ * @param write true if the command modifies the card
+ *
+ * @return false if the command can not be served while the USB host has the card.
+ */
+static bool ftp_storage_acquire(bool write)
+{
+#if FTP_HOST_VIEW
+    if (ftp_view || (tud_mounted() && tinyusb_msc_storage_in_use_by_usb_host()))
+    {
+        if (write)
+            return false;
+        if (!ftp_view)
+            ftp_view = (tinyusb_msc_storage_acquire_view(FTP_CARD_LUN, FTP_STORAGE_USER, FTP_HOST_VIEW_MOUNT_POINT) == ESP_OK);
+        if (ftp_view)
+            tinyusb_msc_storage_view_refresh(FTP_CARD_LUN);
+        return ftp_view;
+    }
+#endif
+    tinyusb_msc_storage_acquire(FTP_CARD_LUN, FTP_STORAGE_USER, MOUNT_POINT);
+    return true;
+}
+
+/**
+ * The function `ftp_storage_continue` prepares the card for the next step of a transfer. A transfer
+ * through the view rereads the sectors the host changed, a read-write transfer remounts the card
+ * unless the USB host holds it.
+ */
+static void ftp_storage_continue(void)
+{
+    if (ftp_view)
+        tinyusb_msc_storage_view_refresh(FTP_CARD_LUN);
+    else if (!(FTP_HOST_VIEW && tud_mounted() && tinyusb_msc_storage_in_use_by_usb_host()))
+        tinyusb_msc_storage_acquire(FTP_CARD_LUN, FTP_STORAGE_USER, MOUNT_POINT);
+}
+
+/**
+ * The function `ftp_storage_release` hands the card back to the USB host once no transfer needs the
+ * read-write mount anymore. The view is not a mount of the card, it is kept.
+ */
+static void ftp_storage_release(void)
+{
+    if (!ftp_view && (ftp_data.state < E_FTP_STE_CONTINUE_LISTING))
+        tinyusb_msc_storage_release(FTP_CARD_LUN, FTP_STORAGE_USER);
+}
+
+/**
+ * The function `ftp_storage_drop_view` unmounts the read-only view once the USB host let go of the
+ * card and nothing is open through it, so that the card can be mounted read-write again.
+ */
+static void ftp_storage_drop_view(void)
+{
+    if (!ftp_view || (tud_mounted() && tinyusb_msc_storage_in_use_by_usb_host()))
+        return;
+    if ((ftp_data.state >= E_FTP_STE_CONTINUE_LISTING) && (ftp_data.state <= E_FTP_STE_CONTINUE_FIND))
+        return;
+
+    tinyusb_msc_storage_release_view(FTP_CARD_LUN, FTP_STORAGE_USER);
+    ftp_view = false;
+    ESP_LOGI(FTP_TAG, "USB host released the card, read-only view closed");
+}
+
+/**
+ * The function `ftp_storage_card_check` ends a transfer whose card was pulled out. The MSC storage
+ * waits for FTP to let go of the mount and the view before it closes them: the files still open are
+ * closed first, the file being received is not journaled, and the client is told 450 so that it can
+ * retry later.
+ */
+static void ftp_storage_card_check(void)
+{
+    if (sd_card_is_attached())
+        return;
+
+    if ((ftp_data.state >= E_FTP_STE_CONTINUE_LISTING) && (ftp_data.state <= E_FTP_STE_CONTINUE_FIND))
+    {
+        ESP_LOGW(FTP_TAG, "SD card removed, transfer aborted");
+        ftp_rx_path[0] = '\0';
+        ftp_close_filesystem_on_error();
+        ftp_send_reply(450, FTP_NO_CARD);
+        ftp_data.state = E_FTP_STE_END_TRANSFER;
+        tinyusb_msc_storage_release(FTP_CARD_LUN, FTP_STORAGE_USER);
+    }
+    if (ftp_view)
+    {
+        tinyusb_msc_storage_release_view(FTP_CARD_LUN, FTP_STORAGE_USER);
+        ftp_view = false;
+    }
+}
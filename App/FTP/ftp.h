@@ -23,6 +23,7 @@ extern "C"
 #define FTP_ACTIVE_DATA_PORT                20
 #define FTP_PASIVE_DATA_PORT                2024
 #define FTP_CMD_SIZE_MAX                    6
+#define FTP_SITE_WORD_SIZE_MAX              16
 #define FTP_CMD_CLIENTS_MAX                 1
 #define FTP_DATA_CLIENTS_MAX                1
 #define FTP_MAX_PARAM_SIZE                  (MICROPY_ALLOC_PATH_MAX + 1)
@@ -30,6 +31,17 @@ extern "C"
 #define FTP_DATA_TIMEOUT_MS                 10000   // 10 seconds
 #define FTP_SOCKETFIFO_ELEMENTS_MAX         4
 
+// While the USB host has the card, FTP reads it through a read-only view instead of taking it away
+#define FTP_HOST_VIEW                       1
+#define FTP_HOST_VIEW_MOUNT_POINT           SD_CARD_VIEW_MOUNT_POINT   // shared with TFTP
+#define FTP_CARD_LUN                        0
+#define FTP_STORAGE_USER                    1       // holder of the card in the MSC storage
+
+// SITE BENCH and FORMAT run on a task of their own, the FTP task keeps serving the network meanwhile
+#define FTP_BENCH_TASK_STACK                4096
+#define FTP_BENCH_TASK_PRIO                 5
+#define FTP_BENCH_TASK_CORE                 1       // with the storage worker, away from lwIP on core 0
+
 #define CONFIG_MICROPY_FTPSERVER_BUFFER_SIZE 1024 * 100
 #define CONFIG_MICROPY_FTPSERVER_TIMEOUT 300
 #define CONFIG_MICROPY_FILESYSTEM_TYPE 0
@@ -70,6 +82,12 @@ typedef enum
     E_FTP_STE_CONTINUE_LISTING,
     E_FTP_STE_CONTINUE_FILE_TX,
     E_FTP_STE_CONTINUE_FILE_RX,
+    E_FTP_STE_CONTINUE_SUMS,
+    E_FTP_STE_CONTINUE_DELTA_RX,
+    E_FTP_STE_CONTINUE_CHANGES,
+    E_FTP_STE_CONTINUE_FIND,
+    E_FTP_STE_CONTINUE_MSCSTAT,
+    E_FTP_STE_CONTINUE_BENCH,
     E_FTP_STE_CONNECTED
 } ftp_state_t;
 
@@ -122,7 +140,7 @@ typedef struct
     int32_t         d_sd;
     int32_t         dtimeout;
     uint32_t        ip_addr;
-    uint32_t        total;
+    uint64_t        total;
     uint32_t        time;
     uint8_t         state;
     uint8_t         substate;
@@ -168,7 +186,10 @@ typedef enum
     E_FTP_CMD_APPE, // 22
     E_FTP_CMD_NLST, // 23
     E_FTP_CMD_AUTH, // 24
-    E_FTP_NUM_FTP_CMDS // 25
+    E_FTP_CMD_SITE, // 25
+    E_FTP_CMD_AVBL, // 26
+    E_FTP_CMD_ALLO, // 27
+    E_FTP_NUM_FTP_CMDS // 28
 } ftp_cmd_index_t;
 
 
@@ -0,0 +1,465 @@
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "esp_log.h"
+#include "esp_rom_md5.h"
+
+#include "ftp_delta.h"
+
+/***********************************
+ *      DEFINES
+ ***********************************/
+
+#define FTP_DELTA_TAG       "[Ftp delta]"
+#define ADLER32_MOD         65521
+#define ADLER32_NMAX        5552    // largest n such that 255n(n+1)/2 + (n+1)(MOD-1) fits 32 bits
+
+/***********************************
+ *   PRIVATE FUNCTIONS PROTOTYPE
+ **********************************/
+
+static uint32_t get_be32(const uint8_t *p);
+static void ftp_delta_fullname(char *dest, const char *root, const char *name);
+static void ftp_delta_drop(const char *root);
+static bool ftp_delta_copy_blocks(ftp_delta_t *d, uint32_t first, uint32_t count);
+static bool ftp_delta_write(ftp_delta_t *d, const uint8_t *data, uint32_t len);
+
+/***********************************
+ *   PUBLIC FUNCTIONS
+ ***********************************/
+
+/**
+ * The function `ftp_delta_adler32` computes the Adler-32 checksum of a buffer, identical to zlib's
+ * `adler32(1, data, len)`. Clients roll it over their local file to find blocks that the card
+ * already has.
+ */
+uint32_t ftp_delta_adler32(const uint8_t *data, uint32_t len)
+{
+    uint32_t a = 1;
+    uint32_t b = 0;
+
+    while (len > 0)
+    {
+        uint32_t n = MIN(len, ADLER32_NMAX);
+        len -= n;
+        while (n--)
+        {
+            a += *data++;
+            b += a;
+        }
+        a %= ADLER32_MOD;
+        b %= ADLER32_MOD;
+    }
+    return (b << 16) | a;
+}
+
+/**
+ * The function `ftp_delta_sums_begin` opens `path` for checksumming in blocks of `blocksize` bytes.
+ *
+ * @return `false` if the block size is out of range, the file cannot be opened or there is no
+ * memory for the block buffer.
+ */
+bool ftp_delta_sums_begin(ftp_delta_t *d, const char *path, uint32_t blocksize)
+{
+    memset(d, 0, sizeof(*d));
+    if ((blocksize < FTP_DELTA_BLOCKSIZE_MIN) || (blocksize > FTP_DELTA_BLOCKSIZE_MAX))
+        return false;
+
+    d->buf = malloc(blocksize);
+    if (d->buf == NULL)
+        return false;
+
+    d->basis = fopen(path, "rb");
+    if (d->basis == NULL)
+    {
+        ftp_delta_close(d);
+        return false;
+    }
+    d->blocksize = blocksize;
+    return true;
+}
+
+/**
+ * The function `ftp_delta_sums_next` reads the next blocks of the file and writes one line
+ * "<index> <adler32> <md5>\r\n" per block into `list`, until the list buffer is full.
+ *
+ * @return `E_FTP_RESULT_CONTINUE` while blocks remain, `E_FTP_RESULT_OK` once the last block has
+ * been listed, `E_FTP_RESULT_FAILED` on a read error.
+ */
+ftp_result_t ftp_delta_sums_next(ftp_delta_t *d, char *list, uint32_t maxlistsize, uint32_t *listsize)
+{
+    uint32_t next = 0;
+    md5_context_t ctx;
+    uint8_t digest[ESP_ROM_MD5_DIGEST_LEN];
+
+    *listsize = 0;
+    while ((maxlistsize - next) > FTP_DELTA_SUMS_LINE_MAX)
+    {
+        size_t n = fread(d->buf, 1, d->blocksize, d->basis);
+        if (n == 0)
+        {
+            if (ferror(d->basis))
+                return E_FTP_RESULT_FAILED;
+            *listsize = next;
+            return E_FTP_RESULT_OK;
+        }
+
+        esp_rom_md5_init(&ctx);
+        esp_rom_md5_update(&ctx, d->buf, n);
+        esp_rom_md5_final(digest, &ctx);
+
+        next += snprintf(list + next, maxlistsize - next, "%" PRIu32 " %08" PRIx32 " ",
+                         d->index, ftp_delta_adler32(d->buf, n));
+        for (int i = 0; i < ESP_ROM_MD5_DIGEST_LEN; i++)
+        {
+            next += snprintf(list + next, maxlistsize - next, "%02x", digest[i]);
+        }
+        next += snprintf(list + next, maxlistsize - next, "\r\n");
+        d->index++;
+
+        if (n < d->blocksize)
+        {
+            *listsize = next;
+            return E_FTP_RESULT_OK;
+        }
+    }
+
+    *listsize = next;
+    return E_FTP_RESULT_CONTINUE;
+}
+
+/**
+ * The function `ftp_delta_apply_begin` prepares to rebuild a file from a delta stream. Copy
+ * instructions refer to `blocksize` blocks of `basis`; the result is written to FTP_DELTA_TMP_FILE
+ * on the volume mounted at `root`, and the path of the basis to FTP_DELTA_TARGET_FILE so that
+ * `ftp_delta_recover` knows which file an interrupted delta was for. A missing basis is allowed, the
+ * stream then may only contain literals.
+ */
+bool ftp_delta_apply_begin(ftp_delta_t *d, const char *root, const char *basis, uint32_t blocksize)
+{
+    char fullname[FTP_DELTA_PATH_MAX];
+
+    memset(d, 0, sizeof(*d));
+    if ((blocksize < FTP_DELTA_BLOCKSIZE_MIN) || (blocksize > FTP_DELTA_BLOCKSIZE_MAX))
+        return false;
+
+    d->buf = malloc(FTP_DELTA_COPYBUF_SIZE);
+    if (d->buf == NULL)
+        return false;
+
+    ftp_delta_fullname(fullname, root, FTP_DELTA_DIR);
+    mkdir(fullname, 0755);
+    ftp_delta_fullname(fullname, root, FTP_DELTA_TARGET_FILE);
+    FILE *fp = fopen(fullname, "w");
+    if ((fp == NULL) || (fputs(basis, fp) < 0) || (fclose(fp) != 0))
+    {
+        ftp_delta_drop(root);
+        ftp_delta_close(d);
+        return false;
+    }
+
+    d->basis = fopen(basis, "rb");
+    ftp_delta_fullname(fullname, root, FTP_DELTA_TMP_FILE);
+    d->out = fopen(fullname, "wb");
+    if (d->out == NULL)
+    {
+        ftp_delta_drop(root);
+        ftp_delta_close(d);
+        return false;
+    }
+    d->blocksize = blocksize;
+    d->state = E_FTP_DELTA_OP;
+    return true;
+}
+
+/**
+ * The function `ftp_delta_apply_feed` consumes the next piece of the delta stream as it arrives on
+ * the data connection. Instructions may be split across calls at any byte.
+ *
+ * @return `E_FTP_RESULT_CONTINUE` if more data is expected, `E_FTP_RESULT_OK` once the end
+ * instruction has been seen, `E_FTP_RESULT_FAILED` on a malformed stream or an I/O error.
+ */
+ftp_result_t ftp_delta_apply_feed(ftp_delta_t *d, const uint8_t *data, uint32_t len)
+{
+    while (len > 0)
+    {
+        switch (d->state)
+        {
+        case E_FTP_DELTA_OP:
+            d->op = *data++;
+            len--;
+            d->hdr_len = 0;
+            if (d->op == FTP_DELTA_OP_COPY)
+            {
+                d->hdr_need = 8;
+                d->state = E_FTP_DELTA_HEADER;
+            }
+            else if (d->op == FTP_DELTA_OP_LITERAL)
+            {
+                d->hdr_need = 4;
+                d->state = E_FTP_DELTA_HEADER;
+            }
+            else if (d->op == FTP_DELTA_OP_END)
+            {
+                d->state = E_FTP_DELTA_DONE;
+            }
+            else
+            {
+                ESP_LOGW(FTP_DELTA_TAG, "Bad opcode 0x%02x", d->op);
+                d->state = E_FTP_DELTA_ERROR;
+            }
+            break;
+        case E_FTP_DELTA_HEADER:
+        {
+            uint32_t n = MIN(len, (uint32_t)(d->hdr_need - d->hdr_len));
+            memcpy(&d->hdr[d->hdr_len], data, n);
+            d->hdr_len += n;
+            data += n;
+            len -= n;
+            if (d->hdr_len < d->hdr_need)
+                break;
+            if (d->op == FTP_DELTA_OP_COPY)
+            {
+                d->state = ftp_delta_copy_blocks(d, get_be32(&d->hdr[0]), get_be32(&d->hdr[4])) ?
+                           E_FTP_DELTA_OP : E_FTP_DELTA_ERROR;
+            }
+            else
+            {
+                d->literal_left = get_be32(&d->hdr[0]);
+                d->state = (d->literal_left > 0) ? E_FTP_DELTA_LITERAL : E_FTP_DELTA_OP;
+            }
+        }
+        break;
+        case E_FTP_DELTA_LITERAL:
+        {
+            uint32_t n = MIN(len, d->literal_left);
+            if (!ftp_delta_write(d, data, n))
+            {
+                d->state = E_FTP_DELTA_ERROR;
+                break;
+            }
+            d->literal_left -= n;
+            data += n;
+            len -= n;
+            if (d->literal_left == 0)
+                d->state = E_FTP_DELTA_OP;
+        }
+        break;
+        case E_FTP_DELTA_DONE:
+            ESP_LOGW(FTP_DELTA_TAG, "Data after end of delta stream");
+            d->state = E_FTP_DELTA_ERROR;
+            break;
+        default:
+            return E_FTP_RESULT_FAILED;
+        }
+    }
+
+    if (d->state == E_FTP_DELTA_ERROR)
+        return E_FTP_RESULT_FAILED;
+    return (d->state == E_FTP_DELTA_DONE) ? E_FTP_RESULT_OK : E_FTP_RESULT_CONTINUE;
+}
+
+/**
+ * The function `ftp_delta_apply_finish` closes both files and, if the stream was complete, moves the
+ * rebuilt file over the basis. FatFs cannot rename over an existing file, so the basis is first moved
+ * to FTP_DELTA_BAK_FILE, the rebuilt file takes its name and only then the old copy is removed: at
+ * any point one complete copy is on the card under a name `ftp_delta_recover` knows. Only the files
+ * in FTP_DELTA_DIR are ever removed.
+ *
+ * @return `true` if the new file is in place, `false` if the stream was incomplete or a rename
+ * failed. The rebuilt file is removed only while the basis is still in place.
+ */
+bool ftp_delta_apply_finish(ftp_delta_t *d, const char *root, const char *basis)
+{
+    char tmp[FTP_DELTA_PATH_MAX];
+    char bak[FTP_DELTA_PATH_MAX];
+    struct stat st;
+    bool complete = (d->state == E_FTP_DELTA_DONE);
+    bool ok = complete;
+
+    if (d->out && fclose(d->out) != 0)
+        ok = false;
+    d->out = NULL;
+    ftp_delta_close(d);
+
+    if (!ok)
+    {
+        ESP_LOGW(FTP_DELTA_TAG, "Delta not applied (%s)", complete ? "write failed" : "incomplete stream");
+        ftp_delta_drop(root);
+        return false;
+    }
+
+    ftp_delta_fullname(tmp, root, FTP_DELTA_TMP_FILE);
+    ftp_delta_fullname(bak, root, FTP_DELTA_BAK_FILE);
+    bool has_basis = (stat(basis, &st) == 0);
+    if (has_basis)
+    {
+        unlink(bak);
+        if (rename(basis, bak) != 0)
+        {
+            ESP_LOGW(FTP_DELTA_TAG, "Delta not applied (basis can not be moved)");
+            ftp_delta_drop(root);
+            return false;
+        }
+    }
+    if (rename(tmp, basis) != 0)
+    {
+        // the basis goes back in place; if that fails too both copies stay for ftp_delta_recover
+        if (!has_basis || rename(bak, basis) == 0)
+            ftp_delta_drop(root);
+        ESP_LOGW(FTP_DELTA_TAG, "Delta not applied (rename failed)");
+        return false;
+    }
+    ftp_delta_drop(root);
+    return true;
+}
+
+/**
+ * The function `ftp_delta_apply_abort` stops a delta before its end, when the data connection is
+ * lost. The basis is left untouched.
+ */
+void ftp_delta_apply_abort(ftp_delta_t *d, const char *root)
+{
+    ftp_delta_close(d);
+    ftp_delta_drop(root);
+}
+
+/**
+ * The function `ftp_delta_recover` cleans up after a delta on the volume mounted at `root` that was
+ * interrupted by a reset, a card removal or a lost connection. The basis is only moved aside once the
+ * rebuilt file is complete, so:
+ * - basis missing, FTP_DELTA_BAK_FILE present: the rebuilt file, if any, is moved in, else the old
+ *   copy goes back;
+ * - basis present: a leftover FTP_DELTA_BAK_FILE is the old copy of a finished swap and a leftover
+ *   FTP_DELTA_TMP_FILE an unfinished stream, both are removed.
+ */
+void ftp_delta_recover(const char *root)
+{
+    char basis[FTP_DELTA_PATH_MAX];
+    char tmp[FTP_DELTA_PATH_MAX];
+    char bak[FTP_DELTA_PATH_MAX];
+    struct stat st;
+
+    ftp_delta_fullname(tmp, root, FTP_DELTA_TARGET_FILE);
+    FILE *fp = fopen(tmp, "r");
+    if (fp == NULL)
+    {
+        ftp_delta_drop(root);
+        return;
+    }
+    bool known = (fgets(basis, sizeof(basis), fp) != NULL);
+    fclose(fp);
+
+    ftp_delta_fullname(tmp, root, FTP_DELTA_TMP_FILE);
+    ftp_delta_fullname(bak, root, FTP_DELTA_BAK_FILE);
+    if (known && (stat(basis, &st) != 0) && (stat(bak, &st) == 0))
+    {
+        if ((stat(tmp, &st) == 0) && (rename(tmp, basis) == 0))
+            ESP_LOGW(FTP_DELTA_TAG, "Completed interrupted delta of %s", basis);
+        else if (rename(bak, basis) == 0)
+            ESP_LOGW(FTP_DELTA_TAG, "Restored %s after an interrupted delta", basis);
+        else
+            return;     // both copies stay for the next attempt
+    }
+    ftp_delta_drop(root);
+}
+
+/**
+ * The function `ftp_delta_close` releases the files and buffer of a checksum or apply session.
+ */
+void ftp_delta_close(ftp_delta_t *d)
+{
+    if (d->basis)
+        fclose(d->basis);
+    if (d->out)
+        fclose(d->out);
+    if (d->buf)
+        free(d->buf);
+
+    d->basis = NULL;
+    d->out = NULL;
+    d->buf = NULL;
+}
+
+bool ftp_delta_active(const ftp_delta_t *d)
+{
+    return (d->buf != NULL);
+}
+
+/***********************************
+ *   PRIVATE FUNCTIONS
+ **********************************/
+
+static uint32_t get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static void ftp_delta_fullname(char *dest, const char *root, const char *name)
+{
+    snprintf(dest, FTP_DELTA_PATH_MAX, "%s%s", root, name);
+}
+
+/**
+ * The function `ftp_delta_drop` removes the files of a delta that are no longer needed, the target
+ * last so that no copy is ever left without it.
+ */
+static void ftp_delta_drop(const char *root)
+{
+    char fullname[FTP_DELTA_PATH_MAX];
+
+    ftp_delta_fullname(fullname, root, FTP_DELTA_TMP_FILE);
+    unlink(fullname);
+    ftp_delta_fullname(fullname, root, FTP_DELTA_BAK_FILE);
+    unlink(fullname);
+    ftp_delta_fullname(fullname, root, FTP_DELTA_TARGET_FILE);
+    unlink(fullname);
+}
+
+static bool ftp_delta_write(ftp_delta_t *d, const uint8_t *data, uint32_t len)
+{
+    if (fwrite(data, 1, len, d->out) != len)
+    {
+        ESP_LOGW(FTP_DELTA_TAG, "Write error at %" PRIu64, d->written);
+        return false;
+    }
+    d->written += len;
+    return true;
+}
+
+/**
+ * The function `ftp_delta_copy_blocks` appends `count` blocks of the basis file, starting at block
+ * `first`, to the output. The last block of the basis may be short.
+ */
+static bool ftp_delta_copy_blocks(ftp_delta_t *d, uint32_t first, uint32_t count)
+{
+    uint64_t offset = (uint64_t)first * d->blocksize;
+    uint64_t left = (uint64_t)count * d->blocksize;
+    off_t pos = (off_t)offset;
+
+    if (d->basis == NULL)
+    {
+        ESP_LOGW(FTP_DELTA_TAG, "Copy without basis file");
+        return false;
+    }
+    // a block past the reach of off_t is refused rather than read from a wrapped offset
+    if ((pos < 0) || ((uint64_t)pos != offset) || (fseeko(d->basis, pos, SEEK_SET) != 0))
+        return false;
+
+    while (left > 0)
+    {
+        size_t n = fread(d->buf, 1, MIN(left, FTP_DELTA_COPYBUF_SIZE), d->basis);
+        if (n == 0)
+            break;  // end of basis, short last block
+        if (!ftp_delta_write(d, d->buf, n))
+            return false;
+        left -= n;
+    }
+    return !ferror(d->basis);
+}
@@ -0,0 +1,91 @@
+#ifndef FTP_DELTA_H_
+#define FTP_DELTA_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "ftp.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+
+#define FTP_DELTA_BLOCKSIZE_MIN     512
+#define FTP_DELTA_BLOCKSIZE_MAX     (64 * 1024)
+#define FTP_DELTA_COPYBUF_SIZE      4096
+#define FTP_DELTA_SUMS_LINE_MAX     64      // "<index> <adler32> <md5>\r\n"
+#define FTP_DELTA_PATH_MAX          (FTP_MAX_PARAM_SIZE + 32)
+
+// Files of a running delta, in a hidden directory at the root of the volume
+#define FTP_DELTA_DIR               "/.delta"
+#define FTP_DELTA_TMP_FILE          FTP_DELTA_DIR "/rebuild.tmp"    // file being rebuilt
+#define FTP_DELTA_BAK_FILE          FTP_DELTA_DIR "/basis.bak"      // basis kept while the rebuilt file is moved in
+#define FTP_DELTA_TARGET_FILE       FTP_DELTA_DIR "/target"         // path of the basis, while the files above exist
+
+// Delta stream opcodes, all integers are big endian
+#define FTP_DELTA_OP_COPY           'C'     // 'C' u32 first_block u32 block_count
+#define FTP_DELTA_OP_LITERAL        'L'     // 'L' u32 length, followed by length bytes
+#define FTP_DELTA_OP_END            'E'     // 'E', end of stream
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+typedef enum
+{
+    E_FTP_DELTA_OP = 0,
+    E_FTP_DELTA_HEADER,
+    E_FTP_DELTA_LITERAL,
+    E_FTP_DELTA_DONE,
+    E_FTP_DELTA_ERROR
+} ftp_delta_state_t;
+
+typedef struct
+{
+    FILE        *basis;
+    FILE        *out;
+    uint8_t     *buf;           // one block (sums) or copy buffer (apply)
+    uint32_t    blocksize;
+    uint32_t    index;          // next block to checksum
+    uint32_t    literal_left;
+    uint64_t    written;
+    uint8_t     state;
+    uint8_t     op;
+    uint8_t     hdr[8];
+    uint8_t     hdr_len;
+    uint8_t     hdr_need;
+} ftp_delta_t;
+
+/**********************
+ *   PUBLIC FUNCTIONS
+ **********************/
+
+uint32_t ftp_delta_adler32(const uint8_t *data, uint32_t len);
+
+bool ftp_delta_sums_begin(ftp_delta_t *d, const char *path, uint32_t blocksize);
+ftp_result_t ftp_delta_sums_next(ftp_delta_t *d, char *list, uint32_t maxlistsize, uint32_t *listsize);
+
+bool ftp_delta_apply_begin(ftp_delta_t *d, const char *root, const char *basis, uint32_t blocksize);
+ftp_result_t ftp_delta_apply_feed(ftp_delta_t *d, const uint8_t *data, uint32_t len);
+bool ftp_delta_apply_finish(ftp_delta_t *d, const char *root, const char *basis);
+void ftp_delta_apply_abort(ftp_delta_t *d, const char *root);
+void ftp_delta_recover(const char *root);
+
+void ftp_delta_close(ftp_delta_t *d);
+bool ftp_delta_active(const ftp_delta_t *d);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FTP_DELTA_H_ */
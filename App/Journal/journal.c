@@ -0,0 +1,1121 @@
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <ctype.h>
+#include <inttypes.h>
+#include <time.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+
+#include "esp_log.h"
+
+#include "journal.h"
+#include "journal_index.h"
+#include "sd_card.h"
+#include "tusb_msc_storage.h"
+#include "tusb.h"
+
+/***********************************
+ *      DEFINES
+ ***********************************/
+
+#define JOURNAL_FULLNAME_MAX    (JOURNAL_PATH_MAX + 16)
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+typedef struct
+{
+    journal_index_reader_t  old;            // index written by the previous reconcile
+    journal_index_writer_t  snap;           // index being written
+    FILE                    *diff;          // events found, numbered once the walk is over
+    bool                    old_valid;      // false at the end of the previous index
+    bool                    quiet;          // no per-file events
+    uint32_t                events;
+    char                    path[JOURNAL_PATH_MAX];     // directory being walked, relative to the mount point
+    char                    fullname[JOURNAL_FULLNAME_MAX];
+} journal_walk_t;
+
+// Called for every journal line; returning false stops the scan before the line is consumed
+typedef bool (*journal_line_cb_t)(void *ctx, char *line);
+
+typedef struct
+{
+    char                    *list;
+    uint32_t                maxlistsize;
+    uint32_t                next;
+} journal_changes_ctx_t;
+
+typedef struct
+{
+    journal_find_t          *f;
+    journal_index_reader_t  *rd;
+    bool                    overflow;       // too much changed, rebuild the index instead
+} journal_overlay_ctx_t;
+
+/***********************************
+ *   PRIVATE DATA
+ ***********************************/
+
+static SemaphoreHandle_t journal_mutex = NULL;
+static TaskHandle_t journal_task_handle = NULL;
+static volatile bool journal_reconciling = false;
+static bool journal_walking = false;                // events are held back until the walk is over
+static volatile bool journal_stale = false;         // another card or a new volume, read everything back
+static volatile bool journal_rebuild = false;       // a search found the index missing or too far behind
+static bool journal_loaded = false;
+static uint32_t journal_seq = 0;
+static uint32_t journal_host_writes = UINT32_MAX;   // never matches on the first use after boot
+static journal_cursor_t journal_index_mark = {0};   // first journal line newer than the index
+
+/***********************************
+ *   PRIVATE FUNCTIONS PROTOTYPE
+ **********************************/
+
+static void journal_fullname(char *dest, const char *path);
+static void journal_task(void *arg);
+static void journal_load(void);
+static void journal_prepare(void);
+static uint32_t journal_host_write_count(void);
+static void journal_reconcile(bool quiet);
+static bool journal_read_seq(const char *path, bool last, uint32_t *seq);
+static FILE *journal_open_log(void);
+static void journal_append(FILE *fp, journal_event_t event, const char *path, const char *new_path);
+static void journal_put_event(FILE *fp, journal_event_t event, const char *path, const char *new_path);
+static void journal_append_file(FILE *fp, const char *path);
+static void journal_scan(journal_cursor_t *c, journal_line_cb_t cb, void *ctx);
+static bool journal_changes_line(void *ctx, char *line);
+static bool journal_in_subtree(const char *path, const char *dir);
+static void journal_old_next(journal_walk_t *w);
+static void journal_old_drop(journal_walk_t *w);
+static void journal_old_keep_subtree(journal_walk_t *w, const char *dir);
+static void journal_walk_entry(journal_walk_t *w, const char *path, bool is_dir, uint64_t size, uint32_t mtime);
+static void journal_walk_dir(journal_walk_t *w);
+static int journal_name_cmp(const void *a, const void *b);
+static bool journal_find_load(journal_find_t *f);
+static bool journal_overlay_line(void *ctx, char *line);
+static bool journal_overlay_add(journal_find_t *f, const char *path);
+static bool journal_overlay_has(const journal_find_t *f, const char *path);
+static bool journal_find_emit(journal_find_t *f, const char *path, bool is_dir, uint64_t size, uint32_t mtime,
+                              char *list, uint32_t maxlistsize, uint32_t *next);
+static bool journal_glob_match(const char *pat, const char *str);
+static uint64_t journal_file_size(const char *fullname, const struct stat *st);
+
+/***********************************
+ *   PUBLIC FUNCTIONS
+ ***********************************/
+
+/**
+ * The function `journal_init` creates the journal lock and the task that reconciles the tree in the
+ * background, which makes its first pass right away: the card may have been written elsewhere while
+ * the board was off.
+ */
+bool journal_init(void)
+{
+    if (journal_mutex == NULL)
+        journal_mutex = xSemaphoreCreateMutex();
+    if (journal_mutex == NULL)
+        return false;
+
+    if ((journal_task_handle == NULL) &&
+        (xTaskCreate(journal_task, "journal", JOURNAL_TASK_STACK, NULL, JOURNAL_TASK_PRIO, &journal_task_handle) != pdPASS))
+    {
+        ESP_LOGE(JOURNAL_TAG, "No memory for the task");
+        return false;
+    }
+    journal_reconcile_start();
+    return true;
+}
+
+/**
+ * The function `journal_reconcile_start` asks the journal task for a reconcile, when the card comes
+ * back from the USB host or another card was inserted. The pass only runs if the host wrote to the
+ * volume since the last one, or if the journal was reset.
+ */
+void journal_reconcile_start(void)
+{
+    if (journal_task_handle != NULL)
+        xTaskNotifyGive(journal_task_handle);
+}
+
+/**
+ * The function `journal_reconcile_busy` tells whether changes made by the USB host are still missing
+ * from the journal, either because a reconcile is running or because it could not start yet, or
+ * whether the index is being rebuilt for a search.
+ */
+bool journal_reconcile_busy(void)
+{
+    return journal_reconciling || journal_stale || journal_rebuild ||
+           (journal_host_write_count() != journal_host_writes);
+}
+
+/**
+ * The function `journal_reset` forgets what is known about the volume, after a card change or a
+ * format: the sequence number and the index are read back from the card at the next use. It does not
+ * wait for the lock, so it may be called from the SD manager task while a reconcile runs.
+ */
+void journal_reset(void)
+{
+    journal_stale = true;
+}
+
+/**
+ * The function `journal_record` appends one event to the journal. It is called by the FTP and TFTP
+ * write paths right after the change is on the card, with the volume mounted. While a reconcile walks
+ * the tree the event is held back and numbered after the events the walk finds, so it is not queued
+ * behind the walk.
+ *
+ * @param path Path relative to the mount point, e.g. "/cam1/0001.mp4".
+ * @param new_path Destination of a rename, NULL for every other event.
+ */
+void journal_record(journal_event_t event, const char *path, const char *new_path)
+{
+    if (journal_mutex == NULL)
+        return;
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    journal_prepare();
+    if (journal_walking)
+    {
+        char fullname[JOURNAL_FULLNAME_MAX];
+        journal_fullname(fullname, JOURNAL_HELD_FILE);
+        FILE *fp = fopen(fullname, "a");
+        if (fp)
+        {
+            journal_put_event(fp, event, path, new_path);
+            fclose(fp);
+        }
+    }
+    else
+    {
+        FILE *fp = journal_open_log();
+        if (fp)
+        {
+            journal_append(fp, event, path, new_path);
+            fclose(fp);
+        }
+    }
+    xSemaphoreGive(journal_mutex);
+}
+
+uint32_t journal_last_seq(void)
+{
+    return journal_seq;
+}
+
+/**
+ * The function `journal_changes_begin` starts a query for all events with a sequence number above
+ * `since`.
+ */
+void journal_changes_begin(journal_cursor_t *c, uint32_t since)
+{
+    memset(c, 0, sizeof(*c));
+    c->since = since;
+}
+
+/**
+ * The function `journal_changes_next` writes the next matching events into `list`, one per line
+ * terminated by "\r\n", until the buffer is full. The files are reopened on every call so a query
+ * survives the volume being unmounted between calls.
+ *
+ * If the requested history has been rotated away, or `since` is ahead of the journal (a different or
+ * reformatted card), the first line is a rescan event for "/" telling the client to list everything.
+ *
+ * @return `E_JOURNAL_RESULT_CONTINUE` while events remain, `E_JOURNAL_RESULT_OK` after the last one.
+ */
+journal_result_t journal_changes_next(journal_cursor_t *c, char *list, uint32_t maxlistsize, uint32_t *listsize)
+{
+    journal_changes_ctx_t ctx = { .list = list, .maxlistsize = maxlistsize, .next = 0 };
+
+    *listsize = 0;
+    if (journal_mutex == NULL)
+        return E_JOURNAL_RESULT_FAILED;
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    if (!c->started)
+    {
+        uint32_t oldest = 0;
+        journal_prepare();
+        if (!journal_read_seq(JOURNAL_OLD_FILE, false, &oldest))
+            journal_read_seq(JOURNAL_LOG_FILE, false, &oldest);
+
+        if (c->since > journal_seq)
+        {
+            ctx.next += snprintf(list, maxlistsize, "%" PRIu32 " %c %lld /\r\n", journal_seq, E_JOURNAL_RESCAN, (long long)time(NULL));
+            c->since = journal_seq;
+        }
+        else if (oldest > c->since + 1)
+        {
+            ctx.next += snprintf(list, maxlistsize, "%" PRIu32 " %c %lld /\r\n", oldest - 1, E_JOURNAL_RESCAN, (long long)time(NULL));
+        }
+        c->started = true;
+    }
+    journal_scan(c, journal_changes_line, &ctx);
+    xSemaphoreGive(journal_mutex);
+
+    *listsize = ctx.next;
+    return (c->part < 2) ? E_JOURNAL_RESULT_CONTINUE : E_JOURNAL_RESULT_OK;
+}
+
+/**
+ * The function `journal_find_begin` starts a search of the metadata index. The index is the sorted
+ * listing written by the last reconcile; files changed since then are known from the journal and
+ * are looked up live instead. When too much has changed the journal task is asked to rebuild the
+ * index, the caller does not wait for the whole tree to be walked.
+ *
+ * @return `false` if no index can be read; `journal_reconcile_busy` then tells whether it is being
+ * rebuilt.
+ */
+bool journal_find_begin(journal_find_t *f, const journal_query_t *q)
+{
+    bool ok;
+
+    memset(f, 0, sizeof(*f));
+    f->q = *q;
+    if (journal_mutex == NULL)
+        return false;
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    journal_prepare();
+    ok = journal_find_load(f);
+    xSemaphoreGive(journal_mutex);
+    if (!ok)
+    {
+        journal_rebuild = true;
+        journal_reconcile_start();
+    }
+    return ok;
+}
+
+/**
+ * The function `journal_find_next` writes the next matching entries into `list` as MLSD style lines
+ * "type=<file|dir>;size=<n>;modify=<YYYYMMDDHHMMSS>; <path>\r\n".
+ *
+ * @return `E_JOURNAL_RESULT_CONTINUE` while entries remain, `E_JOURNAL_RESULT_OK` after the last one,
+ * `E_JOURNAL_RESULT_FAILED` if the index cannot be read.
+ */
+journal_result_t journal_find_next(journal_find_t *f, char *list, uint32_t maxlistsize, uint32_t *listsize)
+{
+    journal_index_reader_t *rd = malloc(sizeof(journal_index_reader_t));
+    char fullname[JOURNAL_FULLNAME_MAX];
+    journal_result_t res = E_JOURNAL_RESULT_CONTINUE;
+    uint32_t next = 0;
+    struct stat st;
+
+    *listsize = 0;
+    if ((rd == NULL) || (journal_mutex == NULL))
+    {
+        free(rd);
+        return E_JOURNAL_RESULT_FAILED;
+    }
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    if (f->pos < f->end)
+    {
+        // indexed entries, skipping those changed since the index was written
+        if (!journal_index_open(rd) || !journal_index_seek(rd, f->pos))
+        {
+            journal_index_close(rd);
+            res = E_JOURNAL_RESULT_FAILED;
+            goto out;
+        }
+        do
+        {
+            if (f->prefix_len && journal_path_ncmp(rd->path, f->q.glob, f->prefix_len))
+            {
+                f->pos = f->end;
+                break;
+            }
+            if (!journal_overlay_has(f, rd->path) &&
+                !journal_find_emit(f, rd->path, rd->r.flags & JOURNAL_INDEX_FLAG_DIR, rd->r.size, rd->r.mtime,
+                                   list, maxlistsize, &next))
+                break;      // list full, this record is sent next time
+            f->pos++;
+        } while ((f->pos < f->end) && journal_index_next(rd));
+        journal_index_close(rd);
+    }
+
+    while ((f->pos >= f->end) && (f->overlay_pos < f->overlay_count))
+    {
+        // entries changed since the index was written, as they are now
+        const char *path = f->overlay[f->overlay_pos];
+        snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT, path);
+        if ((stat(fullname, &st) == 0) &&
+            !journal_find_emit(f, path, S_ISDIR(st.st_mode), S_ISDIR(st.st_mode) ? 0 :
+                               journal_file_size(fullname, &st), (uint32_t)st.st_mtime, list, maxlistsize, &next))
+            break;
+        f->overlay_pos++;
+    }
+    if ((f->pos >= f->end) && (f->overlay_pos >= f->overlay_count))
+        res = E_JOURNAL_RESULT_OK;
+
+out:
+    xSemaphoreGive(journal_mutex);
+    free(rd);
+    *listsize = next;
+    return res;
+}
+
+void journal_find_close(journal_find_t *f)
+{
+    for (uint32_t i = 0; i < f->overlay_count; i++)
+        free(f->overlay[i]);
+    free(f->overlay);
+    f->overlay = NULL;
+    f->overlay_count = 0;
+    f->overlay_pos = 0;
+}
+
+/***********************************
+ *   PRIVATE FUNCTIONS
+ **********************************/
+
+static void journal_fullname(char *dest, const char *path)
+{
+    snprintf(dest, JOURNAL_FULLNAME_MAX, "%s%s", MOUNT_POINT, path);
+}
+
+/**
+ * The function `journal_task` runs the reconciles asked for by `journal_reconcile_start`. It holds
+ * the card for the length of a pass, unless the USB host has it: the next change of owner asks again.
+ * Without host writes to look for, only the index is rebuilt when a search asked for it.
+ */
+static void journal_task(void *arg)
+{
+    for (;;)
+    {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        if (tud_mounted() && tinyusb_msc_storage_in_use_by_usb_host_lun(JOURNAL_CARD_LUN))
+            continue;
+        if (tinyusb_msc_storage_acquire(JOURNAL_CARD_LUN, JOURNAL_STORAGE_USER, MOUNT_POINT) != ESP_OK)
+            continue;
+
+        bool run = true;
+        bool quiet = false;
+
+        journal_reconciling = true;
+        xSemaphoreTake(journal_mutex, portMAX_DELAY);
+        journal_load();
+        uint32_t host_writes = journal_host_write_count();
+        if (host_writes != journal_host_writes)
+            journal_host_writes = host_writes;
+        else if (journal_rebuild)
+            quiet = true;
+        else
+            run = false;
+        journal_rebuild = false;
+        xSemaphoreGive(journal_mutex);
+
+        if (run)
+            journal_reconcile(quiet);
+        journal_reconciling = false;
+
+        tinyusb_msc_storage_release(JOURNAL_CARD_LUN, JOURNAL_STORAGE_USER);
+    }
+}
+
+/**
+ * The function `journal_load` reads the last sequence number back from the card on the first use
+ * after boot or after `journal_reset`. Called with the lock held and the volume mounted.
+ */
+static void journal_load(void)
+{
+    if (journal_stale)
+    {
+        journal_stale = false;
+        journal_loaded = false;
+        journal_host_writes = UINT32_MAX;
+        memset(&journal_index_mark, 0, sizeof(journal_index_mark));
+    }
+    if (!journal_loaded)
+    {
+        char fullname[JOURNAL_FULLNAME_MAX];
+        journal_fullname(fullname, JOURNAL_DIR);
+        mkdir(fullname, 0755);
+        journal_seq = 0;
+        if (!journal_read_seq(JOURNAL_LOG_FILE, true, &journal_seq))
+            journal_read_seq(JOURNAL_OLD_FILE, true, &journal_seq);
+        journal_loaded = true;
+        ESP_LOGI(JOURNAL_TAG, "Last seq %" PRIu32, journal_seq);
+    }
+}
+
+/**
+ * The function `journal_prepare` brings the journal up to date before it is used. The changes the USB
+ * host made since the last reconcile are left to the journal task, the caller does not wait for the
+ * whole tree to be walked. Called with the lock held and the volume mounted.
+ */
+static void journal_prepare(void)
+{
+    journal_load();
+    if (journal_host_write_count() != journal_host_writes)
+        journal_reconcile_start();
+}
+
+/**
+ * The function `journal_host_write_count` sums the host writes of every LUN: a host session is
+ * reconciled whichever of the volumes it wrote to, the LUN of the card is not assumed.
+ */
+static uint32_t journal_host_write_count(void)
+{
+    uint32_t count = 0;
+
+    for (uint8_t lun = 0; lun < tinyusb_msc_storage_get_lun_count(); lun++)
+        count += tinyusb_msc_storage_get_host_write_count_lun(lun);
+    return count;
+}
+
+/**
+ * The function `journal_reconcile` compares the directory tree against the index written by the
+ * previous pass, journals every difference and writes a new index. It runs when the USB host has
+ * written to the volume since the last pass, because those changes bypass the FTP write paths, and
+ * quietly when the index has fallen too far behind the journal.
+ *
+ * The tree is walked depth first with the entries of every directory sorted by name, which keeps
+ * both the walk and the index in one global order: the diff is a single merge of two sorted streams
+ * and only one directory listing is held in RAM at a time.
+ *
+ * The walk runs without the lock, so the servers keep recording and querying meanwhile. Its events
+ * and those recorded in the meantime are numbered and appended to the log at the end, in that order:
+ * a change made during the walk always comes after what the walk saw. The lock is taken again for
+ * that and for swapping in the new index. Called without the lock, from the journal task only.
+ *
+ * @param quiet Only rebuild the index, every change is already in the journal.
+ */
+static void journal_reconcile(bool quiet)
+{
+    journal_walk_t *w = calloc(1, sizeof(journal_walk_t));
+    uint32_t start_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    char fullname[JOURNAL_FULLNAME_MAX];
+    bool ok;
+
+    if (w == NULL)
+        return;
+
+    w->quiet = quiet;
+    journal_fullname(fullname, JOURNAL_WALK_FILE);
+    w->diff = fopen(fullname, "w+");
+    if ((w->diff == NULL) || !journal_index_write_begin(&w->snap))
+    {
+        ESP_LOGW(JOURNAL_TAG, "Reconcile: cannot open journal files");
+        if (w->diff)
+            fclose(w->diff);
+        unlink(fullname);
+        free(w);
+        return;
+    }
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    journal_fullname(fullname, JOURNAL_HELD_FILE);
+    unlink(fullname);
+    journal_walking = true;
+    xSemaphoreGive(journal_mutex);
+
+    w->old_valid = journal_index_open(&w->old);
+    if (!w->old_valid && !quiet)
+    {
+        // no index yet: everything is new, a single rescan event says so
+        w->quiet = true;
+        journal_put_event(w->diff, E_JOURNAL_RESCAN, "/", NULL);
+    }
+    journal_old_next(w);
+
+    w->path[0] = '\0';
+    journal_walk_dir(w);
+    while (w->old_valid)
+        journal_old_drop(w);       // whatever is left was deleted
+    journal_index_close(&w->old);
+    fflush(w->diff);
+    ok = journal_index_write_finish(&w->snap);
+
+    xSemaphoreTake(journal_mutex, portMAX_DELAY);
+    journal_walking = false;
+    FILE *log = journal_stale ? NULL : journal_open_log();
+    if (log)
+    {
+        journal_append_file(log, JOURNAL_WALK_FILE);
+        fflush(log);
+        journal_index_mark.since = journal_seq;
+        journal_index_mark.part = 1;
+        journal_index_mark.offset = ftell(log);
+        journal_append_file(log, JOURNAL_HELD_FILE);
+        fclose(log);
+        journal_index_mark.started = ok && journal_index_write_commit(&w->snap, journal_index_mark.since);
+        ok = journal_index_mark.started;
+    }
+    else
+    {
+        ok = false;
+    }
+    xSemaphoreGive(journal_mutex);
+
+    if (!ok)
+        journal_index_write_abort(&w->snap);
+    fclose(w->diff);
+    journal_fullname(fullname, JOURNAL_WALK_FILE);
+    unlink(fullname);
+    journal_fullname(fullname, JOURNAL_HELD_FILE);
+    unlink(fullname);
+
+    if (ok)
+        ESP_LOGI(JOURNAL_TAG, "Reconciled %" PRIu32 " entries, %" PRIu32 " events, last seq %" PRIu32 " (%" PRIu32 " msec)",
+                 w->snap.count, w->events, journal_seq, xTaskGetTickCount() * portTICK_PERIOD_MS - start_ms);
+    else
+        ESP_LOGW(JOURNAL_TAG, "Reconcile: cannot write the index");
+    free(w);
+}
+
+/**
+ * The function `journal_read_seq` reads the sequence number of the first or the last event of a
+ * journal file. For the last one only the tail of the file is read.
+ *
+ * @return `false` if the file is missing or empty.
+ */
+static bool journal_read_seq(const char *path, bool last, uint32_t *seq)
+{
+    char fullname[JOURNAL_FULLNAME_MAX];
+    char buf[JOURNAL_LINE_MAX];
+    bool found = false;
+
+    journal_fullname(fullname, path);
+    FILE *fp = fopen(fullname, "r");
+    if (fp == NULL)
+        return false;
+
+    if (last)
+    {
+        fseek(fp, 0, SEEK_END);
+        long size = ftell(fp);
+        fseek(fp, (size > (long)sizeof(buf) - 1) ? size - (long)sizeof(buf) + 1 : 0, SEEK_SET);
+        size_t n = fread(buf, 1, sizeof(buf) - 1, fp);
+        buf[n] = '\0';
+        while ((n > 0) && (buf[n - 1] == '\n'))
+            buf[--n] = '\0';
+        char *line = strrchr(buf, '\n');
+        line = line ? line + 1 : buf;
+        found = (*line != '\0');
+        if (found)
+            *seq = strtoul(line, NULL, 10);
+    }
+    else if (fgets(buf, sizeof(buf), fp))
+    {
+        *seq = strtoul(buf, NULL, 10);
+        found = true;
+    }
+    fclose(fp);
+    return found;
+}
+
+/**
+ * The function `journal_open_log` opens changes.log for appending. Once the log has grown past
+ * `JOURNAL_LOG_SIZE_MAX` it becomes changes.old (replacing the previous one) and a new log is
+ * started, so the journal keeps between one and two logs worth of history.
+ */
+static FILE *journal_open_log(void)
+{
+    char fullname[JOURNAL_FULLNAME_MAX];
+    char oldname[JOURNAL_FULLNAME_MAX];
+
+    journal_fullname(fullname, JOURNAL_LOG_FILE);
+    FILE *fp = fopen(fullname, "a");
+    if (fp == NULL)
+    {
+        ESP_LOGW(JOURNAL_TAG, "Cannot open %s", fullname);
+        return NULL;
+    }
+
+    fseek(fp, 0, SEEK_END);
+    if (ftell(fp) >= JOURNAL_LOG_SIZE_MAX)
+    {
+        fclose(fp);
+        journal_fullname(oldname, JOURNAL_OLD_FILE);
+        unlink(oldname);
+        rename(fullname, oldname);
+        fp = fopen(fullname, "a");
+
+        // the index mark moves with its file, or is lost with the previous changes.old
+        if (journal_index_mark.part == 1)
+            journal_index_mark.part = 0;
+        else
+            journal_index_mark.started = false;
+    }
+    return fp;
+}
+
+static void journal_append(FILE *fp, journal_event_t event, const char *path, const char *new_path)
+{
+    journal_seq++;
+    fprintf(fp, "%" PRIu32 " ", journal_seq);
+    journal_put_event(fp, event, path, new_path);
+}
+
+/**
+ * The function `journal_put_event` writes an event line without its sequence number, the form events
+ * wait in while a reconcile runs.
+ */
+static void journal_put_event(FILE *fp, journal_event_t event, const char *path, const char *new_path)
+{
+    if (new_path)
+        fprintf(fp, "%c %lld %s\t%s\n", event, (long long)time(NULL), path, new_path);
+    else
+        fprintf(fp, "%c %lld %s\n", event, (long long)time(NULL), path);
+}
+
+/**
+ * The function `journal_append_file` numbers the events waiting in the file `path` and appends them
+ * to the log. Called with the lock held.
+ */
+static void journal_append_file(FILE *fp, const char *path)
+{
+    char fullname[JOURNAL_FULLNAME_MAX];
+    char line[JOURNAL_LINE_MAX];
+
+    journal_fullname(fullname, path);
+    FILE *in = fopen(fullname, "r");
+    if (in == NULL)
+        return;
+    while (fgets(line, sizeof(line), in))
+    {
+        journal_seq++;
+        fprintf(fp, "%" PRIu32 " %s", journal_seq, line);
+    }
+    fclose(in);
+}
+
+/**
+ * The function `journal_scan` passes the journal lines after the cursor position with a sequence
+ * number above `c->since` to `cb`, oldest first, and advances the cursor.
+ */
+static void journal_scan(journal_cursor_t *c, journal_line_cb_t cb, void *ctx)
+{
+    static const char *parts[] = { JOURNAL_OLD_FILE, JOURNAL_LOG_FILE };
+    char fullname[JOURNAL_FULLNAME_MAX];
+    char line[JOURNAL_LINE_MAX];
+
+    while (c->part < 2)
+    {
+        journal_fullname(fullname, parts[c->part]);
+        FILE *fp = fopen(fullname, "r");
+        if ((fp == NULL) || (fseek(fp, c->offset, SEEK_SET) != 0))
+        {
+            if (fp)
+                fclose(fp);
+            c->part++;
+            c->offset = 0;
+            continue;
+        }
+
+        bool stop = false;
+        long start = c->offset;
+        while (fgets(line, sizeof(line), fp))
+        {
+            if ((strtoul(line, NULL, 10) > c->since) && !cb(ctx, line))
+            {
+                stop = true;
+                break;
+            }
+            start = ftell(fp);
+        }
+        fclose(fp);
+        c->offset = start;
+        if (stop)
+            return;
+        c->part++;
+        c->offset = 0;
+    }
+}
+
+static bool journal_changes_line(void *ctx, char *line)
+{
+    journal_changes_ctx_t *cc = (journal_changes_ctx_t *)ctx;
+
+    if ((cc->maxlistsize - cc->next) <= JOURNAL_LINE_MAX + 2)
+        return false;
+    line[strcspn(line, "\r\n")] = '\0';
+    cc->next += snprintf(cc->list + cc->next, cc->maxlistsize - cc->next, "%s\r\n", line);
+    return true;
+}
+
+static bool journal_in_subtree(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+    return (journal_path_ncmp(path, dir, len) == 0) && (path[len] == '/');
+}
+
+static void journal_old_next(journal_walk_t *w)
+{
+    w->old_valid = w->old_valid && journal_index_next(&w->old);
+}
+
+/**
+ * The function `journal_old_drop` handles an indexed entry that no longer exists: it is journaled as
+ * deleted and, for a directory, its whole subtree is skipped since the client drops it with the
+ * directory.
+ */
+static void journal_old_drop(journal_walk_t *w)
+{
+    char dir[JOURNAL_PATH_MAX];
+    bool was_dir = (w->old.r.flags & JOURNAL_INDEX_FLAG_DIR);
+
+    strlcpy(dir, w->old.path, sizeof(dir));
+    if (!w->quiet)
+    {
+        journal_put_event(w->diff, E_JOURNAL_DELETE, dir, NULL);
+        w->events++;
+    }
+    journal_old_next(w);
+    while (was_dir && w->old_valid && journal_in_subtree(w->old.path, dir))
+        journal_old_next(w);
+}
+
+/**
+ * The function `journal_old_keep_subtree` copies the indexed entries below `dir` unchanged into the
+ * new index. Used for directories too large to diff.
+ */
+static void journal_old_keep_subtree(journal_walk_t *w, const char *dir)
+{
+    while (w->old_valid && journal_in_subtree(w->old.path, dir))
+    {
+        journal_index_write_add(&w->snap, w->old.path, w->old.r.flags & JOURNAL_INDEX_FLAG_DIR,
+                                w->old.r.size, w->old.r.mtime);
+        journal_old_next(w);
+    }
+}
+
+/**
+ * The function `journal_walk_entry` merges one entry of the live tree with the previous index and
+ * writes it to the new one.
+ */
+static void journal_walk_entry(journal_walk_t *w, const char *path, bool is_dir, uint64_t size, uint32_t mtime)
+{
+    journal_event_t event = E_JOURNAL_CREATE;
+
+    while (w->old_valid && (journal_path_cmp(w->old.path, path) < 0))
+        journal_old_drop(w);
+
+    if (w->old_valid && (journal_path_cmp(w->old.path, path) == 0))
+    {
+        if (((w->old.r.flags & JOURNAL_INDEX_FLAG_DIR) != 0) != is_dir)
+        {
+            journal_old_drop(w);    // file replaced by a directory or vice versa
+        }
+        else
+        {
+            event = (!is_dir && ((w->old.r.size != size) || (w->old.r.mtime != mtime))) ? E_JOURNAL_MODIFY : 0;
+            journal_old_next(w);
+        }
+    }
+
+    if (event && !w->quiet)
+    {
+        journal_put_event(w->diff, event, path, NULL);
+        w->events++;
+    }
+    journal_index_write_add(&w->snap, path, is_dir, size, mtime);
+}
+
+/**
+ * The function `journal_walk_dir` lists the directory `w->path`, sorts its names and visits them,
+ * descending into subdirectories in place.
+ */
+static void journal_walk_dir(journal_walk_t *w)
+{
+    size_t len = strlen(w->path);
+    char **names = NULL;
+    uint32_t count = 0;
+    uint32_t alloc = 0;
+    bool too_big = false;
+    struct dirent *de;
+    struct stat st;
+
+    snprintf(w->fullname, sizeof(w->fullname), "%s%s", MOUNT_POINT, w->path);
+    DIR *dp = opendir(w->fullname);
+    if (dp == NULL)
+        return;
+
+    while ((de = readdir(dp)) != NULL)
+    {
+        if (!strcmp(de->d_name, ".") || !strcmp(de->d_name, "..") ||
+            ((len == 0) && !strcasecmp(de->d_name, JOURNAL_DIR + 1)))
+            continue;
+        if (count == alloc)
+        {
+            char **grown = NULL;
+            if (alloc < JOURNAL_DIR_ENTRIES_MAX)
+                grown = realloc(names, (alloc ? alloc * 2 : 64) * sizeof(char *));
+            if (grown == NULL)
+            {
+                too_big = true;
+                break;
+            }
+            names = grown;
+            alloc = alloc ? alloc * 2 : 64;
+        }
+        if ((names[count] = strdup(de->d_name)) == NULL)
+        {
+            too_big = true;
+            break;
+        }
+        count++;
+    }
+    closedir(dp);
+
+    if (too_big)
+    {
+        // keep the old view of this subtree and let the client list it
+        ESP_LOGW(JOURNAL_TAG, "%s too large to diff", w->path);
+        if (!w->quiet)
+        {
+            journal_put_event(w->diff, E_JOURNAL_RESCAN, (len > 0) ? w->path : "/", NULL);
+            w->events++;
+        }
+        journal_old_keep_subtree(w, w->path);
+    }
+    else
+    {
+        qsort(names, count, sizeof(char *), journal_name_cmp);
+        for (uint32_t i = 0; i < count; i++)
+        {
+            if (len + 1 + strlen(names[i]) >= sizeof(w->path))
+                continue;
+            w->path[len] = '/';
+            strcpy(&w->path[len + 1], names[i]);
+            snprintf(w->fullname, sizeof(w->fullname), "%s%s", MOUNT_POINT, w->path);
+            if (stat(w->fullname, &st) == 0)
+            {
+                bool is_dir = S_ISDIR(st.st_mode);
+                journal_walk_entry(w, w->path, is_dir, is_dir ? 0 : journal_file_size(w->fullname, &st),
+                                   (uint32_t)st.st_mtime);
+                if (is_dir)
+                    journal_walk_dir(w);
+            }
+            w->path[len] = '\0';
+        }
+    }
+
+    for (uint32_t i = 0; i < count; i++)
+        free(names[i]);
+    free(names);
+}
+
+static int journal_name_cmp(const void *a, const void *b)
+{
+    return strcasecmp(*(char *const *)a, *(char *const *)b);
+}
+
+/**
+ * The function `journal_find_load` positions a search on the index: the literal start of a path
+ * pattern is binary searched, and the journal events newer than the index are collected as the
+ * overlay. Called with the lock held.
+ *
+ * @return `false` if there is no index or it is too far behind the journal to be patched up.
+ */
+static bool journal_find_load(journal_find_t *f)
+{
+    journal_index_reader_t *rd = malloc(sizeof(journal_index_reader_t));
+    journal_overlay_ctx_t ctx = { .f = f, .rd = rd, .overflow = false };
+
+    if (rd == NULL)
+        return false;
+    journal_find_close(f);
+    if (!journal_index_open(rd) || !journal_index_mark.started || (journal_index_mark.since != rd->hdr.seq))
+    {
+        journal_index_close(rd);
+        free(rd);
+        return false;
+    }
+
+    journal_cursor_t c = journal_index_mark;
+    journal_scan(&c, journal_overlay_line, &ctx);
+
+    f->prefix_len = 0;
+    f->pos = 0;
+    if (f->q.glob[0] == '/')
+    {
+        char prefix[JOURNAL_PATH_MAX];
+        f->prefix_len = strcspn(f->q.glob, "*?");
+        strlcpy(prefix, f->q.glob, f->prefix_len + 1);
+        f->pos = journal_index_lower_bound(rd, prefix);
+    }
+    f->end = rd->hdr.count;
+    journal_index_close(rd);
+    free(rd);
+
+    if (ctx.overflow)
+        journal_find_close(f);
+    return !ctx.overflow;
+}
+
+/**
+ * The function `journal_overlay_line` adds the paths of one journal event to the overlay. Events
+ * that touch a whole subtree (rescans, directory renames and deletes) cannot be patched up path by
+ * path and stop the scan.
+ */
+static bool journal_overlay_line(void *ctx, char *line)
+{
+    journal_overlay_ctx_t *oc = (journal_overlay_ctx_t *)ctx;
+    char fullname[JOURNAL_FULLNAME_MAX];
+    struct stat st;
+
+    // "<seq> <event> <time> <path>[\t<new path>]"
+    line[strcspn(line, "\r\n")] = '\0';
+    char *event = strchr(line, ' ');
+    char *path = event ? strchr(event + 1, ' ') : NULL;
+    if (path == NULL)
+        return true;
+    event++;
+    path = strchr(path + 1, ' ');
+    if (path == NULL)
+        return true;
+    path++;
+    char *new_path = strchr(path, '\t');
+    if (new_path)
+        *new_path++ = '\0';
+
+    switch (*event)
+    {
+    case E_JOURNAL_RENAME:
+        if (new_path == NULL)
+            break;
+        snprintf(fullname, sizeof(fullname), "%s%s", MOUNT_POINT, new_path);
+        if ((stat(fullname, &st) == 0) && S_ISDIR(st.st_mode))
+            oc->overflow = true;
+        else
+            oc->overflow = !journal_overlay_add(oc->f, path) || !journal_overlay_add(oc->f, new_path);
+        break;
+    case E_JOURNAL_DELETE:
+        if ((journal_index_lower_bound(oc->rd, path) < oc->rd->hdr.count) &&
+            (journal_path_cmp(oc->rd->path, path) == 0) && (oc->rd->r.flags & JOURNAL_INDEX_FLAG_DIR))
+            oc->overflow = true;
+        else
+            oc->overflow = !journal_overlay_add(oc->f, path);
+        break;
+    case E_JOURNAL_CREATE:
+    case E_JOURNAL_MODIFY:
+        oc->overflow = !journal_overlay_add(oc->f, path);
+        break;
+    default:
+        oc->overflow = true;
+        break;
+    }
+    return !oc->overflow;
+}
+
+static bool journal_overlay_add(journal_find_t *f, const char *path)
+{
+    if (journal_overlay_has(f, path))
+        return true;
+    if (f->overlay_count >= JOURNAL_FIND_OVERLAY_MAX)
+        return false;
+    if ((f->overlay == NULL) && ((f->overlay = calloc(JOURNAL_FIND_OVERLAY_MAX, sizeof(char *))) == NULL))
+        return false;
+    if ((f->overlay[f->overlay_count] = strdup(path)) == NULL)
+        return false;
+    f->overlay_count++;
+    return true;
+}
+
+static bool journal_overlay_has(const journal_find_t *f, const char *path)
+{
+    for (uint32_t i = 0; i < f->overlay_count; i++)
+    {
+        if (journal_path_cmp(f->overlay[i], path) == 0)
+            return true;
+    }
+    return false;
+}
+
+/**
+ * The function `journal_find_emit` applies the query to one entry and lists it if it matches.
+ *
+ * @return `false` if the list is full; the entry has to be offered again.
+ */
+static bool journal_find_emit(journal_find_t *f, const char *path, bool is_dir, uint64_t size, uint32_t mtime,
+                              char *list, uint32_t maxlistsize, uint32_t *next)
+{
+    const journal_query_t *q = &f->q;
+    const char *name = strrchr(path, '/');
+    char modify[16];
+    time_t t = mtime;
+    struct tm tm_info;
+
+    if ((maxlistsize - *next) <= JOURNAL_LINE_MAX + 2)
+        return false;
+
+    if (is_dir && ((q->size_min > 0) || (q->size_max < UINT64_MAX)))
+        return true;
+    if ((size < q->size_min) || (size > q->size_max) || (mtime < q->mtime_min) || (mtime > q->mtime_max))
+        return true;
+    if (!journal_glob_match(q->glob, (q->glob[0] == '/') ? path : (name ? name + 1 : path)))
+        return true;
+
+    localtime_r(&t, &tm_info);
+    strftime(modify, sizeof(modify), "%Y%m%d%H%M%S", &tm_info);
+    *next += snprintf(list + *next, maxlistsize - *next, "type=%s;size=%" PRIu64 ";modify=%s; %s\r\n",
+                      is_dir ? "dir" : "file", size, modify, path);
+    return true;
+}
+
+/**
+ * The function `journal_glob_match` matches `str` against a pattern where '*' stands for any run of
+ * characters (including '/') and '?' for any one character, ignoring case.
+ */
+static bool journal_glob_match(const char *pat, const char *str)
+{
+    const char *star = NULL;
+    const char *retry = NULL;
+
+    while (*str)
+    {
+        if ((*pat == '?') || ((*pat != '*') && (*pat != '\0') &&
+                              (tolower((unsigned char)*pat) == tolower((unsigned char)*str))))
+        {
+            pat++;
+            str++;
+        }
+        else if (*pat == '*')
+        {
+            star = pat++;
+            retry = str;
+        }
+        else if (star)
+        {
+            pat = star + 1;
+            str = ++retry;
+        }
+        else
+        {
+            return false;
+        }
+    }
+    while (*pat == '*')
+        pat++;
+    return (*pat == '\0');
+}
+
+/**
+ * The function `journal_file_size` gives the size of the file `fullname`, which stat() returned `st`
+ * for. The 32-bit `st_size` is good up to the 4 GB of a FAT file, an exFAT file can be larger and
+ * its size is read through FatFs.
+ */
+static uint64_t journal_file_size(const char *fullname, const struct stat *st)
+{
+#if FF_FS_EXFAT
+    uint64_t size;
+
+    if (tinyusb_msc_storage_get_file_size(fullname, &size) == ESP_OK)
+        return size;
+#endif
+    return (uint32_t)st->st_size;
+}
@@ -0,0 +1,118 @@
+#ifndef JOURNAL_H_
+#define JOURNAL_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+
+// All journal files live in a hidden directory at the root of the card
+#define JOURNAL_DIR                     "/.journal"
+#define JOURNAL_LOG_FILE                JOURNAL_DIR "/changes.log"
+#define JOURNAL_OLD_FILE                JOURNAL_DIR "/changes.old"
+#define JOURNAL_WALK_FILE               JOURNAL_DIR "/walk.new"         // events found by a reconcile, not numbered yet
+#define JOURNAL_HELD_FILE               JOURNAL_DIR "/held.new"         // events recorded while a reconcile runs
+
+#define JOURNAL_LOG_SIZE_MAX            (256 * 1024)    // changes.log is rotated into changes.old beyond this
+#define JOURNAL_PATH_MAX                256
+#define JOURNAL_LINE_MAX                (2 * JOURNAL_PATH_MAX + 48)
+#define JOURNAL_DIR_ENTRIES_MAX         4096            // larger directories are reported as one rescan event
+#define JOURNAL_FIND_OVERLAY_MAX        64              // paths changed since the index was written, beyond this it is rebuilt
+
+#define JOURNAL_TASK_STACK              4096
+#define JOURNAL_TASK_PRIO               2               // below the servers, a reconcile only uses idle time
+#define JOURNAL_CARD_LUN                0
+#define JOURNAL_STORAGE_USER            3               // holder of the card in the MSC storage while reconciling
+
+#define JOURNAL_TAG                     "[Journal]"
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/*
+ * Each event is one line of changes.log: "<seq> <event> <unix time> <path>[\t<new path>]".
+ * Paths are relative to the mount point and start with '/'.
+ */
+typedef enum
+{
+    E_JOURNAL_CREATE = 'C',
+    E_JOURNAL_MODIFY = 'M',
+    E_JOURNAL_DELETE = 'D',
+    E_JOURNAL_RENAME = 'N',     // path -> new path
+    E_JOURNAL_RESCAN = 'S'      // history for this subtree is lost, list it again
+} journal_event_t;
+
+typedef enum
+{
+    E_JOURNAL_RESULT_OK = 0,
+    E_JOURNAL_RESULT_CONTINUE,
+    E_JOURNAL_RESULT_FAILED
+} journal_result_t;
+
+typedef struct
+{
+    uint32_t        since;
+    uint32_t        offset;     // read position in the current file
+    uint8_t         part;       // 0: changes.old, 1: changes.log, 2: done
+    bool            started;
+} journal_cursor_t;
+
+/*
+ * A pattern starting with '/' is matched against the whole path, any other pattern against the file
+ * name only. '*' matches any run of characters, '?' one character, case is ignored.
+ */
+typedef struct
+{
+    char            glob[JOURNAL_PATH_MAX];
+    uint64_t        size_min;
+    uint64_t        size_max;
+    uint32_t        mtime_min;
+    uint32_t        mtime_max;
+} journal_query_t;
+
+typedef struct
+{
+    journal_query_t q;
+    char            **overlay;      // paths changed since the index was written, listed from a live stat
+    uint32_t        overlay_count;
+    uint32_t        overlay_pos;
+    uint32_t        pos;            // next index record
+    uint32_t        end;
+    uint32_t        prefix_len;     // literal start of the pattern, narrows the index range
+} journal_find_t;
+
+/**********************
+ *   PUBLIC FUNCTIONS
+ **********************/
+
+bool journal_init(void);
+void journal_reconcile_start(void);
+bool journal_reconcile_busy(void);
+void journal_reset(void);
+void journal_record(journal_event_t event, const char *path, const char *new_path);
+uint32_t journal_last_seq(void);
+
+void journal_changes_begin(journal_cursor_t *c, uint32_t since);
+journal_result_t journal_changes_next(journal_cursor_t *c, char *list, uint32_t maxlistsize, uint32_t *listsize);
+
+bool journal_find_begin(journal_find_t *f, const journal_query_t *q);
+journal_result_t journal_find_next(journal_find_t *f, char *list, uint32_t maxlistsize, uint32_t *listsize);
+void journal_find_close(journal_find_t *f);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JOURNAL_H_ */
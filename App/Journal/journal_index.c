@@ -0,0 +1,296 @@
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+
+#include "esp_log.h"
+
+#include "journal_index.h"
+#include "sd_card.h"
+
+/***********************************
+ *      DEFINES
+ ***********************************/
+
+#define JOURNAL_INDEX_FULLNAME_MAX  (JOURNAL_PATH_MAX + 16)
+#define JOURNAL_INDEX_COPYBUF_SIZE  512
+
+/***********************************
+ *   PRIVATE FUNCTIONS PROTOTYPE
+ **********************************/
+
+static void journal_index_fullname(char *dest, const char *path);
+static int journal_path_char(char c);
+static bool journal_index_read_path(journal_index_reader_t *rd);
+
+/***********************************
+ *   PUBLIC FUNCTIONS
+ ***********************************/
+
+/**
+ * The function `journal_index_write_begin` starts a new index. Records must then be added in path
+ * order; records and strings go to two temporary files that `journal_index_write_finish` joins.
+ * Nothing but `journal_index_write_commit` touches the index in use.
+ */
+bool journal_index_write_begin(journal_index_writer_t *w)
+{
+    char fullname[JOURNAL_INDEX_FULLNAME_MAX];
+    journal_index_header_t hdr = {0};
+
+    memset(w, 0, sizeof(*w));
+    journal_index_fullname(fullname, JOURNAL_INDEX_TMP);
+    w->rec = fopen(fullname, "wb");
+    journal_index_fullname(fullname, JOURNAL_INDEX_STRINGS_TMP);
+    w->str = fopen(fullname, "wb+");
+    if ((w->rec == NULL) || (w->str == NULL) || (fwrite(&hdr, sizeof(hdr), 1, w->rec) != 1))
+    {
+        journal_index_write_abort(w);
+        return false;
+    }
+    return true;
+}
+
+bool journal_index_write_add(journal_index_writer_t *w, const char *path, bool is_dir, uint64_t size, uint32_t mtime)
+{
+    journal_index_record_t r =
+    {
+        .name = w->str_len,
+        .size = size,
+        .mtime = mtime,
+        .flags = is_dir ? JOURNAL_INDEX_FLAG_DIR : 0
+    };
+    size_t len = strlen(path) + 1;
+
+    if ((fwrite(&r, sizeof(r), 1, w->rec) != 1) || (fwrite(path, 1, len, w->str) != len))
+        return false;
+    w->str_len += len;
+    w->count++;
+    return true;
+}
+
+/**
+ * The function `journal_index_write_finish` appends the strings to the records. The new index is
+ * complete but for its header, the previous one stays in use until `journal_index_write_commit`.
+ */
+bool journal_index_write_finish(journal_index_writer_t *w)
+{
+    char fullname[JOURNAL_INDEX_FULLNAME_MAX];
+    uint8_t buf[JOURNAL_INDEX_COPYBUF_SIZE];
+    bool ok = (fseek(w->str, 0, SEEK_SET) == 0);
+    size_t n;
+
+    while (ok && ((n = fread(buf, 1, sizeof(buf), w->str)) > 0))
+        ok = (fwrite(buf, 1, n, w->rec) == n);
+    if (!ok)
+    {
+        journal_index_write_abort(w);
+        return false;
+    }
+    fclose(w->str);
+    w->str = NULL;
+    journal_index_fullname(fullname, JOURNAL_INDEX_STRINGS_TMP);
+    unlink(fullname);
+    return true;
+}
+
+/**
+ * The function `journal_index_write_commit` fills in the header of a finished index and replaces the
+ * previous index with it.
+ *
+ * @param seq Journal sequence number the new index reflects.
+ */
+bool journal_index_write_commit(journal_index_writer_t *w, uint32_t seq)
+{
+    char tmpname[JOURNAL_INDEX_FULLNAME_MAX];
+    char fullname[JOURNAL_INDEX_FULLNAME_MAX];
+    journal_index_header_t hdr =
+    {
+        .magic = JOURNAL_INDEX_MAGIC,
+        .version = JOURNAL_INDEX_VERSION,
+        .count = w->count,
+        .strings = sizeof(journal_index_header_t) + w->count * sizeof(journal_index_record_t),
+        .seq = seq
+    };
+    bool ok = (fseek(w->rec, 0, SEEK_SET) == 0) && (fwrite(&hdr, sizeof(hdr), 1, w->rec) == 1);
+
+    ok = (fclose(w->rec) == 0) && ok;
+    w->rec = NULL;
+    journal_index_fullname(tmpname, JOURNAL_INDEX_TMP);
+    if (!ok)
+    {
+        unlink(tmpname);
+        return false;
+    }
+    journal_index_fullname(fullname, JOURNAL_INDEX_FILE);
+    unlink(fullname);
+    return (rename(tmpname, fullname) == 0);
+}
+
+void journal_index_write_abort(journal_index_writer_t *w)
+{
+    char fullname[JOURNAL_INDEX_FULLNAME_MAX];
+
+    if (w->rec)
+    {
+        fclose(w->rec);
+        journal_index_fullname(fullname, JOURNAL_INDEX_TMP);
+        unlink(fullname);
+    }
+    if (w->str)
+        fclose(w->str);
+    journal_index_fullname(fullname, JOURNAL_INDEX_STRINGS_TMP);
+    unlink(fullname);
+    w->rec = NULL;
+    w->str = NULL;
+}
+
+/**
+ * The function `journal_index_open` opens the index for reading. Two streams are used so that a
+ * sequential pass reads records and strings without seeking.
+ *
+ * @return `false` if there is no valid index.
+ */
+bool journal_index_open(journal_index_reader_t *rd)
+{
+    char fullname[JOURNAL_INDEX_FULLNAME_MAX];
+
+    memset(rd, 0, sizeof(*rd));
+    journal_index_fullname(fullname, JOURNAL_INDEX_FILE);
+    rd->rec = fopen(fullname, "rb");
+    rd->str = fopen(fullname, "rb");
+    if ((rd->rec == NULL) || (rd->str == NULL) ||
+        (fread(&rd->hdr, sizeof(rd->hdr), 1, rd->rec) != 1) ||
+        (rd->hdr.magic != JOURNAL_INDEX_MAGIC) || (rd->hdr.version != JOURNAL_INDEX_VERSION) ||
+        (fseek(rd->str, rd->hdr.strings, SEEK_SET) != 0))
+    {
+        journal_index_close(rd);
+        return false;
+    }
+    return true;
+}
+
+/**
+ * The function `journal_index_seek` reads record number `pos` and its path.
+ */
+bool journal_index_seek(journal_index_reader_t *rd, uint32_t pos)
+{
+    if ((pos >= rd->hdr.count) ||
+        (fseek(rd->rec, sizeof(journal_index_header_t) + pos * sizeof(journal_index_record_t), SEEK_SET) != 0))
+        return false;
+    rd->pos = pos;
+    if (!journal_index_next(rd))
+        return false;
+    return true;
+}
+
+/**
+ * The function `journal_index_next` reads the record following the last one read.
+ *
+ * @return `false` at the end of the index or on a read error.
+ */
+bool journal_index_next(journal_index_reader_t *rd)
+{
+    if ((rd->pos >= rd->hdr.count) || (fread(&rd->r, sizeof(rd->r), 1, rd->rec) != 1))
+        return false;
+    rd->pos++;
+    return journal_index_read_path(rd);
+}
+
+/**
+ * The function `journal_index_lower_bound` binary searches the index for the first record whose path
+ * is not less than `path`.
+ *
+ * @return A record number, `count` if all paths are less.
+ */
+uint32_t journal_index_lower_bound(journal_index_reader_t *rd, const char *path)
+{
+    uint32_t lo = 0;
+    uint32_t hi = rd->hdr.count;
+
+    while (lo < hi)
+    {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (!journal_index_seek(rd, mid))
+            return rd->hdr.count;
+        if (journal_path_cmp(rd->path, path) < 0)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+void journal_index_close(journal_index_reader_t *rd)
+{
+    if (rd->rec)
+        fclose(rd->rec);
+    if (rd->str)
+        fclose(rd->str);
+    rd->rec = NULL;
+    rd->str = NULL;
+}
+
+/**
+ * The function `journal_path_cmp` compares two paths the way the index is sorted: component by
+ * component ('/' sorts before every other character) and ignoring case like FAT does. A depth first
+ * walk that visits the names of every directory in `strcasecmp` order produces exactly this order.
+ */
+int journal_path_cmp(const char *a, const char *b)
+{
+    return journal_path_ncmp(a, b, SIZE_MAX);
+}
+
+/**
+ * The function `journal_path_ncmp` is `journal_path_cmp` limited to the first `n` characters, used
+ * to test for a path prefix.
+ */
+int journal_path_ncmp(const char *a, const char *b, size_t n)
+{
+    while ((n > 0) && *a && (journal_path_char(*a) == journal_path_char(*b)))
+    {
+        a++;
+        b++;
+        n--;
+    }
+    return (n == 0) ? 0 : journal_path_char(*a) - journal_path_char(*b);
+}
+
+/***********************************
+ *   PRIVATE FUNCTIONS
+ **********************************/
+
+static void journal_index_fullname(char *dest, const char *path)
+{
+    snprintf(dest, JOURNAL_INDEX_FULLNAME_MAX, "%s%s", MOUNT_POINT, path);
+}
+
+static int journal_path_char(char c)
+{
+    return (c == '/') ? 1 : tolower((unsigned char)c);
+}
+
+/**
+ * The function `journal_index_read_path` reads the path of the current record. The string stream is
+ * only repositioned when the record is not the one following the previous read.
+ */
+static bool journal_index_read_path(journal_index_reader_t *rd)
+{
+    uint32_t offset = rd->hdr.strings + rd->r.name;
+    uint32_t len = 0;
+    int c;
+
+    if ((ftell(rd->str) != (long)offset) && (fseek(rd->str, offset, SEEK_SET) != 0))
+        return false;
+
+    while (((c = getc(rd->str)) != EOF) && (c != '\0'))
+    {
+        if (len < sizeof(rd->path) - 1)
+            rd->path[len++] = (char)c;
+    }
+    rd->path[len] = '\0';
+    return (c == '\0');
+}
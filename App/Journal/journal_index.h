@@ -0,0 +1,103 @@
+#ifndef JOURNAL_INDEX_H_
+#define JOURNAL_INDEX_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "journal.h"
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+
+#define JOURNAL_INDEX_FILE              JOURNAL_DIR "/index.bin"
+#define JOURNAL_INDEX_TMP               JOURNAL_DIR "/index.new"
+#define JOURNAL_INDEX_STRINGS_TMP       JOURNAL_DIR "/strings.new"
+#define JOURNAL_INDEX_MAGIC             0x58444946      // "FIDX"
+#define JOURNAL_INDEX_VERSION           2               // 2: 64-bit sizes, for exFAT files over 4 GB
+
+#define JOURNAL_INDEX_FLAG_DIR          0x01
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+/*
+ * index.bin, all fields little endian:
+ *   header
+ *   record[count]      fixed size, sorted by path (see journal_path_cmp)
+ *   strings            NUL terminated paths, in record order
+ * A record can be located by its number alone, so the file is binary searched (or mapped) in place
+ * and never loaded whole.
+ */
+typedef struct
+{
+    uint32_t        magic;
+    uint32_t        version;
+    uint32_t        count;
+    uint32_t        strings;    // file offset of the string section
+    uint32_t        seq;        // journal sequence number the index is current with
+    uint32_t        reserved[3];
+} journal_index_header_t;
+
+typedef struct
+{
+    uint32_t        name;       // offset of the path in the string section
+    uint32_t        mtime;
+    uint64_t        size;
+    uint32_t        flags;
+    uint32_t        reserved;
+} journal_index_record_t;
+
+typedef struct
+{
+    FILE            *rec;
+    FILE            *str;
+    uint32_t        count;
+    uint32_t        str_len;
+} journal_index_writer_t;
+
+typedef struct
+{
+    FILE                    *rec;
+    FILE                    *str;
+    journal_index_header_t  hdr;
+    uint32_t                pos;        // number of the next record read by journal_index_next
+    journal_index_record_t  r;          // last record read
+    char                    path[JOURNAL_PATH_MAX];
+} journal_index_reader_t;
+
+/**********************
+ *   PUBLIC FUNCTIONS
+ **********************/
+
+bool journal_index_write_begin(journal_index_writer_t *w);
+bool journal_index_write_add(journal_index_writer_t *w, const char *path, bool is_dir, uint64_t size, uint32_t mtime);
+bool journal_index_write_finish(journal_index_writer_t *w);
+bool journal_index_write_commit(journal_index_writer_t *w, uint32_t seq);
+void journal_index_write_abort(journal_index_writer_t *w);
+
+bool journal_index_open(journal_index_reader_t *rd);
+bool journal_index_seek(journal_index_reader_t *rd, uint32_t pos);
+bool journal_index_next(journal_index_reader_t *rd);
+uint32_t journal_index_lower_bound(journal_index_reader_t *rd, const char *path);
+void journal_index_close(journal_index_reader_t *rd);
+
+int journal_path_cmp(const char *a, const char *b);
+int journal_path_ncmp(const char *a, const char *b, size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* JOURNAL_INDEX_H_ */
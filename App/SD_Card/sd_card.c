@@ -2,11 +2,21 @@
  *      INCLUDES
  *********************/
 
+#include <string.h>
+
 #include "sd_card.h"
 
 #include "esp_vfs_fat.h"
 #include "esp_log.h"
 #include "esp_check.h"
+#include "esp_timer.h"
+#include "esp_heap_caps.h"
+#include "esp_rom_crc.h"
+#include "esp_attr.h"
+#include "nvs.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 
 #include "driver/sdmmc_host.h"
 
@@ -16,3 +26,480 @@
 
 const char *MOUNT_POINT = "/data";
 
+#define SD_CARD_RENEGOTIATE_BOOTS       16          // boots on a fallback profile before the faster ones are tried again
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+typedef struct
+{
+    uint32_t        freq_khz;
+    uint8_t         width;
+    bool            ddr;
+} sd_card_profile_t;
+
+// Working profile kept in NVS, only used again for the card it was found on
+typedef struct
+{
+    uint32_t        serial;         // CID product serial number
+    uint32_t        freq_khz;
+    uint8_t         width;
+    uint8_t         ddr;
+    uint8_t         boots_left;     // fallback profiles only: boots until the faster profiles are tried again
+    uint32_t        write_kbps;     // measured when the profile was found, 0 if it was not
+} sd_card_saved_profile_t;
+
+typedef struct
+{
+    sd_card_event_cb_t  cb;
+    void               *arg;
+} sd_card_listener_t;
+
+/***********************************
+ *   PRIVATE DATA
+ ***********************************/
+
+/*
+ * Fastest first. The ESP32-S3 host clock tops out at 40 MHz, a card without high speed support runs
+ * the 40 MHz profiles at 20 MHz. DDR is only taken by eMMC: SD cards need UHS-I signalling at 1.8 V
+ * for it, which this slot does not provide, and come up in SDR instead.
+ */
+static const sd_card_profile_t sd_card_profiles[] =
+{
+    { SDMMC_FREQ_HIGHSPEED, 4, true },
+    { SDMMC_FREQ_HIGHSPEED, 4, false },
+    { SDMMC_FREQ_DEFAULT,   4, false },
+    { SDMMC_FREQ_HIGHSPEED, 1, false },
+    { SDMMC_FREQ_DEFAULT,   1, false },
+    { 10000,                1, false },
+    { SDMMC_FREQ_PROBING,   1, false },
+};
+
+#define SD_CARD_PROFILES    (sizeof(sd_card_profiles) / sizeof(sd_card_profiles[0]))
+
+static sd_card_manager_config_t sd_card_config;
+static TaskHandle_t sd_card_task_handle;
+static volatile bool sd_card_attached;
+static uint8_t sd_card_status_failures;     // status requests failed in a row, slot without card detect
+static sd_card_listener_t sd_card_listeners[SD_CARD_LISTENERS_MAX];
+static size_t sd_card_listener_count;
+
+/***********************************
+ *   PRIVATE FUNCTIONS PROTOTYPE
+ **********************************/
+
+static esp_err_t sd_card_try(const sdmmc_host_t *host, sdmmc_card_t *card, const sd_card_profile_t *profile,
+                             const sd_card_saved_profile_t *known, uint8_t *buf, sd_card_bus_info_t *info);
+static esp_err_t sd_card_calibrate(sdmmc_card_t *card, uint8_t *buf, bool write_check, sd_card_bus_info_t *info);
+static size_t sd_card_profile_index(uint32_t freq_khz, uint8_t width, bool ddr);
+static bool sd_card_profile_load(sd_card_saved_profile_t *saved);
+static void sd_card_profile_save(const sd_card_saved_profile_t *saved);
+static void sd_card_task(void *arg);
+static void IRAM_ATTR sd_card_cd_isr(void *arg);
+static bool sd_card_inserted(void);
+static bool sd_card_lost(void);
+static void sd_card_publish(sd_card_event_t event);
+static void sd_card_bus_lock(bool lock);
+
+/***********************************
+ *   PUBLIC FUNCTIONS
+ ***********************************/
+
+/**
+ * The function `sd_card_bus_init` brings the card up in the fastest bus mode that survives a short
+ * calibration. Profiles are tried fastest first and a CRC error, a timeout or data read back wrong
+ * moves on to the next slower one. The working profile is kept in NVS together with the card's serial
+ * number, so that the next boot with the same card goes straight to it; after a fallback the faster
+ * profiles are tried again every SD_CARD_RENEGOTIATE_BOOTS boots. Only a card without a saved
+ * profile gets the write check, a known card is calibrated with reads alone.
+ *
+ * `host` is the host configuration, with the bus width flags the slot is wired for. It is not
+ * changed, the card keeps its own copy set to the working profile. `info` may be NULL.
+ *
+ * @return ESP_OK once a profile works; the error of the slowest profile when none does, e.g. when no
+ * card is inserted.
+ */
+esp_err_t sd_card_bus_init(const sdmmc_host_t *host, sdmmc_card_t *card, sd_card_bus_info_t *info)
+{
+    sd_card_bus_info_t local_info;
+    sd_card_saved_profile_t saved;
+    size_t first = 0;
+    uint8_t attempts = 0;
+    esp_err_t ret = ESP_ERR_NOT_FOUND;
+
+    if (info == NULL)
+        info = &local_info;
+    memset(info, 0, sizeof(*info));
+
+    uint8_t *buf = heap_caps_malloc(SD_CARD_CALIB_SECTORS * 512, MALLOC_CAP_DMA);
+    ESP_RETURN_ON_FALSE(buf, ESP_ERR_NO_MEM, SD_CARD_TAG, "no memory for the calibration buffer");
+
+    bool have_saved = sd_card_profile_load(&saved);
+    const sd_card_saved_profile_t *known = have_saved ? &saved : NULL;
+    if (have_saved && saved.boots_left == 1)
+    {
+        // time to find out whether the fallback is still needed
+        ESP_LOGI(SD_CARD_TAG, "Trying the faster bus profiles again");
+        have_saved = false;
+    }
+    if (have_saved)
+    {
+        const sd_card_profile_t profile = { saved.freq_khz, saved.width, saved.ddr };
+
+        attempts++;
+        ret = sd_card_try(host, card, &profile, known, buf, info);
+        if (ret == ESP_OK && (uint32_t)card->cid.serial == saved.serial)
+        {
+            if (saved.boots_left > 1)
+            {
+                saved.boots_left--;
+                sd_card_profile_save(&saved);
+            }
+            goto done;
+        }
+        if (ret == ESP_OK)
+        {
+            ESP_LOGI(SD_CARD_TAG, "Another card, negotiating its bus profile");
+        }
+        else
+        {
+            // only the slower profiles are left to try
+            first = sd_card_profile_index(saved.freq_khz, saved.width, saved.ddr) + 1;
+            ESP_LOGW(SD_CARD_TAG, "Saved bus profile %lu kHz %u-bit failed (%s)",
+                     saved.freq_khz, saved.width, esp_err_to_name(ret));
+        }
+    }
+
+    ret = ESP_ERR_NOT_FOUND;
+    for (size_t i = (first < SD_CARD_PROFILES) ? first : 0; i < SD_CARD_PROFILES; i++)
+    {
+        const sd_card_profile_t *profile = &sd_card_profiles[i];
+
+        if (profile->width == 4 && !(host->flags & SDMMC_HOST_FLAG_4BIT))
+            continue;
+        if (profile->ddr && !(host->flags & SDMMC_HOST_FLAG_DDR))
+            continue;
+        attempts++;
+        ret = sd_card_try(host, card, profile, known, buf, info);
+        if (ret == ESP_OK)
+        {
+            saved.serial = card->cid.serial;
+            saved.write_kbps = info->write_kbps;
+            saved.freq_khz = profile->freq_khz;
+            saved.width = profile->width;
+            saved.ddr = profile->ddr;
+            saved.boots_left = (i == 0) ? 0 : SD_CARD_RENEGOTIATE_BOOTS;
+            sd_card_profile_save(&saved);
+            break;
+        }
+        ESP_LOGW(SD_CARD_TAG, "Bus profile %lu kHz %u-bit%s failed (%s)", profile->freq_khz,
+                 profile->width, profile->ddr ? " DDR" : "", esp_err_to_name(ret));
+    }
+
+done:
+    heap_caps_free(buf);
+    if (ret == ESP_OK)
+    {
+        info->attempts = attempts;
+        // a write speed of 0 was not measured: the profile was found without the write check
+        ESP_LOGI(SD_CARD_TAG, "SD bus %lu kHz, %u-bit%s: read %lu.%02lu MB/s, write %lu.%02lu MB/s (%u profile(s) tried)",
+                 info->real_freq_khz, info->width, info->ddr ? " DDR" : "",
+                 info->read_kbps / 1024, (info->read_kbps % 1024) * 100 / 1024,
+                 info->write_kbps / 1024, (info->write_kbps % 1024) * 100 / 1024, attempts);
+    }
+    return ret;
+}
+
+/**
+ * The function `sd_card_add_listener` registers a callback for the attach and detach events of the
+ * slot. Listeners are added before sd_card_manager_start() and called from the manager task: on
+ * attach before sd_card_is_attached() turns true, on detach after it turned false, so that the
+ * storage layers are told in the order they may use the card in.
+ */
+esp_err_t sd_card_add_listener(sd_card_event_cb_t cb, void *arg)
+{
+    ESP_RETURN_ON_FALSE(cb, ESP_ERR_INVALID_ARG, SD_CARD_TAG, "no callback");
+    ESP_RETURN_ON_FALSE(sd_card_task_handle == NULL, ESP_ERR_INVALID_STATE, SD_CARD_TAG, "manager already started");
+    ESP_RETURN_ON_FALSE(sd_card_listener_count < SD_CARD_LISTENERS_MAX, ESP_ERR_NO_MEM, SD_CARD_TAG, "too many listeners");
+    sd_card_listeners[sd_card_listener_count].cb = cb;
+    sd_card_listeners[sd_card_listener_count].arg = arg;
+    sd_card_listener_count++;
+    return ESP_OK;
+}
+
+/**
+ * The function `sd_card_manager_start` starts the task that brings the card up in the background and
+ * follows it being removed and inserted again. With a card detect pin the task wakes on its edges;
+ * without one an empty slot is probed every SD_CARD_PROBE_MS and an attached card asked for its
+ * status every SD_CARD_POLL_MS. Each insert negotiates the bus profile again with
+ * sd_card_bus_init(), and counts as a boot towards trying the faster profiles again. These commands
+ * to the card are issued between `bus_lock(true)` and `bus_lock(false)`, so that a queue serving the
+ * card's other users can be held off meanwhile.
+ *
+ * The host and the slot are initialized by the caller. Returns without waiting for a card.
+ */
+esp_err_t sd_card_manager_start(const sd_card_manager_config_t *config)
+{
+    ESP_RETURN_ON_FALSE(config && config->host && config->card, ESP_ERR_INVALID_ARG, SD_CARD_TAG, "no host or card");
+    ESP_RETURN_ON_FALSE(sd_card_task_handle == NULL, ESP_ERR_INVALID_STATE, SD_CARD_TAG, "manager already started");
+    sd_card_config = *config;
+
+    if (config->gpio_cd >= 0)
+    {
+        const gpio_config_t io_config =
+        {
+            .pin_bit_mask = 1ULL << config->gpio_cd,
+            .mode = GPIO_MODE_INPUT,
+            .pull_up_en = GPIO_PULLUP_ENABLE,
+            .intr_type = GPIO_INTR_ANYEDGE,
+        };
+        ESP_RETURN_ON_ERROR(gpio_config(&io_config), SD_CARD_TAG, "card detect GPIO%d", config->gpio_cd);
+        // already installed by another driver is fine
+        esp_err_t err = gpio_install_isr_service(0);
+        ESP_RETURN_ON_FALSE(err == ESP_OK || err == ESP_ERR_INVALID_STATE, err, SD_CARD_TAG, "GPIO ISR service");
+    }
+
+    ESP_RETURN_ON_FALSE(xTaskCreate(sd_card_task, "sd_card", SD_CARD_TASK_STACK, NULL, SD_CARD_TASK_PRIO,
+                                    &sd_card_task_handle) == pdPASS, ESP_ERR_NO_MEM, SD_CARD_TAG, "no memory for the task");
+    if (config->gpio_cd >= 0)
+        ESP_RETURN_ON_ERROR(gpio_isr_handler_add(config->gpio_cd, sd_card_cd_isr, NULL), SD_CARD_TAG, "card detect ISR");
+    return ESP_OK;
+}
+
+bool sd_card_is_attached(void)
+{
+    return sd_card_attached;
+}
+
+/***********************************
+ *   PRIVATE FUNCTIONS
+ ***********************************/
+
+/**
+ * The function `sd_card_task` waits for a card, brings it up and watches it until it is gone, then
+ * waits for the next one. A card that fails to come up is tried again every SD_CARD_PROBE_MS.
+ */
+static void sd_card_task(void *arg)
+{
+    bool waiting = false;
+
+    for (;;)
+    {
+        if (!sd_card_attached)
+        {
+            sd_card_bus_lock(true);
+            bool up = sd_card_inserted() &&
+                      (sd_card_bus_init(sd_card_config.host, sd_card_config.card, sd_card_config.info) == ESP_OK);
+            sd_card_bus_lock(false);
+            if (up)
+            {
+                sdmmc_card_print_info(stdout, sd_card_config.card);
+                sd_card_status_failures = 0;
+                sd_card_publish(SD_CARD_EVENT_ATTACHED);
+                sd_card_attached = true;
+                waiting = false;
+            }
+            else if (!waiting)
+            {
+                ESP_LOGW(SD_CARD_TAG, "No SD card, waiting for one");
+                waiting = true;
+            }
+        }
+        else if (sd_card_lost())
+        {
+            sd_card_attached = false;
+            ESP_LOGW(SD_CARD_TAG, "SD card removed");
+            sd_card_publish(SD_CARD_EVENT_DETACHED);
+        }
+
+        TickType_t timeout = pdMS_TO_TICKS(sd_card_attached ? SD_CARD_POLL_MS : SD_CARD_PROBE_MS);
+        if (!sd_card_attached && sd_card_config.gpio_cd >= 0 && !sd_card_inserted())
+            timeout = portMAX_DELAY;    // the next edge wakes the task
+        if (ulTaskNotifyTake(pdTRUE, timeout))
+        {
+            // let the contacts settle, and the edges they make meanwhile
+            vTaskDelay(pdMS_TO_TICKS(SD_CARD_DEBOUNCE_MS));
+            ulTaskNotifyTake(pdTRUE, 0);
+        }
+    }
+}
+
+static void IRAM_ATTR sd_card_cd_isr(void *arg)
+{
+    BaseType_t woken = pdFALSE;
+
+    vTaskNotifyGiveFromISR(sd_card_task_handle, &woken);
+    if (woken)
+        portYIELD_FROM_ISR();
+}
+
+/**
+ * The function `sd_card_inserted` reads the card detect pin, or without one initializes the card at
+ * the probing clock: cheaper than running through every bus profile for an empty slot.
+ */
+static bool sd_card_inserted(void)
+{
+    if (sd_card_config.gpio_cd >= 0)
+        return gpio_get_level(sd_card_config.gpio_cd) == 0;
+
+    sdmmc_host_t probe_host = *sd_card_config.host;
+
+    probe_host.max_freq_khz = SDMMC_FREQ_PROBING;
+    probe_host.flags &= ~(SDMMC_HOST_FLAG_8BIT | SDMMC_HOST_FLAG_4BIT | SDMMC_HOST_FLAG_DDR);
+    return sdmmc_card_init(&probe_host, sd_card_config.card) == ESP_OK;
+}
+
+/**
+ * The function `sd_card_lost` tells whether the attached card is gone. Without card detect a single
+ * failed status request may be a transfer error, two in a row are taken for a removed card.
+ */
+static bool sd_card_lost(void)
+{
+    if (sd_card_config.gpio_cd >= 0)
+        return gpio_get_level(sd_card_config.gpio_cd) != 0;
+
+    sd_card_bus_lock(true);
+    esp_err_t err = sdmmc_get_status(sd_card_config.card);
+    sd_card_bus_lock(false);
+    if (err == ESP_OK)
+    {
+        sd_card_status_failures = 0;
+        return false;
+    }
+    return ++sd_card_status_failures >= 2;
+}
+
+static void sd_card_publish(sd_card_event_t event)
+{
+    for (size_t i = 0; i < sd_card_listener_count; i++)
+        sd_card_listeners[i].cb(event, sd_card_listeners[i].arg);
+}
+
+static void sd_card_bus_lock(bool lock)
+{
+    if (sd_card_config.bus_lock)
+        sd_card_config.bus_lock(lock, sd_card_config.bus_lock_arg);
+}
+
+/**
+ * The function `sd_card_try` initializes the card in one profile and calibrates it. The card is
+ * reset by the initialization, so a failed profile leaves nothing behind for the next one. The write
+ * check is left out for the card of the saved profile `known`, which may be NULL; its write speed is
+ * then taken from the saved profile when it is the one tried.
+ */
+static esp_err_t sd_card_try(const sdmmc_host_t *host, sdmmc_card_t *card, const sd_card_profile_t *profile,
+                             const sd_card_saved_profile_t *known, uint8_t *buf, sd_card_bus_info_t *info)
+{
+    sdmmc_host_t try_host = *host;
+
+    try_host.max_freq_khz = profile->freq_khz;
+    try_host.flags &= ~(SDMMC_HOST_FLAG_8BIT | SDMMC_HOST_FLAG_4BIT | SDMMC_HOST_FLAG_DDR);
+    if (profile->width == 4)
+        try_host.flags |= SDMMC_HOST_FLAG_4BIT;
+    if (profile->ddr)
+        try_host.flags |= SDMMC_HOST_FLAG_DDR;
+
+    ESP_RETURN_ON_ERROR(sdmmc_card_init(&try_host, card), SD_CARD_TAG, "card init at %lu kHz failed", profile->freq_khz);
+    info->freq_khz = profile->freq_khz;
+    info->real_freq_khz = card->real_freq_khz;
+    info->width = 1 << card->log_bus_width;
+    info->ddr = card->is_ddr;
+    info->write_kbps = 0;
+
+    const bool write_check = (known == NULL) || ((uint32_t)card->cid.serial != known->serial);
+    if (!write_check && known->freq_khz == profile->freq_khz && known->width == profile->width &&
+        known->ddr == profile->ddr)
+        info->write_kbps = known->write_kbps;
+    return sd_card_calibrate(card, buf, write_check, info);
+}
+
+/**
+ * The function `sd_card_calibrate` reads the start of the card sequentially for about
+ * SD_CARD_CALIB_READ_MS, then reads the last SD_CARD_CALIB_SECTORS sectors twice. With `write_check`
+ * they are written back with what they hold in between, and the write is timed. The write puts the
+ * same data in place, and the card drops a block that arrives with a bad CRC rather than programming
+ * it; a transfer garbled on the bus shows as a CRC error or as a checksum that differs. The write
+ * costs the card an erase of that area, which is why it is kept for cards without a saved profile.
+ */
+static esp_err_t sd_card_calibrate(sdmmc_card_t *card, uint8_t *buf, bool write_check, sd_card_bus_info_t *info)
+{
+    const size_t sector_size = card->csd.sector_size;
+    const size_t sectors = SD_CARD_CALIB_SECTORS * 512 / sector_size;
+    const size_t bytes = sectors * sector_size;
+    const size_t capacity = card->csd.capacity;
+    const size_t last = capacity - sectors;
+    uint64_t total = 0;
+    int64_t elapsed;
+
+    ESP_RETURN_ON_FALSE(capacity >= 2 * sectors, ESP_ERR_INVALID_SIZE, SD_CARD_TAG, "card too small");
+
+    int64_t start = esp_timer_get_time();
+    size_t lba = 0;
+    do
+    {
+        ESP_RETURN_ON_ERROR(sdmmc_read_sectors(card, buf, lba, sectors), SD_CARD_TAG, "read at %u failed", lba);
+        lba += sectors;
+        total += bytes;
+        elapsed = esp_timer_get_time() - start;
+    } while (elapsed < SD_CARD_CALIB_READ_MS * 1000 && lba + sectors <= last);
+    info->read_kbps = total * 1000000 / 1024 / (elapsed ? elapsed : 1);
+
+    ESP_RETURN_ON_ERROR(sdmmc_read_sectors(card, buf, last, sectors), SD_CARD_TAG, "read at %u failed", last);
+    const uint32_t crc = esp_rom_crc32_le(0, buf, bytes);
+    if (write_check)
+    {
+        start = esp_timer_get_time();
+        ESP_RETURN_ON_ERROR(sdmmc_write_sectors(card, buf, last, sectors), SD_CARD_TAG, "write at %u failed", last);
+        elapsed = esp_timer_get_time() - start;
+        info->write_kbps = (uint64_t)bytes * 1000000 / 1024 / (elapsed ? elapsed : 1);
+    }
+
+    memset(buf, 0, bytes);
+    ESP_RETURN_ON_ERROR(sdmmc_read_sectors(card, buf, last, sectors), SD_CARD_TAG, "read back at %u failed", last);
+    ESP_RETURN_ON_FALSE(esp_rom_crc32_le(0, buf, bytes) == crc, ESP_ERR_INVALID_CRC, SD_CARD_TAG, "data read back differs");
+    return ESP_OK;
+}
+
+/**
+ * The function `sd_card_profile_index` finds a saved profile in the table, SD_CARD_PROFILES - 1 (the
+ * slowest) when the firmware no longer has it.
+ */
+static size_t sd_card_profile_index(uint32_t freq_khz, uint8_t width, bool ddr)
+{
+    for (size_t i = 0; i < SD_CARD_PROFILES; i++)
+    {
+        if (sd_card_profiles[i].freq_khz == freq_khz && sd_card_profiles[i].width == width &&
+            sd_card_profiles[i].ddr == ddr)
+            return i;
+    }
+    return SD_CARD_PROFILES - 1;
+}
+
+static bool sd_card_profile_load(sd_card_saved_profile_t *saved)
+{
+    nvs_handle_t nvs;
+    size_t len = sizeof(*saved);
+
+    if (nvs_open(SD_CARD_NVS_NAMESPACE, NVS_READONLY, &nvs) != ESP_OK)
+        return false;
+    esp_err_t err = nvs_get_blob(nvs, SD_CARD_NVS_KEY_PROFILE, saved, &len);
+    nvs_close(nvs);
+    return (err == ESP_OK && len == sizeof(*saved));
+}
+
+static void sd_card_profile_save(const sd_card_saved_profile_t *saved)
+{
+    nvs_handle_t nvs;
+    esp_err_t err = nvs_open(SD_CARD_NVS_NAMESPACE, NVS_READWRITE, &nvs);
+
+    if (err == ESP_OK)
+    {
+        err = nvs_set_blob(nvs, SD_CARD_NVS_KEY_PROFILE, saved, sizeof(*saved));
+        if (err == ESP_OK)
+            err = nvs_commit(nvs);
+        nvs_close(nvs);
+    }
+    if (err != ESP_OK)
+        ESP_LOGW(SD_CARD_TAG, "Could not save the bus profile (%s)", esp_err_to_name(err));
+}
@@ -6,10 +6,12 @@
  *********************/
 
 #include <stdint.h>
+#include <stdbool.h>
 
 #include "driver/gpio.h"
 #include "driver/sdspi_host.h"
 
+#include "esp_err.h"
 #include "sdmmc_cmd.h"
 
 #ifdef __cplusplus
@@ -20,12 +22,71 @@ extern "C"
 extern const char *MOUNT_POINT;
 #define SD_CARD_TAG "[sd_card]"
 
+/*********************
+ *      DEFINES
+ *********************/
+
+#define SD_CARD_VIEW_MOUNT_POINT        "/data_ro"  // read-only view of the card while the USB host has it
+#define SD_CARD_NVS_NAMESPACE           "sd_card"
+#define SD_CARD_NVS_KEY_PROFILE         "bus_profile"
+#define SD_CARD_CALIB_SECTORS           64          // sectors per calibration transfer, 32 KB; rewritten only for an unknown card
+#define SD_CARD_CALIB_READ_MS           100         // sequential reads are timed for about this long
+#define SD_CARD_POLL_MS                 1000        // an attached card is checked for removal this often
+#define SD_CARD_PROBE_MS                3000        // a slot without card detect is probed this often while empty
+#define SD_CARD_DEBOUNCE_MS             100         // card detect settles for this long after an edge
+#define SD_CARD_LISTENERS_MAX           4
+#define SD_CARD_TASK_STACK              4096
+#define SD_CARD_TASK_PRIO               5
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+// Bus mode the card was brought up in, and the throughput measured at boot
+typedef struct
+{
+    uint32_t        freq_khz;       // clock asked for, the card may run slower
+    uint32_t        real_freq_khz;  // clock the host set
+    uint8_t         width;          // data lines, 1 or 4
+    bool            ddr;
+    uint32_t        read_kbps;      // KB/s
+    uint32_t        write_kbps;     // 0 when the card was calibrated with reads only
+    uint8_t         attempts;       // profiles tried before this one worked
+} sd_card_bus_info_t;
+
+typedef enum
+{
+    SD_CARD_EVENT_ATTACHED,         // card initialized in its bus profile, ready for I/O
+    SD_CARD_EVENT_DETACHED,         // card removed, or stopped answering
+} sd_card_event_t;
+
+typedef void (*sd_card_event_cb_t)(sd_card_event_t event, void *arg);
+
+// Holds off the other users of the bus around the manager's own commands to the card, see sd_card_manager_start()
+typedef void (*sd_card_bus_lock_cb_t)(bool lock, void *arg);
+
+// Slot the manager task watches
+typedef struct
+{
+    const sdmmc_host_t *host;       // host configuration, see sd_card_bus_init()
+    sdmmc_card_t       *card;       // initialized again on each insert
+    sd_card_bus_info_t *info;       // bus mode of the last insert, may be NULL
+    int                 gpio_cd;    // card detect, low with a card in the slot; -1 to probe the slot instead
+    sd_card_bus_lock_cb_t bus_lock; // may be NULL
+    void               *bus_lock_arg;
+} sd_card_manager_config_t;
+
 /**********************
  *   PUBLIC FUNCTIONS
  **********************/
 
+esp_err_t sd_card_bus_init(const sdmmc_host_t *host, sdmmc_card_t *card, sd_card_bus_info_t *info);
+esp_err_t sd_card_add_listener(sd_card_event_cb_t cb, void *arg);
+esp_err_t sd_card_manager_start(const sd_card_manager_config_t *config);
+bool sd_card_is_attached(void);
+
 #ifdef __cplusplus
 }
 #endif
 
-#endif /* FTP_H_ */
\ No newline at end of file
+#endif /* SD_CARD_H_ */
\ No newline at end of file
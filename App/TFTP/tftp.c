@@ -0,0 +1,755 @@
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <string.h>
+#include <strings.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <sys/stat.h>
+
+#include "lwip/sockets.h"
+
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+#include "esp_log.h"
+
+#include "tftp.h"
+#include "fs_worker.h"
+#include "journal.h"
+#include "sd_card.h"
+#include "tusb_msc_storage.h"
+#include "tusb.h"
+
+/***********************************
+ *      DEFINES
+ ***********************************/
+
+#define TFTP_HEADER_SIZE        4
+#define TFTP_PACKET_SIZE_MAX    (TFTP_HEADER_SIZE + TFTP_BLKSIZE_MAX)
+#define TFTP_WINDOW_SIZE_MAX    (TFTP_BLKSIZE_MAX * TFTP_WINDOWSIZE_MAX)
+
+/***********************************
+ *   PRIVATE DATA
+ ***********************************/
+
+static int32_t tftp_sd = -1;
+static uint8_t *tftp_packet = NULL;
+static uint8_t *tftp_window = NULL;         // two windows: one sent while the next is read ahead
+static char tftp_fullname[TFTP_FILENAME_MAX + 16];
+static bool tftp_view = false;              // the transfer reads the card through the read-only view
+static fs_worker_req_t tftp_io = {0};       // window being read ahead by the storage worker
+
+/***********************************
+ *   PRIVATE FUNCTIONS PROTOTYPE
+ **********************************/
+
+static int32_t tftp_create_socket(uint16_t port);
+static int32_t tftp_recv(int32_t sd, struct sockaddr_in *peer, uint8_t *buf, uint32_t maxlen, uint32_t timeout_s);
+static bool tftp_same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b);
+static void tftp_send_error(int32_t sd, const struct sockaddr_in *peer, tftp_error_t code, const char *msg);
+static void tftp_send_ack(int32_t sd, const struct sockaddr_in *peer, uint16_t block);
+static void tftp_send_oack(int32_t sd, const struct sockaddr_in *peer, const tftp_options_t *opts);
+static bool tftp_parse_request(uint8_t *req, int32_t len, char **filename, char **mode, tftp_options_t *opts);
+static bool tftp_build_path(const char *root, const char *filename);
+static bool tftp_host_has_card(void);
+static const char *tftp_storage_acquire(bool write);
+static void tftp_storage_release(void);
+static void tftp_read_ahead(FILE *fp, uint8_t *buf, uint32_t size);
+static void tftp_serve_read(const struct sockaddr_in *peer, tftp_options_t *opts);
+static void tftp_serve_write(const struct sockaddr_in *peer, tftp_options_t *opts);
+
+/***********************************
+ *   PUBLIC FUNCTIONS
+ ***********************************/
+
+/**
+ * The function `tftp_init` allocates the packet and window buffers and opens the UDP socket the
+ * TFTP server listens on for read and write requests.
+ *
+ * @return `true` if the buffers were allocated and the socket is bound to `TFTP_PORT`, `false`
+ * otherwise.
+ */
+bool tftp_init(void)
+{
+    tftp_deinit();
+
+    tftp_packet = malloc(TFTP_PACKET_SIZE_MAX);
+    if (tftp_packet == NULL)
+        return false;
+
+    tftp_window = malloc(2 * TFTP_WINDOW_SIZE_MAX);
+    if (tftp_window == NULL)
+    {
+        free(tftp_packet);
+        tftp_packet = NULL;
+        return false;
+    }
+
+    tftp_sd = tftp_create_socket(TFTP_PORT);
+    if (tftp_sd < 0)
+    {
+        tftp_deinit();
+        return false;
+    }
+
+    ESP_LOGI(TFTP_TAG, "Listening on port %d (blksize <= %d, windowsize <= %d)",
+             TFTP_PORT, TFTP_BLKSIZE_MAX, TFTP_WINDOWSIZE_MAX);
+    return true;
+}
+
+/**
+ * The function `tftp_deinit` closes the listening socket and frees the buffers allocated by
+ * `tftp_init`.
+ */
+void tftp_deinit(void)
+{
+    if (tftp_sd >= 0)
+        closesocket(tftp_sd);
+    if (tftp_packet)
+        free(tftp_packet);
+    if (tftp_window)
+        free(tftp_window);
+
+    tftp_sd = -1;
+    tftp_packet = NULL;
+    tftp_window = NULL;
+}
+
+/**
+ * The function `tftp_run` waits up to `timeout_ms` for a request on the TFTP port and, if one
+ * arrives, serves the complete transfer before returning.
+ *
+ * @param timeout_ms How long to wait for a new request before returning to the caller.
+ *
+ * @return 0 if the server is healthy (whether or not a transfer took place), -1 if the listening
+ * socket failed.
+ */
+int tftp_run(uint32_t timeout_ms)
+{
+    struct sockaddr_in peer;
+    fd_set rfds;
+    struct timeval tv = {
+        .tv_sec = timeout_ms / 1000,
+        .tv_usec = (timeout_ms % 1000) * 1000,
+    };
+
+    if (tftp_sd < 0)
+        return -1;
+
+    FD_ZERO(&rfds);
+    FD_SET(tftp_sd, &rfds);
+    int res = select(tftp_sd + 1, &rfds, NULL, NULL, &tv);
+    if (res < 0)
+        return -1;
+    if (res == 0)
+        return 0;
+
+    socklen_t addrlen = sizeof(peer);
+    int32_t len = recvfrom(tftp_sd, tftp_packet, TFTP_REQUEST_SIZE_MAX, 0, (struct sockaddr *)&peer, &addrlen);
+    if (len < 0)
+        return (errno == EAGAIN) ? 0 : -1;
+
+    char *filename = NULL;
+    char *mode = NULL;
+    tftp_options_t opts;
+    if (!tftp_parse_request(tftp_packet, len, &filename, &mode, &opts))
+    {
+        tftp_send_error(tftp_sd, &peer, E_TFTP_ERR_ILLEGAL_OPERATION, "Malformed request");
+        return 0;
+    }
+
+    uint16_t opcode = (tftp_packet[0] << 8) | tftp_packet[1];
+    ESP_LOGI(TFTP_TAG, "%s [%s] mode=%s blksize=%u windowsize=%u",
+             (opcode == E_TFTP_OP_RRQ) ? "RRQ" : "WRQ", filename, mode, opts.blksize, opts.windowsize);
+
+    // netascii changes the length of the data, blocks would no longer map onto file offsets
+    if (strcasecmp(mode, "octet"))
+    {
+        tftp_send_error(tftp_sd, &peer, E_TFTP_ERR_ILLEGAL_OPERATION, "Only octet mode is supported");
+        return 0;
+    }
+
+    bool write = (opcode == E_TFTP_OP_WRQ);
+    if (write && tftp_host_has_card())
+    {
+        tftp_send_error(tftp_sd, &peer, E_TFTP_ERR_ACCESS_VIOLATION, "Read-only while the USB host has the card");
+        return 0;
+    }
+    const char *root = tftp_storage_acquire(write);
+    if (root == NULL)
+    {
+        tftp_send_error(tftp_sd, &peer, E_TFTP_ERR_UNDEFINED, "Storage not available");
+        return 0;
+    }
+
+    if (!tftp_build_path(root, filename))
+        tftp_send_error(tftp_sd, &peer, E_TFTP_ERR_ACCESS_VIOLATION, "Invalid file name");
+    else if (write)
+        tftp_serve_write(&peer, &opts);
+    else
+        tftp_serve_read(&peer, &opts);
+
+    tftp_storage_release();
+    return 0;
+}
+
+/***********************************
+ *   PRIVATE FUNCTIONS
+ **********************************/
+
+/**
+ * The function `tftp_create_socket` opens a UDP socket bound to `port` on all interfaces. Port 0
+ * picks an ephemeral port, which is used as the transfer identifier (TID) of a transfer.
+ *
+ * @param port UDP port to bind to.
+ *
+ * @return The socket descriptor, or -1 on error.
+ */
+static int32_t tftp_create_socket(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int32_t sd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+
+    if (sd < 0)
+        return -1;
+
+    int option = 1;
+    setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &option, sizeof(option));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_len = sizeof(addr);
+    addr.sin_port = htons(port);
+
+    if (bind(sd, (const struct sockaddr *)&addr, sizeof(addr)) < 0)
+    {
+        closesocket(sd);
+        return -1;
+    }
+    return sd;
+}
+
+/**
+ * The function `tftp_recv` waits up to `timeout_s` seconds for one datagram.
+ *
+ * @return The datagram length, 0 on timeout, or -1 on socket error.
+ */
+static int32_t tftp_recv(int32_t sd, struct sockaddr_in *peer, uint8_t *buf, uint32_t maxlen, uint32_t timeout_s)
+{
+    fd_set rfds;
+    struct timeval tv = { .tv_sec = timeout_s, .tv_usec = 0 };
+
+    FD_ZERO(&rfds);
+    FD_SET(sd, &rfds);
+    int res = select(sd + 1, &rfds, NULL, NULL, &tv);
+    if (res <= 0)
+        return res;
+
+    socklen_t addrlen = sizeof(*peer);
+    int32_t len = recvfrom(sd, buf, maxlen, 0, (struct sockaddr *)peer, &addrlen);
+    return (len < 0) ? -1 : len;
+}
+
+static bool tftp_same_peer(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return (a->sin_addr.s_addr == b->sin_addr.s_addr) && (a->sin_port == b->sin_port);
+}
+
+static void tftp_send_error(int32_t sd, const struct sockaddr_in *peer, tftp_error_t code, const char *msg)
+{
+    uint8_t pkt[TFTP_HEADER_SIZE + 64];
+    size_t msglen = MIN(strlen(msg), sizeof(pkt) - TFTP_HEADER_SIZE - 1);
+
+    pkt[0] = 0;
+    pkt[1] = E_TFTP_OP_ERROR;
+    pkt[2] = 0;
+    pkt[3] = code;
+    memcpy(&pkt[TFTP_HEADER_SIZE], msg, msglen);
+    pkt[TFTP_HEADER_SIZE + msglen] = '\0';
+
+    ESP_LOGW(TFTP_TAG, "Send error %d: %s", code, msg);
+    sendto(sd, pkt, TFTP_HEADER_SIZE + msglen + 1, 0, (const struct sockaddr *)peer, sizeof(*peer));
+}
+
+static void tftp_send_ack(int32_t sd, const struct sockaddr_in *peer, uint16_t block)
+{
+    uint8_t pkt[TFTP_HEADER_SIZE] = { 0, E_TFTP_OP_ACK, block >> 8, block & 0xFF };
+    sendto(sd, pkt, sizeof(pkt), 0, (const struct sockaddr *)peer, sizeof(*peer));
+}
+
+/**
+ * The function `tftp_send_oack` acknowledges the options accepted from the request (RFC 2347). Only
+ * options the client asked for are echoed back.
+ */
+static void tftp_send_oack(int32_t sd, const struct sockaddr_in *peer, const tftp_options_t *opts)
+{
+    char pkt[96];
+    int len = 2;
+
+    pkt[0] = 0;
+    pkt[1] = E_TFTP_OP_OACK;
+    if (opts->blksize_set)
+        len += snprintf(&pkt[len], sizeof(pkt) - len, "blksize%c%u", '\0', opts->blksize) + 1;
+    if (opts->windowsize_set)
+        len += snprintf(&pkt[len], sizeof(pkt) - len, "windowsize%c%u", '\0', opts->windowsize) + 1;
+    if (opts->timeout_set)
+        len += snprintf(&pkt[len], sizeof(pkt) - len, "timeout%c%u", '\0', opts->timeout_s) + 1;
+    if (opts->tsize_set)
+        len += snprintf(&pkt[len], sizeof(pkt) - len, "tsize%c%" PRIu32, '\0', opts->tsize) + 1;
+
+    sendto(sd, pkt, len, 0, (const struct sockaddr *)peer, sizeof(*peer));
+}
+
+/**
+ * The function `tftp_parse_request` splits an RRQ/WRQ packet into filename, mode and options.
+ * Unknown options are ignored as required by RFC 2347; out-of-range values are clamped to what
+ * this server supports.
+ *
+ * @return `false` if the packet is not a well formed RRQ or WRQ.
+ */
+static bool tftp_parse_request(uint8_t *req, int32_t len, char **filename, char **mode, tftp_options_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->blksize = TFTP_BLKSIZE_DEFAULT;
+    opts->windowsize = TFTP_WINDOWSIZE_DEFAULT;
+    opts->timeout_s = TFTP_TIMEOUT_DEFAULT_S;
+
+    if (len < 4 || req[len - 1] != '\0')
+        return false;
+
+    uint16_t opcode = (req[0] << 8) | req[1];
+    if (opcode != E_TFTP_OP_RRQ && opcode != E_TFTP_OP_WRQ)
+        return false;
+
+    char *p = (char *)&req[2];
+    char *end = (char *)&req[len];
+
+    *filename = p;
+    p += strlen(p) + 1;
+    if (p >= end)
+        return false;
+    *mode = p;
+    p += strlen(p) + 1;
+
+    while (p < end)
+    {
+        char *name = p;
+        p += strlen(p) + 1;
+        if (p >= end)
+            break;
+        char *value = p;
+        p += strlen(p) + 1;
+
+        long v = strtol(value, NULL, 10);
+        if (!strcasecmp(name, "blksize") && v >= TFTP_BLKSIZE_MIN)
+        {
+            opts->blksize = MIN(v, TFTP_BLKSIZE_MAX);
+            opts->blksize_set = true;
+        }
+        else if (!strcasecmp(name, "windowsize") && v >= 1)
+        {
+            opts->windowsize = MIN(v, TFTP_WINDOWSIZE_MAX);
+            opts->windowsize_set = true;
+        }
+        else if (!strcasecmp(name, "timeout") && v >= 1)
+        {
+            opts->timeout_s = MIN(v, TFTP_TIMEOUT_MAX_S);
+            opts->timeout_set = true;
+        }
+        else if (!strcasecmp(name, "tsize") && v >= 0)
+        {
+            opts->tsize = (uint32_t)v;
+            opts->tsize_set = true;
+        }
+    }
+
+    opts->has_options = opts->blksize_set || opts->windowsize_set || opts->timeout_set || opts->tsize_set;
+    return true;
+}
+
+/**
+ * The function `tftp_build_path` maps a TFTP file name onto `root`, `MOUNT_POINT` or the read-only
+ * view. Names that try to leave the mount point are refused.
+ */
+static bool tftp_build_path(const char *root, const char *filename)
+{
+    while (*filename == '/')
+        filename++;
+
+    if ((*filename == '\0') || strstr(filename, "..") || (strlen(filename) > TFTP_FILENAME_MAX))
+        return false;
+
+    snprintf(tftp_fullname, sizeof(tftp_fullname), "%s/%s", root, filename);
+    return true;
+}
+
+static bool tftp_host_has_card(void)
+{
+    return tud_mounted() && tinyusb_msc_storage_in_use_by_usb_host_lun(TFTP_CARD_LUN);
+}
+
+/**
+ * The function `tftp_storage_acquire` makes the card available to one transfer, as FTP does: while
+ * the USB host has the card a read goes through the read-only view shared with FTP, so the host
+ * never loses the volume. Otherwise the card is held read-write until `tftp_storage_release`; a
+ * read falls back on the view if FTP still has it mounted.
+ *
+ * @return The root of the file names, NULL if the card can not be used.
+ */
+static const char *tftp_storage_acquire(bool write)
+{
+    if (!tftp_host_has_card() &&
+        (tinyusb_msc_storage_acquire(TFTP_CARD_LUN, TFTP_STORAGE_USER, MOUNT_POINT) == ESP_OK))
+    {
+        tftp_view = false;
+        return MOUNT_POINT;
+    }
+    if (write || (tinyusb_msc_storage_acquire_view(TFTP_CARD_LUN, TFTP_STORAGE_USER, SD_CARD_VIEW_MOUNT_POINT) != ESP_OK))
+        return NULL;
+
+    tinyusb_msc_storage_view_refresh(TFTP_CARD_LUN);
+    tftp_view = true;
+    return SD_CARD_VIEW_MOUNT_POINT;
+}
+
+static void tftp_storage_release(void)
+{
+    if (tftp_view)
+        tinyusb_msc_storage_release_view(TFTP_CARD_LUN, TFTP_STORAGE_USER);
+    else
+        tinyusb_msc_storage_release(TFTP_CARD_LUN, TFTP_STORAGE_USER);
+    tftp_view = false;
+}
+
+/**
+ * The function `tftp_read_ahead` has the storage worker read the next window of the file into
+ * `buf` while the current one is sent, the pipeline FTP RETR uses.
+ */
+static void tftp_read_ahead(FILE *fp, uint8_t *buf, uint32_t size)
+{
+    tftp_io.op = E_FS_WORKER_READ;
+    tftp_io.fp = fp;
+    tftp_io.buf = buf;
+    tftp_io.size = size;
+    tftp_io.cb = NULL;
+    fs_worker_submit(&tftp_io);
+}
+
+/**
+ * The function `tftp_serve_read` sends a file to the client one window (windowsize * blksize bytes)
+ * at a time. The storage worker reads the next window into the second buffer while the current one
+ * is sent and acknowledged, so the card is read during the network round trip. One ACK from the
+ * client slides the window (RFC 7440); a timeout resends the window from the buffer, a partial ACK
+ * restarts it after the last acknowledged block, read again from the card.
+ */
+static void tftp_serve_read(const struct sockaddr_in *client, tftp_options_t *opts)
+{
+    struct sockaddr_in peer;
+    struct stat st;
+    int32_t sd = tftp_create_socket(0);
+
+    if (sd < 0)
+    {
+        tftp_send_error(tftp_sd, client, E_TFTP_ERR_UNDEFINED, "No socket");
+        return;
+    }
+
+    FILE *fp = fopen(tftp_fullname, "rb");
+    if (fp == NULL)
+    {
+        tftp_send_error(sd, client, E_TFTP_ERR_FILE_NOT_FOUND, "File not found");
+        closesocket(sd);
+        return;
+    }
+    if (opts->tsize_set)
+    {
+        opts->tsize = (stat(tftp_fullname, &st) == 0) ? (uint32_t)st.st_size : 0;
+    }
+
+    const uint32_t blksize = opts->blksize;
+    const uint32_t window_bytes = blksize * opts->windowsize;
+    uint32_t start_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    uint32_t acked = 0;             // last acknowledged block, not wrapped at 16 bits
+    uint32_t cur_first = 0;         // first block held by the current buffer, 0 if none
+    uint32_t cur_len = 0;
+    uint32_t ahead_first = 0;       // first block of the window read ahead, 0 if none
+    uint8_t cur = 0;                // window buffer being sent
+    uint32_t total = 0;
+    uint32_t card_ms = 0;           // spent reading the card
+    uint8_t retries = 0;
+    bool done = false;
+
+    // the first window is read while the options are negotiated
+    tftp_read_ahead(fp, tftp_window, window_bytes);
+    ahead_first = 1;
+    cur = 1;
+
+    if (opts->has_options)
+    {
+        // the OACK is acknowledged with ACK 0 before the first data block
+        while (1)
+        {
+            tftp_send_oack(sd, client, opts);
+            int32_t len = tftp_recv(sd, &peer, tftp_packet, TFTP_PACKET_SIZE_MAX, opts->timeout_s);
+            if (len < 0 || (len == 0 && ++retries > TFTP_RETRIES_MAX))
+                goto out;
+            if (len >= TFTP_HEADER_SIZE && tftp_same_peer(&peer, client))
+            {
+                uint16_t op = (tftp_packet[0] << 8) | tftp_packet[1];
+                if (op == E_TFTP_OP_ERROR)
+                    goto out;
+                if (op == E_TFTP_OP_ACK && tftp_packet[2] == 0 && tftp_packet[3] == 0)
+                    break;
+            }
+        }
+        retries = 0;
+    }
+
+    while (!done)
+    {
+        uint32_t first = acked + 1;
+
+        if (first != cur_first)
+        {
+            if (first == ahead_first)
+            {
+                cur ^= 1;
+            }
+            else
+            {
+                // the window starts inside the one sent, the read ahead is of no use
+                fs_worker_wait(&tftp_io);
+                fseek(fp, (long)(first - 1) * blksize, SEEK_SET);
+                tftp_read_ahead(fp, &tftp_window[cur * TFTP_WINDOW_SIZE_MAX], window_bytes);
+            }
+            fs_worker_wait(&tftp_io);
+            ahead_first = 0;
+            card_ms += tftp_io.run_ms;
+            if (tftp_io.err != 0)
+            {
+                tftp_send_error(sd, client, E_TFTP_ERR_UNDEFINED, "Read error");
+                goto out;
+            }
+            cur_first = first;
+            cur_len = tftp_io.result;
+            if (cur_len == window_bytes)
+            {
+                tftp_read_ahead(fp, &tftp_window[(cur ^ 1) * TFTP_WINDOW_SIZE_MAX], window_bytes);
+                ahead_first = first + opts->windowsize;
+            }
+        }
+
+        // a short window holds the final block, which may be empty
+        const uint8_t *window = &tftp_window[cur * TFTP_WINDOW_SIZE_MAX];
+        uint32_t n = cur_len;
+        bool last_window = (n < window_bytes);
+        uint32_t nblocks = last_window ? (n / blksize) + 1 : opts->windowsize;
+
+        for (uint32_t i = 0; i < nblocks; i++)
+        {
+            uint32_t blk = first + i;
+            uint32_t off = i * blksize;
+            uint32_t chunk = MIN(blksize, n - off);
+
+            tftp_packet[0] = 0;
+            tftp_packet[1] = E_TFTP_OP_DATA;
+            tftp_packet[2] = (blk >> 8) & 0xFF;
+            tftp_packet[3] = blk & 0xFF;
+            memcpy(&tftp_packet[TFTP_HEADER_SIZE], &window[off], chunk);
+            sendto(sd, tftp_packet, TFTP_HEADER_SIZE + chunk, 0, (const struct sockaddr *)client, sizeof(*client));
+        }
+
+        // wait until the client acknowledges some part of the window
+        while (1)
+        {
+            int32_t len = tftp_recv(sd, &peer, tftp_packet, TFTP_PACKET_SIZE_MAX, opts->timeout_s);
+            if (len < 0)
+                goto out;
+            if (len == 0)
+            {
+                if (++retries > TFTP_RETRIES_MAX)
+                {
+                    ESP_LOGW(TFTP_TAG, "Transfer timeout at block %" PRIu32, acked + 1);
+                    goto out;
+                }
+                break;
+            }
+            if (!tftp_same_peer(&peer, client))
+            {
+                tftp_send_error(sd, &peer, E_TFTP_ERR_UNKNOWN_TID, "Unknown transfer ID");
+                continue;
+            }
+            uint16_t op = (tftp_packet[0] << 8) | tftp_packet[1];
+            if (op == E_TFTP_OP_ERROR)
+                goto out;
+            if (op != E_TFTP_OP_ACK || len < TFTP_HEADER_SIZE)
+                continue;
+
+            uint16_t ackno = (tftp_packet[2] << 8) | tftp_packet[3];
+            uint16_t delta = (uint16_t)(ackno - (uint16_t)acked);
+            if (delta > nblocks)
+                continue; // stale ACK from an earlier window
+
+            // delta == 0 is the client asking for the window to be resent
+            retries = (delta > 0) ? 0 : retries;
+            acked += delta;
+            total = MIN(acked * blksize, (uint32_t)(first - 1) * blksize + n);
+            if (last_window && (acked == first + nblocks - 1))
+                done = true;
+            break;
+        }
+    }
+
+    ESP_LOGI(TFTP_TAG, "File sent (%" PRIu32 " bytes in %" PRIu32 " msec, %" PRIu32 " msec in the card).",
+             total, xTaskGetTickCount() * portTICK_PERIOD_MS - start_ms, card_ms);
+
+out:
+    fs_worker_wait(&tftp_io);
+    fclose(fp);
+    closesocket(sd);
+}
+
+/**
+ * The function `tftp_serve_write` receives a file from the client. Blocks are gathered into the
+ * window buffer and written to the card one window at a time; the client is acknowledged once per
+ * window, on the final short block, or with the last in-order block when a gap is detected.
+ */
+static void tftp_serve_write(const struct sockaddr_in *client, tftp_options_t *opts)
+{
+    struct sockaddr_in peer;
+    int32_t sd = tftp_create_socket(0);
+
+    if (sd < 0)
+    {
+        tftp_send_error(tftp_sd, client, E_TFTP_ERR_UNDEFINED, "No socket");
+        return;
+    }
+
+    struct stat st;
+    bool exists = (stat(tftp_fullname, &st) == 0);
+    journal_event_t event = exists ? E_JOURNAL_MODIFY : E_JOURNAL_CREATE;
+
+    // With tsize the client announced the file size, refuse it before any block is sent
+    uint64_t free_bytes;
+    if (opts->tsize_set && (tinyusb_msc_storage_get_free_space_lun(TFTP_CARD_LUN, NULL, &free_bytes) == ESP_OK) &&
+        (opts->tsize > free_bytes + (exists ? (uint64_t)st.st_size : 0)))
+    {
+        tftp_send_error(sd, client, E_TFTP_ERR_DISK_FULL, "Not enough space");
+        closesocket(sd);
+        return;
+    }
+
+    FILE *fp = fopen(tftp_fullname, "wb");
+    if (fp == NULL)
+    {
+        tftp_send_error(sd, client, E_TFTP_ERR_ACCESS_VIOLATION, "Cannot create file");
+        closesocket(sd);
+        return;
+    }
+
+    const uint32_t blksize = opts->blksize;
+    const uint32_t window_bytes = blksize * opts->windowsize;
+    uint32_t start_ms = xTaskGetTickCount() * portTICK_PERIOD_MS;
+    uint32_t expected = 1;
+    uint32_t since_ack = 0;
+    uint32_t buffered = 0;
+    uint32_t total = 0;
+    uint8_t retries = 0;
+    bool done = false;
+
+    if (opts->has_options)
+        tftp_send_oack(sd, client, opts);
+    else
+        tftp_send_ack(sd, client, 0);
+
+    while (!done)
+    {
+        int32_t len = tftp_recv(sd, &peer, tftp_packet, TFTP_PACKET_SIZE_MAX, opts->timeout_s);
+        if (len < 0)
+            goto out;
+        if (len == 0)
+        {
+            if (++retries > TFTP_RETRIES_MAX)
+            {
+                ESP_LOGW(TFTP_TAG, "Transfer timeout at block %" PRIu32, expected);
+                goto out;
+            }
+            if ((expected == 1) && opts->has_options)
+                tftp_send_oack(sd, client, opts);
+            else
+                tftp_send_ack(sd, client, (uint16_t)(expected - 1));
+            since_ack = 0;
+            continue;
+        }
+        if (!tftp_same_peer(&peer, client))
+        {
+            tftp_send_error(sd, &peer, E_TFTP_ERR_UNKNOWN_TID, "Unknown transfer ID");
+            continue;
+        }
+        uint16_t op = (tftp_packet[0] << 8) | tftp_packet[1];
+        if (op == E_TFTP_OP_ERROR)
+            goto out;
+        if (op != E_TFTP_OP_DATA || len < TFTP_HEADER_SIZE)
+            continue;
+
+        uint16_t blk = (tftp_packet[2] << 8) | tftp_packet[3];
+        if (blk != (uint16_t)expected)
+        {
+            // gap or duplicate: acknowledge the last in-order block so the sender restarts there
+            tftp_send_ack(sd, client, (uint16_t)(expected - 1));
+            since_ack = 0;
+            continue;
+        }
+
+        uint32_t datalen = len - TFTP_HEADER_SIZE;
+        memcpy(&tftp_window[buffered], &tftp_packet[TFTP_HEADER_SIZE], datalen);
+        buffered += datalen;
+        total += datalen;
+        expected++;
+        since_ack++;
+        retries = 0;
+        done = (datalen < blksize);
+
+        if (done || (buffered + blksize > window_bytes))
+        {
+            if (fwrite(tftp_window, 1, buffered, fp) != buffered)
+            {
+                tftp_send_error(sd, client, E_TFTP_ERR_DISK_FULL, "Write error");
+                goto out;
+            }
+            buffered = 0;
+        }
+        if (done || (since_ack >= opts->windowsize))
+        {
+            tftp_send_ack(sd, client, (uint16_t)(expected - 1));
+            since_ack = 0;
+        }
+    }
+
+    fclose(fp);
+    fp = NULL;
+    journal_record(event, tftp_fullname + strlen(MOUNT_POINT), NULL);
+    ESP_LOGI(TFTP_TAG, "File received (%" PRIu32 " bytes in %" PRIu32 " msec).",
+             total, xTaskGetTickCount() * portTICK_PERIOD_MS - start_ms);
+
+    // dally: re-acknowledge the final block if the client did not see our last ACK
+    while (tftp_recv(sd, &peer, tftp_packet, TFTP_PACKET_SIZE_MAX, opts->timeout_s) > 0)
+    {
+        if (tftp_same_peer(&peer, client))
+            tftp_send_ack(sd, client, (uint16_t)(expected - 1));
+    }
+
+out:
+    if (fp)
+    {
+        fclose(fp);
+        unlink(tftp_fullname);
+        if (event == E_JOURNAL_MODIFY)
+            journal_record(E_JOURNAL_DELETE, tftp_fullname + strlen(MOUNT_POINT), NULL);
+    }
+    closesocket(sd);
+}
@@ -0,0 +1,92 @@
+#ifndef TFTP_H_
+#define TFTP_H_
+
+/*********************
+ *      INCLUDES
+ *********************/
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+/*********************
+ *      DEFINES
+ *********************/
+
+#define TFTP_PORT                       69
+#define TFTP_BLKSIZE_DEFAULT            512
+#define TFTP_BLKSIZE_MIN                8
+#define TFTP_BLKSIZE_MAX                1428    // 1428 + 4 (TFTP) + 8 (UDP) + 20 (IP) fits one Ethernet/WiFi frame
+#define TFTP_WINDOWSIZE_DEFAULT         1
+#define TFTP_WINDOWSIZE_MAX             16
+#define TFTP_TIMEOUT_DEFAULT_S          1
+#define TFTP_TIMEOUT_MAX_S              30
+#define TFTP_RETRIES_MAX                5
+#define TFTP_FILENAME_MAX               128
+#define TFTP_REQUEST_SIZE_MAX           512
+#define TFTP_CARD_LUN                   0
+#define TFTP_STORAGE_USER               2       // holder of the card in the MSC storage, FTP is 1
+
+#define TFTP_TAG                        "[Tftp]"
+
+#ifndef MIN
+#define MIN(x, y) ((x) < (y) ? (x) : (y))
+#endif
+
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+typedef enum
+{
+    E_TFTP_OP_RRQ = 1,
+    E_TFTP_OP_WRQ,
+    E_TFTP_OP_DATA,
+    E_TFTP_OP_ACK,
+    E_TFTP_OP_ERROR,
+    E_TFTP_OP_OACK
+} tftp_opcode_t;
+
+typedef enum
+{
+    E_TFTP_ERR_UNDEFINED = 0,
+    E_TFTP_ERR_FILE_NOT_FOUND,
+    E_TFTP_ERR_ACCESS_VIOLATION,
+    E_TFTP_ERR_DISK_FULL,
+    E_TFTP_ERR_ILLEGAL_OPERATION,
+    E_TFTP_ERR_UNKNOWN_TID,
+    E_TFTP_ERR_FILE_EXISTS,
+    E_TFTP_ERR_NO_SUCH_USER,
+    E_TFTP_ERR_OPTION_REFUSED
+} tftp_error_t;
+
+typedef struct
+{
+    uint16_t        blksize;
+    uint16_t        windowsize;
+    uint8_t         timeout_s;
+    bool            has_options;    // client sent any option we accepted -> answer with OACK
+    bool            blksize_set;
+    bool            windowsize_set;
+    bool            timeout_set;
+    bool            tsize_set;
+    uint32_t        tsize;
+} tftp_options_t;
+
+/**********************
+ *   PUBLIC FUNCTIONS
+ **********************/
+
+bool tftp_init(void);
+void tftp_deinit(void);
+int tftp_run(uint32_t timeout_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* TFTP_H_ */
@@ -119,6 +119,11 @@ extern "C" {
 // MSC Buffer size of Device Mass storage
 #define CFG_TUD_MSC_BUFSIZE         CONFIG_TINYUSB_MSC_BUFSIZE
 
+// SPC-3, so that hosts look for logical block provisioning and send UNMAP
+#if CONFIG_TINYUSB_MSC_UNMAP
+#define CFG_TUD_MSC_INQUIRY_VERSION 5
+#endif
+
 // MIDI macros
 #define CFG_TUD_MIDI_EP_BUFSIZE     64
 #define CFG_TUD_MIDI_EPSIZE         CFG_TUD_MIDI_EP_BUFSIZE
@@ -11,6 +11,8 @@ extern "C" {
 #endif
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
 #include "esp_err.h"
 #include "wear_levelling.h"
 #include "esp_vfs_fat.h"
@@ -18,6 +20,16 @@ extern "C" {
 #include "driver/sdmmc_host.h"
 #endif
 
+/**
+ * @brief Maximum number of storages exposed as separate LUNs of the MSC interface
+ *
+ * Each call of one of the tinyusb_msc_storage_init_*() functions adds the next LUN, starting with 0. The functions without a `lun` parameter act on LUN 0.
+ */
+#define TINYUSB_MSC_LUN_MAX 2
+
+#define TINYUSB_MSC_USERS_MAX       32  /*!< Application users holding a storage, see tinyusb_msc_storage_acquire() */
+#define TINYUSB_MSC_USER_DEFAULT    0   /*!< User of tinyusb_msc_storage_mount() and _unmount(), yields to a host attaching */
+
 /**
  * @brief Data provided to the input of the `callback_mount_changed` and `callback_premount_changed` callback
  */
@@ -38,6 +50,7 @@ typedef enum {
  */
 typedef struct {
     tinyusb_msc_event_type_t type; /*!< Event type */
+    uint8_t lun;                   /*!< LUN of the storage the event is about */
     union {
         tinyusb_msc_event_mount_changed_data_t mount_changed_data; /*!< Data input of the callback */
     };
@@ -79,26 +92,132 @@ typedef struct {
 /**
  * @brief Register storage type spiflash with tinyusb driver
  *
+ * The storage becomes the next LUN of the MSC interface, starting with LUN 0.
+ *
  * @param config pointer to the spiflash configuration
  * @return esp_err_t
  *       - ESP_OK, if success;
  *       - ESP_ERR_NO_MEM, if there was no memory to allocate storage components;
+ *       - ESP_ERR_INVALID_STATE, if TINYUSB_MSC_LUN_MAX storages are already registered
  */
 esp_err_t tinyusb_msc_storage_init_spiflash(const tinyusb_msc_spiflash_config_t *config);
 
+/**
+ * @brief Operations of a block device storage
+ *
+ * Sectors are addressed by number and transferred whole. The operations can be called from several
+ * tasks at once: the TinyUSB task, the read-ahead and write-back tasks and the tasks using the FAT
+ * mounted on the application.
+ */
+typedef struct {
+    esp_err_t (*read)(void *ctx, uint32_t lba, uint32_t count, void *dest);         /*!< Read `count` sectors from `lba` */
+    esp_err_t (*write)(void *ctx, uint32_t lba, uint32_t count, const void *src);   /*!< Write `count` sectors at `lba` */
+    esp_err_t (*flush)(void *ctx);                                  /*!< Make the writes durable, may be NULL */
+    esp_err_t (*trim)(void *ctx, uint32_t lba, uint32_t count);     /*!< The sectors hold no data anymore, may be NULL */
+    void (*deinit)(void *ctx);                                      /*!< Release `ctx` on tinyusb_msc_storage_deinit(), may be NULL */
+} tinyusb_msc_blockdev_ops_t;
+
+/**
+ * @brief Configuration structure for a block device storage
+ */
+typedef struct {
+    const tinyusb_msc_blockdev_ops_t *ops;          /*!< Operations of the storage */
+    void *ctx;                                      /*!< Passed to the operations */
+    uint32_t sector_count;                          /*!< Number of sectors */
+    uint32_t sector_size;                           /*!< Bytes per sector, 512 to 4096 */
+    const char *product;                            /*!< INQUIRY product id, up to 16 characters, NULL for "Block Device" */
+    bool uncached;                                  /*!< The storage is as fast as RAM, no read-ahead or write-back cache is set up */
+    bool queued;                                    /*!< Transfers go through an I/O queue as those of an SD card do, see CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH */
+    tusb_msc_callback_t callback_mount_changed;     /*!< Pointer to the function callback that will be delivered AFTER mount/unmount operation is successfully finished */
+    tusb_msc_callback_t callback_premount_changed;  /*!< Pointer to the function callback that will be delivered BEFORE mount/unmount operation is started */
+    const esp_vfs_fat_mount_config_t mount_config; /*!< FATFS mount config */
+} tinyusb_msc_blockdev_config_t;
+
+/**
+ * @brief Configuration structure for a RAM disk
+ */
+typedef struct {
+    uint32_t sector_count;                          /*!< Number of sectors, at least 128 to hold a FAT */
+    uint32_t sector_size;                           /*!< Bytes per sector, 0 for 512 */
+    uint32_t caps;                                  /*!< Heap capabilities of the disk memory, 0 for PSRAM when the board has it, internal RAM otherwise */
+    tusb_msc_callback_t callback_mount_changed;     /*!< Pointer to the function callback that will be delivered AFTER mount/unmount operation is successfully finished */
+    tusb_msc_callback_t callback_premount_changed;  /*!< Pointer to the function callback that will be delivered BEFORE mount/unmount operation is started */
+    const esp_vfs_fat_mount_config_t mount_config; /*!< FATFS mount config */
+} tinyusb_msc_ramdisk_config_t;
+
+/**
+ * @brief Configuration structure for a disk image file
+ */
+typedef struct {
+    const char *path;                               /*!< Image file */
+    uint32_t sector_count;                          /*!< Number of sectors, the file is created or extended to hold them. 0 takes the size of the existing file */
+    uint32_t sector_size;                           /*!< Bytes per sector, 0 for 512 */
+    tusb_msc_callback_t callback_mount_changed;     /*!< Pointer to the function callback that will be delivered AFTER mount/unmount operation is successfully finished */
+    tusb_msc_callback_t callback_premount_changed;  /*!< Pointer to the function callback that will be delivered BEFORE mount/unmount operation is started */
+    const esp_vfs_fat_mount_config_t mount_config; /*!< FATFS mount config */
+} tinyusb_msc_file_config_t;
+
+/**
+ * @brief Register a storage implemented by the application with tinyusb driver
+ *
+ * The storage becomes the next LUN of the MSC interface, starting with LUN 0. The FAT is mounted on
+ * the application through the same operations. The host is offered UNMAP if `ops->trim` is set.
+ *
+ * @param config pointer to the block device configuration
+ * @return esp_err_t
+ *       - ESP_OK, if success; `ops->deinit` releases `ctx` on tinyusb_msc_storage_deinit()
+ *       - ESP_ERR_INVALID_ARG, if read or write is missing or the geometry is not supported
+ *       - ESP_ERR_NO_MEM, if there was no memory to allocate storage components;
+ *       - ESP_ERR_INVALID_STATE, if TINYUSB_MSC_LUN_MAX storages are already registered
+ */
+esp_err_t tinyusb_msc_storage_init_blockdev(const tinyusb_msc_blockdev_config_t *config);
+
+/**
+ * @brief Register a RAM disk with tinyusb driver
+ *
+ * A block device storage kept in memory, e.g. a fast scratch LUN in PSRAM. Its content is lost on
+ * tinyusb_msc_storage_deinit() and on reset; it is formatted on the first mount.
+ *
+ * @param config pointer to the RAM disk configuration
+ * @return esp_err_t
+ *       - ESP_OK, if success;
+ *       - ESP_ERR_NO_MEM, if the disk memory could not be allocated
+ *       - other errors of tinyusb_msc_storage_init_blockdev()
+ */
+esp_err_t tinyusb_msc_storage_init_ramdisk(const tinyusb_msc_ramdisk_config_t *config);
+
+/**
+ * @brief Register a disk image file with tinyusb driver
+ *
+ * A block device storage read and written with POSIX file I/O: an image file on another mounted
+ * volume, or on the host file system when the storage layer runs in a Linux build for testing and
+ * benchmarking. Flushes call fsync().
+ *
+ * @param config pointer to the image file configuration
+ * @return esp_err_t
+ *       - ESP_OK, if success;
+ *       - ESP_ERR_NOT_FOUND, if the file could not be opened or created
+ *       - ESP_ERR_INVALID_SIZE, if it could not be extended, or is empty and sector_count is 0
+ *       - other errors of tinyusb_msc_storage_init_blockdev()
+ */
+esp_err_t tinyusb_msc_storage_init_file(const tinyusb_msc_file_config_t *config);
+
 #if SOC_SDMMC_HOST_SUPPORTED
 /**
  * @brief Register storage type sd-card with tinyusb driver
  *
+ * The storage becomes the next LUN of the MSC interface, starting with LUN 0.
+ *
  * @param config pointer to the sd card configuration
  * @return esp_err_t
  *       - ESP_OK, if success;
  *       - ESP_ERR_NO_MEM, if there was no memory to allocate storage components;
+ *       - ESP_ERR_INVALID_STATE, if TINYUSB_MSC_LUN_MAX storages are already registered
  */
 esp_err_t tinyusb_msc_storage_init_sdmmc(const tinyusb_msc_sdmmc_config_t *config);
 #endif
 /**
- * @brief Deregister storage with tinyusb driver and frees the memory
+ * @brief Deregister the storages of all LUNs with tinyusb driver and frees the memory
  *
  */
 void tinyusb_msc_storage_deinit(void);
@@ -123,6 +242,28 @@ esp_err_t tinyusb_msc_register_callback(tinyusb_msc_event_type_t event_type,
  */
 esp_err_t tinyusb_msc_unregister_callback(tinyusb_msc_event_type_t event_type);
 
+/**
+ * @brief Register a callback invoking on MSC event of a given LUN
+ *
+ * tinyusb_msc_register_callback() registers it for LUN 0.
+ *
+ * @param lun        LUN of the storage
+ * @param event_type type of registered event for a callback
+ * @param callback   callback function
+ * @return esp_err_t - ESP_OK or ESP_ERR_INVALID_ARG, also if the LUN is not registered
+ */
+esp_err_t tinyusb_msc_register_callback_lun(uint8_t lun, tinyusb_msc_event_type_t event_type,
+        tusb_msc_callback_t callback);
+
+/**
+ * @brief Unregister a callback invoking on MSC event of a given LUN
+ *
+ * @param lun        LUN of the storage
+ * @param event_type type of registered event for a callback
+ * @return esp_err_t - ESP_OK or ESP_ERR_INVALID_ARG, also if the LUN is not registered
+ */
+esp_err_t tinyusb_msc_unregister_callback_lun(uint8_t lun, tinyusb_msc_event_type_t event_type);
+
 /**
  * @brief Mount the storage partition locally on the firmware application.
  *
@@ -140,26 +281,102 @@ esp_err_t tinyusb_msc_unregister_callback(tinyusb_msc_event_type_t event_type);
  *       - ESP_OK, if success;
  *       - ESP_ERR_NOT_FOUND if the maximum count of volumes is already mounted
  *       - ESP_ERR_NO_MEM if not enough memory or too many VFSes already registered;
+ *       - ESP_ERR_NOT_SUPPORTED if the medium holds an exFAT volume and FatFs is built without
+ *         exFAT. Any other medium without a file system is formatted.
  */
 esp_err_t tinyusb_msc_storage_mount(const char *base_path);
 
+/**
+ * @brief Mount the storage of one LUN locally on the firmware application
+ *
+ * Same as tinyusb_msc_storage_mount() for the storage registered as `lun`. The other LUNs stay
+ * exposed to the host. Once a LUN was mounted, base_path NULL mounts it again at the same path.
+ *
+ * @param lun        LUN of the storage, in the order the storages were registered
+ * @param base_path  path prefix where FATFS should be registered, NULL for the last path (or the
+ *                   default path for LUN 0)
+ * @return esp_err_t
+ *       - ESP_OK, if success;
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered or there is no path to mount it at
+ *       - the errors of tinyusb_msc_storage_mount()
+ */
+esp_err_t tinyusb_msc_storage_mount_lun(uint8_t lun, const char *base_path);
+
+/**
+ * @brief Hold the storage of one LUN mounted on the firmware application for one user
+ *
+ * Same as tinyusb_msc_storage_mount_lun() on behalf of `user`. The storage stays on the application
+ * until every user that acquired it released it with tinyusb_msc_storage_release(), so a user can
+ * not hand it to the host while another one still has files open. Acquiring it again is harmless.
+ * A host attaching takes the storage from TINYUSB_MSC_USER_DEFAULT only; it gets the medium once
+ * the other users released it.
+ *
+ * @param lun        LUN of the storage
+ * @param user       holder, TINYUSB_MSC_USER_DEFAULT + 1 to TINYUSB_MSC_USERS_MAX - 1 for the
+ *                   application's own servers
+ * @param base_path  as in tinyusb_msc_storage_mount_lun()
+ * @return esp_err_t
+ *       - ESP_OK, if success;
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered or `user` is out of range
+ *       - the errors of tinyusb_msc_storage_mount()
+ */
+esp_err_t tinyusb_msc_storage_acquire(uint8_t lun, uint8_t user, const char *base_path);
+
 /**
  * @brief Unmount the storage partition from the firmware application.
  *
  * Unmount the partition. Unregister diskio driver.
  * Unregister the SPI flash partition.
  * Finally, Un-register FATFS from VFS.
- * After this function is called, storage device can be seen (recognized) by host (PC).
- * When this function is called from the tinyusb callback functions, care must be taken
- * so as to make sure that user callbacks must be completed within a specific time.
- * Otherwise, MSC device may not appear on Host.
+ * The storage is handed to the host CONFIG_TINYUSB_MSC_OWNER_GRACE_MS after this function is
+ * called, at the next TEST UNIT READY of the host, or at once when a host attaches. Until then FATFS
+ * stays mounted: a tinyusb_msc_storage_mount() in the meantime keeps the storage on the application
+ * without any I/O, and tinyusb_msc_storage_in_use_by_usb_host() returns false. The host is told the
+ * medium may have changed once it gets it. The mount changed callbacks are called from the TinyUSB
+ * task then, they must be completed within a specific time, otherwise the MSC device may not
+ * appear on Host. With a grace period of 0 the storage is unmounted before this function returns.
  *
  * @return esp_err_t
  *      - ESP_OK on success
- *      - ESP_ERR_INVALID_STATE if FATFS is not registered in VFS
+ *      - ESP_ERR_INVALID_STATE if FATFS is not registered in VFS (grace period 0 only)
  */
 esp_err_t tinyusb_msc_storage_unmount(void);
 
+/**
+ * @brief Unmount the storage of one LUN from the firmware application and expose it to the host
+ *
+ * Same as tinyusb_msc_storage_unmount(), the grace period runs for each LUN on its own.
+ *
+ * @param lun LUN of the storage
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the LUN is not registered
+ *      - ESP_ERR_INVALID_STATE if FATFS is not registered in VFS
+ */
+esp_err_t tinyusb_msc_storage_unmount_lun(uint8_t lun);
+
+/**
+ * @brief Release the storage of one LUN acquired by one user
+ *
+ * The storage is released as by tinyusb_msc_storage_unmount_lun() once no user holds it anymore.
+ * Releasing a storage the user does not hold is harmless.
+ *
+ * @param lun  LUN of the storage
+ * @param user holder given to tinyusb_msc_storage_acquire()
+ * @return esp_err_t
+ *      - ESP_OK on success
+ *      - ESP_ERR_INVALID_ARG if the LUN is not registered or `user` is out of range
+ *      - ESP_ERR_INVALID_STATE if FATFS is not registered in VFS (grace period 0 only)
+ */
+esp_err_t tinyusb_msc_storage_release(uint8_t lun, uint8_t user);
+
+/**
+ * @brief Get the number of storages registered as LUNs
+ *
+ * @return uint8_t number of LUNs reported to the host
+ */
+uint8_t tinyusb_msc_storage_get_lun_count(void);
+
 /**
  * @brief Get number of sectors in storage media
  *
@@ -179,10 +396,591 @@ uint32_t tinyusb_msc_storage_get_sector_size(void);
  *
  * @return bool
  *      - true, if the storage media is exposed to Host
- *      - false, if the stoarge media is mounted on application (not exposed to Host)
+ *      - false, if the stoarge media is mounted on application (not exposed to Host), also during
+ *        the grace period after tinyusb_msc_storage_unmount()
  */
 bool tinyusb_msc_storage_in_use_by_usb_host(void);
 
+/**
+ * @brief Get status if the storage of one LUN is exposed over USB to Host
+ *
+ * @param lun LUN of the storage, must be registered
+ * @return bool, as tinyusb_msc_storage_in_use_by_usb_host()
+ */
+bool tinyusb_msc_storage_in_use_by_usb_host_lun(uint8_t lun);
+
+/**
+ * @brief Report the removable medium of a LUN removed or inserted
+ *
+ * While the medium is removed the host is told MEDIUM NOT PRESENT and the volume can not be mounted
+ * on the application nor viewed. The sectors left in the write-back cache are dropped: the medium
+ * they belong to is gone. FatFs calls on a mount of the application or a read-only view still open
+ * fail from then on; the call waits for the users holding them (all but TINYUSB_MSC_USER_DEFAULT)
+ * to release them, then closes them. Once a medium is inserted again and initialized (for an SD card, sdmmc_card_init() on the
+ * same sdmmc_card_t), the host is told that the medium changed and reads its new capacity.
+ *
+ * A storage is present once registered. An SD card not initialized yet is registered, then reported
+ * removed at once, until it is.
+ *
+ * @param lun     LUN of the storage
+ * @param present true once the medium is inserted and initialized, false once it was removed
+ * @return esp_err_t
+ *       - ESP_OK, if success
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered
+ */
+esp_err_t tinyusb_msc_storage_set_present(uint8_t lun, bool present);
+
+/**
+ * @brief Layout of a volume formatted by tinyusb_msc_storage_format()
+ */
+typedef struct {
+    uint32_t erase_unit;        /*!< Bytes the layout is aligned to: the allocation unit of an SD card, the flash sector under wear levelling, else the sector */
+    uint32_t partition_lba;     /*!< First sector of the volume, one erase unit in; 0 without a partition table */
+    uint32_t fat_lba;           /*!< First sector of the FAT */
+    uint32_t data_lba;          /*!< First sector of the cluster area, on an erase unit boundary */
+    uint32_t cluster_size;      /*!< Bytes, a divisor of the erase unit */
+    uint8_t fat_type;           /*!< FS_FAT12, FS_FAT16, FS_FAT32 or FS_EXFAT */
+} tinyusb_msc_format_info_t;
+
+/**
+ * @brief Format the volume of a LUN aligned to the erase unit of its medium
+ *
+ * Flash media erase and program whole erase units (the allocation unit, AU, of an SD card: 64 KB
+ * to 64 MB, read from its SD status). The volume is laid out the way the SD Association formatter
+ * does it: one partition starting one erase unit in, a cluster area starting on an erase unit
+ * boundary, and clusters that divide the erase unit, so that no cluster straddles two of them.
+ * The file system and cluster size follow the capacity: FAT12/16 up to 2 GB, FAT32 with 32 KB
+ * clusters up to 32 GB, exFAT with 128 KB clusters above (256 KB above 512 GB) if FatFs is built
+ * with exFAT, FAT32 otherwise. A medium whose erase unit is a sector gets no partition table, as
+ * the formatting on the first mount did before.
+ *
+ * Everything on the volume is lost. The host is told that the medium changed.
+ *
+ * @param lun        LUN of the storage
+ * @param[out] info  Layout of the new volume, may be NULL
+ *
+ * @return esp_err_t
+ *       - ESP_OK, if success
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered
+ *       - ESP_ERR_INVALID_STATE, if the volume is mounted on the application
+ *       - ESP_ERR_NOT_FOUND, if the medium is removed, or all FatFs drives are in use
+ *       - ESP_ERR_NO_MEM, if the work buffers could not be allocated
+ *       - ESP_FAIL, if FatFs could not format the volume
+ */
+esp_err_t tinyusb_msc_storage_format(uint8_t lun, tinyusb_msc_format_info_t *info);
+
+/**
+ * @brief Get the number of WRITE10 commands the USB host has completed on the storage media
+ *
+ * The counter only grows. A changed value tells the application that the host may have modified the
+ * file system while it was exposed over USB.
+ *
+ * @return uint32_t
+ */
+uint32_t tinyusb_msc_storage_get_host_write_count(void);
+
+/**
+ * @brief Get the number of WRITE10 commands the USB host has completed on the media of a given LUN
+ *
+ * @param lun LUN of the storage
+ * @return uint32_t, as tinyusb_msc_storage_get_host_write_count()
+ */
+uint32_t tinyusb_msc_storage_get_host_write_count_lun(uint8_t lun);
+
+/**
+ * @brief Read-ahead cache statistics, counted since boot
+ *
+ * The hit rate is hit_sectors / (hit_sectors + miss_sectors).
+ */
+typedef struct {
+    uint32_t hit_sectors;           /*!< Sectors of host reads served from the read-ahead cache */
+    uint32_t miss_sectors;          /*!< Sectors of host reads read from the media on request */
+    uint32_t prefetched_sectors;    /*!< Sectors read ahead of the host */
+    uint32_t wasted_sectors;        /*!< Prefetched sectors dropped before the host read them */
+    uint32_t window_sectors;        /*!< Current prefetch window */
+} tinyusb_msc_readahead_stats_t;
+
+/**
+ * @brief Get the statistics of the sequential read-ahead cache
+ *
+ * All zero if the cache is disabled (CONFIG_TINYUSB_MSC_READAHEAD_SIZE 0 or out of memory).
+ *
+ * @param lun         LUN of the storage
+ * @param[out] stats   all zero as well if the LUN is not registered
+ */
+void tinyusb_msc_storage_get_readahead_stats(uint8_t lun, tinyusb_msc_readahead_stats_t *stats);
+
+/**
+ * @brief Write-back cache statistics, counted since boot
+ *
+ * The average length of the writes issued to the media is flushed_sectors / flush_writes.
+ */
+typedef struct {
+    uint32_t cached_sectors;        /*!< Sectors of host writes kept in the write-back cache */
+    uint32_t merged_sectors;        /*!< Cached sectors overwritten before they were flushed */
+    uint32_t direct_sectors;        /*!< Sectors of large host writes written to the media at once */
+    uint32_t flushed_sectors;       /*!< Sectors written to the media by flushes */
+    uint32_t flush_writes;          /*!< Multi-block writes issued by flushes */
+    uint32_t flushes;               /*!< Flushes of the whole cache */
+    uint32_t dirty_sectors;         /*!< Sectors currently waiting to be written */
+} tinyusb_msc_writeback_stats_t;
+
+/**
+ * @brief Get the statistics of the write-back cache
+ *
+ * All zero if the cache is disabled (CONFIG_TINYUSB_MSC_WRITEBACK_SIZE 0 or out of memory).
+ *
+ * @param lun         LUN of the storage
+ * @param[out] stats   all zero as well if the LUN is not registered
+ */
+void tinyusb_msc_storage_get_writeback_stats(uint8_t lun, tinyusb_msc_writeback_stats_t *stats);
+
+/**
+ * @brief Write the sectors held by the write-back caches of all LUNs to the storages
+ *
+ * Also writes the flash sectors gathered by the SPI flash write combining. Done automatically on
+ * SYNCHRONIZE CACHE, eject, USB suspend or disconnect, before the storage is mounted on the
+ * application and after an idle time.
+ *
+ * @return esp_err_t
+ *       - ESP_OK, if nothing is left in the cache
+ *       - error of the storage write otherwise, the sectors stay in the cache
+ */
+esp_err_t tinyusb_msc_storage_flush(void);
+
+/**
+ * @brief SPI flash write combining statistics, counted since boot
+ *
+ * Without write combining every storage sector written costs one flash sector erase, so
+ * host_sectors / erases is the reduction in erases.
+ */
+typedef struct {
+    uint32_t host_sectors;          /*!< Storage sectors written to the SPI flash storage */
+    uint32_t erases;                /*!< Flash sectors erased */
+    uint32_t gathered_blocks;       /*!< Flash sectors programmed from gathered host writes */
+    uint32_t whole_blocks;          /*!< Flash sectors programmed from a single host write */
+    uint32_t fill_sectors;          /*!< Storage sectors read back to complete a partly written flash sector */
+} tinyusb_msc_wl_combine_stats_t;
+
+/**
+ * @brief Get the statistics of the SPI flash write combining
+ *
+ * All zero with the SD card storage, or if write combining is disabled (CONFIG_WL_SECTOR_SIZE 4096,
+ * CONFIG_TINYUSB_MSC_WL_COMBINE_SIZE 0 or out of memory).
+ *
+ * @param lun         LUN of the storage
+ * @param[out] stats   all zero as well if the LUN is not registered
+ */
+void tinyusb_msc_storage_get_wl_combine_stats(uint8_t lun, tinyusb_msc_wl_combine_stats_t *stats);
+
+/**
+ * @brief Metadata cache statistics, counted since boot
+ *
+ * The hit rate is hits / (hits + misses). Sectors read and written through the FatFs window (boot
+ * sector, FAT, directories, exFAT allocation bitmap) are the ones cached.
+ */
+typedef struct {
+    uint32_t hits;                  /*!< FatFs window reads served from the cache */
+    uint32_t misses;                /*!< FatFs window reads that went to the storage */
+    uint32_t writes;                /*!< FatFs window writes */
+    uint32_t absorbed;              /*!< Write-back: window writes to a sector still dirty, a storage write saved */
+    uint32_t flushed;               /*!< Write-back: dirty sectors written to the storage */
+    uint32_t evictions;             /*!< Sectors dropped to make room for another one */
+    uint32_t invalidations;         /*!< Times the whole cache was emptied: unmount, handover to the host, medium change */
+    uint32_t dirty_sectors;         /*!< Sectors currently waiting to be written */
+} tinyusb_msc_meta_cache_stats_t;
+
+/**
+ * @brief Get the statistics of the metadata cache of the application mount
+ *
+ * All zero if the cache is disabled (CONFIG_TINYUSB_MSC_META_CACHE_SIZE 0, a RAM disk, or out of
+ * memory).
+ *
+ * @param lun         LUN of the storage
+ * @param[out] stats   all zero as well if the LUN is not registered
+ */
+void tinyusb_msc_storage_get_meta_cache_stats(uint8_t lun, tinyusb_msc_meta_cache_stats_t *stats);
+
+/**
+ * @brief Classes of the requests queued in front of the SD card
+ */
+typedef enum {
+    TINYUSB_MSC_IO_HOST,            /*!< USB host commands and the read-ahead serving them, dispatched first */
+    TINYUSB_MSC_IO_BACKGROUND,      /*!< Application file system (FTP), write-back flushes, free space scans, benchmarks */
+    TINYUSB_MSC_IO_CLASSES,
+} tinyusb_msc_io_class_t;
+
+/**
+ * @brief Requests of one class, counted since boot
+ *
+ * The average wait is wait_us / requests.
+ */
+typedef struct {
+    uint32_t requests;              /*!< Requests queued */
+    uint64_t wait_us;               /*!< Total time from queued to dispatched */
+    uint32_t wait_max_us;           /*!< Longest time from queued to dispatched */
+} tinyusb_msc_io_class_stats_t;
+
+/**
+ * @brief SD card I/O queue statistics, counted since boot
+ *
+ * The average depth found by a new request is depth_sum / the requests of both classes.
+ */
+typedef struct {
+    tinyusb_msc_io_class_stats_t cls[TINYUSB_MSC_IO_CLASSES];   /*!< Indexed by tinyusb_msc_io_class_t */
+    uint32_t transfers;             /*!< Reads, writes and erases issued to the card */
+    uint32_t merged;                /*!< Requests issued in the same transfer as the one before */
+    uint32_t expired;               /*!< Requests dispatched out of LBA order, having waited past the ordering window */
+    uint32_t starved;               /*!< Background requests dispatched ahead of host requests, having waited past the limit */
+    uint32_t depth;                 /*!< Requests currently queued or in progress */
+    uint32_t depth_max;             /*!< Most requests queued or in progress at a time */
+    uint64_t depth_sum;             /*!< Requests found queued or in progress by each new request */
+} tinyusb_msc_io_stats_t;
+
+/**
+ * @brief Get the statistics of the I/O queue in front of the SD card
+ *
+ * All zero with the other storages but block devices registered with `queued`, or if the queue is
+ * disabled (CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH 0 or out of memory).
+ *
+ * @param lun         LUN of the storage
+ * @param[out] stats   all zero as well if the LUN is not registered
+ */
+void tinyusb_msc_storage_get_io_stats(uint8_t lun, tinyusb_msc_io_stats_t *stats);
+
+/**
+ * @brief Hold the dispatcher of the I/O queue in front of the SD card between two transfers
+ *
+ * For the card commands issued besides the queue, e.g. the status polls and the initialization of
+ * a slot without card detect. Waits for the transfer in progress; the requests queued meanwhile
+ * stay queued until tinyusb_msc_storage_io_resume(), called from the same task. Does nothing with
+ * the other storages, or if the queue is disabled.
+ *
+ * @param lun LUN of the storage, nothing is done if it is not registered
+ */
+void tinyusb_msc_storage_io_pause(uint8_t lun);
+
+/**
+ * @brief Let the dispatcher paused by tinyusb_msc_storage_io_pause() go on
+ *
+ * @param lun LUN of the storage
+ */
+void tinyusb_msc_storage_io_resume(uint8_t lun);
+
+/**
+ * @brief Number of buckets of the latency histograms
+ *
+ * Bucket 0 counts times below 2 us, bucket i times from 2^i to 2^(i+1) - 1 us, the last bucket every
+ * time from 2^19 us (0.5 s) on.
+ */
+#define TINYUSB_MSC_LATENCY_BUCKETS 20
+
+/**
+ * @brief Kinds of SCSI commands the latencies are counted for
+ */
+typedef enum {
+    TINYUSB_MSC_CMD_READ10,
+    TINYUSB_MSC_CMD_WRITE10,
+    TINYUSB_MSC_CMD_TEST_UNIT_READY,
+    TINYUSB_MSC_CMD_OTHER,
+    TINYUSB_MSC_CMD_KINDS,
+} tinyusb_msc_cmd_kind_t;
+
+/**
+ * @brief Latency statistics of one kind of SCSI command on one LUN, counted since boot
+ *
+ * The total time runs from the command block received to the status received by the host. The data
+ * stage of READ10 and WRITE10 is double buffered, so the storage and the USB times of a command can
+ * overlap and add up to more than its total time.
+ */
+typedef struct {
+    uint32_t commands;              /*!< Commands completed */
+    uint32_t failed;                /*!< Commands completed with a failed status */
+    uint64_t bytes;                 /*!< Data stage bytes transferred */
+    uint64_t total_us;              /*!< Sum of the total times */
+    uint64_t storage_us;            /*!< Sum of the times spent in the storage callbacks */
+    uint64_t usb_us;                /*!< Sum of the times data stage transfers were queued on the USB endpoint */
+    uint32_t total_max_us;          /*!< Longest total time */
+    uint32_t total_hist[TINYUSB_MSC_LATENCY_BUCKETS];      /*!< Commands by total time */
+    uint32_t storage_hist[TINYUSB_MSC_LATENCY_BUCKETS];    /*!< Commands by storage time */
+    uint32_t usb_hist[TINYUSB_MSC_LATENCY_BUCKETS];        /*!< Commands by USB time */
+} tinyusb_msc_latency_stats_t;
+
+/**
+ * @brief One SCSI command of the trace
+ */
+typedef struct {
+    uint32_t start_us;              /*!< esp_timer_get_time() when the command was received, wraps after 71 minutes */
+    uint32_t lba;                   /*!< First sector of READ10 and WRITE10, 0 for other commands */
+    uint32_t bytes;                 /*!< Data stage bytes transferred */
+    uint32_t total_us;
+    uint32_t storage_us;
+    uint32_t usb_us;
+    uint8_t lun;
+    uint8_t opcode;                 /*!< SCSI operation code */
+    uint8_t status;                 /*!< CSW status, 0 if the command passed */
+} tinyusb_msc_trace_entry_t;
+
+/**
+ * @brief Get the latency statistics of one kind of SCSI command
+ *
+ * Updated by the TinyUSB task without locking, a consistent copy is taken. All zero if
+ * CONFIG_TINYUSB_MSC_LATENCY_STATS is disabled.
+ *
+ * @param lun          LUN of the storage
+ * @param kind         kind of command
+ * @param[out] stats   all zero as well if the LUN or the kind is out of range
+ */
+void tinyusb_msc_storage_get_latency_stats(uint8_t lun, tinyusb_msc_cmd_kind_t kind, tinyusb_msc_latency_stats_t *stats);
+
+/**
+ * @brief Get the last SCSI commands completed, of all LUNs
+ *
+ * At most CONFIG_TINYUSB_MSC_TRACE_DEPTH commands are kept.
+ *
+ * @param[out] entries  commands, the oldest first
+ * @param max           size of `entries`
+ * @return size_t number of commands copied
+ */
+size_t tinyusb_msc_storage_get_trace(tinyusb_msc_trace_entry_t *entries, size_t max);
+
+/**
+ * @brief Clear the latency statistics and the trace
+ *
+ * The TinyUSB task clears them before it counts the next command.
+ */
+void tinyusb_msc_storage_reset_latency_stats(void);
+
+/**
+ * @brief Get the size and the free space of the FAT volume without scanning it
+ *
+ * The free cluster count is taken from FSINFO or kept across mounts and updated on every
+ * allocation by FatFs. When it is unknown (no valid FSINFO, or the USB host wrote to the media) a
+ * background scan of the FAT is started and ESP_ERR_NOT_FINISHED is returned until it completes.
+ * Works while the storage is exposed to the USB host, from the last known values.
+ *
+ * @param[out] total_bytes  Size of the data area, may be NULL
+ * @param[out] free_bytes   Free space, may be NULL
+ *
+ * @return esp_err_t
+ *      - ESP_OK, if the values are known
+ *      - ESP_ERR_NOT_FINISHED, if the free space is being counted
+ *      - ESP_ERR_INVALID_STATE, if the storage was never mounted on the application
+ */
+esp_err_t tinyusb_msc_storage_get_free_space(uint64_t *total_bytes, uint64_t *free_bytes);
+
+/**
+ * @brief Get the size and the free space of the FAT volume of a given LUN without scanning it
+ *
+ * @param lun               LUN of the storage
+ * @param[out] total_bytes  Size of the data area, may be NULL
+ * @param[out] free_bytes   Free space, may be NULL
+ *
+ * @return esp_err_t, as tinyusb_msc_storage_get_free_space(), or ESP_ERR_INVALID_ARG if the LUN is
+ * not registered
+ */
+esp_err_t tinyusb_msc_storage_get_free_space_lun(uint8_t lun, uint64_t *total_bytes, uint64_t *free_bytes);
+
+/**
+ * @brief Get the size of a file on a volume mounted by this component
+ *
+ * stat() reports the size in a 32-bit `off_t`, which wraps above 2 GB and cannot hold the size of
+ * an exFAT file over 4 GB. The size is read from the directory entry through FatFs instead.
+ *
+ * @param path      VFS path of the file, below the application mount or a read-only view
+ * @param[out] size Size of the file in bytes
+ *
+ * @return esp_err_t
+ *      - ESP_OK, if the size was read
+ *      - ESP_ERR_NOT_FOUND, if the file does not exist or the path is on no volume of a LUN
+ *      - ESP_ERR_INVALID_ARG, if an argument is NULL
+ *      - ESP_FAIL, if FatFs failed
+ */
+esp_err_t tinyusb_msc_storage_get_file_size(const char *path, uint64_t *size);
+
+/**
+ * @brief Mount a read-only view of a storage the USB host is using
+ *
+ * A second FatFs volume is registered at base_path. It reads what the host sees, including the
+ * sectors still held by the write-back cache, and never writes. The host keeps the storage, no
+ * unmount is forced on it. Reads of file system metadata wait for a pause in the host writes and
+ * are repeated if a host write overlapped them.
+ *
+ * FatFs keeps one FAT or directory sector cached, call tinyusb_msc_storage_view_refresh() before
+ * each use of the view. While it is mounted tinyusb_msc_storage_mount_lun() fails for this LUN.
+ * Same as tinyusb_msc_storage_acquire_view() for TINYUSB_MSC_USER_DEFAULT.
+ *
+ * @param lun        LUN of the storage
+ * @param base_path  path prefix where the view is registered, must differ from the read-write path
+ * @return esp_err_t
+ *       - ESP_OK, if success or already mounted
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered or base_path is NULL
+ *       - ESP_ERR_INVALID_STATE, if the storage is mounted on the application, or its view is
+ *         mounted at another path
+ *       - ESP_ERR_NOT_FOUND, if the maximum count of volumes is already mounted
+ *       - ESP_FAIL, if there is no FAT file system on the storage
+ */
+esp_err_t tinyusb_msc_storage_mount_view(uint8_t lun, const char *base_path);
+
+/**
+ * @brief Hold the read-only view of a storage for one user
+ *
+ * Same as tinyusb_msc_storage_mount_view() on behalf of `user`. Every user shares the one view of
+ * a LUN, mounted at the same base_path. It stays mounted until every user released it with
+ * tinyusb_msc_storage_release_view().
+ *
+ * @param lun        LUN of the storage
+ * @param user       holder, as in tinyusb_msc_storage_acquire()
+ * @param base_path  path prefix of the view
+ * @return esp_err_t
+ *       - the errors of tinyusb_msc_storage_mount_view()
+ *       - ESP_ERR_INVALID_ARG, if `user` is out of range
+ */
+esp_err_t tinyusb_msc_storage_acquire_view(uint8_t lun, uint8_t user, const char *base_path);
+
+/**
+ * @brief Release the read-only view of a storage held by one user
+ *
+ * The view is unmounted once no user holds it anymore. The files the user opened through the view
+ * must be closed first.
+ *
+ * @param lun  LUN of the storage
+ * @param user holder given to tinyusb_msc_storage_acquire_view()
+ * @return esp_err_t
+ *       - ESP_OK, if success or the view is still held by another user
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered or `user` is out of range
+ */
+esp_err_t tinyusb_msc_storage_release_view(uint8_t lun, uint8_t user);
+
+/**
+ * @brief Unmount the read-only view of a storage for all its users
+ *
+ * Files and directories opened through the view must be closed first.
+ *
+ * @param lun LUN of the storage
+ * @return esp_err_t
+ *       - ESP_OK, if success or no view was mounted
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered
+ */
+esp_err_t tinyusb_msc_storage_unmount_view(uint8_t lun);
+
+/**
+ * @brief Drop the sectors the read-only view cached if the host wrote since they were read
+ *
+ * Call from the task using the view, between file system calls. Open files stay valid.
+ *
+ * @param lun LUN of the storage
+ * @return true, if the host wrote to the storage since the last refresh
+ */
+bool tinyusb_msc_storage_view_refresh(uint8_t lun);
+
+/**
+ * @brief Kinds of storage benchmark tests
+ */
+typedef enum {
+    TINYUSB_MSC_BENCH_SEQ_READ,
+    TINYUSB_MSC_BENCH_SEQ_WRITE,
+    TINYUSB_MSC_BENCH_RAND_READ,
+    TINYUSB_MSC_BENCH_RAND_WRITE,
+    TINYUSB_MSC_BENCH_KINDS
+} tinyusb_msc_bench_kind_t;
+
+#define TINYUSB_MSC_BENCH_BLOCK_MIN     512             /*!< Smallest transfer of a benchmark */
+#define TINYUSB_MSC_BENCH_BLOCK_MAX     (64 * 1024)     /*!< Largest transfer of a benchmark */
+#define TINYUSB_MSC_BENCH_RESULTS_MAX   (8 * TINYUSB_MSC_BENCH_KINDS)   /*!< Results of a full run, 512 B to 64 KB */
+
+/**
+ * @brief Configuration of a storage benchmark, zero for the defaults
+ */
+typedef struct {
+    uint32_t block_min;         /*!< Smallest transfer in bytes, 0 for 512. Every power of two up to block_max is run */
+    uint32_t block_max;         /*!< Largest transfer in bytes, 0 for 64 KB, the most allowed */
+    uint32_t duration_ms;       /*!< Time given to each test, 0 for 500 ms. A test also ends after 2048 transfers */
+    bool fat;                   /*!< Through FatFs and the VFS on a scratch file, instead of raw sectors */
+    uint32_t fat_file_size;     /*!< Size of the scratch file in bytes, 0 for 1 MB */
+} tinyusb_msc_bench_config_t;
+
+/**
+ * @brief Result of one benchmark test
+ */
+typedef struct {
+    tinyusb_msc_bench_kind_t kind;
+    uint32_t block_size;        /*!< Bytes per transfer */
+    uint32_t ops;               /*!< Transfers timed */
+    uint64_t bytes;
+    uint32_t busy_us;           /*!< Time spent in the timed transfers and the final flush of a write test */
+    uint32_t kbps;              /*!< Throughput, KB/s */
+    uint32_t iops;
+    uint32_t p50_us;            /*!< Transfer latency percentiles */
+    uint32_t p90_us;
+    uint32_t p99_us;
+    uint32_t max_us;
+} tinyusb_msc_bench_result_t;
+
+/**
+ * @brief Measure the throughput, IOPS and latency of a storage
+ *
+ * Runs sequential and random reads and writes for each transfer size, smallest first, and logs
+ * each result. Transfers smaller than a sector or larger than the volume are left out. The raw tests go straight to the storage backend, below the read-ahead and
+ * write-back caches. A raw write test first reads each block without timing it, then writes the
+ * same data back, so the volume keeps its content. For the raw tests the storage is taken from the
+ * USB host for the duration, which sees it as becoming ready and is told afterwards that the medium
+ * may have changed. The FatFs tests use a scratch file at the root of the volume, mounted on the
+ * application for the duration if it is not already, and delete it at the end.
+ *
+ * Mount and unmount calls for the LUN, and a USB host attaching, wait while the benchmark runs.
+ *
+ * @param lun           LUN of the storage
+ * @param config        Benchmark configuration, NULL for the defaults
+ * @param[out] results  TINYUSB_MSC_BENCH_RESULTS_MAX results for a full run, in the order run
+ * @param max_results   Size of `results`, the run stops once it is full
+ * @param[out] count    Number of results written
+ *
+ * @return esp_err_t
+ *       - ESP_OK, if success
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered or the transfer sizes are not powers of two
+ *       - ESP_ERR_INVALID_STATE, for the raw tests, if the storage is mounted on the application
+ *       - ESP_ERR_NO_MEM, if the transfer buffer could not be allocated
+ *       - the error of the storage or of the file system if a transfer failed
+ */
+esp_err_t tinyusb_msc_storage_benchmark(uint8_t lun, const tinyusb_msc_bench_config_t *config,
+                                        tinyusb_msc_bench_result_t *results, size_t max_results, size_t *count);
+
+#define TINYUSB_MSC_META_BENCH_FILES    64      /*!< Files created by a metadata benchmark by default */
+
+/**
+ * @brief Result of a metadata benchmark run
+ */
+typedef struct {
+    bool cached;                /*!< Run with the metadata cache, or with FatFs going straight to the storage */
+    uint32_t files;
+    uint32_t create_us;         /*!< Creating the empty files, each opened and closed */
+    uint32_t list_us;           /*!< Listing the directory, with stat() of each file */
+    uint32_t delete_us;         /*!< Deleting the files and the directory */
+    uint32_t hits;              /*!< Metadata cache hits during the run */
+    uint32_t misses;            /*!< FatFs window reads that went to the storage during the run */
+} tinyusb_msc_meta_bench_result_t;
+
+/**
+ * @brief Measure directory listing and file creation through FatFs, without and with the metadata cache
+ *
+ * Creates `files` empty files in a scratch directory at the root of the volume, lists the directory
+ * and deletes it all, first with the metadata cache bypassed, then with the cache, and logs both
+ * runs. The volume is mounted on the application for the duration if it is not already. With the
+ * cache disabled both runs go straight to the storage.
+ *
+ * @param lun           LUN of the storage
+ * @param files         Files to create, 0 for TINYUSB_MSC_META_BENCH_FILES
+ * @param[out] results  Run without the cache, then run with it
+ *
+ * @return esp_err_t
+ *       - ESP_OK, if success
+ *       - ESP_ERR_INVALID_ARG, if the LUN is not registered
+ *       - ESP_ERR_NOT_FOUND, if the medium is removed
+ *       - ESP_FAIL, if a file could not be created, listed or deleted
+ */
+esp_err_t tinyusb_msc_storage_benchmark_meta(uint8_t lun, uint32_t files, tinyusb_msc_meta_bench_result_t results[2]);
+
 #ifdef __cplusplus
 }
 #endif
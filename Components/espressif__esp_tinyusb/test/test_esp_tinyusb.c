@@ -8,17 +8,27 @@
 #if SOC_USB_OTG_SUPPORTED
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include "esp_system.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_err.h"
+#include "esp_rom_sys.h"
+#include "esp_heap_caps.h"
 
 #include "unity.h"
 #include "tinyusb.h"
 #include "tusb_cdc_acm.h"
 #include "vfs_tinyusb.h"
+#if CONFIG_TINYUSB_MSC_ENABLED
+#include "esp_partition.h"
+#include "wear_levelling.h"
+#include "tusb_msc_storage.h"
+#endif
 
 #define VFS_PATH "/dev/usb-cdc1"
 
@@ -127,4 +137,833 @@ TEST_CASE("tinyusb_cdc", "[esp_tinyusb]")
     }
 }
 
+#if CONFIG_TINYUSB_MSC_ENABLED
+
+#define MSC_PATH "/msc-test"
+#define GRACE_MS CONFIG_TINYUSB_MSC_OWNER_GRACE_MS
+#define MSC_RAM_SECTORS 160
+
+typedef enum {
+    REPLAY_TUR,         /*!< host TEST UNIT READY, `expect` 1 if the unit is ready */
+    REPLAY_READ,        /*!< host READ10 of sector `arg`, `expect` 1 if it is served */
+    REPLAY_MOUNT,       /*!< application mounts the storage */
+    REPLAY_UNMOUNT,     /*!< application releases the storage */
+    REPLAY_WAIT,        /*!< `arg` ms pass */
+} msc_replay_op_t;
+
+typedef struct {
+    msc_replay_op_t op;
+    uint32_t arg;
+    int expect;
+    int mount_changes;  /*!< MOUNT_CHANGED events seen so far */
+} msc_replay_step_t;
+
+/*
+ * A host polling the unit while an FTP session on the device mounts the storage for each command
+ * and releases it after. The host gets the storage only once the session went quiet for the grace
+ * period, and the FAT is mounted and unmounted once rather than per command.
+ */
+static const msc_replay_step_t msc_replay[] = {
+    { REPLAY_MOUNT,   0,                0, 1 },     // boot
+    { REPLAY_TUR,     0,                0, 1 },     // medium not present
+    { REPLAY_READ,    0,                0, 1 },
+    { REPLAY_UNMOUNT, 0,                0, 1 },     // FTP command done
+    { REPLAY_TUR,     0,                0, 1 },     // becoming ready
+    { REPLAY_WAIT,    GRACE_MS / 4,     0, 1 },
+    { REPLAY_MOUNT,   0,                0, 1 },     // next command, nothing to mount
+    { REPLAY_TUR,     0,                0, 1 },
+    { REPLAY_UNMOUNT, 0,                0, 1 },
+    { REPLAY_WAIT,    GRACE_MS / 4,     0, 1 },
+    { REPLAY_TUR,     0,                0, 1 },
+    { REPLAY_MOUNT,   0,                0, 1 },
+    { REPLAY_UNMOUNT, 0,                0, 1 },     // session over
+    { REPLAY_WAIT,    GRACE_MS / 2,     0, 1 },
+    { REPLAY_TUR,     0,                0, 1 },     // still within the grace period of the last release
+    { REPLAY_WAIT,    GRACE_MS / 2 + 100, 0, 1 },
+    { REPLAY_TUR,     0,                0, 2 },     // handed over, unit attention
+    { REPLAY_TUR,     0,                1, 2 },
+    { REPLAY_READ,    0,                1, 2 },
+    { REPLAY_READ,    1,                1, 2 },
+    { REPLAY_TUR,     0,                1, 2 },
+    { REPLAY_MOUNT,   0,                0, 3 },     // application takes it back at once
+    { REPLAY_TUR,     0,                0, 3 },
+    { REPLAY_READ,    0,                0, 3 },
+    { REPLAY_UNMOUNT, 0,                0, 3 },
+    { REPLAY_WAIT,    GRACE_MS + 100,   0, 3 },
+    { REPLAY_TUR,     0,                0, 4 },
+    { REPLAY_TUR,     0,                1, 4 },
+    { REPLAY_READ,    2,                1, 4 },
+};
+
+static int msc_mount_changes;
+
+static void msc_mount_changed_cb(tinyusb_msc_event_t *event)
+{
+    msc_mount_changes++;
+}
+
+/* Registers a RAM disk of MSC_RAM_SECTORS sectors */
+static void msc_ramdisk_init(void)
+{
+    const tinyusb_msc_ramdisk_config_t config = {
+        .sector_count = MSC_RAM_SECTORS,
+        .caps = MALLOC_CAP_8BIT,
+    };
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_init_ramdisk(&config));
+}
+
+/*
+ * Releases the application mount and lets the grace period pass: the first poll of the host then
+ * takes the storage and reports the medium change, the second finds the unit ready.
+ */
+static void msc_hand_to_host(void)
+{
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+    vTaskDelay(pdMS_TO_TICKS(GRACE_MS + 10));
+    tud_msc_test_unit_ready_cb(0);
+    TEST_ASSERT_TRUE(tud_msc_test_unit_ready_cb(0));
+}
+
+/**
+ * @brief TinyUSB MSC owner testcase
+ *
+ * Replays the host and application requests of msc_replay[] against a wear levelled FAT partition
+ * through the TinyUSB MSC callbacks, no USB host is needed.
+ */
+TEST_CASE("tinyusb_msc_owner", "[esp_tinyusb]")
+{
+    if (GRACE_MS == 0) {
+        TEST_IGNORE_MESSAGE("CONFIG_TINYUSB_MSC_OWNER_GRACE_MS is 0");
+    }
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, NULL);
+    TEST_ASSERT_NOT_NULL(part);
+    wl_handle_t wl_handle;
+    TEST_ASSERT_EQUAL(ESP_OK, wl_mount(part, &wl_handle));
+
+    const tinyusb_msc_spiflash_config_t config = {
+        .wl_handle = wl_handle,
+        .callback_mount_changed = msc_mount_changed_cb,
+    };
+    msc_mount_changes = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_init_spiflash(&config));
+    uint32_t sector_size = tinyusb_msc_storage_get_sector_size();
+    uint8_t *buf = malloc(sector_size);
+    TEST_ASSERT_NOT_NULL(buf);
+
+    for (int i = 0; i < sizeof(msc_replay) / sizeof(msc_replay[0]); i++) {
+        const msc_replay_step_t *step = &msc_replay[i];
+        int result = 0;
+
+        switch (step->op) {
+        case REPLAY_TUR:
+            result = tud_msc_test_unit_ready_cb(0);
+            break;
+        case REPLAY_READ:
+            result = (tud_msc_read10_cb(0, step->arg, 0, buf, sector_size) == sector_size);
+            break;
+        case REPLAY_MOUNT:
+            TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+            break;
+        case REPLAY_UNMOUNT:
+            TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+            break;
+        case REPLAY_WAIT:
+            vTaskDelay(pdMS_TO_TICKS(step->arg));
+            break;
+        }
+        TEST_ASSERT_EQUAL(step->expect, result);
+        TEST_ASSERT_EQUAL(step->mount_changes, msc_mount_changes);
+    }
+
+    free(buf);
+    tinyusb_msc_storage_deinit();
+    TEST_ASSERT_EQUAL(ESP_OK, wl_unmount(wl_handle));
+}
+
+/**
+ * @brief TinyUSB MSC RAM disk testcase
+ *
+ * Formats a RAM disk through the application mount, writes a file and hands the disk to the host,
+ * which then reads the boot sector and the file through the TinyUSB MSC callbacks.
+ */
+TEST_CASE("tinyusb_msc_ramdisk", "[esp_tinyusb]")
+{
+    msc_ramdisk_init();
+    TEST_ASSERT_EQUAL(MSC_RAM_SECTORS, tinyusb_msc_storage_get_sector_count());
+    TEST_ASSERT_EQUAL(512, tinyusb_msc_storage_get_sector_size());
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    FILE *f = fopen(MSC_PATH "/hello.txt", "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs("ramdisk", f);
+    fclose(f);
+    msc_hand_to_host();
+
+    uint8_t *buf = malloc(MSC_RAM_SECTORS * 512);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_EQUAL(MSC_RAM_SECTORS * 512, tud_msc_read10_cb(0, 0, 0, buf, MSC_RAM_SECTORS * 512));
+    TEST_ASSERT_EQUAL_HEX8(0x55, buf[510]);
+    TEST_ASSERT_EQUAL_HEX8(0xAA, buf[511]);
+    TEST_ASSERT_NOT_NULL(memmem(buf, MSC_RAM_SECTORS * 512, "ramdisk", 7));
+
+    free(buf);
+    tinyusb_msc_storage_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC benchmark testcase
+ *
+ * Runs the raw benchmark on a RAM disk given to the host, which must find the volume unchanged and
+ * be told of a medium change, then the FatFs benchmark, which must leave no scratch file behind.
+ */
+TEST_CASE("tinyusb_msc_benchmark", "[esp_tinyusb]")
+{
+    const tinyusb_msc_bench_config_t bench = {
+        .duration_ms = 20,
+    };
+    tinyusb_msc_bench_result_t results[TINYUSB_MSC_BENCH_RESULTS_MAX];
+    size_t count = 0;
+    msc_ramdisk_init();
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, tinyusb_msc_storage_benchmark(0, &bench, results, TINYUSB_MSC_BENCH_RESULTS_MAX, &count));
+    msc_hand_to_host();
+
+    uint8_t *before = malloc(MSC_RAM_SECTORS * 512);
+    uint8_t *after = malloc(MSC_RAM_SECTORS * 512);
+    TEST_ASSERT_NOT_NULL(before);
+    TEST_ASSERT_NOT_NULL(after);
+    TEST_ASSERT_EQUAL(MSC_RAM_SECTORS * 512, tud_msc_read10_cb(0, 0, 0, before, MSC_RAM_SECTORS * 512));
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_benchmark(0, &bench, results, TINYUSB_MSC_BENCH_RESULTS_MAX, &count));
+    TEST_ASSERT_EQUAL(TINYUSB_MSC_BENCH_RESULTS_MAX, count);
+    for (size_t i = 0; i < count; i++) {
+        TEST_ASSERT_EQUAL(512 << (i / TINYUSB_MSC_BENCH_KINDS), results[i].block_size);
+        TEST_ASSERT_EQUAL(i % TINYUSB_MSC_BENCH_KINDS, results[i].kind);
+        TEST_ASSERT_GREATER_THAN(0, results[i].ops);
+        TEST_ASSERT_LESS_OR_EQUAL(results[i].max_us, results[i].p99_us);
+        TEST_ASSERT_LESS_OR_EQUAL(results[i].p99_us, results[i].p50_us);
+    }
+    // the medium changed as far as the host knows, its content did not
+    TEST_ASSERT_FALSE(tud_msc_test_unit_ready_cb(0));
+    TEST_ASSERT_TRUE(tud_msc_test_unit_ready_cb(0));
+    TEST_ASSERT_EQUAL(MSC_RAM_SECTORS * 512, tud_msc_read10_cb(0, 0, 0, after, MSC_RAM_SECTORS * 512));
+    TEST_ASSERT_EQUAL_MEMORY(before, after, MSC_RAM_SECTORS * 512);
+
+    const tinyusb_msc_bench_config_t fat = {
+        .block_max = 4096,
+        .duration_ms = 20,
+        .fat = true,
+        .fat_file_size = 16 * 1024,
+    };
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_benchmark(0, &fat, results, TINYUSB_MSC_BENCH_RESULTS_MAX, &count));
+    TEST_ASSERT_EQUAL(4 * TINYUSB_MSC_BENCH_KINDS, count);
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    struct stat st;
+    TEST_ASSERT_NOT_EQUAL(0, stat(MSC_PATH "/.msc_bench.tmp", &st));
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+
+    free(before);
+    free(after);
+    tinyusb_msc_storage_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC removable medium testcase
+ *
+ * Removes the medium of a RAM disk mounted on the application: the mount is closed and the host told
+ * MEDIUM NOT PRESENT, until the medium is inserted again and reported changed.
+ */
+TEST_CASE("tinyusb_msc_removable", "[esp_tinyusb]")
+{
+    msc_ramdisk_init();
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    uint8_t *buf = malloc(512);
+    TEST_ASSERT_NOT_NULL(buf);
+    uint32_t block_count;
+    uint16_t block_size;
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_set_present(0, false));
+    TEST_ASSERT_TRUE(tinyusb_msc_storage_in_use_by_usb_host());
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, tinyusb_msc_storage_mount(MSC_PATH));
+    TEST_ASSERT_FALSE(tud_msc_test_unit_ready_cb(0));
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+    TEST_ASSERT_EQUAL(0, block_count);
+    TEST_ASSERT_EQUAL(-1, tud_msc_read10_cb(0, 0, 0, buf, 512));
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_set_present(0, true));
+    TEST_ASSERT_FALSE(tud_msc_test_unit_ready_cb(0));   // medium changed
+    TEST_ASSERT_TRUE(tud_msc_test_unit_ready_cb(0));
+    tud_msc_capacity_cb(0, &block_count, &block_size);
+    TEST_ASSERT_EQUAL(MSC_RAM_SECTORS, block_count);
+    TEST_ASSERT_EQUAL(512, tud_msc_read10_cb(0, 0, 0, buf, 512));
+    TEST_ASSERT_EQUAL_HEX8(0x55, buf[510]);
+
+    free(buf);
+    tinyusb_msc_storage_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC format testcase
+ *
+ * Formats a RAM disk, which is refused while it is mounted on the application. A RAM disk has no
+ * erase unit: the volume starts at sector 0 without a partition table, and the host is told of the
+ * medium change before it reads the new boot sector.
+ */
+TEST_CASE("tinyusb_msc_format", "[esp_tinyusb]")
+{
+    tinyusb_msc_format_info_t info;
+    msc_ramdisk_init();
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    FILE *f = fopen(MSC_PATH "/old.txt", "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fclose(f);
+    TEST_ASSERT_EQUAL(ESP_ERR_INVALID_STATE, tinyusb_msc_storage_format(0, &info));
+    msc_hand_to_host();
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_format(0, &info));
+    TEST_ASSERT_EQUAL(512, info.erase_unit);
+    TEST_ASSERT_EQUAL(0, info.partition_lba);
+    TEST_ASSERT_EQUAL(4096, info.cluster_size);
+    TEST_ASSERT_EQUAL(FS_FAT12, info.fat_type);
+    TEST_ASSERT_LESS_THAN(info.data_lba, info.fat_lba);
+
+    uint8_t *buf = malloc(512);
+    TEST_ASSERT_NOT_NULL(buf);
+    TEST_ASSERT_FALSE(tud_msc_test_unit_ready_cb(0));   // medium changed
+    TEST_ASSERT_TRUE(tud_msc_test_unit_ready_cb(0));
+    TEST_ASSERT_EQUAL(512, tud_msc_read10_cb(0, 0, 0, buf, 512));
+    TEST_ASSERT_EQUAL_HEX8(0x55, buf[510]);
+    TEST_ASSERT_EQUAL_HEX8(0xAA, buf[511]);
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    struct stat st;
+    TEST_ASSERT_NOT_EQUAL(0, stat(MSC_PATH "/old.txt", &st));
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+
+    free(buf);
+    tinyusb_msc_storage_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC file size testcase
+ *
+ * Reads the size of a file through FatFs by its VFS path, which must agree with stat(). Paths on
+ * no mounted volume are not found.
+ */
+TEST_CASE("tinyusb_msc_file_size", "[esp_tinyusb]")
+{
+    uint64_t size = 0;
+    struct stat st;
+    msc_ramdisk_init();
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    FILE *f = fopen(MSC_PATH "/size.txt", "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs("0123456789", f);
+    fclose(f);
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_get_file_size(MSC_PATH "/size.txt", &size));
+    TEST_ASSERT_EQUAL(0, stat(MSC_PATH "/size.txt", &st));
+    TEST_ASSERT_EQUAL(10, size);
+    TEST_ASSERT_EQUAL(st.st_size, size);
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, tinyusb_msc_storage_get_file_size(MSC_PATH "/none.txt", &size));
+    TEST_ASSERT_EQUAL(ESP_ERR_NOT_FOUND, tinyusb_msc_storage_get_file_size("/nowhere/size.txt", &size));
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+    tinyusb_msc_storage_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC I/O queue testcase
+ *
+ * The queue only stands in front of the SD card: a RAM disk, and a LUN not registered, report no
+ * requests.
+ */
+TEST_CASE("tinyusb_msc_io_queue", "[esp_tinyusb]")
+{
+    const tinyusb_msc_io_stats_t zero = {0};
+    tinyusb_msc_io_stats_t st;
+    msc_ramdisk_init();
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    FILE *f = fopen(MSC_PATH "/queue.txt", "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs("0123456789", f);
+    fclose(f);
+
+    memset(&st, 0xff, sizeof(st));
+    tinyusb_msc_storage_get_io_stats(0, &st);
+    TEST_ASSERT_EQUAL_MEMORY(&zero, &st, sizeof(st));
+    memset(&st, 0xff, sizeof(st));
+    tinyusb_msc_storage_get_io_stats(TINYUSB_MSC_LUN_MAX, &st);
+    TEST_ASSERT_EQUAL_MEMORY(&zero, &st, sizeof(st));
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+    tinyusb_msc_storage_deinit();
+}
+
+static uint8_t *s_ram_disk;
+static uint32_t s_ram_disk_reads;
+static uint32_t s_ram_disk_delay_us;    /*!< added to every read, 0 for RAM speed */
+static uint32_t s_io_log[64];           /*!< first sectors of the reads, in the order they reached the storage */
+static volatile uint32_t s_io_log_count;
+
+static esp_err_t ram_disk_read(void *ctx, uint32_t lba, uint32_t count, void *dest)
+{
+    if (s_io_log_count < sizeof(s_io_log) / sizeof(s_io_log[0])) {
+        s_io_log[s_io_log_count++] = lba;
+    }
+    if (s_ram_disk_delay_us) {
+        esp_rom_delay_us(s_ram_disk_delay_us);
+    }
+    memcpy(dest, s_ram_disk + lba * 512, count * 512);
+    s_ram_disk_reads++;
+    return ESP_OK;
+}
+
+static esp_err_t ram_disk_write(void *ctx, uint32_t lba, uint32_t count, const void *src)
+{
+    memcpy(s_ram_disk + lba * 512, src, count * 512);
+    return ESP_OK;
+}
+
+/**
+ * Registers a block device in RAM of MSC_RAM_SECTORS sectors, each filled with its number. Unlike a
+ * RAM disk, the read-ahead, write-back and metadata caches stand in front of it unless `uncached`;
+ * with `queued` its transfers go through the I/O queue of an SD card.
+ */
+static void ram_disk_init(bool uncached, bool queued)
+{
+    static const tinyusb_msc_blockdev_ops_t ops = {
+        .read = ram_disk_read,
+        .write = ram_disk_write,
+    };
+    const tinyusb_msc_blockdev_config_t config = {
+        .ops = &ops,
+        .sector_count = MSC_RAM_SECTORS,
+        .sector_size = 512,
+        .uncached = uncached,
+        .queued = queued,
+    };
+    s_ram_disk = malloc(MSC_RAM_SECTORS * 512);
+    TEST_ASSERT_NOT_NULL(s_ram_disk);
+    for (uint32_t lba = 0; lba < MSC_RAM_SECTORS; lba++) {
+        memset(s_ram_disk + lba * 512, (uint8_t)lba, 512);
+    }
+    s_ram_disk_reads = 0;
+    s_ram_disk_delay_us = 0;
+    s_io_log_count = 0;
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_init_blockdev(&config));
+}
+
+static void ram_disk_deinit(void)
+{
+    tinyusb_msc_storage_deinit();
+    free(s_ram_disk);
+    s_ram_disk = NULL;
+}
+
+/**
+ * @brief TinyUSB MSC read-ahead testcase
+ *
+ * Sequential host reads start a prefetch of the sectors that follow. The host then writes a sector of
+ * the prefetched window: the next read of the window must go to the storage and return the new data.
+ */
+TEST_CASE("tinyusb_msc_readahead", "[esp_tinyusb]")
+{
+    if (CONFIG_TINYUSB_MSC_READAHEAD_SIZE == 0) {
+        TEST_IGNORE_MESSAGE("CONFIG_TINYUSB_MSC_READAHEAD_SIZE is 0");
+    }
+    tinyusb_msc_readahead_stats_t before;
+    tinyusb_msc_readahead_stats_t st;
+    uint8_t *buf = malloc(8 * 512);
+    TEST_ASSERT_NOT_NULL(buf);
+    ram_disk_init(false, false);
+    tud_msc_test_unit_ready_cb(0);
+    TEST_ASSERT_TRUE(tud_msc_test_unit_ready_cb(0));
+
+    TEST_ASSERT_EQUAL(8 * 512, tud_msc_read10_cb(0, 0, 0, buf, 8 * 512));
+    TEST_ASSERT_EQUAL(8 * 512, tud_msc_read10_cb(0, 8, 0, buf, 8 * 512));
+    for (int i = 0; i < 100; i++) {
+        tinyusb_msc_storage_get_readahead_stats(0, &st);
+        if (st.prefetched_sectors >= 8) {
+            break;
+        }
+        vTaskDelay(1);
+    }
+    TEST_ASSERT_GREATER_OR_EQUAL(8, st.prefetched_sectors);    // at least 16 to 23
+    TEST_ASSERT_EQUAL_HEX8(15, buf[7 * 512]);
+
+    memset(buf, 0xA5, 512);
+    TEST_ASSERT_EQUAL(512, tud_msc_write10_cb(0, 18, 0, buf, 512));
+    tinyusb_msc_storage_get_readahead_stats(0, &before);
+    TEST_ASSERT_EQUAL(8 * 512, tud_msc_read10_cb(0, 16, 0, buf, 8 * 512));
+    tinyusb_msc_storage_get_readahead_stats(0, &st);
+    TEST_ASSERT_EQUAL(before.hit_sectors, st.hit_sectors);
+    TEST_ASSERT_EQUAL(before.miss_sectors + 8, st.miss_sectors);
+    TEST_ASSERT_EQUAL_HEX8(16, buf[0]);
+    TEST_ASSERT_EQUAL_HEX8(0xA5, buf[2 * 512]);
+    TEST_ASSERT_EQUAL_HEX8(19, buf[3 * 512]);
+
+    free(buf);
+    ram_disk_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC write-back testcase
+ *
+ * Small host writes stay in the write-back cache until SYNCHRONIZE CACHE, a START STOP UNIT to the
+ * stopped state, or the volume going back to the application, each of which must write them to the
+ * storage.
+ */
+TEST_CASE("tinyusb_msc_writeback", "[esp_tinyusb]")
+{
+    if (CONFIG_TINYUSB_MSC_WRITEBACK_SIZE == 0) {
+        TEST_IGNORE_MESSAGE("CONFIG_TINYUSB_MSC_WRITEBACK_SIZE is 0");
+    }
+    const uint8_t sync_cache[16] = { 0x35 };    // SYNCHRONIZE CACHE (10)
+    tinyusb_msc_writeback_stats_t st;
+    uint8_t *buf = malloc(512);
+    TEST_ASSERT_NOT_NULL(buf);
+    ram_disk_init(false, false);
+    // formatted by the first mount, the last sectors stay free for the host to write
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    msc_hand_to_host();
+
+    memset(buf, 0x5A, 512);
+    TEST_ASSERT_EQUAL(512, tud_msc_write10_cb(0, 157, 0, buf, 512));
+    tinyusb_msc_storage_get_writeback_stats(0, &st);
+    TEST_ASSERT_EQUAL(1, st.dirty_sectors);
+    TEST_ASSERT_EQUAL(0, tud_msc_scsi_cb(0, sync_cache, NULL, 0));
+    tinyusb_msc_storage_get_writeback_stats(0, &st);
+    TEST_ASSERT_EQUAL(0, st.dirty_sectors);
+    TEST_ASSERT_EQUAL_HEX8(0x5A, s_ram_disk[157 * 512]);
+
+    memset(buf, 0x6B, 512);
+    TEST_ASSERT_EQUAL(512, tud_msc_write10_cb(0, 158, 0, buf, 512));
+    tinyusb_msc_storage_get_writeback_stats(0, &st);
+    TEST_ASSERT_EQUAL(1, st.dirty_sectors);
+    TEST_ASSERT_TRUE(tud_msc_start_stop_cb(0, 0, false, false));
+    tinyusb_msc_storage_get_writeback_stats(0, &st);
+    TEST_ASSERT_EQUAL(0, st.dirty_sectors);
+    TEST_ASSERT_EQUAL_HEX8(0x6B, s_ram_disk[158 * 512]);
+
+    memset(buf, 0x7C, 512);
+    TEST_ASSERT_EQUAL(512, tud_msc_write10_cb(0, 159, 0, buf, 512));
+    tinyusb_msc_storage_get_writeback_stats(0, &st);
+    TEST_ASSERT_EQUAL(1, st.dirty_sectors);
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    tinyusb_msc_storage_get_writeback_stats(0, &st);
+    TEST_ASSERT_EQUAL(0, st.dirty_sectors);
+    TEST_ASSERT_EQUAL_HEX8(0x7C, s_ram_disk[159 * 512]);
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_unmount());
+
+    free(buf);
+    ram_disk_deinit();
+}
+
+/**
+ * @brief TinyUSB MSC SPI flash write combining testcase
+ *
+ * Two host writes of single sectors in the same flash sector are gathered: the flush erases the flash
+ * sector once, reads back the six sectors the host did not write and programs the whole of it, which
+ * must then hold the new sectors next to the old ones.
+ */
+TEST_CASE("tinyusb_msc_wl_combine", "[esp_tinyusb]")
+{
+    if (CONFIG_WL_SECTOR_SIZE != 512 || CONFIG_TINYUSB_MSC_WL_COMBINE_SIZE == 0) {
+        TEST_IGNORE_MESSAGE("needs CONFIG_WL_SECTOR_SIZE 512 and CONFIG_TINYUSB_MSC_WL_COMBINE_SIZE");
+    }
+    const esp_partition_t *part = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, NULL);
+    TEST_ASSERT_NOT_NULL(part);
+    wl_handle_t wl_handle;
+    TEST_ASSERT_EQUAL(ESP_OK, wl_mount(part, &wl_handle));
+    const tinyusb_msc_spiflash_config_t config = {
+        .wl_handle = wl_handle,
+    };
+    tinyusb_msc_wl_combine_stats_t before;
+    tinyusb_msc_wl_combine_stats_t st;
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_init_spiflash(&config));
+    TEST_ASSERT_EQUAL(512, tinyusb_msc_storage_get_sector_size());
+    tud_msc_test_unit_ready_cb(0);
+    TEST_ASSERT_TRUE(tud_msc_test_unit_ready_cb(0));
+
+    uint8_t *expect = malloc(4096);
+    uint8_t *flash = malloc(4096);
+    uint8_t *buf = malloc(512);
+    TEST_ASSERT_NOT_NULL(expect);
+    TEST_ASSERT_NOT_NULL(flash);
+    TEST_ASSERT_NOT_NULL(buf);
+    // sectors 8 to 15 share the second flash sector
+    TEST_ASSERT_EQUAL(4096, tud_msc_read10_cb(0, 8, 0, expect, 4096));
+    memset(expect + 1 * 512, ~expect[1 * 512], 512);
+    memset(expect + 4 * 512, ~expect[4 * 512], 512);
+
+    tinyusb_msc_storage_get_wl_combine_stats(0, &before);
+    memcpy(buf, expect + 1 * 512, 512);
+    TEST_ASSERT_EQUAL(512, tud_msc_write10_cb(0, 9, 0, buf, 512));
+    memcpy(buf, expect + 4 * 512, 512);
+    TEST_ASSERT_EQUAL(512, tud_msc_write10_cb(0, 12, 0, buf, 512));
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_flush());
+    tinyusb_msc_storage_get_wl_combine_stats(0, &st);
+    TEST_ASSERT_EQUAL(before.host_sectors + 2, st.host_sectors);
+    TEST_ASSERT_EQUAL(before.erases + 1, st.erases);
+    TEST_ASSERT_EQUAL(before.gathered_blocks + 1, st.gathered_blocks);
+    TEST_ASSERT_EQUAL(before.fill_sectors + 6, st.fill_sectors);
+
+    // past every cache, straight from the wear levelling layer
+    TEST_ASSERT_EQUAL(ESP_OK, wl_read(wl_handle, 8 * 512, flash, 4096));
+    TEST_ASSERT_EQUAL_MEMORY(expect, flash, 4096);
+
+    free(expect);
+    free(flash);
+    free(buf);
+    tinyusb_msc_storage_deinit();
+    TEST_ASSERT_EQUAL(ESP_OK, wl_unmount(wl_handle));
+}
+
+#define MSC_VIEW_PATH "/msc-view"
+#define IO_QUEUE_HOST_LBA (MSC_RAM_SECTORS - 1)    // past the file, the last sector of the disk
+#define IO_QUEUE_HOST_READS 1000
+
+typedef struct {
+    SemaphoreHandle_t ready;
+    SemaphoreHandle_t go;
+    SemaphoreHandle_t done;
+    uint32_t host_reads;            /*!< READ10s of the host task, repeated until the application read is over */
+    uint32_t host_errors;
+    volatile bool app_done;
+    size_t app_bytes;
+} io_queue_job_t;
+
+/* The READ10 callback makes its caller the host task of the queue */
+static void io_queue_host_task(void *arg)
+{
+    io_queue_job_t *job = arg;
+    uint8_t buf[512];
+
+    xSemaphoreTake(job->go, portMAX_DELAY);
+    do {
+        if (tud_msc_read10_cb(0, IO_QUEUE_HOST_LBA, 0, buf, 512) != 512) {
+            job->host_errors++;
+        }
+    } while (++job->host_reads < IO_QUEUE_HOST_READS && !job->app_done);
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
+
+/* Any other task is served as the application */
+static void io_queue_app_task(void *arg)
+{
+    io_queue_job_t *job = arg;
+    static uint8_t buf[2048];
+    FILE *f = fopen(MSC_VIEW_PATH "/queue.bin", "rb");
+
+    xSemaphoreGive(job->ready);
+    xSemaphoreTake(job->go, portMAX_DELAY);
+    job->app_bytes = f ? fread(buf, 1, sizeof(buf), f) : 0;
+    job->app_done = true;
+    if (f) {
+        fclose(f);
+    }
+    xSemaphoreGive(job->done);
+    vTaskDelete(NULL);
+}
+
+/**
+ * @brief TinyUSB MSC I/O queue scheduling testcase
+ *
+ * A block device registered with `queued` goes through the queue of an SD card. With the dispatcher
+ * paused, an application read through the read-only view is queued before a host READ10: the host
+ * request must be dispatched first. The host then reads without a pause while the application reads
+ * a file, which must complete all the same.
+ */
+TEST_CASE("tinyusb_msc_io_queue_sched", "[esp_tinyusb]")
+{
+    if (CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH < 2 || CONFIG_TINYUSB_MSC_IO_SCHED_STARVE_MS < 50) {
+        TEST_IGNORE_MESSAGE("needs CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH 2 and CONFIG_TINYUSB_MSC_IO_SCHED_STARVE_MS 50 at least");
+    }
+    io_queue_job_t job = {
+        .ready = xSemaphoreCreateCounting(2, 0),
+        .go = xSemaphoreCreateCounting(2, 0),
+        .done = xSemaphoreCreateCounting(2, 0),
+    };
+    tinyusb_msc_io_stats_t before;
+    tinyusb_msc_io_stats_t st;
+    TEST_ASSERT_NOT_NULL(job.ready);
+    TEST_ASSERT_NOT_NULL(job.go);
+    TEST_ASSERT_NOT_NULL(job.done);
+    ram_disk_init(true, true);
+    s_ram_disk_delay_us = 200;  // about a card transfer
+
+    // formatted by the first mount
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    FILE *f = fopen(MSC_PATH "/queue.bin", "wb");
+    TEST_ASSERT_NOT_NULL(f);
+    for (int i = 0; i < 2048; i++) {
+        fputc(0x3C, f);
+    }
+    fclose(f);
+    msc_hand_to_host();
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_acquire_view(0, 1, MSC_VIEW_PATH));
+
+    // one request of each class queued while the dispatcher is held, the host's last
+    job.host_reads = IO_QUEUE_HOST_READS - 1;
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(io_queue_app_task, "io_app", 4096, &job, 5, NULL));
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(io_queue_host_task, "io_host", 4096, &job, 5, NULL));
+    TEST_ASSERT_TRUE(xSemaphoreTake(job.ready, pdMS_TO_TICKS(1000)));
+    tinyusb_msc_storage_get_io_stats(0, &before);
+    tinyusb_msc_storage_io_pause(0);
+    s_io_log_count = 0;
+    xSemaphoreGive(job.go);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    xSemaphoreGive(job.go);
+    vTaskDelay(pdMS_TO_TICKS(10));
+    tinyusb_msc_storage_get_io_stats(0, &st);
+    TEST_ASSERT_EQUAL(2, st.depth);
+    TEST_ASSERT_EQUAL(0, s_io_log_count);
+    tinyusb_msc_storage_io_resume(0);
+    TEST_ASSERT_TRUE(xSemaphoreTake(job.done, pdMS_TO_TICKS(1000)));
+    TEST_ASSERT_TRUE(xSemaphoreTake(job.done, pdMS_TO_TICKS(1000)));
+    TEST_ASSERT_EQUAL(2048, job.app_bytes);
+    TEST_ASSERT_GREATER_OR_EQUAL(2, s_io_log_count);
+    TEST_ASSERT_EQUAL(IO_QUEUE_HOST_LBA, s_io_log[0]);
+    tinyusb_msc_storage_get_io_stats(0, &st);
+    TEST_ASSERT_EQUAL(before.cls[TINYUSB_MSC_IO_HOST].requests + 1, st.cls[TINYUSB_MSC_IO_HOST].requests);
+    TEST_ASSERT_GREATER_THAN(before.cls[TINYUSB_MSC_IO_BACKGROUND].requests, st.cls[TINYUSB_MSC_IO_BACKGROUND].requests);
+    TEST_ASSERT_TRUE(st.cls[TINYUSB_MSC_IO_BACKGROUND].wait_us > before.cls[TINYUSB_MSC_IO_BACKGROUND].wait_us);
+    TEST_ASSERT_GREATER_OR_EQUAL(before.transfers + 2, st.transfers);
+    TEST_ASSERT_GREATER_OR_EQUAL(2, st.depth_max);
+    TEST_ASSERT_EQUAL(0, st.depth);
+
+    // the host reading back to back does not hold the application off
+    job.host_reads = 0;
+    job.app_done = false;
+    job.app_bytes = 0;
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(io_queue_app_task, "io_app", 4096, &job, 5, NULL));
+    TEST_ASSERT_EQUAL(pdPASS, xTaskCreate(io_queue_host_task, "io_host", 4096, &job, 5, NULL));
+    TEST_ASSERT_TRUE(xSemaphoreTake(job.ready, pdMS_TO_TICKS(1000)));
+    xSemaphoreGive(job.go);
+    xSemaphoreGive(job.go);
+    TEST_ASSERT_TRUE(xSemaphoreTake(job.done, pdMS_TO_TICKS(5000)));
+    TEST_ASSERT_TRUE(xSemaphoreTake(job.done, pdMS_TO_TICKS(5000)));
+    TEST_ASSERT_EQUAL(2048, job.app_bytes);
+    TEST_ASSERT_LESS_THAN(IO_QUEUE_HOST_READS, job.host_reads);
+    TEST_ASSERT_EQUAL(0, job.host_errors);
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_release_view(0, 1));
+    ram_disk_deinit();
+    vSemaphoreDelete(job.ready);
+    vSemaphoreDelete(job.go);
+    vSemaphoreDelete(job.done);
+}
+
+#if CONFIG_TINYUSB_MSC_META_CACHE_SIZE
+/**
+ * @brief TinyUSB MSC metadata cache testcase
+ *
+ * Lists a directory twice on a cached block device: the second listing must be served from the cache
+ * without reading the storage. The host then gets the volume and must find the file and the
+ * directory FatFs wrote through the cache.
+ */
+TEST_CASE("tinyusb_msc_meta_cache", "[esp_tinyusb]")
+{
+    tinyusb_msc_meta_cache_stats_t stats;
+    tinyusb_msc_meta_bench_result_t bench[2];
+    ram_disk_init(false, false);
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_mount(MSC_PATH));
+    TEST_ASSERT_EQUAL(0, mkdir(MSC_PATH "/dir", 0755));
+    FILE *f = fopen(MSC_PATH "/dir/meta.txt", "w");
+    TEST_ASSERT_NOT_NULL(f);
+    fputs("metadata", f);
+    fclose(f);
+    struct stat st;
+    TEST_ASSERT_EQUAL(0, stat(MSC_PATH "/dir/meta.txt", &st));
+    const uint32_t reads = s_ram_disk_reads;
+    TEST_ASSERT_EQUAL(0, stat(MSC_PATH "/dir/meta.txt", &st));
+    TEST_ASSERT_EQUAL(reads, s_ram_disk_reads);
+    tinyusb_msc_storage_get_meta_cache_stats(0, &stats);
+    TEST_ASSERT_GREATER_THAN(0, stats.hits);
+    TEST_ASSERT_GREATER_THAN(0, stats.writes);
+
+    TEST_ASSERT_EQUAL(ESP_OK, tinyusb_msc_storage_benchmark_meta(0, 8, bench));
+    TEST_ASSERT_FALSE(bench[0].cached);
+    TEST_ASSERT_TRUE(bench[1].cached);
+    TEST_ASSERT_EQUAL(0, bench[0].hits);
+    TEST_ASSERT_GREATER_THAN(0, bench[1].hits);
+    TEST_ASSERT_LESS_THAN(bench[0].misses, bench[1].misses);
+
+    msc_hand_to_host();
+    tinyusb_msc_storage_get_meta_cache_stats(0, &stats);
+    TEST_ASSERT_EQUAL(0, stats.dirty_sectors);
+    TEST_ASSERT_GREATER_THAN(0, stats.invalidations);
+    TEST_ASSERT_NOT_NULL(memmem(s_ram_disk, MSC_RAM_SECTORS * 512, "META    TXT", 11));
+    TEST_ASSERT_NOT_NULL(memmem(s_ram_disk, MSC_RAM_SECTORS * 512, "metadata", 8));
+
+    ram_disk_deinit();
+}
+#endif
+
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+/**
+ * @brief TinyUSB MSC latency statistics testcase
+ *
+ * Reports the steps of a READ10 and of a failing TEST UNIT READY the way the class driver does and
+ * checks the times they land in.
+ */
+TEST_CASE("tinyusb_msc_latency", "[esp_tinyusb]")
+{
+    const uint8_t read10[16] = { SCSI_CMD_READ_10, 0, 0, 0, 0x01, 0x00, 0, 0, 8 };
+    const uint8_t tur[16] = { SCSI_CMD_TEST_UNIT_READY };
+    tinyusb_msc_latency_stats_t st;
+    tinyusb_msc_trace_entry_t trace[2];
+
+    tinyusb_msc_storage_reset_latency_stats();
+    tud_msc_trace_cb(0, read10, MSC_TRACE_CBW, 4096);
+    tud_msc_trace_cb(0, read10, MSC_TRACE_APP_BEGIN, 0);
+    esp_rom_delay_us(300);
+    tud_msc_trace_cb(0, read10, MSC_TRACE_APP_END, 0);
+    tud_msc_trace_cb(0, read10, MSC_TRACE_XFER_QUEUED, 4096);
+    esp_rom_delay_us(1400);
+    tud_msc_trace_cb(0, read10, MSC_TRACE_XFER_DONE, 4096);
+    tud_msc_trace_cb(0, read10, MSC_TRACE_CSW, 0);
+    tud_msc_trace_cb(0, tur, MSC_TRACE_CBW, 0);
+    tud_msc_trace_cb(0, tur, MSC_TRACE_CSW, 1);
+
+    tinyusb_msc_storage_get_latency_stats(0, TINYUSB_MSC_CMD_READ10, &st);
+    TEST_ASSERT_EQUAL(1, st.commands);
+    TEST_ASSERT_EQUAL(0, st.failed);
+    TEST_ASSERT_EQUAL(4096, st.bytes);
+    TEST_ASSERT_EQUAL(1, st.storage_hist[8]);   // 256 to 511 us
+    TEST_ASSERT_EQUAL(1, st.usb_hist[10]);      // 1024 to 2047 us
+    TEST_ASSERT_EQUAL(1, st.total_hist[10]);
+    tinyusb_msc_storage_get_latency_stats(0, TINYUSB_MSC_CMD_TEST_UNIT_READY, &st);
+    TEST_ASSERT_EQUAL(1, st.commands);
+    TEST_ASSERT_EQUAL(1, st.failed);
+    TEST_ASSERT_EQUAL(1, st.usb_hist[0]);
+
+    if (CONFIG_TINYUSB_MSC_TRACE_DEPTH >= 2) {
+        TEST_ASSERT_EQUAL(2, tinyusb_msc_storage_get_trace(trace, 2));
+        TEST_ASSERT_EQUAL(SCSI_CMD_READ_10, trace[0].opcode);
+        TEST_ASSERT_EQUAL(0x100, trace[0].lba);
+        TEST_ASSERT_EQUAL(SCSI_CMD_TEST_UNIT_READY, trace[1].opcode);
+    }
+
+    // the reset is applied with the next command, which alone must be counted
+    tinyusb_msc_storage_reset_latency_stats();
+    tud_msc_trace_cb(0, tur, MSC_TRACE_CBW, 0);
+    tud_msc_trace_cb(0, tur, MSC_TRACE_CSW, 0);
+    tinyusb_msc_storage_get_latency_stats(0, TINYUSB_MSC_CMD_READ10, &st);
+    TEST_ASSERT_EQUAL(0, st.commands);
+    TEST_ASSERT_EQUAL(0, st.bytes);
+    tinyusb_msc_storage_get_latency_stats(0, TINYUSB_MSC_CMD_TEST_UNIT_READY, &st);
+    TEST_ASSERT_EQUAL(1, st.commands);
+    TEST_ASSERT_EQUAL(0, st.failed);
+    if (CONFIG_TINYUSB_MSC_TRACE_DEPTH >= 2) {
+        TEST_ASSERT_EQUAL(1, tinyusb_msc_storage_get_trace(trace, 2));
+        TEST_ASSERT_EQUAL(SCSI_CMD_TEST_UNIT_READY, trace[0].opcode);
+    }
+}
+#endif // CONFIG_TINYUSB_MSC_LATENCY_STATS
+
+#endif // CONFIG_TINYUSB_MSC_ENABLED
+
 #endif
@@ -0,0 +1,191 @@
+/*
+ * SPDX-FileCopyrightText: 2023 Espressif Systems (Shanghai) CO LTD
+ *
+ * SPDX-License-Identifier: Apache-2.0
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "esp_log.h"
+#include "esp_err.h"
+#include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "tusb_msc_storage.h"
+
+static const char *TAG = "tinyusb_msc_blockdev";
+
+#define MSC_BLOCKDEV_SECTOR_SIZE_DEFAULT 512
+
+typedef struct {
+    uint8_t *data;
+    uint32_t sector_size;
+} msc_ramdisk_t;
+
+typedef struct {
+    int fd;
+    uint32_t sector_size;
+} msc_file_t;
+
+/* RAM disk
+   ********************************************************************* */
+
+static esp_err_t _ramdisk_read(void *ctx, uint32_t lba, uint32_t count, void *dest)
+{
+    msc_ramdisk_t *rd = ctx;
+    memcpy(dest, rd->data + (size_t)lba * rd->sector_size, (size_t)count * rd->sector_size);
+    return ESP_OK;
+}
+
+static esp_err_t _ramdisk_write(void *ctx, uint32_t lba, uint32_t count, const void *src)
+{
+    msc_ramdisk_t *rd = ctx;
+    memcpy(rd->data + (size_t)lba * rd->sector_size, src, (size_t)count * rd->sector_size);
+    return ESP_OK;
+}
+
+static void _ramdisk_deinit(void *ctx)
+{
+    msc_ramdisk_t *rd = ctx;
+    heap_caps_free(rd->data);
+    free(rd);
+}
+
+static const tinyusb_msc_blockdev_ops_t s_ramdisk_ops = {
+    .read = _ramdisk_read,
+    .write = _ramdisk_write,
+    .deinit = _ramdisk_deinit,
+};
+
+esp_err_t tinyusb_msc_storage_init_ramdisk(const tinyusb_msc_ramdisk_config_t *config)
+{
+    const uint32_t sector_size = config->sector_size ? config->sector_size : MSC_BLOCKDEV_SECTOR_SIZE_DEFAULT;
+    size_t size = 0;
+    ESP_RETURN_ON_FALSE(!__builtin_mul_overflow(config->sector_count, sector_size, &size), ESP_ERR_INVALID_SIZE,
+                        TAG, "%lu sectors of %lu bytes do not fit in memory", config->sector_count, sector_size);
+
+    msc_ramdisk_t *rd = calloc(1, sizeof(msc_ramdisk_t));
+    ESP_RETURN_ON_FALSE(rd, ESP_ERR_NO_MEM, TAG, "could not allocate the RAM disk");
+    // zeroed: the first mount finds no file system and formats the disk
+    if (config->caps) {
+        rd->data = heap_caps_calloc(1, size, config->caps);
+    } else {
+        rd->data = heap_caps_calloc_prefer(1, size, 2, MALLOC_CAP_SPIRAM, MALLOC_CAP_8BIT);
+    }
+    if (!rd->data) {
+        ESP_LOGE(TAG, "could not allocate %u bytes for the RAM disk", size);
+        free(rd);
+        return ESP_ERR_NO_MEM;
+    }
+    rd->sector_size = sector_size;
+
+    const tinyusb_msc_blockdev_config_t bdev_config = {
+        .ops = &s_ramdisk_ops,
+        .ctx = rd,
+        .sector_count = config->sector_count,
+        .sector_size = sector_size,
+        .product = "RAM Disk",
+        .uncached = true,
+        .callback_mount_changed = config->callback_mount_changed,
+        .callback_premount_changed = config->callback_premount_changed,
+        .mount_config = config->mount_config,
+    };
+    esp_err_t ret = tinyusb_msc_storage_init_blockdev(&bdev_config);
+    if (ret != ESP_OK) {
+        _ramdisk_deinit(rd);
+    }
+    return ret;
+}
+
+/* Image file
+   ********************************************************************* */
+
+/**
+ * pread() and pwrite() carry the file offset with each call, so that the tasks sharing the storage
+ * need no lock around a seek and the transfer.
+ */
+static esp_err_t _file_read(void *ctx, uint32_t lba, uint32_t count, void *dest)
+{
+    msc_file_t *f = ctx;
+    const size_t size = (size_t)count * f->sector_size;
+    return (pread(f->fd, dest, size, (off_t)lba * f->sector_size) == (ssize_t)size) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t _file_write(void *ctx, uint32_t lba, uint32_t count, const void *src)
+{
+    msc_file_t *f = ctx;
+    const size_t size = (size_t)count * f->sector_size;
+    return (pwrite(f->fd, src, size, (off_t)lba * f->sector_size) == (ssize_t)size) ? ESP_OK : ESP_FAIL;
+}
+
+static esp_err_t _file_flush(void *ctx)
+{
+    msc_file_t *f = ctx;
+    return (fsync(f->fd) == 0) ? ESP_OK : ESP_FAIL;
+}
+
+static void _file_deinit(void *ctx)
+{
+    msc_file_t *f = ctx;
+    close(f->fd);
+    free(f);
+}
+
+static const tinyusb_msc_blockdev_ops_t s_file_ops = {
+    .read = _file_read,
+    .write = _file_write,
+    .flush = _file_flush,
+    .deinit = _file_deinit,
+};
+
+esp_err_t tinyusb_msc_storage_init_file(const tinyusb_msc_file_config_t *config)
+{
+    const uint32_t sector_size = config->sector_size ? config->sector_size : MSC_BLOCKDEV_SECTOR_SIZE_DEFAULT;
+    uint32_t sector_count = config->sector_count;
+
+    msc_file_t *f = calloc(1, sizeof(msc_file_t));
+    ESP_RETURN_ON_FALSE(f, ESP_ERR_NO_MEM, TAG, "could not allocate the image file");
+    f->sector_size = sector_size;
+    f->fd = open(config->path, O_RDWR | (sector_count ? O_CREAT : 0), 0644);
+    if (f->fd < 0) {
+        ESP_LOGE(TAG, "could not open %s", config->path);
+        free(f);
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    esp_err_t ret = ESP_OK;
+    struct stat st;
+    if (fstat(f->fd, &st) != 0) {
+        ret = ESP_ERR_INVALID_SIZE;
+    } else if (sector_count == 0) {
+        sector_count = MIN((uint64_t)st.st_size / sector_size, UINT32_MAX);
+        ret = sector_count ? ESP_OK : ESP_ERR_INVALID_SIZE;
+    } else if ((uint64_t)st.st_size < (uint64_t)sector_count * sector_size) {
+        // the new sectors read as zeros, a new image is formatted on the first mount
+        ret = (ftruncate(f->fd, (off_t)sector_count * sector_size) == 0) ? ESP_OK : ESP_ERR_INVALID_SIZE;
+    }
+    if (ret != ESP_OK) {
+        ESP_LOGE(TAG, "%s has no room for %lu sectors of %lu bytes", config->path, sector_count, sector_size);
+        _file_deinit(f);
+        return ret;
+    }
+
+    const tinyusb_msc_blockdev_config_t bdev_config = {
+        .ops = &s_file_ops,
+        .ctx = f,
+        .sector_count = sector_count,
+        .sector_size = sector_size,
+        .product = "Image File",
+        .callback_mount_changed = config->callback_mount_changed,
+        .callback_premount_changed = config->callback_premount_changed,
+        .mount_config = config->mount_config,
+    };
+    ret = tinyusb_msc_storage_init_blockdev(&bdev_config);
+    if (ret != ESP_OK) {
+        _file_deinit(f);
+    }
+    return ret;
+}
@@ -4,10 +4,23 @@
  * SPDX-License-Identifier: Apache-2.0
  */
 
+#include <stdlib.h>
 #include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/param.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "freertos/queue.h"
 #include "esp_log.h"
 #include "esp_err.h"
 #include "esp_check.h"
+#include "esp_heap_caps.h"
+#include "esp_timer.h"
 #include "esp_vfs_fat.h"
 #include "diskio_impl.h"
 #include "diskio_wl.h"
@@ -24,43 +37,438 @@
 
 static const char *TAG = "tinyusb_msc_storage";
 
+typedef struct tinyusb_msc_storage_handle_s tinyusb_msc_storage_handle_s;
+
+#define MSC_FREE_SCAN_TASK_STACK    3072
+#define MSC_FREE_SCAN_TASK_PRIO     (tskIDLE_PRIORITY + 1)
+
+#define MSC_READAHEAD_TASK_STACK    2560
+#define MSC_READAHEAD_TASK_PRIO     (CONFIG_TINYUSB_TASK_PRIORITY - 1)
+#define MSC_READAHEAD_WINDOW_MIN    4096    /*!< bytes, first prefetch of a sequential stream */
+#define MSC_READAHEAD_WAIT_MS       500
+
+typedef struct {
+    uint8_t *data;
+    uint32_t lba;
+    uint32_t count;                 /*!< sectors held, or being read */
+    uint32_t served_end;            /*!< end of the furthest host read served from this buffer */
+    bool filling;                   /*!< being read by the read-ahead task */
+    bool stale;                     /*!< written by the host while being read */
+} msc_readahead_buf_t;
+
+typedef struct {
+    bool enabled;
+    SemaphoreHandle_t lock;
+    SemaphoreHandle_t done;         /*!< given after each prefetch */
+    QueueHandle_t queue;            /*!< index of the buffer to fill */
+    TaskHandle_t task;
+    msc_readahead_buf_t buf[2];
+    uint32_t sector_size;
+    uint32_t capacity;              /*!< sectors per buffer */
+    uint32_t window;                /*!< sectors per prefetch */
+    uint32_t window_min;
+    uint32_t next_lba;              /*!< where the next read of a sequential stream starts */
+    tinyusb_msc_readahead_stats_t stats;
+} msc_readahead_t;
+
+#define MSC_WRITEBACK_TASK_STACK    2560
+#define MSC_WRITEBACK_TASK_PRIO     (CONFIG_TINYUSB_TASK_PRIORITY - 1)
+
+typedef struct {
+    bool enabled;                   /*!< lock and task exist, the cache itself may have 0 slots */
+    bool dirty;                     /*!< host writes since the last complete flush */
+    SemaphoreHandle_t lock;         /*!< held across every host read and write */
+    SemaphoreHandle_t kick;         /*!< given on each cached write, restarts the idle timeout */
+    TaskHandle_t task;
+    uint8_t *data;                  /*!< `slots` sectors */
+    uint32_t *lba;                  /*!< sector held by each slot, the first `used` slots are valid */
+    uint16_t *order;                /*!< slot indexes sorted by LBA during a flush */
+    uint8_t *staging;               /*!< DMA capable, one merged write of up to `run_max` sectors */
+    uint32_t sector_size;
+    uint32_t slots;
+    uint32_t used;
+    uint32_t run_max;               /*!< longest merged write, also the largest host write cached */
+    TickType_t last_write;
+    tinyusb_msc_writeback_stats_t stats;
+} msc_writeback_t;
+
+#define MSC_VIEW_QUIET_MS           50      /*!< pause of the host writes awaited before the view reads the FAT */
+#define MSC_VIEW_READ_RETRIES       4
+#define MSC_DETACH_WARN_MS          5000    /*!< a removed medium still held by a user is logged this often */
+
+#define MSC_WL_ERASE_SIZE           4096    /*!< SPI flash sector, the smallest erasable unit */
+#define MSC_SECTOR_SIZE_MAX         4096    /*!< largest sector of any backend (WL_SECTOR_SIZE_4096) */
+#define MSC_WL_COMBINE_BLOCKS_MAX   16
+#define MSC_WL_UNMAP_SECTORS_MAX    64      /*!< flash sectors erased by one UNMAP, about 2 s of erases */
+
+typedef struct {
+    size_t addr;                    /*!< flash sector held, SIZE_MAX if the block is free */
+    uint32_t valid;                 /*!< bit per storage sector written by the host */
+    uint32_t age;                   /*!< `seq` of the last host write, the oldest block is evicted */
+} msc_wl_block_t;
+
+typedef struct {
+    bool enabled;
+    SemaphoreHandle_t lock;
+    uint8_t *data;                  /*!< MSC_WL_ERASE_SIZE bytes per block */
+    msc_wl_block_t block[MSC_WL_COMBINE_BLOCKS_MAX];
+    uint32_t blocks;
+    uint32_t sector_size;
+    uint32_t full_mask;             /*!< `valid` of a block written entirely */
+    uint32_t seq;
+    tinyusb_msc_wl_combine_stats_t stats;
+} msc_wl_combine_t;
+
+#define MSC_META_CACHE_SLOTS_MAX    128
+
+typedef struct {
+    uint32_t lba;                   /*!< sector held, UINT32_MAX if the slot is free */
+    uint32_t age;                   /*!< `seq` of the last access, the oldest slot is evicted */
+    bool dirty;                     /*!< written by FatFs, not yet to the storage */
+} msc_meta_slot_t;
+
+typedef struct {
+    bool enabled;
+    bool write_back;                /*!< CONFIG_TINYUSB_MSC_META_CACHE_WRITE_BACK */
+    bool bypass;                    /*!< FatFs goes straight to the storage, see tinyusb_msc_storage_benchmark_meta() */
+    SemaphoreHandle_t lock;
+    const BYTE *win;                /*!< FatFs window of the application mount, NULL while unmounted */
+    uint8_t *data;                  /*!< CONFIG_TINYUSB_MSC_META_CACHE_SIZE bytes, `sector_size` per slot */
+    msc_meta_slot_t slot[MSC_META_CACHE_SLOTS_MAX];
+    uint32_t slots;
+    uint32_t sector_size;
+    uint32_t seq;
+    uint32_t dirty_count;
+    tinyusb_msc_meta_cache_stats_t stats;
+} msc_meta_cache_t;
+
+#define MSC_IO_TASK_STACK           2560
+#define MSC_IO_TASK_PRIO            CONFIG_TINYUSB_TASK_PRIORITY
+#define MSC_IO_DEPTH_MAX            32
+
+typedef enum {
+    MSC_IO_READ,
+    MSC_IO_WRITE,
+    MSC_IO_ERASE,                   /*!< trim, never merged */
+} msc_io_op_t;
+
+typedef enum {
+    MSC_IO_FREE,
+    MSC_IO_QUEUED,
+    MSC_IO_ACTIVE,                  /*!< taken by the dispatcher, freed by the submitting task once woken */
+} msc_io_state_t;
+
+typedef struct {
+    msc_io_state_t state;
+    msc_io_op_t op;
+    tinyusb_msc_io_class_t cls;
+    uint32_t lba;
+    uint32_t count;                 /*!< sectors */
+    void *buf;                      /*!< read destination or write source, NULL for an erase */
+    uint32_t seq;                   /*!< submission order */
+    int64_t queued_at;
+    esp_err_t err;
+    SemaphoreHandle_t done;         /*!< given by the dispatcher once the transfer completed */
+} msc_io_req_t;
+
+typedef struct {
+    bool enabled;
+    SemaphoreHandle_t lock;         /*!< guards the requests and the statistics, never held across a transfer */
+    SemaphoreHandle_t slots;        /*!< counting, free requests */
+    SemaphoreHandle_t kick;         /*!< given on each submission */
+    SemaphoreHandle_t bus;          /*!< held across each transfer, and by tinyusb_msc_storage_io_pause() */
+    TaskHandle_t task;
+    TaskHandle_t host_task;         /*!< TinyUSB task, recorded by the READ10 and WRITE10 callbacks */
+    msc_io_req_t req[MSC_IO_DEPTH_MAX];
+    uint32_t depth;                 /*!< requests */
+    uint32_t seq;
+    uint32_t head;                  /*!< end of the last transfer, the LBA order goes on from there */
+    uint8_t *merge;                 /*!< DMA capable, one merged transfer of up to `merge_max` sectors */
+    uint32_t merge_max;
+    uint32_t sector_size;
+    tinyusb_msc_io_stats_t stats;
+} msc_io_t;
+
+#define MSC_FORMAT_WORKBUF_SIZE     (16 * 1024)     /*!< f_mkfs() clears the FAT and the root directory this much at a time */
+#define MSC_FORMAT_UNIT_DEFAULT     (4 * 1024 * 1024)   /*!< largest AU of an SDHC card, for cards not reporting theirs */
+
+/* Volume being formatted: a window on the medium starting at the partition, see _format() */
+typedef struct {
+    tinyusb_msc_storage_handle_s *h;
+    uint32_t base;                  /*!< first sector of the partition */
+    uint32_t count;                 /*!< sectors of the partition */
+    uint32_t align;                 /*!< erase unit in sectors, reported to f_mkfs() as the block size */
+} msc_format_t;
+
+#define MSC_BENCH_DURATION_MS       500
+#define MSC_BENCH_SAMPLES_MAX       2048    /*!< transfers timed by one test at most */
+#define MSC_BENCH_FILE_SIZE         (1024 * 1024)
+#define MSC_BENCH_FILE_NAME         "/.msc_bench.tmp"
+#define MSC_BENCH_DIR_NAME          "/.msc_meta.tmp"
+
 typedef struct {
+    tinyusb_msc_storage_handle_s *h;
+    int fd;                         /*!< scratch file of the FatFs tests, -1 for the raw tests */
+    uint64_t size;                  /*!< bytes tested, the volume or the scratch file */
+    uint32_t sector_size;
+    uint8_t *buf;
+    uint32_t *lat;                  /*!< latency of each transfer of the current test */
+    uint64_t rand;                  /*!< xorshift state of the random offsets */
+    char path[32];                  /*!< scratch file, ESP_VFS_PATH_MAX + MSC_BENCH_FILE_NAME */
+} msc_bench_t;
+
+/* Owner of a LUN. The application releasing the volume does not hand it to the host at once: it
+   stays mounted for CONFIG_TINYUSB_MSC_OWNER_GRACE_MS, so that an application mounting it again
+   shortly after (one FTP command after the other) takes it back without any I/O, and without the
+   host seeing the medium come and go. */
+typedef enum {
+    MSC_OWNER_APP,                  /*!< FAT mounted on the application, the host sees no medium */
+    MSC_OWNER_HOST,                 /*!< FAT unmounted, the host reads and writes the volume */
+    MSC_OWNER_TRANSITIONING,        /*!< released by the application, still mounted until the grace period ends */
+    MSC_OWNER_BENCHMARK,            /*!< FAT unmounted, raw sectors benchmarked or formatted, the host waits */
+} msc_owner_t;
+
+struct tinyusb_msc_storage_handle_s {
+    uint8_t lun;
     bool is_fat_mounted;
+    msc_owner_t owner;
+    SemaphoreHandle_t owner_lock;   /*!< recursive, held across each change of owner */
+    TickType_t owner_tick;          /*!< when the application released the volume */
+    uint32_t app_users;             /*!< bit per application user holding the FAT mount, released at 0 */
+    uint32_t view_users;            /*!< bit per application user holding the read-only view, unmounted at 0 */
+    bool unit_attention;            /*!< the medium changed under the host, reported by the next TEST UNIT READY */
+    bool absent;                    /*!< removable medium removed, see tinyusb_msc_storage_set_present() */
+    SemaphoreHandle_t users_gone;   /*!< binary, given when a user lets go of a removed medium */
     const char *base_path;
     union {
         wl_handle_t wl_handle;
 #if SOC_SDMMC_HOST_SUPPORTED
         sdmmc_card_t *card;
 #endif
+        struct {
+            const tinyusb_msc_blockdev_ops_t *ops;
+            void *ctx;
+            uint32_t sector_count;
+            uint32_t sector_size;
+        } bdev;                     /*!< storage implemented by the application */
     };
-    esp_err_t (*mount)(BYTE pdrv);
-    esp_err_t (*unmount)(void);
-    uint32_t (*sector_count)(void);
-    uint32_t (*sector_size)(void);
-    esp_err_t (*read)(size_t sector_size, uint32_t lba, uint32_t offset, size_t size, void *dest);
-    esp_err_t (*write)(size_t sector_size, size_t addr, uint32_t lba, uint32_t offset, size_t size, const void *src);
+    const char *product;            /*!< INQUIRY product id */
+    esp_err_t (*mount)(tinyusb_msc_storage_handle_s *h, BYTE pdrv);
+    esp_err_t (*unmount)(tinyusb_msc_storage_handle_s *h);
+    uint32_t (*sector_count)(tinyusb_msc_storage_handle_s *h);
+    uint32_t (*sector_size)(tinyusb_msc_storage_handle_s *h);
+    esp_err_t (*read)(tinyusb_msc_storage_handle_s *h, size_t sector_size, uint32_t lba, uint32_t offset, size_t size, void *dest);
+    esp_err_t (*write)(tinyusb_msc_storage_handle_s *h, size_t sector_size, size_t addr, uint32_t lba, uint32_t offset, size_t size, const void *src);
+    esp_err_t (*flush)(tinyusb_msc_storage_handle_s *h);       /*!< writes what the backend holds in RAM, NULL if it holds nothing */
+    esp_err_t (*trim)(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count);  /*!< the sectors hold no data anymore */
+    void (*release)(tinyusb_msc_storage_handle_s *h);          /*!< frees what the backend allocated, NULL if nothing */
+    bool uncached;                  /*!< the backend is as fast as RAM, no read-ahead and write-back caches */
+    bool queued;                    /*!< transfers go through the I/O queue, see _io_init() */
+    uint32_t unmap_max;             /*!< sectors trimmed by one UNMAP at most */
+    uint32_t unmap_granularity;     /*!< sectors, trims of less are not worth it */
+    uint32_t *wl_erased;            /*!< bit per flash sector erased by a trim and not written since, NULL if not tracked */
     tusb_msc_callback_t callback_mount_changed;
     tusb_msc_callback_t callback_premount_changed;
     int max_files;
-} tinyusb_msc_storage_handle_s; /*!< MSC object */
+    uint32_t host_write_count;      /*!< WRITE10 commands completed for the USB host */
+    FATFS *fs;                      /*!< FatFs object while mounted on the application */
+    BYTE app_pdrv;                  /*!< FatFs drive while mounted on the application */
+    /* Free cluster accounting. FatFs keeps `free_clst` up to date on every allocation and release,
+       but forgets it on unmount; the count is kept here so it survives the frequent remounts. */
+    BYTE fat_type;                  /*!< FS_FAT12/16/32/EXFAT, 0 until the volume was mounted once */
+    LBA_t fat_base;                 /*!< first sector of the FAT (exFAT: allocation bitmap) */
+    uint32_t fat_entries;           /*!< FatFs `n_fatent`: data clusters + 2 */
+    uint32_t fat_cluster_bytes;
+    uint32_t free_clusters;
+    uint32_t free_host_writes;      /*!< `host_write_count` the count was taken at */
+    bool free_valid;
+    bool free_scanning;             /*!< background scan of the FAT in progress */
+    /* Read-only view of the volume for the application while the host has it */
+    FATFS *view_fs;
+    const char *view_path;
+    BYTE view_pdrv;
+    uint32_t view_host_writes;      /*!< `host_write_count` the FatFs window of the view was read at */
+    TickType_t host_write_tick;     /*!< end of the last host WRITE10 */
+    msc_readahead_t ra;
+    msc_writeback_t wb;
+    msc_wl_combine_t wc;
+    msc_meta_cache_t mc;
+    msc_io_t io;
+}; /*!< MSC object, one per LUN */
+
+/* handles of tinyusb driver connected to application, indexed by LUN */
+static tinyusb_msc_storage_handle_s *s_storage[TINYUSB_MSC_LUN_MAX];
+static uint8_t s_lun_count;
+static uint8_t *s_msc_buf[2];       /*!< MSC data stage buffers, NULL if the built-in ones are used */
+static tinyusb_msc_storage_handle_s *s_view[FF_VOLUMES];   /*!< LUN read by each FatFs drive of a read-only view */
+static tinyusb_msc_storage_handle_s *s_app[FF_VOLUMES];    /*!< LUN behind each FatFs drive mounted on the application */
+static msc_format_t s_format[FF_VOLUMES];                   /*!< partition behind each FatFs drive being formatted */
+
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+/* SCSI command in progress, timed by tud_msc_trace_cb() */
+typedef struct {
+    bool active;                    /*!< command block received, status not sent yet */
+    int64_t start;
+    int64_t app_start;              /*!< storage callback running since, 0 if none */
+    int64_t xfer_start;             /*!< data stage transfer queued since, 0 if none */
+    tinyusb_msc_trace_entry_t e;
+} msc_latency_cmd_t;
+
+/* Only the TinyUSB task writes the statistics and the trace. Readers copy them between two reads
+   of the same even `s_latency_seq`, the TinyUSB task never waits for them. */
+static msc_latency_cmd_t s_cmd;
+static tinyusb_msc_latency_stats_t s_latency[TINYUSB_MSC_LUN_MAX][TINYUSB_MSC_CMD_KINDS];
+#if CONFIG_TINYUSB_MSC_TRACE_DEPTH
+static tinyusb_msc_trace_entry_t s_trace[CONFIG_TINYUSB_MSC_TRACE_DEPTH];
+#endif
+static uint32_t s_trace_count;      /*!< commands traced, the newest is at (s_trace_count - 1) % depth */
+static atomic_uint s_latency_seq;   /*!< odd while the TinyUSB task updates the statistics */
+static atomic_bool s_latency_reset; /*!< cleared by the TinyUSB task with the statistics */
+#endif
 
-/* handle of tinyusb driver connected to application */
-static tinyusb_msc_storage_handle_s *s_storage_handle;
+static tinyusb_msc_storage_handle_s *_storage_get(uint8_t lun);
+static esp_err_t _storage_add(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _fat_mount(tinyusb_msc_storage_handle_s *h, const char *base_path);
+static esp_err_t _app_register(tinyusb_msc_storage_handle_s *h, BYTE pdrv);
+static esp_err_t _fat_unmount(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _owner_app(tinyusb_msc_storage_handle_s *h, const char *base_path);
+static esp_err_t _owner_release(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _owner_host(tinyusb_msc_storage_handle_s *h);
+static bool _owner_grace_over(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _view_mount(tinyusb_msc_storage_handle_s *h, const char *base_path);
+static esp_err_t _view_unmount(tinyusb_msc_storage_handle_s *h);
+static void _detach_wait(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _storage_flush(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _storage_trim(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count);
+static esp_err_t msc_storage_read_sector(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest);
+static void _free_space_mounted(tinyusb_msc_storage_handle_s *h, FATFS *fs);
+static void _free_space_unmounting(tinyusb_msc_storage_handle_s *h);
+static void _free_space_scan_start(tinyusb_msc_storage_handle_s *h);
+static void _free_space_scan_task(void *arg);
+static void _msc_buffers_alloc(void);
+static void _msc_buffers_free(void);
+static void _readahead_init(tinyusb_msc_storage_handle_s *h);
+static void _readahead_deinit(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _readahead_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest);
+static void _readahead_schedule(tinyusb_msc_storage_handle_s *h, uint32_t end, uint32_t count);
+static void _readahead_task(void *arg);
+static void _readahead_invalidate(tinyusb_msc_storage_handle_s *h, uint32_t lba, size_t size);
+static void _writeback_init(tinyusb_msc_storage_handle_s *h);
+static void _writeback_deinit(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _writeback_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest);
+static esp_err_t _writeback_write(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, const void *src);
+static void _writeback_overlay(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest);
+static void _writeback_discard(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count);
+static esp_err_t _writeback_flush_locked(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _writeback_sync_locked(tinyusb_msc_storage_handle_s *h);
+static void _writeback_task(void *arg);
+static void _wl_combine_init(tinyusb_msc_storage_handle_s *h);
+static void _wl_combine_deinit(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _wl_combine_write(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size, const void *src);
+static msc_wl_block_t *_wl_combine_get(tinyusb_msc_storage_handle_s *h, esp_err_t *err);
+static esp_err_t _wl_combine_flush_block(tinyusb_msc_storage_handle_s *h, msc_wl_block_t *b);
+static esp_err_t _wl_combine_program(tinyusb_msc_storage_handle_s *h, size_t addr, const void *data);
+static void _wl_combine_overlay(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size, void *dest);
+static void _wl_combine_discard(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size);
+static esp_err_t _wl_erase(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size);
+static void _meta_cache_init(tinyusb_msc_storage_handle_s *h);
+static void _meta_cache_deinit(tinyusb_msc_storage_handle_s *h);
+static void _meta_cache_attach(tinyusb_msc_storage_handle_s *h, const BYTE *win);
+static esp_err_t _meta_cache_detach(tinyusb_msc_storage_handle_s *h, bool discard);
+static esp_err_t _meta_cache_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count, void *dest);
+static esp_err_t _meta_cache_write(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count, const void *src);
+static esp_err_t _meta_cache_flush(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _meta_cache_flush_locked(tinyusb_msc_storage_handle_s *h);
+static void _meta_cache_discard(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count);
+static void _meta_cache_drop(msc_meta_cache_t *mc, uint32_t lba, uint32_t count);
+static msc_meta_slot_t *_meta_cache_get(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _meta_cache_bypass(tinyusb_msc_storage_handle_s *h, bool bypass);
+static void _io_init(tinyusb_msc_storage_handle_s *h);
+static void _io_deinit(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _io_submit(tinyusb_msc_storage_handle_s *h, msc_io_op_t op, uint32_t lba, uint32_t count, void *buf);
+static bool _io_older(const msc_io_req_t *a, const msc_io_req_t *b);
+static uint32_t _io_next(msc_io_t *io, msc_io_req_t **batch);
+static msc_io_req_t *_io_scan(msc_io_t *io, tinyusb_msc_io_class_t cls);
+static msc_io_req_t *_io_blocker(msc_io_t *io, const msc_io_req_t *r);
+static void _io_dispatch(tinyusb_msc_storage_handle_s *h, msc_io_req_t **batch, uint32_t n);
+static esp_err_t _io_transfer(tinyusb_msc_storage_handle_s *h, msc_io_op_t op, uint32_t lba, uint32_t count, void *buf);
+static void _io_task(void *arg);
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+static void _latency_account(const tinyusb_msc_trace_entry_t *e);
+static unsigned _latency_read_begin(void);
+static bool _latency_read_retry(unsigned seq);
+#endif
+static esp_err_t _bench_io(msc_bench_t *b, bool write, uint64_t offset, uint32_t size);
+static esp_err_t _bench_test(msc_bench_t *b, tinyusb_msc_bench_kind_t kind, uint32_t block, uint32_t duration_ms,
+                             tinyusb_msc_bench_result_t *result);
+static esp_err_t _bench_file_open(msc_bench_t *b, uint32_t file_size, uint32_t block_max);
+static uint32_t _bench_percentile(const uint32_t *sorted, uint32_t count, uint32_t percent);
+static int _bench_compare(const void *a, const void *b);
+static esp_err_t _bench_meta_run(tinyusb_msc_storage_handle_s *h, uint32_t files, tinyusb_msc_meta_bench_result_t *r);
+static DSTATUS _app_disk_status(BYTE pdrv);
+static DRESULT _app_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
+static DRESULT _app_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+static DRESULT _app_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff);
+static esp_err_t _app_write(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count, const void *src);
+static DRESULT _disk_ioctl_geometry(tinyusb_msc_storage_handle_s *h, BYTE cmd, void *buff);
+static esp_err_t _view_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, size_t size, void *dest);
+static DSTATUS _view_disk_status(BYTE pdrv);
+static DRESULT _view_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
+static DRESULT _view_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+static DRESULT _view_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff);
+static esp_err_t _format(tinyusb_msc_storage_handle_s *h, BYTE pdrv, tinyusb_msc_format_info_t *info);
+#if !FF_FS_EXFAT
+static bool _volume_is_exfat(tinyusb_msc_storage_handle_s *h);
+#endif
+static uint32_t _format_erase_unit(tinyusb_msc_storage_handle_s *h);
+static esp_err_t _format_partition(tinyusb_msc_storage_handle_s *h, const msc_format_t *f, BYTE fat_type, uint8_t *buf);
+static void _put_le32(uint8_t *p, uint32_t v);
+static DSTATUS _format_disk_status(BYTE pdrv);
+static DRESULT _format_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count);
+static DRESULT _format_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count);
+static DRESULT _format_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff);
+
+/* FatFs driver of the application mounts, see _app_disk_ioctl() */
+static const ff_diskio_impl_t s_app_impl = {
+    .init = &_app_disk_status,
+    .status = &_app_disk_status,
+    .read = &_app_disk_read,
+    .write = &_app_disk_write,
+    .ioctl = &_app_disk_ioctl,
+};
+
+/* FatFs driver of the read-only views */
+static const ff_diskio_impl_t s_view_impl = {
+    .init = &_view_disk_status,
+    .status = &_view_disk_status,
+    .read = &_view_disk_read,
+    .write = &_view_disk_write,
+    .ioctl = &_view_disk_ioctl,
+};
 
-static esp_err_t _mount_spiflash(BYTE pdrv)
+/* FatFs driver of the volumes being formatted */
+static const ff_diskio_impl_t s_format_impl = {
+    .init = &_format_disk_status,
+    .status = &_format_disk_status,
+    .read = &_format_disk_read,
+    .write = &_format_disk_write,
+    .ioctl = &_format_disk_ioctl,
+};
+
+static esp_err_t _mount_spiflash(tinyusb_msc_storage_handle_s *h, BYTE pdrv)
 {
-    return ff_diskio_register_wl_partition(pdrv, s_storage_handle->wl_handle);
+    return ff_diskio_register_wl_partition(pdrv, h->wl_handle);
 }
 
-static esp_err_t _unmount_spiflash(void)
+static esp_err_t _unmount_spiflash(tinyusb_msc_storage_handle_s *h)
 {
     BYTE pdrv;
-    pdrv = ff_diskio_get_pdrv_wl(s_storage_handle->wl_handle);
+    pdrv = ff_diskio_get_pdrv_wl(h->wl_handle);
     if (pdrv == 0xff) {
         ESP_LOGE(TAG, "Invalid state");
         return ESP_ERR_INVALID_STATE;
     }
-    ff_diskio_clear_pdrv_wl(s_storage_handle->wl_handle);
+    ff_diskio_clear_pdrv_wl(h->wl_handle);
 
     char drv[3] = {(char)('0' + pdrv), ':', 0};
     f_mount(0, drv, 0);
@@ -69,27 +477,28 @@ static esp_err_t _unmount_spiflash(void)
     return ESP_OK;
 }
 
-static uint32_t _get_sector_count_spiflash(void)
+static uint32_t _get_sector_count_spiflash(tinyusb_msc_storage_handle_s *h)
 {
     uint32_t result = 0;
-    assert(s_storage_handle->wl_handle != WL_INVALID_HANDLE);
-    size_t size = wl_sector_size(s_storage_handle->wl_handle);
+    assert(h->wl_handle != WL_INVALID_HANDLE);
+    size_t size = wl_sector_size(h->wl_handle);
     if (size == 0) {
         ESP_LOGW(TAG, "WL Sector size is zero !!!");
         result = 0;
     } else {
-        result = (uint32_t)(wl_size(s_storage_handle->wl_handle) / size);
+        result = (uint32_t)(wl_size(h->wl_handle) / size);
     }
     return result;
 }
 
-static uint32_t _get_sector_size_spiflash(void)
+static uint32_t _get_sector_size_spiflash(tinyusb_msc_storage_handle_s *h)
 {
-    assert(s_storage_handle->wl_handle != WL_INVALID_HANDLE);
-    return (uint32_t)wl_sector_size(s_storage_handle->wl_handle);
+    assert(h->wl_handle != WL_INVALID_HANDLE);
+    return (uint32_t)wl_sector_size(h->wl_handle);
 }
 
-static esp_err_t _read_sector_spiflash(size_t sector_size,
+static esp_err_t _read_sector_spiflash(tinyusb_msc_storage_handle_s *h,
+                                       size_t sector_size,
                                        uint32_t lba,
                                        uint32_t offset,
                                        size_t size,
@@ -99,35 +508,103 @@ static esp_err_t _read_sector_spiflash(size_t sector_size,
     size_t addr = 0; // Address of the data to be read, relative to the beginning of the partition.
     ESP_RETURN_ON_FALSE(!__builtin_umul_overflow(lba, sector_size, &temp), ESP_ERR_INVALID_SIZE, TAG, "overflow lba %lu sector_size %u", lba, sector_size);
     ESP_RETURN_ON_FALSE(!__builtin_uadd_overflow(temp, offset, &addr), ESP_ERR_INVALID_SIZE, TAG, "overflow addr %u offset %lu", temp, offset);
-    return wl_read(s_storage_handle->wl_handle, addr, dest, size);
+    esp_err_t err = wl_read(h->wl_handle, addr, dest, size);
+    if (err == ESP_OK) {
+        _wl_combine_overlay(h, addr, size, dest);
+    }
+    return err;
 }
 
-static esp_err_t _write_sector_spiflash(size_t sector_size,
+static esp_err_t _write_sector_spiflash(tinyusb_msc_storage_handle_s *h,
+                                        size_t sector_size,
                                         size_t addr,
                                         uint32_t lba,
                                         uint32_t offset,
                                         size_t size,
                                         const void *src)
 {
-    ESP_RETURN_ON_ERROR(wl_erase_range(s_storage_handle->wl_handle, addr, size),
+    if (h->wc.enabled) {
+        return _wl_combine_write(h, addr, size, src);
+    }
+    ESP_RETURN_ON_ERROR(_wl_erase(h, addr, size),
                         TAG, "Failed to erase");
-    return wl_write(s_storage_handle->wl_handle, addr, src, size);
+    return wl_write(h->wl_handle, addr, src, size);
+}
+
+/**
+ * Erases the flash sectors lying entirely in the range, ahead of the writes that will reuse them.
+ * Gathered sectors in the range are dropped rather than written.
+ */
+static esp_err_t _trim_spiflash(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    const size_t sector_size = (h->sector_size)(h);
+    const size_t start = ((size_t)lba * sector_size + MSC_WL_ERASE_SIZE - 1) / MSC_WL_ERASE_SIZE * MSC_WL_ERASE_SIZE;
+    const size_t end = ((size_t)lba + count) * sector_size / MSC_WL_ERASE_SIZE * MSC_WL_ERASE_SIZE;
+
+    for (size_t addr = start; addr < end; addr += MSC_WL_ERASE_SIZE) {
+        const size_t n = addr / MSC_WL_ERASE_SIZE;
+        _wl_combine_discard(h, addr, MSC_WL_ERASE_SIZE);
+        if (h->wl_erased[n / 32] & (1UL << (n % 32))) {
+            continue;
+        }
+        ESP_RETURN_ON_ERROR(wl_erase_range(h->wl_handle, addr, MSC_WL_ERASE_SIZE), TAG, "Failed to erase");
+        h->wl_erased[n / 32] |= 1UL << (n % 32);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Erases ahead of a write, unless a trim left every flash sector of the range erased. The sectors are
+ * no longer known to be erased afterwards.
+ */
+static esp_err_t _wl_erase(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size)
+{
+    bool erased = (h->wl_erased != NULL);
+
+    for (size_t n = addr / MSC_WL_ERASE_SIZE; erased && n * MSC_WL_ERASE_SIZE < addr + size; n++) {
+        erased = (h->wl_erased[n / 32] & (1UL << (n % 32))) != 0;
+    }
+    if (h->wl_erased) {
+        for (size_t n = addr / MSC_WL_ERASE_SIZE; n * MSC_WL_ERASE_SIZE < addr + size; n++) {
+            h->wl_erased[n / 32] &= ~(1UL << (n % 32));
+        }
+    }
+    return erased ? ESP_OK : wl_erase_range(h->wl_handle, addr, size);
+}
+
+static esp_err_t _flush_spiflash(tinyusb_msc_storage_handle_s *h)
+{
+    msc_wl_combine_t *wc = &h->wc;
+    esp_err_t ret = ESP_OK;
+
+    if (!wc->enabled) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(wc->lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < wc->blocks; i++) {
+        if (wc->block[i].addr != SIZE_MAX) {
+            esp_err_t err = _wl_combine_flush_block(h, &wc->block[i]);
+            ret = (ret == ESP_OK) ? err : ret;
+        }
+    }
+    xSemaphoreGive(wc->lock);
+    return ret;
 }
 
 #if SOC_SDMMC_HOST_SUPPORTED
-static esp_err_t _mount_sdmmc(BYTE pdrv)
+static esp_err_t _mount_sdmmc(tinyusb_msc_storage_handle_s *h, BYTE pdrv)
 {
     printf("usb mount\r\n");
-    ff_diskio_register_sdmmc(pdrv, s_storage_handle->card);
+    ff_diskio_register_sdmmc(pdrv, h->card);
     ff_sdmmc_set_disk_status_check(pdrv, false);
     return ESP_OK;
 }
 
-static esp_err_t _unmount_sdmmc(void)
+static esp_err_t _unmount_sdmmc(tinyusb_msc_storage_handle_s *h)
 {
     printf("usb unmount\r\n");
     BYTE pdrv;
-    pdrv = ff_diskio_get_pdrv_card(s_storage_handle->card);
+    pdrv = ff_diskio_get_pdrv_card(h->card);
     if (pdrv == 0xff) {
         ESP_LOGE(TAG, "Invalid state");
         return ESP_ERR_INVALID_STATE;
@@ -140,59 +617,167 @@ static esp_err_t _unmount_sdmmc(void)
     return ESP_OK;
 }
 
-static uint32_t _get_sector_count_sdmmc(void)
+static uint32_t _get_sector_count_sdmmc(tinyusb_msc_storage_handle_s *h)
 {
-    assert(s_storage_handle->card);
-    return (uint32_t)s_storage_handle->card->csd.capacity;
+    assert(h->card);
+    return (uint32_t)h->card->csd.capacity;
 }
 
-static uint32_t _get_sector_size_sdmmc(void)
+static uint32_t _get_sector_size_sdmmc(tinyusb_msc_storage_handle_s *h)
 {
-    assert(s_storage_handle->card);
-    return (uint32_t)s_storage_handle->card->csd.sector_size;
+    assert(h->card);
+    // a card registered before it was initialized, see tinyusb_msc_storage_set_present()
+    return h->card->csd.sector_size ? (uint32_t)h->card->csd.sector_size : 512;
 }
 
-static esp_err_t _read_sector_sdmmc(size_t sector_size,
+static esp_err_t _read_sector_sdmmc(tinyusb_msc_storage_handle_s *h,
+                                    size_t sector_size,
                                     uint32_t lba,
                                     uint32_t offset,
                                     size_t size,
                                     void *dest)
 {
-    return sdmmc_read_sectors(s_storage_handle->card, dest, lba, size / sector_size);
+    if (h->io.enabled) {
+        return _io_submit(h, MSC_IO_READ, lba, size / sector_size, dest);
+    }
+    return sdmmc_read_sectors(h->card, dest, lba, size / sector_size);
 }
 
-static esp_err_t _write_sector_sdmmc(size_t sector_size,
+static esp_err_t _write_sector_sdmmc(tinyusb_msc_storage_handle_s *h,
+                                     size_t sector_size,
                                      size_t addr,
                                      uint32_t lba,
                                      uint32_t offset,
                                      size_t size,
                                      const void *src)
 {
-    return sdmmc_write_sectors(s_storage_handle->card, src, lba, size / sector_size);
+    if (h->io.enabled) {
+        return _io_submit(h, MSC_IO_WRITE, lba, size / sector_size, (void *)src);
+    }
+    return sdmmc_write_sectors(h->card, src, lba, size / sector_size);
+}
+
+static esp_err_t _erase_sdmmc(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    // either way the card's flash translation layer learns the sectors are free
+    const sdmmc_erase_arg_t arg = (sdmmc_can_discard(h->card) == ESP_OK) ? SDMMC_DISCARD_ARG : SDMMC_ERASE_ARG;
+    return sdmmc_erase_sectors(h->card, lba, count, arg);
+}
+
+static esp_err_t _trim_sdmmc(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    if (h->io.enabled) {
+        return _io_submit(h, MSC_IO_ERASE, lba, count, NULL);
+    }
+    return _erase_sdmmc(h, lba, count);
 }
 #endif
 
-static esp_err_t msc_storage_read_sector(uint32_t lba,
+static esp_err_t _mount_bdev(tinyusb_msc_storage_handle_s *h, BYTE pdrv)
+{
+    s_app[pdrv] = h;
+    ff_diskio_register(pdrv, &s_app_impl);
+    return ESP_OK;
+}
+
+static esp_err_t _unmount_bdev(tinyusb_msc_storage_handle_s *h)
+{
+    BYTE pdrv = 0;
+    while (pdrv < FF_VOLUMES && s_app[pdrv] != h) {
+        pdrv++;
+    }
+    if (pdrv == FF_VOLUMES) {
+        ESP_LOGE(TAG, "Invalid state");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    char drv[3] = {(char)('0' + pdrv), ':', 0};
+    f_mount(0, drv, 0);
+    ff_diskio_unregister(pdrv);
+
+    return ESP_OK;
+}
+
+static uint32_t _get_sector_count_bdev(tinyusb_msc_storage_handle_s *h)
+{
+    return h->bdev.sector_count;
+}
+
+static uint32_t _get_sector_size_bdev(tinyusb_msc_storage_handle_s *h)
+{
+    return h->bdev.sector_size;
+}
+
+static esp_err_t _read_sector_bdev(tinyusb_msc_storage_handle_s *h,
+                                   size_t sector_size,
+                                   uint32_t lba,
+                                   uint32_t offset,
+                                   size_t size,
+                                   void *dest)
+{
+    if (h->io.enabled) {
+        return _io_submit(h, MSC_IO_READ, lba, size / sector_size, dest);
+    }
+    return h->bdev.ops->read(h->bdev.ctx, lba, size / sector_size, dest);
+}
+
+static esp_err_t _write_sector_bdev(tinyusb_msc_storage_handle_s *h,
+                                    size_t sector_size,
+                                    size_t addr,
+                                    uint32_t lba,
+                                    uint32_t offset,
+                                    size_t size,
+                                    const void *src)
+{
+    if (h->io.enabled) {
+        return _io_submit(h, MSC_IO_WRITE, lba, size / sector_size, (void *)src);
+    }
+    return h->bdev.ops->write(h->bdev.ctx, lba, size / sector_size, src);
+}
+
+static esp_err_t _flush_bdev(tinyusb_msc_storage_handle_s *h)
+{
+    return h->bdev.ops->flush(h->bdev.ctx);
+}
+
+static esp_err_t _trim_bdev(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    if (h->io.enabled) {
+        return _io_submit(h, MSC_IO_ERASE, lba, count, NULL);
+    }
+    return h->bdev.ops->trim(h->bdev.ctx, lba, count);
+}
+
+static void _release_bdev(tinyusb_msc_storage_handle_s *h)
+{
+    if (h->bdev.ops->deinit) {
+        h->bdev.ops->deinit(h->bdev.ctx);
+    }
+}
+
+static esp_err_t msc_storage_read_sector(tinyusb_msc_storage_handle_s *h,
+        uint32_t lba,
         uint32_t offset,
         size_t size,
         void *dest)
 {
-    assert(s_storage_handle);
-    size_t sector_size = tinyusb_msc_storage_get_sector_size();
-    return (s_storage_handle->read)(sector_size, lba, offset, size, dest);
+    assert(h);
+    size_t sector_size = (h->sector_size)(h);
+    return (h->read)(h, sector_size, lba, offset, size, dest);
 }
 
-static esp_err_t msc_storage_write_sector(uint32_t lba,
+static esp_err_t msc_storage_write_sector(tinyusb_msc_storage_handle_s *h,
+        uint32_t lba,
         uint32_t offset,
         size_t size,
         const void *src)
 {
-    assert(s_storage_handle);
-    if (s_storage_handle->is_fat_mounted) {
+    assert(h);
+    if (h->is_fat_mounted) {
         ESP_LOGE(TAG, "can't write, FAT mounted");
         return ESP_ERR_INVALID_STATE;
     }
-    size_t sector_size = tinyusb_msc_storage_get_sector_size();
+    size_t sector_size = (h->sector_size)(h);
     size_t temp = 0;
     size_t addr = 0; // Address of the data to be read, relative to the beginning of the partition.
     ESP_RETURN_ON_FALSE(!__builtin_umul_overflow(lba, sector_size, &temp), ESP_ERR_INVALID_SIZE, TAG, "overflow lba %lu sector_size %u", lba, sector_size);
@@ -202,76 +787,98 @@ static esp_err_t msc_storage_write_sector(uint32_t lba,
         ESP_LOGE(TAG, "Invalid Argument lba(%lu) offset(%lu) size(%u) sector_size(%u)", lba, offset, size, sector_size);
         return ESP_ERR_INVALID_ARG;
     }
-    return (s_storage_handle->write)(sector_size, addr, lba, offset, size, src);
+    return (h->write)(h, sector_size, addr, lba, offset, size, src);
 }
 
-static esp_err_t _mount(char *drv, FATFS *fs)
+static esp_err_t _mount(tinyusb_msc_storage_handle_s *h, BYTE pdrv, char *drv, FATFS *fs)
 {
-    void *workbuf = NULL;
-    const size_t workbuf_size = 4096;
     esp_err_t ret;
     // Try to mount partition
     FRESULT fresult = f_mount(fs, drv, 1);
     if (fresult != FR_OK) {
         ESP_LOGW(TAG, "f_mount failed (%d)", fresult);
         if (!((fresult == FR_NO_FILESYSTEM || fresult == FR_INT_ERR))) {
-            ret = ESP_FAIL;
-            goto fail;
-        }
-        workbuf = ff_memalloc(workbuf_size);
-        if (workbuf == NULL) {
-            ret = ESP_ERR_NO_MEM;
-            goto fail;
-        }
-        size_t alloc_unit_size = esp_vfs_fat_get_allocation_unit_size(
-                                     CONFIG_WL_SECTOR_SIZE,
-                                     4096);
-        ESP_LOGW(TAG, "formatting card, allocation unit size=%d", alloc_unit_size);
-        const MKFS_PARM opt = {(BYTE)FM_FAT, 0, 0, 0, alloc_unit_size};
-        fresult = f_mkfs("", &opt, workbuf, workbuf_size); // Use default volume
-        if (fresult != FR_OK) {
-            ret = ESP_FAIL;
-            ESP_LOGE(TAG, "f_mkfs failed (%d)", fresult);
-            goto fail;
+            return ESP_FAIL;
+        }
+#if !FF_FS_EXFAT
+        // SDXC cards come with exFAT, which this FatFs cannot read: the card is left as it is
+        ESP_RETURN_ON_FALSE(!_volume_is_exfat(h), ESP_ERR_NOT_SUPPORTED, TAG,
+                            "LUN %u holds an exFAT volume, FatFs is built without exFAT", h->lun);
+#endif
+        ESP_LOGW(TAG, "formatting LUN %u", h->lun);
+        // the drive is lent to the formatting, then given back to the backend
+        ret = _format(h, pdrv, NULL);
+        if (ret == ESP_OK) {
+            ret = _app_register(h, pdrv);
+        }
+        if (ret != ESP_OK) {
+            return ret;
         }
-        free(workbuf);
-        workbuf = NULL;
         fresult = f_mount(fs, drv, 0);
         if (fresult != FR_OK) {
-            ret = ESP_FAIL;
             ESP_LOGE(TAG, "f_mount failed after formatting (%d)", fresult);
-            goto fail;
+            return ESP_FAIL;
         }
     }
     return ESP_OK;
-fail:
-    if (workbuf) {
-        free(workbuf);
+}
+
+esp_err_t tinyusb_msc_storage_mount(const char *base_path)
+{
+    return tinyusb_msc_storage_mount_lun(0, base_path);
+}
+
+esp_err_t tinyusb_msc_storage_mount_lun(uint8_t lun, const char *base_path)
+{
+    return tinyusb_msc_storage_acquire(lun, TINYUSB_MSC_USER_DEFAULT, base_path);
+}
+
+esp_err_t tinyusb_msc_storage_acquire(uint8_t lun, uint8_t user, const char *base_path)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+    ESP_RETURN_ON_FALSE(user < TINYUSB_MSC_USERS_MAX, ESP_ERR_INVALID_ARG, TAG, "user %u out of range", user);
+
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    esp_err_t ret = _owner_app(h, base_path);
+    if (ret == ESP_OK) {
+        h->app_users |= 1UL << user;
     }
+    xSemaphoreGiveRecursive(h->owner_lock);
     return ret;
 }
 
-esp_err_t tinyusb_msc_storage_mount(const char *base_path)
+static esp_err_t _fat_mount(tinyusb_msc_storage_handle_s *h, const char *base_path)
 {
     esp_err_t ret = ESP_OK;
-    assert(s_storage_handle);
+    uint8_t lun = h->lun;
 
-    if (s_storage_handle->is_fat_mounted) {
+    if (h->is_fat_mounted) {
         return ESP_OK;
     }
+    // two FatFs objects on one volume would not see each other's changes
+    ESP_RETURN_ON_FALSE(!h->view_fs, ESP_ERR_INVALID_STATE, TAG, "LUN %u has a read-only view mounted", lun);
+    // the sectors are left in the cache on failure, FatFs must not see the volume without them
+    ESP_RETURN_ON_ERROR(_storage_flush(h), TAG, "Failed to flush the write-back cache");
 
-    tusb_msc_callback_t cb = s_storage_handle->callback_premount_changed;
+    tusb_msc_callback_t cb = h->callback_premount_changed;
     if (cb) {
         tinyusb_msc_event_t event = {
             .type = TINYUSB_MSC_EVENT_PREMOUNT_CHANGED,
+            .lun = h->lun,
             .mount_changed_data = {
-                .is_mounted = s_storage_handle->is_fat_mounted
+                .is_mounted = h->is_fat_mounted
             }
         };
         cb(&event);
     }
 
     if (!base_path) {
+        base_path = h->base_path;
+    }
+    if (!base_path) {
+        // the default path belongs to the first LUN
+        ESP_RETURN_ON_FALSE(lun == 0, ESP_ERR_INVALID_ARG, TAG, "LUN %u needs a mount path", lun);
         base_path = CONFIG_TINYUSB_MSC_MOUNT_PATH;
     }
 
@@ -281,28 +888,36 @@ esp_err_t tinyusb_msc_storage_mount(const char *base_path)
                         "The maximum count of volumes is already mounted");
     char drv[3] = {(char)('0' + pdrv), ':', 0};
 
-    ESP_GOTO_ON_ERROR((s_storage_handle->mount)(pdrv), fail, TAG, "Failed pdrv=%d", pdrv);
+    ESP_GOTO_ON_ERROR(_app_register(h, pdrv), fail, TAG, "Failed pdrv=%d", pdrv);
 
+    /* `_fat_unmount` always unregisters the path: a path still registered belongs to another
+       volume, and `fs` is only returned for a new registration */
     FATFS *fs = NULL;
-    ret = esp_vfs_fat_register(base_path, drv, s_storage_handle->max_files, &fs);
+    ret = esp_vfs_fat_register(base_path, drv, h->max_files, &fs);
     if (ret == ESP_ERR_INVALID_STATE) {
-        ESP_LOGD(TAG, "it's okay, already registered with VFS");
+        ESP_LOGE(TAG, "LUN %u: %s is in use by another volume", lun, base_path);
+        goto fail;
     } else if (ret != ESP_OK) {
         ESP_LOGE(TAG, "esp_vfs_fat_register failed (0x%x)", ret);
         goto fail;
     }
 
-    ESP_GOTO_ON_ERROR(_mount(drv, fs), fail, TAG, "Failed _mount");
+    _meta_cache_attach(h, fs->win);
+    ESP_GOTO_ON_ERROR(_mount(h, pdrv, drv, fs), fail, TAG, "Failed _mount");
+    _free_space_mounted(h, fs);
+    _readahead_invalidate(h, 0, 0);
 
-    s_storage_handle->is_fat_mounted = true;
-    s_storage_handle->base_path = base_path;
+    h->is_fat_mounted = true;
+    h->base_path = base_path;
+    h->app_pdrv = pdrv;
 
-    cb = s_storage_handle->callback_mount_changed;
+    cb = h->callback_mount_changed;
     if (cb) {
         tinyusb_msc_event_t event = {
             .type = TINYUSB_MSC_EVENT_MOUNT_CHANGED,
+            .lun = h->lun,
             .mount_changed_data = {
-                .is_mounted = s_storage_handle->is_fat_mounted
+                .is_mounted = h->is_fat_mounted
             }
         };
         cb(&event);
@@ -315,46 +930,95 @@ fail:
         esp_vfs_fat_unregister_path(base_path);
     }
     ff_diskio_unregister(pdrv);
-    s_storage_handle->is_fat_mounted = false;
+    s_app[pdrv] = NULL;
+    _meta_cache_detach(h, true);
+    h->is_fat_mounted = false;
     ESP_LOGW(TAG, "Failed to mount storage (0x%x)", ret);
     return ret;
 }
 
+/**
+ * Connects the FatFs drive to the backend of the LUN, or to the application driver in front of it.
+ */
+static esp_err_t _app_register(tinyusb_msc_storage_handle_s *h, BYTE pdrv)
+{
+    ESP_RETURN_ON_ERROR((h->mount)(h, pdrv), TAG, "Failed pdrv=%d", pdrv);
+    s_app[pdrv] = h;
+    ff_diskio_register(pdrv, &s_app_impl);
+    return ESP_OK;
+}
+
 esp_err_t tinyusb_msc_storage_unmount(void)
 {
-    if (!s_storage_handle) {
-        return ESP_FAIL;
+    return tinyusb_msc_storage_unmount_lun(0);
+}
+
+esp_err_t tinyusb_msc_storage_unmount_lun(uint8_t lun)
+{
+    return tinyusb_msc_storage_release(lun, TINYUSB_MSC_USER_DEFAULT);
+}
+
+esp_err_t tinyusb_msc_storage_release(uint8_t lun, uint8_t user)
+{
+    esp_err_t err = ESP_OK;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+    ESP_RETURN_ON_FALSE(user < TINYUSB_MSC_USERS_MAX, ESP_ERR_INVALID_ARG, TAG, "user %u out of range", user);
+
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    h->app_users &= ~(1UL << user);
+    // the files of the other users stay open, the volume goes to the host after the last one
+    if (h->app_users == 0) {
+        err = _owner_release(h);
+    }
+    if (h->absent) {
+        xSemaphoreGive(h->users_gone);
     }
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return err;
+}
 
-    if (!s_storage_handle->is_fat_mounted) {
+static esp_err_t _fat_unmount(tinyusb_msc_storage_handle_s *h)
+{
+    if (!h->is_fat_mounted) {
         return ESP_OK;
     }
 
-    tusb_msc_callback_t cb = s_storage_handle->callback_premount_changed;
+    tusb_msc_callback_t cb = h->callback_premount_changed;
     if (cb) {
         tinyusb_msc_event_t event = {
             .type = TINYUSB_MSC_EVENT_PREMOUNT_CHANGED,
+            .lun = h->lun,
             .mount_changed_data = {
-                .is_mounted = s_storage_handle->is_fat_mounted
+                .is_mounted = h->is_fat_mounted
             }
         };
         cb(&event);
     }
 
-    esp_err_t err = (s_storage_handle->unmount)();
+    // the host may rewrite any sector once it has the volume, a removed medium takes nothing more
+    ESP_RETURN_ON_ERROR(_meta_cache_detach(h, h->absent), TAG, "Failed to write the metadata cache");
+    _free_space_unmounting(h);
+    esp_err_t err = (h->unmount)(h);
     if (err) {
         return err;
     }
-    err = esp_vfs_fat_unregister_path(s_storage_handle->base_path);
-    s_storage_handle->base_path = NULL;
-    s_storage_handle->is_fat_mounted = false;
+    for (BYTE pdrv = 0; pdrv < FF_VOLUMES; pdrv++) {
+        if (s_app[pdrv] == h) {
+            s_app[pdrv] = NULL;
+        }
+    }
+    // `base_path` is kept, the next mount without a path goes back to it
+    err = esp_vfs_fat_unregister_path(h->base_path);
+    h->is_fat_mounted = false;
 
-    cb = s_storage_handle->callback_mount_changed;
+    cb = h->callback_mount_changed;
     if (cb) {
         tinyusb_msc_event_t event = {
             .type = TINYUSB_MSC_EVENT_MOUNT_CHANGED,
+            .lun = h->lun,
             .mount_changed_data = {
-                .is_mounted = s_storage_handle->is_fat_mounted
+                .is_mounted = h->is_fat_mounted
             }
         };
         cb(&event);
@@ -365,105 +1029,189 @@ esp_err_t tinyusb_msc_storage_unmount(void)
 
 uint32_t tinyusb_msc_storage_get_sector_count(void)
 {
-    assert(s_storage_handle);
-    return (s_storage_handle->sector_count)();
+    tinyusb_msc_storage_handle_s *h = _storage_get(0);
+    assert(h);
+    return (h->sector_count)(h);
 }
 
 uint32_t tinyusb_msc_storage_get_sector_size(void)
 {
-    assert(s_storage_handle);
-    return (s_storage_handle->sector_size)();
+    tinyusb_msc_storage_handle_s *h = _storage_get(0);
+    assert(h);
+    return (h->sector_size)(h);
 }
 
 esp_err_t tinyusb_msc_storage_init_spiflash(const tinyusb_msc_spiflash_config_t *config)
 {
-    assert(!s_storage_handle);
-    s_storage_handle = (tinyusb_msc_storage_handle_s *)malloc(sizeof(tinyusb_msc_storage_handle_s));
-    ESP_RETURN_ON_FALSE(s_storage_handle, ESP_ERR_NO_MEM, TAG, "could not allocate new handle for storage");
-    s_storage_handle->mount = &_mount_spiflash;
-    s_storage_handle->unmount = &_unmount_spiflash;
-    s_storage_handle->sector_count = &_get_sector_count_spiflash;
-    s_storage_handle->sector_size = &_get_sector_size_spiflash;
-    s_storage_handle->read = &_read_sector_spiflash;
-    s_storage_handle->write = &_write_sector_spiflash;
-    s_storage_handle->is_fat_mounted = false;
-    s_storage_handle->base_path = NULL;
-    s_storage_handle->wl_handle = config->wl_handle;
+    ESP_RETURN_ON_FALSE(s_lun_count < TINYUSB_MSC_LUN_MAX, ESP_ERR_INVALID_STATE, TAG, "all LUNs are in use");
+    tinyusb_msc_storage_handle_s *h = (tinyusb_msc_storage_handle_s *)calloc(1, sizeof(tinyusb_msc_storage_handle_s));
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_NO_MEM, TAG, "could not allocate new handle for storage");
+    h->product = "Flash Storage";
+    h->mount = &_mount_spiflash;
+    h->unmount = &_unmount_spiflash;
+    h->sector_count = &_get_sector_count_spiflash;
+    h->sector_size = &_get_sector_size_spiflash;
+    h->read = &_read_sector_spiflash;
+    h->write = &_write_sector_spiflash;
+    h->flush = &_flush_spiflash;
+#if CONFIG_TINYUSB_MSC_UNMAP
+    h->wl_erased = calloc((wl_size(config->wl_handle) / MSC_WL_ERASE_SIZE + 31) / 32, sizeof(uint32_t));
+    if (h->wl_erased) {
+        h->trim = &_trim_spiflash;
+        h->unmap_granularity = MSC_WL_ERASE_SIZE / wl_sector_size(config->wl_handle);
+        h->unmap_max = MSC_WL_UNMAP_SECTORS_MAX * h->unmap_granularity;
+    }
+#endif
+    h->is_fat_mounted = false;
+    h->owner = MSC_OWNER_HOST;
+    h->base_path = NULL;
+    h->wl_handle = config->wl_handle;
     // In case the user does not set mount_config.max_files
     // and for backward compatibility with versions <1.4.2
     // max_files is set to 2
     const int max_files = config->mount_config.max_files;
-    s_storage_handle->max_files = max_files > 0 ? max_files : 2;
-
-    /* Callbacks setting up*/
-    if (config->callback_mount_changed) {
-        tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED, config->callback_mount_changed);
-    } else {
-        tinyusb_msc_unregister_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED);
-    }
-    if (config->callback_premount_changed) {
-        tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_PREMOUNT_CHANGED, config->callback_premount_changed);
-    } else {
-        tinyusb_msc_unregister_callback(TINYUSB_MSC_EVENT_PREMOUNT_CHANGED);
+    h->max_files = max_files > 0 ? max_files : 2;
+    h->host_write_count = 0;
+    h->callback_mount_changed = config->callback_mount_changed;
+    h->callback_premount_changed = config->callback_premount_changed;
+    esp_err_t ret = _storage_add(h);
+    if (ret != ESP_OK) {
+        free(h->wl_erased);
+        free(h);
     }
-
-    return ESP_OK;
+    return ret;
 }
 
 #if SOC_SDMMC_HOST_SUPPORTED
 esp_err_t tinyusb_msc_storage_init_sdmmc(const tinyusb_msc_sdmmc_config_t *config)
 {
-    assert(!s_storage_handle);
-    s_storage_handle = (tinyusb_msc_storage_handle_s *)malloc(sizeof(tinyusb_msc_storage_handle_s));
-    ESP_RETURN_ON_FALSE(s_storage_handle, ESP_ERR_NO_MEM, TAG, "could not allocate new handle for storage");
-    s_storage_handle->mount = &_mount_sdmmc;
-    s_storage_handle->unmount = &_unmount_sdmmc;
-    s_storage_handle->sector_count = &_get_sector_count_sdmmc;
-    s_storage_handle->sector_size = &_get_sector_size_sdmmc;
-    s_storage_handle->read = &_read_sector_sdmmc;
-    s_storage_handle->write = &_write_sector_sdmmc;
-    s_storage_handle->is_fat_mounted = false;
-    s_storage_handle->base_path = NULL;
-    s_storage_handle->card = config->card;
+    ESP_RETURN_ON_FALSE(s_lun_count < TINYUSB_MSC_LUN_MAX, ESP_ERR_INVALID_STATE, TAG, "all LUNs are in use");
+    tinyusb_msc_storage_handle_s *h = (tinyusb_msc_storage_handle_s *)calloc(1, sizeof(tinyusb_msc_storage_handle_s));
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_NO_MEM, TAG, "could not allocate new handle for storage");
+    h->product = "SD Card";
+    h->mount = &_mount_sdmmc;
+    h->unmount = &_unmount_sdmmc;
+    h->sector_count = &_get_sector_count_sdmmc;
+    h->sector_size = &_get_sector_size_sdmmc;
+    h->read = &_read_sector_sdmmc;
+    h->write = &_write_sector_sdmmc;
+    h->queued = true;
+#if CONFIG_TINYUSB_MSC_UNMAP
+    h->trim = &_trim_sdmmc;
+    h->unmap_granularity = 1;
+    h->unmap_max = UINT32_MAX;
+#endif
+    h->is_fat_mounted = false;
+    h->owner = MSC_OWNER_HOST;
+    h->base_path = NULL;
+    h->card = config->card;
     // In case the user does not set mount_config.max_files
     // and for backward compatibility with versions <1.4.2
     // max_files is set to 2
     const int max_files = config->mount_config.max_files;
-    s_storage_handle->max_files = max_files > 0 ? max_files : 2;
+    h->max_files = max_files > 0 ? max_files : 2;
+    h->host_write_count = 0;
+    h->callback_mount_changed = config->callback_mount_changed;
+    h->callback_premount_changed = config->callback_premount_changed;
+    esp_err_t ret = _storage_add(h);
+    if (ret != ESP_OK) {
+        free(h);
+    }
+    return ret;
+}
+#endif
 
-    /* Callbacks setting up*/
-    if (config->callback_mount_changed) {
-        tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED, config->callback_mount_changed);
-    } else {
-        tinyusb_msc_unregister_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED);
+esp_err_t tinyusb_msc_storage_init_blockdev(const tinyusb_msc_blockdev_config_t *config)
+{
+    const tinyusb_msc_blockdev_ops_t *ops = config->ops;
+    ESP_RETURN_ON_FALSE(ops && ops->read && ops->write, ESP_ERR_INVALID_ARG, TAG, "read and write are required");
+    ESP_RETURN_ON_FALSE(config->sector_count && config->sector_size >= 512 && config->sector_size <= MSC_SECTOR_SIZE_MAX &&
+                        (config->sector_size & (config->sector_size - 1)) == 0,
+                        ESP_ERR_INVALID_ARG, TAG, "%lu sectors of %lu bytes not supported", config->sector_count, config->sector_size);
+    ESP_RETURN_ON_FALSE(s_lun_count < TINYUSB_MSC_LUN_MAX, ESP_ERR_INVALID_STATE, TAG, "all LUNs are in use");
+    tinyusb_msc_storage_handle_s *h = (tinyusb_msc_storage_handle_s *)calloc(1, sizeof(tinyusb_msc_storage_handle_s));
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_NO_MEM, TAG, "could not allocate new handle for storage");
+    h->product = config->product ? config->product : "Block Device";
+    h->mount = &_mount_bdev;
+    h->unmount = &_unmount_bdev;
+    h->sector_count = &_get_sector_count_bdev;
+    h->sector_size = &_get_sector_size_bdev;
+    h->read = &_read_sector_bdev;
+    h->write = &_write_sector_bdev;
+    h->flush = ops->flush ? &_flush_bdev : NULL;
+    h->release = &_release_bdev;
+#if CONFIG_TINYUSB_MSC_UNMAP
+    if (ops->trim) {
+        h->trim = &_trim_bdev;
+        h->unmap_granularity = 1;
+        h->unmap_max = UINT32_MAX;
     }
-    if (config->callback_premount_changed) {
-        tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_PREMOUNT_CHANGED, config->callback_premount_changed);
-    } else {
-        tinyusb_msc_unregister_callback(TINYUSB_MSC_EVENT_PREMOUNT_CHANGED);
+#endif
+    h->uncached = config->uncached;
+    h->queued = config->queued;
+    h->is_fat_mounted = false;
+    h->owner = MSC_OWNER_HOST;
+    h->base_path = NULL;
+    h->bdev.ops = ops;
+    h->bdev.ctx = config->ctx;
+    h->bdev.sector_count = config->sector_count;
+    h->bdev.sector_size = config->sector_size;
+    const int max_files = config->mount_config.max_files;
+    h->max_files = max_files > 0 ? max_files : 2;
+    h->host_write_count = 0;
+    h->callback_mount_changed = config->callback_mount_changed;
+    h->callback_premount_changed = config->callback_premount_changed;
+    esp_err_t ret = _storage_add(h);
+    if (ret != ESP_OK) {
+        free(h);
     }
-
-    return ESP_OK;
+    return ret;
 }
-#endif
 
 void tinyusb_msc_storage_deinit(void)
 {
-    assert(s_storage_handle);
-    free(s_storage_handle);
-    s_storage_handle = NULL;
+    assert(s_lun_count);
+    while (s_lun_count) {
+        tinyusb_msc_storage_handle_s *h = s_storage[--s_lun_count];
+        if (_storage_flush(h) != ESP_OK) {
+            ESP_LOGE(TAG, "LUN %u: %lu sectors written by the USB host are lost", h->lun, h->wb.used);
+        }
+        // the LUN is not registered anymore, the view is unmounted without the public API
+        _view_unmount(h);
+        _writeback_deinit(h);
+        _wl_combine_deinit(h);
+        _readahead_deinit(h);
+        _meta_cache_deinit(h);
+        _io_deinit(h);
+        vSemaphoreDelete(h->owner_lock);
+        vSemaphoreDelete(h->users_gone);
+        if (h->release) {
+            (h->release)(h);
+        }
+        free(h->wl_erased);
+        free(h);
+        s_storage[s_lun_count] = NULL;
+    }
+    _msc_buffers_free();
 }
 
 esp_err_t tinyusb_msc_register_callback(tinyusb_msc_event_type_t event_type,
                                         tusb_msc_callback_t callback)
 {
-    assert(s_storage_handle);
+    return tinyusb_msc_register_callback_lun(0, event_type, callback);
+}
+
+esp_err_t tinyusb_msc_register_callback_lun(uint8_t lun, tinyusb_msc_event_type_t event_type,
+        tusb_msc_callback_t callback)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
     switch (event_type) {
     case TINYUSB_MSC_EVENT_MOUNT_CHANGED:
-        s_storage_handle->callback_mount_changed = callback;
+        h->callback_mount_changed = callback;
         return ESP_OK;
     case TINYUSB_MSC_EVENT_PREMOUNT_CHANGED:
-        s_storage_handle->callback_premount_changed = callback;
+        h->callback_premount_changed = callback;
         return ESP_OK;
     default:
         ESP_LOGE(TAG, "Wrong event type");
@@ -473,13 +1221,19 @@ esp_err_t tinyusb_msc_register_callback(tinyusb_msc_event_type_t event_type,
 
 esp_err_t tinyusb_msc_unregister_callback(tinyusb_msc_event_type_t event_type)
 {
-    assert(s_storage_handle);
+    return tinyusb_msc_unregister_callback_lun(0, event_type);
+}
+
+esp_err_t tinyusb_msc_unregister_callback_lun(uint8_t lun, tinyusb_msc_event_type_t event_type)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
     switch (event_type) {
     case TINYUSB_MSC_EVENT_MOUNT_CHANGED:
-        s_storage_handle->callback_mount_changed = NULL;
+        h->callback_mount_changed = NULL;
         return ESP_OK;
     case TINYUSB_MSC_EVENT_PREMOUNT_CHANGED:
-        s_storage_handle->callback_premount_changed = NULL;
+        h->callback_premount_changed = NULL;
         return ESP_OK;
     default:
         ESP_LOGE(TAG, "Wrong event type");
@@ -487,89 +1241,3055 @@ esp_err_t tinyusb_msc_unregister_callback(tinyusb_msc_event_type_t event_type)
     }
 }
 
-bool tinyusb_msc_storage_in_use_by_usb_host(void)
+uint8_t tinyusb_msc_storage_get_lun_count(void)
 {
-    assert(s_storage_handle);
-    return !s_storage_handle->is_fat_mounted;
+    return s_lun_count;
 }
 
+bool tinyusb_msc_storage_in_use_by_usb_host(void)
+{
+    return tinyusb_msc_storage_in_use_by_usb_host_lun(0);
+}
 
-/* TinyUSB MSC callbacks
-   ********************************************************************* */
-
-/** SCSI ASC/ASCQ codes. **/
-/** User can add and use more codes as per the need of the application **/
-#define SCSI_CODE_ASC_MEDIUM_NOT_PRESENT 0x3A /** SCSI ASC code for 'MEDIUM NOT PRESENT' **/
-#define SCSI_CODE_ASC_INVALID_COMMAND_OPERATION_CODE 0x20 /** SCSI ASC code for 'INVALID COMMAND OPERATION CODE' **/
-#define SCSI_CODE_ASCQ 0x00
+bool tinyusb_msc_storage_in_use_by_usb_host_lun(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    assert(h);
+    return h->owner == MSC_OWNER_HOST;
+}
 
-// Invoked when received SCSI_CMD_INQUIRY
-// Application fill vendor id, product id and revision with string up to 8, 16, 4 characters respectively
-void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+esp_err_t tinyusb_msc_storage_set_present(uint8_t lun, bool present)
 {
-    (void) lun;
-    const char vid[] = "TinyUSB";
-    const char pid[] = "Flash Storage";
-    const char rev[] = "0.1";
+    esp_err_t err = ESP_OK;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
 
-    memcpy(vendor_id, vid, strlen(vid));
-    memcpy(product_id, pid, strlen(pid));
-    memcpy(product_rev, rev, strlen(rev));
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    if (h->absent == !present) {
+        xSemaphoreGiveRecursive(h->owner_lock);
+        return ESP_OK;
+    }
+    if (!present) {
+        h->absent = true;
+        // nothing is written to the medium anymore, what the caches hold belongs to the one removed
+        if (h->wb.enabled) {
+            xSemaphoreTake(h->wb.lock, portMAX_DELAY);
+            _writeback_discard(h, 0, UINT32_MAX);
+            h->wb.dirty = false;
+            xSemaphoreGive(h->wb.lock);
+        }
+        // FatFs on the medium fails from now on, the users let go of it once theirs did
+        _detach_wait(h);
+        if (h->is_fat_mounted) {
+            err = _fat_unmount(h);
+        }
+        h->owner = MSC_OWNER_HOST;
+        h->app_users = 0;
+        tinyusb_msc_storage_unmount_view(lun);
+        ESP_LOGI(TAG, "LUN %u: medium removed", lun);
+    } else {
+        h->absent = false;
+        h->unit_attention = true;
+        ESP_LOGI(TAG, "LUN %u: medium inserted, %lu sectors of %lu bytes", lun, (h->sector_count)(h), (h->sector_size)(h));
+    }
+    // the next medium may hold another file system
+    _readahead_invalidate(h, 0, 0);
+    h->fat_type = 0;
+    h->free_valid = false;
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return err;
 }
 
-// Invoked when received Test Unit Ready command.
-// return true allowing host to read/write this LUN e.g SD card inserted
-bool tud_msc_test_unit_ready_cb(uint8_t lun)
+esp_err_t tinyusb_msc_storage_format(uint8_t lun, tinyusb_msc_format_info_t *info)
 {
-    (void) lun;
-    bool result = false;
+    esp_err_t ret = ESP_OK;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
 
-    if (s_storage_handle->is_fat_mounted) {
-        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
-        result = false;
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    if (h->absent) {
+        ESP_LOGE(TAG, "LUN %u: no medium", lun);
+        ret = ESP_ERR_NOT_FOUND;
+    } else if (h->owner == MSC_OWNER_APP) {
+        ESP_LOGE(TAG, "LUN %u is mounted on the application", lun);
+        ret = ESP_ERR_INVALID_STATE;
     } else {
-        if (tinyusb_msc_storage_unmount() != ESP_OK) {
-            ESP_LOGW(TAG, "tud_msc_test_unit_ready_cb() unmount Fails");
+        // ends a grace period; a read-only view would read the volume changing under it
+        ret = _owner_host(h);
+        if (ret == ESP_OK) {
+            tinyusb_msc_storage_unmount_view(lun);
+            // the host's last writes must not land on the new volume
+            ret = _storage_flush(h);
+        }
+        BYTE pdrv = 0xFF;
+        if (ret == ESP_OK) {
+            ret = ff_diskio_get_drive(&pdrv);
+        }
+        if (ret == ESP_OK) {
+            h->owner = MSC_OWNER_BENCHMARK;
+            ret = _format(h, pdrv, info);
+            h->owner = MSC_OWNER_HOST;
+            h->unit_attention = true;
         }
-        result = true;
     }
-    return result;
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return ret;
 }
 
-// Invoked when received SCSI_CMD_READ_CAPACITY_10 and SCSI_CMD_READ_FORMAT_CAPACITY to determine the disk size
-// Application update block count and block size
-void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
+uint32_t tinyusb_msc_storage_get_host_write_count(void)
 {
-    (void) lun;
+    return tinyusb_msc_storage_get_host_write_count_lun(0);
+}
 
-    uint32_t sec_count = tinyusb_msc_storage_get_sector_count();
-    uint32_t sec_size = tinyusb_msc_storage_get_sector_size();
-    *block_count = sec_count;
-    *block_size  = (uint16_t)sec_size;
+uint32_t tinyusb_msc_storage_get_host_write_count_lun(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    assert(h);
+    return h->host_write_count;
 }
 
-// Invoked when received Start Stop Unit command
-// - Start = 0 : stopped power mode, if load_eject = 1 : unload disk storage
-// - Start = 1 : active mode, if load_eject = 1 : load disk storage
-bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
+void tinyusb_msc_storage_get_readahead_stats(uint8_t lun, tinyusb_msc_readahead_stats_t *stats)
 {
-    (void) lun;
-    (void) power_condition;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
 
-    if (load_eject && !start) {
-        if (tinyusb_msc_storage_mount(s_storage_handle->base_path) != ESP_OK) {
-            ESP_LOGW(TAG, "tud_msc_start_stop_cb() mount Fails");
-        }
+    memset(stats, 0, sizeof(*stats));
+    if (!h || !h->ra.enabled) {
+        return;
     }
-    return true;
+    xSemaphoreTake(h->ra.lock, portMAX_DELAY);
+    *stats = h->ra.stats;
+    xSemaphoreGive(h->ra.lock);
 }
 
-// Invoked when received SCSI READ10 command
-// - Address = lba * BLOCK_SIZE + offset
+void tinyusb_msc_storage_get_writeback_stats(uint8_t lun, tinyusb_msc_writeback_stats_t *stats)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    memset(stats, 0, sizeof(*stats));
+    if (!h || !h->wb.enabled || h->wb.slots == 0) {
+        return;
+    }
+    xSemaphoreTake(h->wb.lock, portMAX_DELAY);
+    *stats = h->wb.stats;
+    stats->dirty_sectors = h->wb.used;
+    xSemaphoreGive(h->wb.lock);
+}
+
+esp_err_t tinyusb_msc_storage_flush(void)
+{
+    esp_err_t ret = ESP_OK;
+
+    for (uint8_t lun = 0; lun < s_lun_count; lun++) {
+        esp_err_t err = _storage_flush(s_storage[lun]);
+        ret = (ret == ESP_OK) ? err : ret;
+    }
+    return ret;
+}
+
+void tinyusb_msc_storage_get_wl_combine_stats(uint8_t lun, tinyusb_msc_wl_combine_stats_t *stats)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    memset(stats, 0, sizeof(*stats));
+    if (!h || !h->wc.enabled) {
+        return;
+    }
+    xSemaphoreTake(h->wc.lock, portMAX_DELAY);
+    *stats = h->wc.stats;
+    xSemaphoreGive(h->wc.lock);
+}
+
+void tinyusb_msc_storage_get_meta_cache_stats(uint8_t lun, tinyusb_msc_meta_cache_stats_t *stats)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    memset(stats, 0, sizeof(*stats));
+    if (!h || !h->mc.enabled) {
+        return;
+    }
+    xSemaphoreTake(h->mc.lock, portMAX_DELAY);
+    *stats = h->mc.stats;
+    stats->dirty_sectors = h->mc.dirty_count;
+    xSemaphoreGive(h->mc.lock);
+}
+
+void tinyusb_msc_storage_get_io_stats(uint8_t lun, tinyusb_msc_io_stats_t *stats)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    memset(stats, 0, sizeof(*stats));
+    if (!h || !h->io.enabled) {
+        return;
+    }
+    xSemaphoreTake(h->io.lock, portMAX_DELAY);
+    *stats = h->io.stats;
+    xSemaphoreGive(h->io.lock);
+}
+
+void tinyusb_msc_storage_io_pause(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    if (h && h->io.enabled) {
+        xSemaphoreTake(h->io.bus, portMAX_DELAY);
+    }
+}
+
+void tinyusb_msc_storage_io_resume(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    if (h && h->io.enabled) {
+        xSemaphoreGive(h->io.bus);
+    }
+}
+
+void tinyusb_msc_storage_get_latency_stats(uint8_t lun, tinyusb_msc_cmd_kind_t kind, tinyusb_msc_latency_stats_t *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+    if (lun >= TINYUSB_MSC_LUN_MAX || kind >= TINYUSB_MSC_CMD_KINDS || atomic_load(&s_latency_reset)) {
+        return;
+    }
+    unsigned seq;
+    do {
+        seq = _latency_read_begin();
+        *stats = s_latency[lun][kind];
+    } while (_latency_read_retry(seq));
+#endif
+}
+
+size_t tinyusb_msc_storage_get_trace(tinyusb_msc_trace_entry_t *entries, size_t max)
+{
+    size_t n = 0;
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS && CONFIG_TINYUSB_MSC_TRACE_DEPTH
+    if (atomic_load(&s_latency_reset)) {
+        return 0;
+    }
+    unsigned seq;
+    do {
+        seq = _latency_read_begin();
+        uint32_t count = s_trace_count;
+        n = MIN(MIN(count, CONFIG_TINYUSB_MSC_TRACE_DEPTH), max);
+        for (size_t i = 0; i < n; i++) {
+            entries[i] = s_trace[(count - n + i) % CONFIG_TINYUSB_MSC_TRACE_DEPTH];
+        }
+    } while (_latency_read_retry(seq));
+#endif
+    return n;
+}
+
+void tinyusb_msc_storage_reset_latency_stats(void)
+{
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+    atomic_store(&s_latency_reset, true);
+#endif
+}
+
+esp_err_t tinyusb_msc_storage_get_free_space(uint64_t *total_bytes, uint64_t *free_bytes)
+{
+    return tinyusb_msc_storage_get_free_space_lun(0, total_bytes, free_bytes);
+}
+
+esp_err_t tinyusb_msc_storage_get_free_space_lun(uint8_t lun, uint64_t *total_bytes, uint64_t *free_bytes)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+    FATFS *fs = h->fs;
+    uint32_t free_clst;
+
+    ESP_RETURN_ON_FALSE(!h->absent, ESP_ERR_NOT_FOUND, TAG, "No medium");
+    ESP_RETURN_ON_FALSE(h->fat_type != 0, ESP_ERR_INVALID_STATE, TAG, "Storage was never mounted");
+    if (fs && fs->free_clst <= fs->n_fatent - 2) {
+        free_clst = fs->free_clst;
+    } else if (h->free_valid && h->free_host_writes == h->host_write_count) {
+        free_clst = h->free_clusters;
+    } else {
+        _free_space_scan_start(h);
+        return ESP_ERR_NOT_FINISHED;
+    }
+
+    if (total_bytes) {
+        *total_bytes = (uint64_t)(h->fat_entries - 2) * h->fat_cluster_bytes;
+    }
+    if (free_bytes) {
+        *free_bytes = (uint64_t)free_clst * h->fat_cluster_bytes;
+    }
+    return ESP_OK;
+}
+
+esp_err_t tinyusb_msc_storage_get_file_size(const char *path, uint64_t *size)
+{
+    ESP_RETURN_ON_FALSE(path && size, ESP_ERR_INVALID_ARG, TAG, "no path");
+
+    for (uint8_t lun = 0; lun < s_lun_count; lun++) {
+        tinyusb_msc_storage_handle_s *h = s_storage[lun];
+        xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+        const char *base = h->is_fat_mounted ? h->base_path : h->view_path;
+        const BYTE pdrv = h->is_fat_mounted ? h->app_pdrv : h->view_pdrv;
+        const size_t len = base ? strlen(base) : 0;
+        if (len == 0 || strncmp(path, base, len) != 0 || (path[len] != '/' && path[len] != '\0')) {
+            xSemaphoreGiveRecursive(h->owner_lock);
+            continue;
+        }
+        char fpath[3 + FF_MAX_LFN + 1];
+        FILINFO info;
+        snprintf(fpath, sizeof(fpath), "%c:%s", '0' + pdrv, path[len] ? path + len : "/");
+        const FRESULT fresult = f_stat(fpath, &info);
+        xSemaphoreGiveRecursive(h->owner_lock);
+        if (fresult == FR_NO_FILE || fresult == FR_NO_PATH) {
+            return ESP_ERR_NOT_FOUND;
+        }
+        ESP_RETURN_ON_FALSE(fresult == FR_OK, ESP_FAIL, TAG, "f_stat of %s failed (%d)", path, fresult);
+        *size = info.fsize;
+        return ESP_OK;
+    }
+    return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t tinyusb_msc_storage_mount_view(uint8_t lun, const char *base_path)
+{
+    return tinyusb_msc_storage_acquire_view(lun, TINYUSB_MSC_USER_DEFAULT, base_path);
+}
+
+esp_err_t tinyusb_msc_storage_acquire_view(uint8_t lun, uint8_t user, const char *base_path)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h && base_path, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+    ESP_RETURN_ON_FALSE(user < TINYUSB_MSC_USERS_MAX, ESP_ERR_INVALID_ARG, TAG, "user %u out of range", user);
+
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    esp_err_t ret = _view_mount(h, base_path);
+    if (ret == ESP_OK) {
+        h->view_users |= 1UL << user;
+    }
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return ret;
+}
+
+esp_err_t tinyusb_msc_storage_unmount_view(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    h->view_users = 0;
+    esp_err_t err = _view_unmount(h);
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return err;
+}
+
+esp_err_t tinyusb_msc_storage_release_view(uint8_t lun, uint8_t user)
+{
+    esp_err_t err = ESP_OK;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+    ESP_RETURN_ON_FALSE(user < TINYUSB_MSC_USERS_MAX, ESP_ERR_INVALID_ARG, TAG, "user %u out of range", user);
+
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    h->view_users &= ~(1UL << user);
+    if (h->view_users == 0) {
+        err = _view_unmount(h);
+    }
+    if (h->absent) {
+        xSemaphoreGive(h->users_gone);
+    }
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return err;
+}
+
+bool tinyusb_msc_storage_view_refresh(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    if (!h) {
+        return false;
+    }
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    if (!h->view_fs || h->view_host_writes == h->host_write_count) {
+        xSemaphoreGiveRecursive(h->owner_lock);
+        return false;
+    }
+    FATFS *fs = h->view_fs;
+    h->view_host_writes = h->host_write_count;
+    /* forget the FAT or directory sector held in the window, the view never has anything to write
+       back; a call of another user in progress only reads the sector again */
+    fs->winsect = (LBA_t)0 - 1;
+    fs->wflag = 0;
+    fs->free_clst = 0xFFFFFFFF;
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return true;
+}
+
+esp_err_t tinyusb_msc_storage_benchmark(uint8_t lun, const tinyusb_msc_bench_config_t *config,
+                                        tinyusb_msc_bench_result_t *results, size_t max_results, size_t *count)
+{
+    static const char *const kind_name[TINYUSB_MSC_BENCH_KINDS] = {
+        "sequential read", "sequential write", "random read", "random write"
+    };
+    static const tinyusb_msc_bench_config_t defaults = { 0 };
+    esp_err_t ret = ESP_OK;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h && results && count, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+
+    if (!config) {
+        config = &defaults;
+    }
+    const uint32_t block_min = config->block_min ? config->block_min : TINYUSB_MSC_BENCH_BLOCK_MIN;
+    uint32_t block_max = config->block_max ? config->block_max : TINYUSB_MSC_BENCH_BLOCK_MAX;
+    const uint32_t duration_ms = config->duration_ms ? config->duration_ms : MSC_BENCH_DURATION_MS;
+    ESP_RETURN_ON_FALSE(!(block_min & (block_min - 1)) && !(block_max & (block_max - 1)) &&
+                        block_min >= TINYUSB_MSC_BENCH_BLOCK_MIN && block_max <= TINYUSB_MSC_BENCH_BLOCK_MAX &&
+                        block_min <= block_max, ESP_ERR_INVALID_ARG, TAG,
+                        "transfers of %lu to %lu bytes are not powers of two from 512 B to 64 KB", block_min, block_max);
+    *count = 0;
+
+    msc_bench_t b = {
+        .h = h,
+        .fd = -1,
+        .sector_size = (h->sector_size)(h),
+        .rand = 0x9E3779B97F4A7C15ULL,
+    };
+    b.lat = malloc(MSC_BENCH_SAMPLES_MAX * sizeof(uint32_t));
+    // the largest transfers are left out when memory is short
+    while (block_max >= block_min &&
+            !(b.buf = heap_caps_malloc(block_max, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL))) {
+        block_max /= 2;
+    }
+    ESP_GOTO_ON_FALSE(b.lat && b.buf, ESP_ERR_NO_MEM, free, TAG, "could not allocate the benchmark buffers");
+
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    const msc_owner_t owner = h->owner;
+    if (h->absent) {
+        ESP_LOGE(TAG, "LUN %u: no medium", lun);
+        ret = ESP_ERR_NOT_FOUND;
+    } else if (config->fat) {
+        ret = _owner_app(h, NULL);
+        if (ret == ESP_OK) {
+            ret = _bench_file_open(&b, config->fat_file_size ? config->fat_file_size : MSC_BENCH_FILE_SIZE, block_max);
+        }
+    } else if (owner == MSC_OWNER_APP) {
+        ESP_LOGE(TAG, "LUN %u is mounted on the application", lun);
+        ret = ESP_ERR_INVALID_STATE;
+    } else {
+        // ends a grace period, the FAT must not be mounted under the raw tests
+        ret = _owner_host(h);
+        if (ret == ESP_OK) {
+            h->owner = MSC_OWNER_BENCHMARK;
+            // the tests read what the host wrote and write it back unchanged, the caches stay valid
+            ret = _storage_flush(h);
+            b.size = (uint64_t)(h->sector_count)(h) * b.sector_size;
+        }
+    }
+
+    for (uint32_t block = block_min; ret == ESP_OK && block <= block_max; block *= 2) {
+        if (block < b.sector_size || block > b.size) {
+            continue;
+        }
+        for (tinyusb_msc_bench_kind_t kind = 0; ret == ESP_OK && kind < TINYUSB_MSC_BENCH_KINDS; kind++) {
+            if (*count == max_results) {
+                block = block_max;
+                break;
+            }
+            tinyusb_msc_bench_result_t *r = &results[*count];
+            ret = _bench_test(&b, kind, block, duration_ms, r);
+            if (ret == ESP_OK) {
+                (*count)++;
+                ESP_LOGI(TAG, "LUN %u %s %s of %lu B: %lu KB/s, %lu IOPS, latency p50 %lu us, p90 %lu us, p99 %lu us, max %lu us",
+                         lun, config->fat ? "FatFs" : "raw", kind_name[kind], block, r->kbps, r->iops,
+                         r->p50_us, r->p90_us, r->p99_us, r->max_us);
+            }
+            // a test keeps the CPU for its whole duration on a RAM disk, the idle task gets a turn
+            vTaskDelay(1);
+        }
+    }
+
+    if (b.fd >= 0) {
+        close(b.fd);
+        unlink(b.path);
+    }
+    if (config->fat) {
+        if (owner != MSC_OWNER_APP) {
+            _owner_release(h);
+        }
+    } else if (h->owner == MSC_OWNER_BENCHMARK) {
+        h->owner = MSC_OWNER_HOST;
+        h->unit_attention = true;
+    }
+    xSemaphoreGiveRecursive(h->owner_lock);
+
+free:
+    heap_caps_free(b.buf);
+    free(b.lat);
+    return ret;
+}
+
+esp_err_t tinyusb_msc_storage_benchmark_meta(uint8_t lun, uint32_t files, tinyusb_msc_meta_bench_result_t results[2])
+{
+    esp_err_t ret = ESP_OK;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    ESP_RETURN_ON_FALSE(h && results, ESP_ERR_INVALID_ARG, TAG, "LUN %u is not registered", lun);
+
+    if (files == 0) {
+        files = TINYUSB_MSC_META_BENCH_FILES;
+    }
+    xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    const msc_owner_t owner = h->owner;
+    if (h->absent) {
+        ESP_LOGE(TAG, "LUN %u: no medium", lun);
+        ret = ESP_ERR_NOT_FOUND;
+    } else {
+        ret = _owner_app(h, NULL);
+    }
+    for (int run = 0; ret == ESP_OK && run < 2; run++) {
+        tinyusb_msc_meta_bench_result_t *r = &results[run];
+        *r = (tinyusb_msc_meta_bench_result_t) {
+            .cached = (run == 1 && h->mc.enabled),
+            .files = files,
+        };
+        ret = _bench_meta_run(h, files, r);
+        if (ret == ESP_OK) {
+            ESP_LOGI(TAG, "LUN %u FatFs metadata %s: %lu files created in %lu us, listed in %lu us, deleted in %lu us, "
+                     "%lu hits, %lu misses", lun, r->cached ? "cached" : "uncached", files,
+                     r->create_us, r->list_us, r->delete_us, r->hits, r->misses);
+        }
+    }
+    if (owner != MSC_OWNER_APP) {
+        _owner_release(h);
+    }
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return ret;
+}
+
+/* LUNs
+   ********************************************************************* */
+
+static tinyusb_msc_storage_handle_s *_storage_get(uint8_t lun)
+{
+    return (lun < s_lun_count) ? s_storage[lun] : NULL;
+}
+
+/**
+ * Gives an initialized handle the next LUN. The MSC transfer buffers are shared by all LUNs and
+ * set up with the first one.
+ */
+static esp_err_t _storage_add(tinyusb_msc_storage_handle_s *h)
+{
+    h->owner_lock = xSemaphoreCreateRecursiveMutex();
+    ESP_RETURN_ON_FALSE(h->owner_lock, ESP_ERR_NO_MEM, TAG, "could not allocate the owner lock");
+    h->users_gone = xSemaphoreCreateBinary();
+    if (!h->users_gone) {
+        vSemaphoreDelete(h->owner_lock);
+        ESP_LOGE(TAG, "could not allocate the owner lock");
+        return ESP_ERR_NO_MEM;
+    }
+    if (s_lun_count == 0) {
+        _msc_buffers_alloc();
+    }
+    h->lun = s_lun_count;
+    _io_init(h);
+    _readahead_init(h);
+    _wl_combine_init(h);
+    _writeback_init(h);
+    _meta_cache_init(h);
+    s_storage[s_lun_count++] = h;
+    ESP_LOGI(TAG, "LUN %u: %s, %lu sectors of %lu bytes", h->lun, h->product,
+             (h->sector_count)(h), (h->sector_size)(h));
+    return ESP_OK;
+}
+
+/**
+ * Writes what the metadata cache, the write-back cache and the backend of one LUN hold in RAM.
+ */
+static esp_err_t _storage_flush(tinyusb_msc_storage_handle_s *h)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    ESP_RETURN_ON_ERROR(_meta_cache_flush(h), TAG, "Failed to write the metadata cache");
+    if (!wb->enabled) {
+        return h->flush ? (h->flush)(h) : ESP_OK;
+    }
+    xSemaphoreTake(wb->lock, portMAX_DELAY);
+    esp_err_t err = _writeback_sync_locked(h);
+    xSemaphoreGive(wb->lock);
+    return err;
+}
+
+/**
+ * The sectors hold no data anymore: the host unmapped them or FatFs on the application freed them.
+ * Copies still in the caches are dropped, then the backend passes the news on to the media.
+ */
+static esp_err_t _storage_trim(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    if (!h->trim || count == 0) {
+        return ESP_OK;
+    }
+    // also keeps the write-back task off `wl_erased` meanwhile
+    if (wb->enabled) {
+        xSemaphoreTake(wb->lock, portMAX_DELAY);
+        _writeback_discard(h, lba, count);
+    }
+    _readahead_invalidate(h, lba, (size_t)count * (h->sector_size)(h));
+    esp_err_t err = (h->trim)(h, lba, count);
+    if (wb->enabled) {
+        xSemaphoreGive(wb->lock);
+    }
+    return err;
+}
+
+/* Owner
+   ********************************************************************* */
+
+/**
+ * The application needs the volume. A release still in its grace period is cancelled, the FAT was
+ * never unmounted and the host never saw the medium. Called with `owner_lock` held.
+ */
+static esp_err_t _owner_app(tinyusb_msc_storage_handle_s *h, const char *base_path)
+{
+    ESP_RETURN_ON_FALSE(!h->absent, ESP_ERR_NOT_FOUND, TAG, "LUN %u: no medium", h->lun);
+    if (h->owner == MSC_OWNER_HOST) {
+        ESP_RETURN_ON_ERROR(_fat_mount(h, base_path), TAG, "LUN %u: mount failed", h->lun);
+    }
+    h->owner = MSC_OWNER_APP;
+    return ESP_OK;
+}
+
+/**
+ * The application is done with the volume. It goes to the host once the grace period is over, at
+ * the next TEST UNIT READY. Called with `owner_lock` held.
+ */
+static esp_err_t _owner_release(tinyusb_msc_storage_handle_s *h)
+{
+    if (h->owner != MSC_OWNER_APP) {
+        return ESP_OK;
+    }
+    h->owner = MSC_OWNER_TRANSITIONING;
+    h->owner_tick = xTaskGetTickCount();
+    if (CONFIG_TINYUSB_MSC_OWNER_GRACE_MS == 0) {
+        return _owner_host(h);
+    }
+    return ESP_OK;
+}
+
+/**
+ * Unmounts the FAT and gives the volume to the host, which is told that the medium may have
+ * changed. Called with `owner_lock` held.
+ */
+static esp_err_t _owner_host(tinyusb_msc_storage_handle_s *h)
+{
+    if (h->owner == MSC_OWNER_HOST) {
+        return ESP_OK;
+    }
+    esp_err_t err = _fat_unmount(h);
+    if (!h->is_fat_mounted) {
+        h->owner = MSC_OWNER_HOST;
+        h->unit_attention = true;
+    }
+    return err;
+}
+
+static bool _owner_grace_over(tinyusb_msc_storage_handle_s *h)
+{
+    return (xTaskGetTickCount() - h->owner_tick) >= pdMS_TO_TICKS(CONFIG_TINYUSB_MSC_OWNER_GRACE_MS);
+}
+
+/**
+ * Mounts the read-only view at `base_path`, or checks that the view already mounted is there: all
+ * the users of a view share it. Called with `owner_lock` held.
+ */
+static esp_err_t _view_mount(tinyusb_msc_storage_handle_s *h, const char *base_path)
+{
+    esp_err_t ret = ESP_OK;
+    uint8_t lun = h->lun;
+
+    if (h->view_fs) {
+        ESP_RETURN_ON_FALSE(strcmp(h->view_path, base_path) == 0, ESP_ERR_INVALID_STATE, TAG,
+                            "LUN %u has its read-only view at %s", lun, h->view_path);
+        return ESP_OK;
+    }
+    ESP_RETURN_ON_FALSE(!h->absent, ESP_ERR_NOT_FOUND, TAG, "LUN %u: no medium", lun);
+    ESP_RETURN_ON_FALSE(!h->is_fat_mounted, ESP_ERR_INVALID_STATE, TAG, "LUN %u is mounted on the application", lun);
+
+    BYTE pdrv = 0xFF;
+    ESP_RETURN_ON_ERROR(ff_diskio_get_drive(&pdrv), TAG,
+                        "The maximum count of volumes is already mounted");
+    char drv[3] = {(char)('0' + pdrv), ':', 0};
+    s_view[pdrv] = h;
+    ff_diskio_register(pdrv, &s_view_impl);
+
+    FATFS *fs = NULL;
+    ESP_GOTO_ON_ERROR(esp_vfs_fat_register(base_path, drv, h->max_files, &fs), fail, TAG,
+                      "esp_vfs_fat_register failed");
+    h->view_fs = fs;
+    h->view_pdrv = pdrv;
+    h->view_host_writes = h->host_write_count;
+    // never formats, the host owns the volume
+    FRESULT fresult = f_mount(fs, drv, 1);
+    if (fresult != FR_OK) {
+        ESP_LOGE(TAG, "f_mount of the read-only view failed (%d)", fresult);
+        ret = ESP_FAIL;
+        goto fail;
+    }
+    h->view_path = base_path;
+    ESP_LOGI(TAG, "LUN %u: read-only view at %s", lun, base_path);
+    return ESP_OK;
+
+fail:
+    if (fs) {
+        f_mount(NULL, drv, 0);
+        esp_vfs_fat_unregister_path(base_path);
+    }
+    ff_diskio_unregister(pdrv);
+    s_view[pdrv] = NULL;
+    h->view_fs = NULL;
+    return ret;
+}
+
+/**
+ * Unmounts the read-only view, files still open through it fail from then on. Called with
+ * `owner_lock` held.
+ */
+static esp_err_t _view_unmount(tinyusb_msc_storage_handle_s *h)
+{
+    if (!h->view_fs) {
+        return ESP_OK;
+    }
+    char drv[3] = {(char)('0' + h->view_pdrv), ':', 0};
+    f_mount(NULL, drv, 0);
+    esp_err_t err = esp_vfs_fat_unregister_path(h->view_path);
+    ff_diskio_unregister(h->view_pdrv);
+    s_view[h->view_pdrv] = NULL;
+    h->view_fs = NULL;
+    h->view_path = NULL;
+    return err;
+}
+
+/**
+ * Waits for the users of a removed medium to release the mount and the view: unmounting them frees
+ * the FatFs objects a user may still be in. Their I/O fails at once, so they do not take long.
+ * TINYUSB_MSC_USER_DEFAULT is not waited for, it holds the volume for the application as a whole
+ * while no host is attached. Called with `owner_lock` held once, it is given up while waiting.
+ */
+static void _detach_wait(tinyusb_msc_storage_handle_s *h)
+{
+    const uint32_t others = ~(1UL << TINYUSB_MSC_USER_DEFAULT);
+    uint32_t users;
+
+    while ((users = (h->app_users | h->view_users) & others) != 0) {
+        xSemaphoreGiveRecursive(h->owner_lock);
+        if (xSemaphoreTake(h->users_gone, pdMS_TO_TICKS(MSC_DETACH_WARN_MS)) != pdTRUE) {
+            ESP_LOGW(TAG, "LUN %u: waiting for users 0x%lx to release the removed medium", h->lun, users);
+        }
+        xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+    }
+}
+
+/* MSC transfer buffers
+   ********************************************************************* */
+
+/**
+ * Replaces the small built-in data stage buffers of the MSC class with two large ones, so that one
+ * READ10/WRITE10 chunk becomes a single multi-block command instead of one command per sector. They
+ * come from DMA capable internal RAM, otherwise the SDMMC driver bounces every sector through its own
+ * buffer. The size is halved until it leaves room in the heap for the rest of the application.
+ */
+static void _msc_buffers_alloc(void)
+{
+    const uint32_t caps = MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL;
+    size_t size = CONFIG_TINYUSB_MSC_BUFSIZE_MAX;
+
+    for (; size > CONFIG_TINYUSB_MSC_BUFSIZE; size /= 2) {
+        // a whole number of sectors of every LUN, including ones added later
+        size -= size % MSC_SECTOR_SIZE_MAX;
+        if (size <= CONFIG_TINYUSB_MSC_BUFSIZE) {
+            break;
+        }
+        // keep at least as much DMA capable memory free as the buffers take
+        if (heap_caps_get_free_size(caps) < 4 * size || heap_caps_get_largest_free_block(caps) < size) {
+            continue;
+        }
+        uint8_t *buf0 = heap_caps_malloc(size, caps);
+        uint8_t *buf1 = heap_caps_malloc(size, caps);
+        if (buf0 && buf1 && tud_msc_set_buffers(buf0, buf1, size)) {
+            s_msc_buf[0] = buf0;
+            s_msc_buf[1] = buf1;
+            ESP_LOGI(TAG, "MSC transfer buffers: 2 x %u bytes", size);
+            return;
+        }
+        heap_caps_free(buf0);
+        heap_caps_free(buf1);
+    }
+    ESP_LOGW(TAG, "MSC transfer buffers: using built-in 2 x %d bytes", CONFIG_TINYUSB_MSC_BUFSIZE);
+}
+
+static void _msc_buffers_free(void)
+{
+    tud_msc_set_buffers(NULL, NULL, 0);
+    heap_caps_free(s_msc_buf[0]);
+    heap_caps_free(s_msc_buf[1]);
+    s_msc_buf[0] = NULL;
+    s_msc_buf[1] = NULL;
+}
+
+/* SD card I/O queue
+   ********************************************************************* */
+
+/**
+ * Every transfer to the SD card goes through one queue served by a dispatcher task, whoever issues
+ * it: the TinyUSB task, the read-ahead and write-back tasks, FatFs on the application. A block
+ * device storage registered with `queued` set gets one as well. Requests of
+ * the USB host (the TinyUSB and read-ahead tasks) are dispatched before the others, unless the
+ * oldest of those waited CONFIG_TINYUSB_MSC_IO_SCHED_STARVE_MS. Within a class the requests go in
+ * ascending LBA order from the end of the last transfer, wrapping around, unless the oldest waited
+ * CONFIG_TINYUSB_MSC_IO_SCHED_WINDOW_MS. Queued reads or writes starting where the dispatched one
+ * ends are merged into one multi-block transfer through a bounce buffer. A request never passes an
+ * older one overlapping it if either writes.
+ */
+static void _io_init(tinyusb_msc_storage_handle_s *h)
+{
+    msc_io_t *io = &h->io;
+
+    memset(io, 0, sizeof(*io));
+    // the other storages are as fast as RAM, or serialized by their own driver
+    if (CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH == 0 || !h->queued) {
+        return;
+    }
+    const uint32_t sector_size = (h->sector_size)(h);
+    const uint32_t merge_max = CONFIG_TINYUSB_MSC_IO_SCHED_MERGE_SIZE / sector_size;
+    bool ok = true;
+
+    io->depth = MIN(CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH, MSC_IO_DEPTH_MAX);
+    io->lock = xSemaphoreCreateMutex();
+    io->slots = xSemaphoreCreateCounting(io->depth, io->depth);
+    io->kick = xSemaphoreCreateBinary();
+    io->bus = xSemaphoreCreateMutex();
+    for (uint32_t i = 0; i < io->depth; i++) {
+        io->req[i].done = xSemaphoreCreateBinary();
+        ok = ok && io->req[i].done;
+    }
+    if (merge_max >= 2) {
+        io->merge = heap_caps_malloc(merge_max * sector_size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        io->merge_max = io->merge ? merge_max : 0;
+    }
+    if (!ok || !io->lock || !io->slots || !io->kick || !io->bus ||
+            xTaskCreate(_io_task, "msc_io", MSC_IO_TASK_STACK, h, MSC_IO_TASK_PRIO, &io->task) != pdPASS) {
+        ESP_LOGW(TAG, "SD card I/O queue disabled, out of memory");
+        _io_deinit(h);
+        return;
+    }
+    io->sector_size = sector_size;
+    io->enabled = true;
+}
+
+static void _io_deinit(tinyusb_msc_storage_handle_s *h)
+{
+    msc_io_t *io = &h->io;
+
+    if (io->task) {
+        vTaskDelete(io->task);
+    }
+    if (io->lock) {
+        vSemaphoreDelete(io->lock);
+    }
+    if (io->slots) {
+        vSemaphoreDelete(io->slots);
+    }
+    if (io->kick) {
+        vSemaphoreDelete(io->kick);
+    }
+    if (io->bus) {
+        vSemaphoreDelete(io->bus);
+    }
+    for (uint32_t i = 0; i < io->depth; i++) {
+        if (io->req[i].done) {
+            vSemaphoreDelete(io->req[i].done);
+        }
+    }
+    heap_caps_free(io->merge);
+    memset(io, 0, sizeof(*io));
+}
+
+/**
+ * Queues a transfer and waits for the dispatcher to complete it. The class is that of the calling
+ * task. Blocks while all CONFIG_TINYUSB_MSC_IO_SCHED_DEPTH requests are in use.
+ */
+static esp_err_t _io_submit(tinyusb_msc_storage_handle_s *h, msc_io_op_t op, uint32_t lba, uint32_t count, void *buf)
+{
+    msc_io_t *io = &h->io;
+    const TaskHandle_t self = xTaskGetCurrentTaskHandle();
+    msc_io_req_t *r = NULL;
+
+    xSemaphoreTake(io->slots, portMAX_DELAY);
+    xSemaphoreTake(io->lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < io->depth && !r; i++) {
+        if (io->req[i].state == MSC_IO_FREE) {
+            r = &io->req[i];
+        }
+    }
+    assert(r);
+    r->state = MSC_IO_QUEUED;
+    r->op = op;
+    r->cls = (self == io->host_task || self == h->ra.task) ? TINYUSB_MSC_IO_HOST : TINYUSB_MSC_IO_BACKGROUND;
+    r->lba = lba;
+    r->count = count;
+    r->buf = buf;
+    r->seq = io->seq++;
+    r->queued_at = esp_timer_get_time();
+    io->stats.cls[r->cls].requests++;
+    io->stats.depth_sum += io->stats.depth;
+    io->stats.depth++;
+    io->stats.depth_max = MAX(io->stats.depth_max, io->stats.depth);
+    xSemaphoreGive(io->lock);
+    xSemaphoreGive(io->kick);
+
+    xSemaphoreTake(r->done, portMAX_DELAY);
+    xSemaphoreTake(io->lock, portMAX_DELAY);
+    const esp_err_t err = r->err;
+    r->state = MSC_IO_FREE;
+    io->stats.depth--;
+    xSemaphoreGive(io->lock);
+    xSemaphoreGive(io->slots);
+    return err;
+}
+
+static bool _io_older(const msc_io_req_t *a, const msc_io_req_t *b)
+{
+    return (int32_t)(a->seq - b->seq) < 0;
+}
+
+/**
+ * Older queued request `r` must not pass: overlapping it, one of them writing or erasing. NULL if
+ * `r` may go.
+ */
+static msc_io_req_t *_io_blocker(msc_io_t *io, const msc_io_req_t *r)
+{
+    for (uint32_t i = 0; i < io->depth; i++) {
+        msc_io_req_t *o = &io->req[i];
+        if (o->state == MSC_IO_QUEUED && _io_older(o, r) && (o->op != MSC_IO_READ || r->op != MSC_IO_READ) &&
+                o->lba < r->lba + r->count && r->lba < o->lba + o->count) {
+            return o;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Queued request of `cls` with the lowest LBA from the end of the last transfer on, or with the
+ * lowest LBA of all if none is beyond. NULL if every request of the class is blocked.
+ */
+static msc_io_req_t *_io_scan(msc_io_t *io, tinyusb_msc_io_class_t cls)
+{
+    msc_io_req_t *ahead = NULL;
+    msc_io_req_t *lowest = NULL;
+
+    for (uint32_t i = 0; i < io->depth; i++) {
+        msc_io_req_t *r = &io->req[i];
+        if (r->state != MSC_IO_QUEUED || r->cls != cls || _io_blocker(io, r)) {
+            continue;
+        }
+        if (r->lba >= io->head && (!ahead || r->lba < ahead->lba)) {
+            ahead = r;
+        }
+        if (!lowest || r->lba < lowest->lba) {
+            lowest = r;
+        }
+    }
+    return ahead ? ahead : lowest;
+}
+
+/**
+ * Takes the requests of the next transfer off the queue: the one chosen by class, age and LBA, then
+ * those of the same direction following it on the card while the merge buffer holds them. Called
+ * with the lock held, returns 0 if the queue is empty.
+ */
+static uint32_t _io_next(msc_io_t *io, msc_io_req_t **batch)
+{
+    const int64_t now = esp_timer_get_time();
+    msc_io_req_t *oldest[TINYUSB_MSC_IO_CLASSES] = {NULL};
+
+    for (uint32_t i = 0; i < io->depth; i++) {
+        msc_io_req_t *r = &io->req[i];
+        if (r->state == MSC_IO_QUEUED && (!oldest[r->cls] || _io_older(r, oldest[r->cls]))) {
+            oldest[r->cls] = r;
+        }
+    }
+    const msc_io_req_t *background = oldest[TINYUSB_MSC_IO_BACKGROUND];
+    tinyusb_msc_io_class_t cls = TINYUSB_MSC_IO_HOST;
+    if (!oldest[cls]) {
+        if (!background) {
+            return 0;
+        }
+        cls = TINYUSB_MSC_IO_BACKGROUND;
+    } else if (background && now - background->queued_at >= CONFIG_TINYUSB_MSC_IO_SCHED_STARVE_MS * 1000LL) {
+        cls = TINYUSB_MSC_IO_BACKGROUND;
+        io->stats.starved++;
+    }
+
+    msc_io_req_t *r = _io_scan(io, cls);
+    if (!r || (r != oldest[cls] && now - oldest[cls]->queued_at >= CONFIG_TINYUSB_MSC_IO_SCHED_WINDOW_MS * 1000LL)) {
+        if (r) {
+            io->stats.expired++;
+        }
+        r = oldest[cls];
+    }
+    // an older request of the other class in the way goes first, the oldest of all is never blocked
+    for (msc_io_req_t *o = _io_blocker(io, r); o; o = _io_blocker(io, r)) {
+        r = o;
+    }
+
+    uint32_t n = 0;
+    uint32_t end = r->lba + r->count;
+    uint32_t total = r->count;
+    batch[n++] = r;
+    r->state = MSC_IO_ACTIVE;
+    while (r->op != MSC_IO_ERASE && n < io->depth) {
+        msc_io_req_t *next = NULL;
+        for (uint32_t i = 0; i < io->depth && !next; i++) {
+            msc_io_req_t *o = &io->req[i];
+            if (o->state == MSC_IO_QUEUED && o->op == r->op && o->lba == end &&
+                    total + o->count <= io->merge_max && !_io_blocker(io, o)) {
+                next = o;
+            }
+        }
+        if (!next) {
+            break;
+        }
+        batch[n++] = next;
+        next->state = MSC_IO_ACTIVE;
+        end += next->count;
+        total += next->count;
+        io->stats.merged++;
+    }
+    io->head = end;
+    io->stats.transfers++;
+    for (uint32_t i = 0; i < n; i++) {
+        tinyusb_msc_io_class_stats_t *st = &io->stats.cls[batch[i]->cls];
+        const uint32_t wait = (uint32_t)(now - batch[i]->queued_at);
+        st->wait_us += wait;
+        st->wait_max_us = MAX(st->wait_max_us, wait);
+    }
+    return n;
+}
+
+/**
+ * Issues the transfer of the requests taken by _io_next() and wakes their tasks.
+ */
+static void _io_dispatch(tinyusb_msc_storage_handle_s *h, msc_io_req_t **batch, uint32_t n)
+{
+    msc_io_t *io = &h->io;
+    msc_io_req_t *r = batch[0];
+    esp_err_t err;
+
+    if (n == 1) {
+        err = _io_transfer(h, r->op, r->lba, r->count, r->buf);
+    } else {
+        uint32_t total = 0;
+        if (r->op == MSC_IO_WRITE) {
+            for (uint32_t i = 0; i < n; i++) {
+                memcpy(io->merge + total * io->sector_size, batch[i]->buf, batch[i]->count * io->sector_size);
+                total += batch[i]->count;
+            }
+            err = _io_transfer(h, MSC_IO_WRITE, r->lba, total, io->merge);
+        } else {
+            for (uint32_t i = 0; i < n; i++) {
+                total += batch[i]->count;
+            }
+            err = _io_transfer(h, MSC_IO_READ, r->lba, total, io->merge);
+            for (uint32_t i = 0, pos = 0; i < n && err == ESP_OK; pos += batch[i++]->count) {
+                memcpy(batch[i]->buf, io->merge + pos * io->sector_size, batch[i]->count * io->sector_size);
+            }
+        }
+    }
+    for (uint32_t i = 0; i < n; i++) {
+        batch[i]->err = err;
+        xSemaphoreGive(batch[i]->done);
+    }
+}
+
+static esp_err_t _io_transfer(tinyusb_msc_storage_handle_s *h, msc_io_op_t op, uint32_t lba, uint32_t count, void *buf)
+{
+    if (h->read == &_read_sector_bdev) {
+        switch (op) {
+        case MSC_IO_READ:
+            return h->bdev.ops->read(h->bdev.ctx, lba, count, buf);
+        case MSC_IO_WRITE:
+            return h->bdev.ops->write(h->bdev.ctx, lba, count, buf);
+        default:
+            return h->bdev.ops->trim(h->bdev.ctx, lba, count);
+        }
+    }
+#if SOC_SDMMC_HOST_SUPPORTED
+    switch (op) {
+    case MSC_IO_READ:
+        return sdmmc_read_sectors(h->card, buf, lba, count);
+    case MSC_IO_WRITE:
+        return sdmmc_write_sectors(h->card, buf, lba, count);
+    default:
+        return _erase_sdmmc(h, lba, count);
+    }
+#else
+    return ESP_ERR_NOT_SUPPORTED;
+#endif
+}
+
+static void _io_task(void *arg)
+{
+    tinyusb_msc_storage_handle_s *h = arg;
+    msc_io_t *io = &h->io;
+    msc_io_req_t *batch[MSC_IO_DEPTH_MAX];
+
+    while (true) {
+        xSemaphoreTake(io->kick, portMAX_DELAY);
+        while (true) {
+            // a pause holds the requests back before they are picked, they are scheduled after it
+            xSemaphoreTake(io->bus, portMAX_DELAY);
+            xSemaphoreTake(io->lock, portMAX_DELAY);
+            const uint32_t n = _io_next(io, batch);
+            xSemaphoreGive(io->lock);
+            if (n == 0) {
+                xSemaphoreGive(io->bus);
+                break;
+            }
+            _io_dispatch(h, batch, n);
+            xSemaphoreGive(io->bus);
+        }
+    }
+}
+
+/* Read-ahead cache
+   ********************************************************************* */
+
+/**
+ * Sequential READ10 streams (a host copying a large file) are detected by the request starting where
+ * the previous one ended. The next `window` sectors are then read into one of two buffers by a
+ * background task while the host is served from the other. The window doubles each time a buffer
+ * was read completely by the host and halves when prefetched sectors are dropped unread.
+ * Host writes invalidate overlapping buffers, mounting on the application invalidates everything.
+ */
+static void _readahead_init(tinyusb_msc_storage_handle_s *h)
+{
+    msc_readahead_t *ra = &h->ra;
+    const uint32_t sector_size = (h->sector_size)(h);
+    const uint32_t capacity = h->uncached ? 0 : CONFIG_TINYUSB_MSC_READAHEAD_SIZE / sector_size;
+
+    memset(ra, 0, sizeof(*ra));
+    if (capacity == 0) {
+        return;
+    }
+    ra->lock = xSemaphoreCreateMutex();
+    ra->done = xSemaphoreCreateBinary();
+    ra->queue = xQueueCreate(1, sizeof(uint8_t));
+    for (int i = 0; i < 2; i++) {
+        ra->buf[i].data = heap_caps_malloc(capacity * sector_size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+    }
+    if (!ra->lock || !ra->done || !ra->queue || !ra->buf[0].data || !ra->buf[1].data ||
+            xTaskCreate(_readahead_task, "msc_readahead", MSC_READAHEAD_TASK_STACK, h,
+                        MSC_READAHEAD_TASK_PRIO, &ra->task) != pdPASS) {
+        ESP_LOGW(TAG, "Read-ahead disabled, out of memory");
+        _readahead_deinit(h);
+        return;
+    }
+    ra->sector_size = sector_size;
+    ra->capacity = capacity;
+    ra->window_min = MAX(1, MSC_READAHEAD_WINDOW_MIN / sector_size);
+    ra->window = ra->window_min;
+    ra->enabled = true;
+}
+
+static void _readahead_deinit(tinyusb_msc_storage_handle_s *h)
+{
+    msc_readahead_t *ra = &h->ra;
+
+    if (ra->task) {
+        vTaskDelete(ra->task);
+    }
+    if (ra->lock) {
+        vSemaphoreDelete(ra->lock);
+    }
+    if (ra->done) {
+        vSemaphoreDelete(ra->done);
+    }
+    if (ra->queue) {
+        vQueueDelete(ra->queue);
+    }
+    heap_caps_free(ra->buf[0].data);
+    heap_caps_free(ra->buf[1].data);
+    memset(ra, 0, sizeof(*ra));
+}
+
+/**
+ * Serves a host read: the part held by the cache is copied, waiting for a prefetch that is under
+ * way, the rest is read from the media. A prefetch is started if the stream is sequential.
+ */
+static esp_err_t _readahead_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest)
+{
+    msc_readahead_t *ra = &h->ra;
+
+    if (!ra->enabled || offset != 0 || size % ra->sector_size != 0) {
+        return msc_storage_read_sector(h, lba, offset, size, dest);
+    }
+
+    const uint32_t count = size / ra->sector_size;
+    const uint32_t end = lba + count;
+    uint32_t pos = lba;
+    int waits = 0;
+
+    xSemaphoreTake(ra->lock, portMAX_DELAY);
+    const bool sequential = (lba == ra->next_lba);
+    ra->next_lba = end;
+    while (pos < end) {
+        msc_readahead_buf_t *found = NULL;
+        for (int i = 0; i < 2; i++) {
+            msc_readahead_buf_t *b = &ra->buf[i];
+            if (b->count && pos >= b->lba && pos < b->lba + b->count) {
+                found = b;
+            }
+        }
+        if (found == NULL) {
+            break;
+        }
+        if (found->filling) {
+            // the sectors are being prefetched right now, wait for them rather than reading twice
+            if (waits++ == 2) {
+                break;
+            }
+            xSemaphoreGive(ra->lock);
+            xSemaphoreTake(ra->done, pdMS_TO_TICKS(MSC_READAHEAD_WAIT_MS));
+            xSemaphoreTake(ra->lock, portMAX_DELAY);
+            continue;
+        }
+        uint32_t n = MIN(end, found->lba + found->count) - pos;
+        memcpy((uint8_t *)dest + (pos - lba) * ra->sector_size,
+               found->data + (pos - found->lba) * ra->sector_size, n * ra->sector_size);
+        pos += n;
+        found->served_end = MAX(found->served_end, pos);
+    }
+    ra->stats.hit_sectors += pos - lba;
+    ra->stats.miss_sectors += end - pos;
+    if (sequential) {
+        _readahead_schedule(h, end, count);
+    }
+    xSemaphoreGive(ra->lock);
+
+    if (pos == end) {
+        return ESP_OK;
+    }
+    return msc_storage_read_sector(h, pos, 0, (end - pos) * ra->sector_size,
+                                   (uint8_t *)dest + (pos - lba) * ra->sector_size);
+}
+
+/**
+ * Starts filling a free buffer with the sectors following what is already cached or being fetched
+ * after `end`, unless a full window is already ahead of the host. The window is at least the size
+ * of the host requests. Called with the lock held.
+ */
+static void _readahead_schedule(tinyusb_msc_storage_handle_s *h, uint32_t end, uint32_t count)
+{
+    msc_readahead_t *ra = &h->ra;
+    const uint32_t sector_count = (h->sector_count)(h);
+    uint32_t frontier = end;
+    int idx = -1;
+
+    ra->window = MAX(ra->window, MIN(ra->capacity, count));
+    // two passes, the buffers may be in either order
+    for (int i = 0; i < 4; i++) {
+        msc_readahead_buf_t *b = &ra->buf[i % 2];
+        uint32_t b_end = b->lba + b->count;
+        if (b->count && b->lba <= frontier && b_end > frontier) {
+            frontier = b_end;
+        }
+    }
+    if (frontier - end >= ra->window || frontier >= sector_count) {
+        return;
+    }
+    // reuse a buffer the host is done with: empty, or entirely behind the current position
+    for (int i = 0; i < 2 && idx < 0; i++) {
+        msc_readahead_buf_t *b = &ra->buf[i];
+        if (!b->filling && (b->count == 0 || b->lba + b->count <= end || b->lba > frontier)) {
+            idx = i;
+        }
+    }
+    if (idx < 0) {
+        return;
+    }
+
+    msc_readahead_buf_t *b = &ra->buf[idx];
+    if (b->count) {
+        // adapt the window to how much of the previous prefetch the host actually read
+        uint32_t served = (b->served_end > b->lba) ? MIN(b->served_end, b->lba + b->count) - b->lba : 0;
+        uint32_t wasted = b->count - served;
+        ra->stats.wasted_sectors += wasted;
+        if (wasted) {
+            ra->window = MAX(ra->window_min, ra->window / 2);
+        } else {
+            ra->window = MIN(ra->capacity, ra->window * 2);
+        }
+    }
+    b->lba = frontier;
+    b->count = MIN(ra->window, sector_count - frontier);
+    b->served_end = 0;
+    b->filling = true;
+    b->stale = false;
+    ra->stats.window_sectors = ra->window;
+
+    uint8_t i = (uint8_t)idx;
+    if (xQueueSend(ra->queue, &i, 0) != pdTRUE) {
+        b->filling = false;
+        b->count = 0;
+    }
+}
+
+static void _readahead_task(void *arg)
+{
+    tinyusb_msc_storage_handle_s *h = arg;
+    msc_readahead_t *ra = &h->ra;
+    uint8_t idx;
+
+    while (true) {
+        xQueueReceive(ra->queue, &idx, portMAX_DELAY);
+        msc_readahead_buf_t *b = &ra->buf[idx];
+        esp_err_t err = msc_storage_read_sector(h, b->lba, 0, b->count * ra->sector_size, b->data);
+
+        xSemaphoreTake(ra->lock, portMAX_DELAY);
+        b->filling = false;
+        if (err != ESP_OK || b->stale) {
+            b->count = 0;
+        } else {
+            ra->stats.prefetched_sectors += b->count;
+        }
+        xSemaphoreGive(ra->lock);
+        xSemaphoreGive(ra->done);
+    }
+}
+
+/**
+ * Drops cached sectors overlapping `size` bytes from `lba` on. A buffer being filled is marked stale
+ * and dropped once the read completes. `size` 0 drops everything.
+ */
+static void _readahead_invalidate(tinyusb_msc_storage_handle_s *h, uint32_t lba, size_t size)
+{
+    msc_readahead_t *ra = &h->ra;
+
+    if (!ra->enabled) {
+        return;
+    }
+    const uint32_t count = (size + ra->sector_size - 1) / ra->sector_size;
+    xSemaphoreTake(ra->lock, portMAX_DELAY);
+    for (int i = 0; i < 2; i++) {
+        msc_readahead_buf_t *b = &ra->buf[i];
+        if (count == 0 || (lba < b->lba + b->count && b->lba < lba + count)) {
+            if (b->filling) {
+                b->stale = true;
+            } else {
+                b->count = 0;
+            }
+        }
+    }
+    ra->next_lba = UINT32_MAX;
+    xSemaphoreGive(ra->lock);
+}
+
+/* Write-back cache
+   ********************************************************************* */
+
+/**
+ * Host writes of up to `run_max` sectors (FAT, directory and small file updates, scattered all over
+ * the volume) are kept in RAM, a sector written again only replaces the cached copy. A flush writes
+ * the cached sectors in LBA order, each run of adjacent sectors as one multi-block command. Larger
+ * host writes go to the media at once and drop the cached copies they overwrite. Host reads see the
+ * cached sectors over what is on the media or in the read-ahead cache.
+ */
+static void _writeback_init(tinyusb_msc_storage_handle_s *h)
+{
+    msc_writeback_t *wb = &h->wb;
+    const uint32_t sector_size = (h->sector_size)(h);
+    uint32_t slots = h->uncached ? 0 : MIN(CONFIG_TINYUSB_MSC_WRITEBACK_SIZE / sector_size, UINT16_MAX);
+
+    memset(wb, 0, sizeof(*wb));
+    if (slots == 0 && !h->flush) {
+        return;
+    }
+    // without slots every write is direct, the task still flushes the backend when the host is idle
+    if (slots) {
+        wb->run_max = MAX(1, slots / 4);
+        wb->data = heap_caps_malloc(slots * sector_size, MALLOC_CAP_INTERNAL);
+        wb->lba = heap_caps_malloc(slots * sizeof(uint32_t), MALLOC_CAP_INTERNAL);
+        wb->order = heap_caps_malloc(slots * sizeof(uint16_t), MALLOC_CAP_INTERNAL);
+        wb->staging = heap_caps_malloc(wb->run_max * sector_size, MALLOC_CAP_DMA | MALLOC_CAP_INTERNAL);
+        if (!wb->data || !wb->lba || !wb->order || !wb->staging) {
+            ESP_LOGW(TAG, "Write-back cache disabled, out of memory");
+            slots = 0;
+            wb->run_max = 0;
+        }
+    }
+    wb->lock = xSemaphoreCreateMutex();
+    wb->kick = xSemaphoreCreateBinary();
+    if (!wb->lock || !wb->kick ||
+            xTaskCreate(_writeback_task, "msc_writeback", MSC_WRITEBACK_TASK_STACK, h,
+                        MSC_WRITEBACK_TASK_PRIO, &wb->task) != pdPASS) {
+        ESP_LOGW(TAG, "Write-back disabled, out of memory");
+        _writeback_deinit(h);
+        return;
+    }
+    wb->sector_size = sector_size;
+    wb->slots = slots;
+    wb->enabled = true;
+}
+
+static void _writeback_deinit(tinyusb_msc_storage_handle_s *h)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    if (wb->task) {
+        vTaskDelete(wb->task);
+    }
+    if (wb->lock) {
+        vSemaphoreDelete(wb->lock);
+    }
+    if (wb->kick) {
+        vSemaphoreDelete(wb->kick);
+    }
+    heap_caps_free(wb->data);
+    heap_caps_free(wb->lba);
+    heap_caps_free(wb->order);
+    heap_caps_free(wb->staging);
+    memset(wb, 0, sizeof(*wb));
+}
+
+static esp_err_t _writeback_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    if (!wb->enabled) {
+        return _readahead_read(h, lba, offset, size, dest);
+    }
+    // the lock keeps a flush from dropping cached sectors between the media read and the overlay
+    xSemaphoreTake(wb->lock, portMAX_DELAY);
+    esp_err_t err = _readahead_read(h, lba, offset, size, dest);
+    if (err == ESP_OK) {
+        _writeback_overlay(h, lba, offset, size, dest);
+    }
+    xSemaphoreGive(wb->lock);
+    return err;
+}
+
+/**
+ * Copies the cached sectors over what was read from the media. Called with the lock held.
+ */
+static void _writeback_overlay(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, void *dest)
+{
+    msc_writeback_t *wb = &h->wb;
+    const uint64_t start = (uint64_t)lba * wb->sector_size + offset;
+    const uint64_t end = start + size;
+
+    for (uint32_t i = 0; i < wb->used; i++) {
+        const uint64_t s_start = (uint64_t)wb->lba[i] * wb->sector_size;
+        const uint64_t from = MAX(start, s_start);
+        const uint64_t to = MIN(end, s_start + wb->sector_size);
+        if (from < to) {
+            memcpy((uint8_t *)dest + (from - start), wb->data + i * wb->sector_size + (from - s_start), to - from);
+        }
+    }
+}
+
+/**
+ * Takes a host write. A full cache is flushed first, which is where most merging happens.
+ */
+static esp_err_t _writeback_write(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t offset, size_t size, const void *src)
+{
+    msc_writeback_t *wb = &h->wb;
+    esp_err_t err = ESP_OK;
+
+    if (!wb->enabled) {
+        return msc_storage_write_sector(h, lba, offset, size, src);
+    }
+    if (h->is_fat_mounted) {
+        ESP_LOGE(TAG, "can't write, FAT mounted");
+        return ESP_ERR_INVALID_STATE;
+    }
+
+    const uint32_t count = size / wb->sector_size;
+    xSemaphoreTake(wb->lock, portMAX_DELAY);
+    wb->dirty = true;
+    wb->last_write = xTaskGetTickCount();
+    if (offset != 0 || size % wb->sector_size != 0 || count > wb->run_max) {
+        err = msc_storage_write_sector(h, lba, offset, size, src);
+        if (err == ESP_OK) {
+            _writeback_discard(h, lba, count);
+            wb->stats.direct_sectors += count;
+        }
+        xSemaphoreGive(wb->lock);
+        xSemaphoreGive(wb->kick);
+        return err;
+    }
+    for (uint32_t i = 0; i < count && err == ESP_OK; i++) {
+        uint32_t slot = 0;
+        while (slot < wb->used && wb->lba[slot] != lba + i) {
+            slot++;
+        }
+        if (slot < wb->used) {
+            wb->stats.merged_sectors++;
+        } else {
+            if (wb->used == wb->slots) {
+                err = _writeback_flush_locked(h);
+                if (err != ESP_OK) {
+                    break;
+                }
+            }
+            slot = wb->used++;
+            wb->lba[slot] = lba + i;
+        }
+        memcpy(wb->data + slot * wb->sector_size, (const uint8_t *)src + i * wb->sector_size, wb->sector_size);
+        wb->stats.cached_sectors++;
+    }
+    xSemaphoreGive(wb->lock);
+    xSemaphoreGive(wb->kick);
+    return err;
+}
+
+/**
+ * Drops the cached copies of `count` sectors from `lba` on. Called with the lock held.
+ */
+static void _writeback_discard(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    for (uint32_t i = wb->used; i-- > 0;) {
+        if (wb->lba[i] >= lba && wb->lba[i] - lba < count) {
+            // the last slot fills the hole
+            wb->used--;
+            if (i != wb->used) {
+                wb->lba[i] = wb->lba[wb->used];
+                memcpy(wb->data + i * wb->sector_size, wb->data + wb->used * wb->sector_size, wb->sector_size);
+            }
+        }
+    }
+}
+
+/**
+ * Writes every cached sector, runs of adjacent LBAs merged. On error the cache is left as it is, the
+ * runs already written are simply written again by the next flush. Called with the lock held.
+ */
+static esp_err_t _writeback_flush_locked(tinyusb_msc_storage_handle_s *h)
+{
+    msc_writeback_t *wb = &h->wb;
+    const uint32_t sector_size = wb->sector_size;
+
+    if (wb->used == 0) {
+        return ESP_OK;
+    }
+    // insertion sort, the cache holds a few dozen sectors
+    for (uint32_t i = 0; i < wb->used; i++) {
+        uint32_t j = i;
+        while (j > 0 && wb->lba[wb->order[j - 1]] > wb->lba[i]) {
+            wb->order[j] = wb->order[j - 1];
+            j--;
+        }
+        wb->order[j] = (uint16_t)i;
+    }
+
+    for (uint32_t i = 0, n = 0; i < wb->used; i += n) {
+        const uint32_t first = wb->lba[wb->order[i]];
+        for (n = 0; i + n < wb->used && n < wb->run_max && wb->lba[wb->order[i + n]] == first + n; n++) {
+            memcpy(wb->staging + n * sector_size, wb->data + wb->order[i + n] * sector_size, sector_size);
+        }
+        esp_err_t err = msc_storage_write_sector(h, first, 0, n * sector_size, wb->staging);
+        if (err != ESP_OK) {
+            ESP_LOGE(TAG, "Write-back of %lu sectors at %lu failed: 0x%x", n, first, err);
+            return err;
+        }
+        // a prefetch may have read the old contents while the sectors were cached
+        _readahead_invalidate(h, first, n * sector_size);
+        wb->stats.flushed_sectors += n;
+        wb->stats.flush_writes++;
+    }
+    wb->used = 0;
+    wb->stats.flushes++;
+    return ESP_OK;
+}
+
+/**
+ * Flushes the cache, then whatever the backend holds in RAM. Called with the lock held.
+ */
+static esp_err_t _writeback_sync_locked(tinyusb_msc_storage_handle_s *h)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    esp_err_t err = _writeback_flush_locked(h);
+    if (err == ESP_OK && h->flush) {
+        err = (h->flush)(h);
+    }
+    if (err == ESP_OK) {
+        wb->dirty = false;
+    }
+    return err;
+}
+
+/**
+ * Flushes the cache once the host stopped writing for CONFIG_TINYUSB_MSC_WRITEBACK_IDLE_MS. A failed
+ * flush is retried after the same delay.
+ */
+static void _writeback_task(void *arg)
+{
+    tinyusb_msc_storage_handle_s *h = arg;
+    msc_writeback_t *wb = &h->wb;
+    const TickType_t idle = pdMS_TO_TICKS(CONFIG_TINYUSB_MSC_WRITEBACK_IDLE_MS);
+    TickType_t wait = portMAX_DELAY;
+
+    while (true) {
+        xSemaphoreTake(wb->kick, wait);
+        xSemaphoreTake(wb->lock, portMAX_DELAY);
+        TickType_t elapsed = xTaskGetTickCount() - wb->last_write;
+        if (wb->dirty && elapsed >= idle) {
+            _writeback_sync_locked(h);
+            elapsed = 0;
+        }
+        wait = wb->dirty ? idle - elapsed : portMAX_DELAY;
+        xSemaphoreGive(wb->lock);
+    }
+}
+
+/* SPI flash write combining
+   ********************************************************************* */
+
+/**
+ * With wear levelling sectors smaller than a flash sector (CONFIG_WL_SECTOR_SIZE 512), erasing one
+ * storage sector erases and rewrites its whole 4 KB flash sector. Host writes are therefore gathered
+ * per flash sector in a few RAM blocks, and each block is erased and programmed once: as soon as the
+ * host wrote all of it, when it is the least recently written block and another one is needed, or on
+ * a flush. Sectors the host did not write are read back from the flash first. Host writes covering
+ * whole flash sectors bypass the blocks.
+ */
+static void _wl_combine_init(tinyusb_msc_storage_handle_s *h)
+{
+    msc_wl_combine_t *wc = &h->wc;
+    const uint32_t sector_size = (h->sector_size)(h);
+    const uint32_t blocks = MIN(CONFIG_TINYUSB_MSC_WL_COMBINE_SIZE / MSC_WL_ERASE_SIZE, MSC_WL_COMBINE_BLOCKS_MAX);
+
+    memset(wc, 0, sizeof(*wc));
+    // only the wear levelling backend erases flash sectors
+    if (h->write != &_write_sector_spiflash || blocks == 0 || sector_size == 0 || sector_size * 2 > MSC_WL_ERASE_SIZE) {
+        return;
+    }
+    wc->lock = xSemaphoreCreateMutex();
+    wc->data = heap_caps_malloc(blocks * MSC_WL_ERASE_SIZE, MALLOC_CAP_INTERNAL);
+    if (!wc->lock || !wc->data) {
+        ESP_LOGW(TAG, "Flash write combining disabled, out of memory");
+        _wl_combine_deinit(h);
+        return;
+    }
+    for (uint32_t i = 0; i < blocks; i++) {
+        wc->block[i].addr = SIZE_MAX;
+    }
+    wc->blocks = blocks;
+    wc->sector_size = sector_size;
+    wc->full_mask = (1UL << (MSC_WL_ERASE_SIZE / sector_size)) - 1;
+    wc->enabled = true;
+}
+
+static void _wl_combine_deinit(tinyusb_msc_storage_handle_s *h)
+{
+    msc_wl_combine_t *wc = &h->wc;
+
+    if (wc->lock) {
+        vSemaphoreDelete(wc->lock);
+    }
+    heap_caps_free(wc->data);
+    memset(wc, 0, sizeof(*wc));
+}
+
+static esp_err_t _wl_combine_write(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size, const void *src)
+{
+    msc_wl_combine_t *wc = &h->wc;
+    const uint8_t *p = src;
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(wc->lock, portMAX_DELAY);
+    wc->stats.host_sectors += size / wc->sector_size;
+    while (size > 0 && err == ESP_OK) {
+        const size_t base = addr - addr % MSC_WL_ERASE_SIZE;
+        const size_t off = addr - base;
+        const size_t n = MIN(size, MSC_WL_ERASE_SIZE - off);
+        msc_wl_block_t *b = NULL;
+
+        for (uint32_t i = 0; i < wc->blocks; i++) {
+            if (wc->block[i].addr == base) {
+                b = &wc->block[i];
+            }
+        }
+        if (n == MSC_WL_ERASE_SIZE) {
+            // the gathered sectors are overwritten anyway
+            if (b) {
+                b->addr = SIZE_MAX;
+            }
+            err = _wl_combine_program(h, base, p);
+            wc->stats.whole_blocks++;
+        } else {
+            if (b == NULL && (b = _wl_combine_get(h, &err)) != NULL) {
+                b->addr = base;
+                b->valid = 0;
+            }
+            if (b) {
+                memcpy(wc->data + (b - wc->block) * MSC_WL_ERASE_SIZE + off, p, n);
+                b->valid |= ((1UL << (n / wc->sector_size)) - 1) << (off / wc->sector_size);
+                b->age = ++wc->seq;
+                if (b->valid == wc->full_mask) {
+                    err = _wl_combine_flush_block(h, b);
+                }
+            }
+        }
+        addr += n;
+        p += n;
+        size -= n;
+    }
+    xSemaphoreGive(wc->lock);
+    return err;
+}
+
+/**
+ * Returns a free block, flushing the least recently written one if there is none. Called with the
+ * lock held.
+ */
+static msc_wl_block_t *_wl_combine_get(tinyusb_msc_storage_handle_s *h, esp_err_t *err)
+{
+    msc_wl_combine_t *wc = &h->wc;
+    msc_wl_block_t *b = NULL;
+
+    for (uint32_t i = 0; i < wc->blocks; i++) {
+        msc_wl_block_t *c = &wc->block[i];
+        if (c->addr == SIZE_MAX) {
+            return c;
+        }
+        if (b == NULL || (int32_t)(c->age - b->age) < 0) {
+            b = c;
+        }
+    }
+    *err = _wl_combine_flush_block(h, b);
+    return (*err == ESP_OK) ? b : NULL;
+}
+
+/**
+ * Completes a block with the sectors the host did not write and programs it. The block stays in use
+ * on error. Called with the lock held.
+ */
+static esp_err_t _wl_combine_flush_block(tinyusb_msc_storage_handle_s *h, msc_wl_block_t *b)
+{
+    msc_wl_combine_t *wc = &h->wc;
+    uint8_t *data = wc->data + (b - wc->block) * MSC_WL_ERASE_SIZE;
+    esp_err_t err = ESP_OK;
+
+    for (uint32_t i = 0; i * wc->sector_size < MSC_WL_ERASE_SIZE && err == ESP_OK; i++) {
+        if (!(b->valid & (1UL << i))) {
+            err = wl_read(h->wl_handle, b->addr + i * wc->sector_size,
+                          data + i * wc->sector_size, wc->sector_size);
+            wc->stats.fill_sectors++;
+        }
+    }
+    if (err == ESP_OK) {
+        err = _wl_combine_program(h, b->addr, data);
+    }
+    if (err != ESP_OK) {
+        ESP_LOGE(TAG, "Failed to write flash sector at 0x%x: 0x%x", b->addr, err);
+        return err;
+    }
+    b->addr = SIZE_MAX;
+    b->valid = 0;
+    wc->stats.gathered_blocks++;
+    return ESP_OK;
+}
+
+static esp_err_t _wl_combine_program(tinyusb_msc_storage_handle_s *h, size_t addr, const void *data)
+{
+    msc_wl_combine_t *wc = &h->wc;
+
+    ESP_RETURN_ON_ERROR(_wl_erase(h, addr, MSC_WL_ERASE_SIZE),
+                        TAG, "Failed to erase");
+    wc->stats.erases++;
+    return wl_write(h->wl_handle, addr, data, MSC_WL_ERASE_SIZE);
+}
+
+/**
+ * Copies the gathered sectors over what was read from the flash.
+ */
+static void _wl_combine_overlay(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size, void *dest)
+{
+    msc_wl_combine_t *wc = &h->wc;
+
+    if (!wc->enabled) {
+        return;
+    }
+    xSemaphoreTake(wc->lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < wc->blocks; i++) {
+        const msc_wl_block_t *b = &wc->block[i];
+        if (b->addr == SIZE_MAX || b->addr >= addr + size || b->addr + MSC_WL_ERASE_SIZE <= addr) {
+            continue;
+        }
+        for (uint32_t s = 0; s * wc->sector_size < MSC_WL_ERASE_SIZE; s++) {
+            const size_t s_start = b->addr + s * wc->sector_size;
+            const size_t from = MAX(addr, s_start);
+            const size_t to = MIN(addr + size, s_start + wc->sector_size);
+            if ((b->valid & (1UL << s)) && from < to) {
+                memcpy((uint8_t *)dest + (from - addr), wc->data + i * MSC_WL_ERASE_SIZE + (from - b->addr), to - from);
+            }
+        }
+    }
+    xSemaphoreGive(wc->lock);
+}
+
+/**
+ * Drops the blocks of the flash sectors lying entirely in the range, the host no longer needs them.
+ */
+static void _wl_combine_discard(tinyusb_msc_storage_handle_s *h, size_t addr, size_t size)
+{
+    msc_wl_combine_t *wc = &h->wc;
+
+    if (!wc->enabled) {
+        return;
+    }
+    xSemaphoreTake(wc->lock, portMAX_DELAY);
+    for (uint32_t i = 0; i < wc->blocks; i++) {
+        msc_wl_block_t *b = &wc->block[i];
+        if (b->addr != SIZE_MAX && b->addr >= addr && b->addr + MSC_WL_ERASE_SIZE <= addr + size) {
+            b->addr = SIZE_MAX;
+            b->valid = 0;
+        }
+    }
+    xSemaphoreGive(wc->lock);
+}
+
+/* Metadata cache
+   ********************************************************************* */
+
+/**
+ * FatFs reads and writes the boot sector, the FAT, the directories and the exFAT allocation bitmap
+ * one sector at a time through the window of its volume object, which holds a single sector: a
+ * directory scan or a cluster chain walk reads the same sectors over and over. The sectors moved
+ * through the window are kept here, the least recently used dropped first. File data goes through
+ * the per-file buffers or straight to the caller's buffer and is not cached; it only drops the
+ * copies of the sectors it overwrites, and sees the ones still to be written over what it reads.
+ *
+ * With write-back, FatFs writes replace the cached copy and reach the storage on a sync (f_sync(),
+ * f_close() and every directory change), when the slot is needed for another sector, or on
+ * unmount. The cache only lives while the volume is mounted on the application: it is written and
+ * emptied before the host gets the volume, and emptied without writing when the medium is removed.
+ */
+static void _meta_cache_init(tinyusb_msc_storage_handle_s *h)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    memset(mc, 0, sizeof(*mc));
+    // a RAM disk is read as fast as the cache
+    if (h->uncached || CONFIG_TINYUSB_MSC_META_CACHE_SIZE == 0) {
+        return;
+    }
+    mc->lock = xSemaphoreCreateMutex();
+    mc->data = heap_caps_malloc(CONFIG_TINYUSB_MSC_META_CACHE_SIZE, MALLOC_CAP_INTERNAL);
+    if (!mc->lock || !mc->data) {
+        ESP_LOGW(TAG, "Metadata cache disabled, out of memory");
+        _meta_cache_deinit(h);
+        return;
+    }
+#if CONFIG_TINYUSB_MSC_META_CACHE_WRITE_BACK
+    mc->write_back = true;
+#endif
+    mc->enabled = true;
+}
+
+static void _meta_cache_deinit(tinyusb_msc_storage_handle_s *h)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    if (mc->lock) {
+        vSemaphoreDelete(mc->lock);
+    }
+    heap_caps_free(mc->data);
+    memset(mc, 0, sizeof(*mc));
+}
+
+/**
+ * The volume is being mounted on the application with `win` as the FatFs window. The slots are cut
+ * to the sector size of the medium in place, which may differ from the one before.
+ */
+static void _meta_cache_attach(tinyusb_msc_storage_handle_s *h, const BYTE *win)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    if (!mc->enabled) {
+        return;
+    }
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    mc->sector_size = (h->sector_size)(h);
+    mc->slots = MIN(CONFIG_TINYUSB_MSC_META_CACHE_SIZE / mc->sector_size, MSC_META_CACHE_SLOTS_MAX);
+    for (uint32_t i = 0; i < MSC_META_CACHE_SLOTS_MAX; i++) {
+        mc->slot[i] = (msc_meta_slot_t) {
+            .lba = UINT32_MAX,
+        };
+    }
+    mc->dirty_count = 0;
+    // sectors larger than the whole cache are never cached
+    mc->win = mc->slots ? win : NULL;
+    xSemaphoreGive(mc->lock);
+}
+
+/**
+ * The mount on the application ends. The sectors still to be written go to the storage, unless
+ * `discard`, and the cache is emptied; it stays as it was if a write fails.
+ */
+static esp_err_t _meta_cache_detach(tinyusb_msc_storage_handle_s *h, bool discard)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    if (!mc->enabled) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    esp_err_t err = discard ? ESP_OK : _meta_cache_flush_locked(h);
+    if (err == ESP_OK) {
+        _meta_cache_drop(mc, 0, UINT32_MAX);
+        mc->win = NULL;
+        mc->stats.invalidations++;
+    }
+    xSemaphoreGive(mc->lock);
+    return err;
+}
+
+static esp_err_t _meta_cache_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count, void *dest)
+{
+    msc_meta_cache_t *mc = &h->mc;
+    const size_t sector_size = mc->sector_size;
+    esp_err_t err;
+
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    if (dest != mc->win || count != 1 || mc->bypass) {
+        if (dest == mc->win && mc->win) {
+            mc->stats.misses++;
+        }
+        err = msc_storage_read_sector(h, lba, 0, (size_t)count * sector_size, dest);
+        // a sector still to be written is newer than the storage's copy
+        for (uint32_t i = 0; err == ESP_OK && mc->dirty_count && i < mc->slots; i++) {
+            const msc_meta_slot_t *s = &mc->slot[i];
+            if (s->dirty && s->lba - lba < count) {
+                memcpy((uint8_t *)dest + (size_t)(s->lba - lba) * sector_size, mc->data + i * sector_size, sector_size);
+            }
+        }
+        xSemaphoreGive(mc->lock);
+        return err;
+    }
+
+    for (uint32_t i = 0; i < mc->slots; i++) {
+        msc_meta_slot_t *s = &mc->slot[i];
+        if (s->lba == lba) {
+            memcpy(dest, mc->data + i * sector_size, sector_size);
+            s->age = ++mc->seq;
+            mc->stats.hits++;
+            xSemaphoreGive(mc->lock);
+            return ESP_OK;
+        }
+    }
+    mc->stats.misses++;
+    err = msc_storage_read_sector(h, lba, 0, sector_size, dest);
+    msc_meta_slot_t *s = (err == ESP_OK) ? _meta_cache_get(h) : NULL;
+    if (s) {
+        memcpy(mc->data + (s - mc->slot) * sector_size, dest, sector_size);
+        s->lba = lba;
+        s->age = ++mc->seq;
+    }
+    xSemaphoreGive(mc->lock);
+    return err;
+}
+
+static esp_err_t _meta_cache_write(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count, const void *src)
+{
+    msc_meta_cache_t *mc = &h->mc;
+    const size_t sector_size = mc->sector_size;
+    esp_err_t err = ESP_OK;
+
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    if (src != mc->win || count != 1 || mc->bypass) {
+        err = _app_write(h, lba, count, src);
+        // even if the write failed, the sectors may hold part of it
+        _meta_cache_drop(mc, lba, count);
+        xSemaphoreGive(mc->lock);
+        return err;
+    }
+
+    mc->stats.writes++;
+    msc_meta_slot_t *s = NULL;
+    for (uint32_t i = 0; i < mc->slots && !s; i++) {
+        if (mc->slot[i].lba == lba) {
+            s = &mc->slot[i];
+        }
+    }
+    if (!s) {
+        s = _meta_cache_get(h);
+    }
+    // no slot when a dirty one could not be written, the sector is written through
+    if (mc->write_back && s) {
+        if (s->dirty) {
+            mc->stats.absorbed++;
+        } else {
+            s->dirty = true;
+            mc->dirty_count++;
+        }
+    } else {
+        err = _app_write(h, lba, 1, src);
+    }
+    if (s && err == ESP_OK) {
+        memcpy(mc->data + (s - mc->slot) * sector_size, src, sector_size);
+        s->lba = lba;
+        s->age = ++mc->seq;
+    } else if (s) {
+        // what the storage holds now is unknown
+        s->lba = UINT32_MAX;
+    }
+    xSemaphoreGive(mc->lock);
+    return err;
+}
+
+static esp_err_t _meta_cache_flush(tinyusb_msc_storage_handle_s *h)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    if (!mc->enabled) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    esp_err_t err = _meta_cache_flush_locked(h);
+    xSemaphoreGive(mc->lock);
+    return err;
+}
+
+/**
+ * Writes the dirty sectors in LBA order, they mostly lie in the FAT and a few directories. The
+ * sectors are kept, clean.
+ */
+static esp_err_t _meta_cache_flush_locked(tinyusb_msc_storage_handle_s *h)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    while (mc->dirty_count) {
+        msc_meta_slot_t *first = NULL;
+        for (uint32_t i = 0; i < mc->slots; i++) {
+            msc_meta_slot_t *s = &mc->slot[i];
+            if (s->dirty && (!first || s->lba < first->lba)) {
+                first = s;
+            }
+        }
+        ESP_RETURN_ON_ERROR(_app_write(h, first->lba, 1, mc->data + (first - mc->slot) * mc->sector_size),
+                            TAG, "Failed to write sector %lu", first->lba);
+        first->dirty = false;
+        mc->dirty_count--;
+        mc->stats.flushed++;
+    }
+    return ESP_OK;
+}
+
+/**
+ * FatFs freed the sectors, the copies are dropped without being written.
+ */
+static void _meta_cache_discard(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    if (!mc->enabled) {
+        return;
+    }
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    _meta_cache_drop(mc, lba, count);
+    xSemaphoreGive(mc->lock);
+}
+
+static void _meta_cache_drop(msc_meta_cache_t *mc, uint32_t lba, uint32_t count)
+{
+    for (uint32_t i = 0; i < mc->slots; i++) {
+        msc_meta_slot_t *s = &mc->slot[i];
+        // also false for the free slots, UINT32_MAX - lba < count never holds
+        if (s->lba - lba < count) {
+            mc->dirty_count -= s->dirty;
+            s->lba = UINT32_MAX;
+            s->dirty = false;
+        }
+    }
+}
+
+/**
+ * A free slot, or the least recently used one once its sector is written; NULL if that write failed.
+ * Called with the lock held.
+ */
+static msc_meta_slot_t *_meta_cache_get(tinyusb_msc_storage_handle_s *h)
+{
+    msc_meta_cache_t *mc = &h->mc;
+    msc_meta_slot_t *victim = NULL;
+
+    for (uint32_t i = 0; i < mc->slots; i++) {
+        msc_meta_slot_t *s = &mc->slot[i];
+        if (s->lba == UINT32_MAX) {
+            return s;
+        }
+        if (!victim || (int32_t)(s->age - victim->age) < 0) {
+            victim = s;
+        }
+    }
+    if (victim->dirty) {
+        if (_app_write(h, victim->lba, 1, mc->data + (victim - mc->slot) * mc->sector_size) != ESP_OK) {
+            return NULL;
+        }
+        victim->dirty = false;
+        mc->dirty_count--;
+        mc->stats.flushed++;
+    }
+    mc->stats.evictions++;
+    victim->lba = UINT32_MAX;
+    return victim;
+}
+
+/**
+ * Makes FatFs go straight to the storage, or back through the cache. Either way the cache is written
+ * and starts empty; it is kept if a write fails.
+ */
+static esp_err_t _meta_cache_bypass(tinyusb_msc_storage_handle_s *h, bool bypass)
+{
+    msc_meta_cache_t *mc = &h->mc;
+
+    if (!mc->enabled) {
+        return ESP_OK;
+    }
+    xSemaphoreTake(mc->lock, portMAX_DELAY);
+    esp_err_t err = _meta_cache_flush_locked(h);
+    if (err == ESP_OK) {
+        _meta_cache_drop(mc, 0, UINT32_MAX);
+    }
+    mc->bypass = bypass;
+    xSemaphoreGive(mc->lock);
+    return err;
+}
+
+/* Free space accounting
+   ********************************************************************* */
+
+/**
+ * Called after FatFs mounted the volume. FatFs already loaded the count from a valid FSINFO sector;
+ * otherwise the count kept from the previous mount is handed back to it. Only if neither exists
+ * (first mount of a volume without FSINFO, or the USB host wrote to it meanwhile) the FAT is scanned
+ * in the background, so no caller ever waits for a full f_getfree().
+ */
+static void _free_space_mounted(tinyusb_msc_storage_handle_s *h, FATFS *fs)
+{
+    h->fs = fs;
+    h->fat_type = fs->fs_type;
+    h->fat_entries = fs->n_fatent;
+    h->fat_cluster_bytes = (uint32_t)fs->csize * (h->sector_size)(h);
+    h->fat_base = fs->fatbase;
+#if FF_FS_EXFAT
+    if (fs->fs_type == FS_EXFAT) {
+        h->fat_base = fs->bitbase;
+    }
+#endif
+
+    if (h->free_valid && h->free_host_writes != h->host_write_count) {
+        h->free_valid = false;
+    }
+    if (h->free_valid && h->free_clusters <= fs->n_fatent - 2) {
+        // FSINFO is only rewritten on sync, our own count is at least as recent
+        fs->free_clst = h->free_clusters;
+    } else if (fs->free_clst <= fs->n_fatent - 2) {
+        h->free_clusters = fs->free_clst;
+        h->free_host_writes = h->host_write_count;
+        h->free_valid = true;
+    } else {
+        _free_space_scan_start(h);
+    }
+}
+
+static void _free_space_unmounting(tinyusb_msc_storage_handle_s *h)
+{
+    FATFS *fs = h->fs;
+
+    if (fs && fs->free_clst <= fs->n_fatent - 2) {
+        h->free_clusters = fs->free_clst;
+        h->free_host_writes = h->host_write_count;
+        h->free_valid = true;
+    }
+    h->fs = NULL;
+}
+
+static void _free_space_scan_start(tinyusb_msc_storage_handle_s *h)
+{
+    if (h->free_scanning || h->fat_type == 0) {
+        return;
+    }
+    h->free_scanning = true;
+    if (xTaskCreate(_free_space_scan_task, "msc_free_scan", MSC_FREE_SCAN_TASK_STACK, h,
+                    MSC_FREE_SCAN_TASK_PRIO, NULL) != pdPASS) {
+        ESP_LOGE(TAG, "Failed to start free space scan");
+        h->free_scanning = false;
+    }
+}
+
+/**
+ * Counts the free clusters by reading the FAT (exFAT: the allocation bitmap) straight from the
+ * media, one sector at a time at low priority and without holding the FatFs volume lock. Entries
+ * are read as a little endian bit stream, which covers the packed 12 bit entries of FAT12 as well.
+ * The result is dropped if the USB host wrote to the media meanwhile; clusters the application
+ * allocates during the scan may be missed, which only makes the count a slight overestimate until
+ * the next valid FSINFO is read.
+ */
+static void _free_space_scan_task(void *arg)
+{
+    tinyusb_msc_storage_handle_s *h = arg;
+    const uint32_t host_writes = h->host_write_count;
+    const uint32_t sector_size = (h->sector_size)(h);
+    const uint32_t entries = h->fat_entries;
+    uint32_t width;
+    uint32_t index;         // cluster number of the next entry
+    uint32_t free_clst = 0;
+    uint64_t acc = 0;
+    uint32_t bits = 0;
+    TickType_t start = xTaskGetTickCount();
+
+    switch (h->fat_type) {
+    case FS_FAT12: width = 12; index = 0; break;
+    case FS_FAT16: width = 16; index = 0; break;
+    case FS_FAT32: width = 32; index = 0; break;
+    default:       width = 1;  index = 2; break;       // exFAT bitmap starts at cluster 2
+    }
+    const uint32_t mask = (width == 32) ? 0x0FFFFFFF : (1UL << width) - 1;
+
+    uint8_t *buf = malloc(sector_size);
+    bool ok = (buf != NULL);
+    for (LBA_t sect = h->fat_base; ok && index < entries; sect++) {
+        ok = (msc_storage_read_sector(h, sect, 0, sector_size, buf) == ESP_OK) &&
+             (h->host_write_count == host_writes);
+        for (uint32_t i = 0; ok && i < sector_size && index < entries; i++) {
+            acc |= (uint64_t)buf[i] << bits;
+            bits += 8;
+            while (bits >= width && index < entries) {
+                if (index >= 2 && (acc & mask) == 0) {
+                    free_clst++;
+                }
+                acc >>= width;
+                bits -= width;
+                index++;
+            }
+        }
+    }
+    free(buf);
+
+    if (ok) {
+        h->free_clusters = free_clst;
+        h->free_host_writes = host_writes;
+        h->free_valid = true;
+        ESP_LOGI(TAG, "Free space scan: %lu of %lu clusters free (%lu ms)", free_clst, entries - 2,
+                 (unsigned long)((xTaskGetTickCount() - start) * portTICK_PERIOD_MS));
+    } else {
+        ESP_LOGW(TAG, "Free space scan aborted");
+    }
+    h->free_scanning = false;
+    vTaskDelete(NULL);
+}
+
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+/* Latency statistics
+   ********************************************************************* */
+
+static uint32_t _latency_bucket(uint32_t us)
+{
+    return (us < 2) ? 0 : MIN(31 - __builtin_clz(us), TINYUSB_MSC_LATENCY_BUCKETS - 1);
+}
+
+static tinyusb_msc_cmd_kind_t _latency_kind(uint8_t opcode)
+{
+    switch (opcode) {
+    case SCSI_CMD_READ_10:
+        return TINYUSB_MSC_CMD_READ10;
+    case SCSI_CMD_WRITE_10:
+        return TINYUSB_MSC_CMD_WRITE10;
+    case SCSI_CMD_TEST_UNIT_READY:
+        return TINYUSB_MSC_CMD_TEST_UNIT_READY;
+    default:
+        return TINYUSB_MSC_CMD_OTHER;
+    }
+}
+
+/**
+ * Adds a completed command to the statistics of its LUN and to the trace. TinyUSB task only.
+ */
+static void _latency_account(const tinyusb_msc_trace_entry_t *e)
+{
+    unsigned seq = atomic_load_explicit(&s_latency_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&s_latency_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    if (atomic_exchange(&s_latency_reset, false)) {
+        memset(s_latency, 0, sizeof(s_latency));
+        s_trace_count = 0;
+    }
+
+    tinyusb_msc_latency_stats_t *st = &s_latency[e->lun][_latency_kind(e->opcode)];
+    st->commands++;
+    st->failed += (e->status != 0);
+    st->bytes += e->bytes;
+    st->total_us += e->total_us;
+    st->storage_us += e->storage_us;
+    st->usb_us += e->usb_us;
+    st->total_max_us = MAX(st->total_max_us, e->total_us);
+    st->total_hist[_latency_bucket(e->total_us)]++;
+    st->storage_hist[_latency_bucket(e->storage_us)]++;
+    st->usb_hist[_latency_bucket(e->usb_us)]++;
+#if CONFIG_TINYUSB_MSC_TRACE_DEPTH
+    s_trace[s_trace_count % CONFIG_TINYUSB_MSC_TRACE_DEPTH] = *e;
+#endif
+    s_trace_count++;
+
+    atomic_store_explicit(&s_latency_seq, seq + 2, memory_order_release);
+}
+
+static unsigned _latency_read_begin(void)
+{
+    unsigned seq;
+
+    while ((seq = atomic_load_explicit(&s_latency_seq, memory_order_acquire)) & 1) {
+        // the TinyUSB task was preempted in the middle of an update
+        vTaskDelay(1);
+    }
+    return seq;
+}
+
+static bool _latency_read_retry(unsigned seq)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return atomic_load_explicit(&s_latency_seq, memory_order_relaxed) != seq;
+}
+#endif // CONFIG_TINYUSB_MSC_LATENCY_STATS
+
+/* Benchmark
+   ********************************************************************* */
+
+/**
+ * One transfer of the benchmark buffer: on the scratch file, or raw through the backend, below the
+ * read-ahead and write-back caches.
+ */
+static esp_err_t _bench_io(msc_bench_t *b, bool write, uint64_t offset, uint32_t size)
+{
+    tinyusb_msc_storage_handle_s *h = b->h;
+
+    if (b->fd >= 0) {
+        const ssize_t done = write ? pwrite(b->fd, b->buf, size, (off_t)offset) : pread(b->fd, b->buf, size, (off_t)offset);
+        return (done == (ssize_t)size) ? ESP_OK : ESP_FAIL;
+    }
+    const uint32_t lba = (uint32_t)(offset / b->sector_size);
+    if (write) {
+        return (h->write)(h, b->sector_size, (size_t)offset, lba, 0, size, b->buf);
+    }
+    return (h->read)(h, b->sector_size, lba, 0, size, b->buf);
+}
+
+/**
+ * Times transfers of one kind and size for `duration_ms`, or MSC_BENCH_SAMPLES_MAX transfers. A
+ * write test ends with a flush, timed as well, so that a storage gathering the writes in RAM does
+ * not look faster than it is.
+ */
+static esp_err_t _bench_test(msc_bench_t *b, tinyusb_msc_bench_kind_t kind, uint32_t block, uint32_t duration_ms,
+                             tinyusb_msc_bench_result_t *result)
+{
+    tinyusb_msc_storage_handle_s *h = b->h;
+    const bool write = (kind == TINYUSB_MSC_BENCH_SEQ_WRITE || kind == TINYUSB_MSC_BENCH_RAND_WRITE);
+    const bool random = (kind == TINYUSB_MSC_BENCH_RAND_READ || kind == TINYUSB_MSC_BENCH_RAND_WRITE);
+    const uint64_t blocks = b->size / block;
+    const int64_t end = esp_timer_get_time() + (int64_t)duration_ms * 1000;
+    uint64_t busy_us = 0;
+    uint32_t ops = 0;
+
+    while (ops < MSC_BENCH_SAMPLES_MAX && esp_timer_get_time() < end) {
+        uint64_t index = ops % blocks;
+        if (random) {
+            b->rand ^= b->rand << 13;
+            b->rand ^= b->rand >> 7;
+            b->rand ^= b->rand << 17;
+            index = b->rand % blocks;
+        }
+        const uint64_t offset = index * block;
+        // a raw write puts back what the sectors hold, the volume is left as it was
+        if (write && b->fd < 0) {
+            ESP_RETURN_ON_ERROR(_bench_io(b, false, offset, block), TAG, "read at %llu failed", offset);
+        }
+        const int64_t start = esp_timer_get_time();
+        ESP_RETURN_ON_ERROR(_bench_io(b, write, offset, block), TAG, "%s at %llu failed",
+                            write ? "write" : "read", offset);
+        const uint32_t us = (uint32_t)(esp_timer_get_time() - start);
+        b->lat[ops++] = us;
+        busy_us += us;
+    }
+    if (write) {
+        const int64_t start = esp_timer_get_time();
+        if (b->fd >= 0) {
+            ESP_RETURN_ON_FALSE(fsync(b->fd) == 0, ESP_FAIL, TAG, "fsync of %s failed", b->path);
+        } else if (h->flush) {
+            ESP_RETURN_ON_ERROR((h->flush)(h), TAG, "flush failed");
+        }
+        busy_us += esp_timer_get_time() - start;
+    }
+
+    qsort(b->lat, ops, sizeof(uint32_t), _bench_compare);
+    busy_us = MAX(busy_us, 1);
+    *result = (tinyusb_msc_bench_result_t) {
+        .kind = kind,
+        .block_size = block,
+        .ops = ops,
+        .bytes = (uint64_t)ops * block,
+        .busy_us = (uint32_t)MIN(busy_us, UINT32_MAX),
+        .kbps = (uint32_t)((uint64_t)ops * block * 1000000 / 1024 / busy_us),
+        .iops = (uint32_t)((uint64_t)ops * 1000000 / busy_us),
+        .p50_us = _bench_percentile(b->lat, ops, 50),
+        .p90_us = _bench_percentile(b->lat, ops, 90),
+        .p99_us = _bench_percentile(b->lat, ops, 99),
+        .max_us = _bench_percentile(b->lat, ops, 100),
+    };
+    return ESP_OK;
+}
+
+/**
+ * Creates the scratch file of the FatFs tests on the mounted volume. It is written in full first, so
+ * that the read tests find data and the write tests overwrite clusters already allocated.
+ */
+static esp_err_t _bench_file_open(msc_bench_t *b, uint32_t file_size, uint32_t block_max)
+{
+    b->size = file_size - file_size % block_max;
+    ESP_RETURN_ON_FALSE(b->size, ESP_ERR_INVALID_ARG, TAG, "a scratch file of %lu bytes holds no %lu byte transfer",
+                        file_size, block_max);
+    snprintf(b->path, sizeof(b->path), "%s" MSC_BENCH_FILE_NAME, b->h->base_path);
+    b->fd = open(b->path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    ESP_RETURN_ON_FALSE(b->fd >= 0, ESP_FAIL, TAG, "could not create %s", b->path);
+
+    memset(b->buf, 0xA5, block_max);
+    for (uint64_t offset = 0; offset < b->size; offset += block_max) {
+        ESP_RETURN_ON_ERROR(_bench_io(b, true, offset, block_max), TAG, "could not fill %s, is the volume full?", b->path);
+    }
+    ESP_RETURN_ON_FALSE(fsync(b->fd) == 0, ESP_FAIL, TAG, "fsync of %s failed", b->path);
+    return ESP_OK;
+}
+
+static uint32_t _bench_percentile(const uint32_t *sorted, uint32_t count, uint32_t percent)
+{
+    return count ? sorted[(uint64_t)(count - 1) * percent / 100] : 0;
+}
+
+static int _bench_compare(const void *a, const void *b)
+{
+    const uint32_t x = *(const uint32_t *)a;
+    const uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * One run of the metadata benchmark, through the cache if `r->cached`. The cache starts empty, so
+ * that the cached run pays for its misses. Every step is a FatFs directory update or scan: the
+ * files stay empty, no data cluster is written.
+ */
+static esp_err_t _bench_meta_run(tinyusb_msc_storage_handle_s *h, uint32_t files, tinyusb_msc_meta_bench_result_t *r)
+{
+    char dir[32];                   // ESP_VFS_PATH_MAX + MSC_BENCH_DIR_NAME
+    char path[64];
+    tinyusb_msc_meta_cache_stats_t before, after;
+    esp_err_t ret = ESP_OK;
+    uint32_t listed = 0;
+
+    tinyusb_msc_storage_get_meta_cache_stats(h->lun, &before);
+    ESP_GOTO_ON_ERROR(_meta_cache_bypass(h, !r->cached), done, TAG, "Failed to write the metadata cache");
+    snprintf(dir, sizeof(dir), "%s" MSC_BENCH_DIR_NAME, h->base_path);
+    ESP_GOTO_ON_FALSE(mkdir(dir, 0755) == 0, ESP_FAIL, done, TAG, "could not create %s", dir);
+
+    int64_t start = esp_timer_get_time();
+    for (uint32_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/f%lu.tmp", dir, i);
+        const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        ESP_GOTO_ON_FALSE(fd >= 0, ESP_FAIL, clean, TAG, "could not create %s, is the volume full?", path);
+        close(fd);
+    }
+    r->create_us = (uint32_t)(esp_timer_get_time() - start);
+
+    start = esp_timer_get_time();
+    DIR *d = opendir(dir);
+    ESP_GOTO_ON_FALSE(d, ESP_FAIL, clean, TAG, "could not list %s", dir);
+    struct dirent *e;
+    while ((e = readdir(d))) {
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+        listed += (stat(path, &st) == 0);
+    }
+    closedir(d);
+    r->list_us = (uint32_t)(esp_timer_get_time() - start);
+    ESP_GOTO_ON_FALSE(listed == files, ESP_FAIL, clean, TAG, "%lu of %lu files listed", listed, files);
+
+clean:
+    start = esp_timer_get_time();
+    for (uint32_t i = 0; i < files; i++) {
+        snprintf(path, sizeof(path), "%s/f%lu.tmp", dir, i);
+        unlink(path);
+    }
+    if (rmdir(dir) != 0 && ret == ESP_OK) {
+        ESP_LOGE(TAG, "could not delete %s", dir);
+        ret = ESP_FAIL;
+    }
+    r->delete_us = (uint32_t)(esp_timer_get_time() - start);
+
+done:
+    tinyusb_msc_storage_get_meta_cache_stats(h->lun, &after);
+    r->hits = after.hits - before.hits;
+    r->misses = after.misses - before.misses;
+    const esp_err_t err = _meta_cache_bypass(h, false);
+    return (ret == ESP_OK) ? err : ret;
+}
+
+/* Formatting
+   ********************************************************************* */
+
+/**
+ * Formats the volume through FatFs drive `pdrv`, which is left unregistered. f_mkfs() is given the
+ * partition as a drive of its own with the erase unit as block size, and aligns the cluster area
+ * to it counting from the partition start; the partition itself starts one erase unit in, so the
+ * cluster area is aligned on the medium as well. The partition table is written last.
+ */
+static esp_err_t _format(tinyusb_msc_storage_handle_s *h, BYTE pdrv, tinyusb_msc_format_info_t *info)
+{
+    const uint32_t sector_size = (h->sector_size)(h);
+    const uint32_t sectors = (h->sector_count)(h);
+    const uint64_t bytes = (uint64_t)sectors * sector_size;
+    char drv[3] = {(char)('0' + pdrv), ':', 0};
+    uint32_t align = MAX(_format_erase_unit(h) / sector_size, 1);
+    esp_err_t ret = ESP_OK;
+
+    // a small volume does not give up more than a sixteenth to the alignment
+    while (align > 1 && (uint64_t)align * 16 > sectors) {
+        align /= 2;
+    }
+    BYTE fmt = FM_FAT | FM_FAT32;
+    uint32_t cluster = (bytes <= 64 * 1024 * 1024) ? 4096 : 32 * 1024;
+#if FF_FS_EXFAT
+    if (bytes > 32ULL * 1024 * 1024 * 1024) {
+        fmt = FM_EXFAT;
+        cluster = (bytes > 512ULL * 1024 * 1024 * 1024) ? 256 * 1024 : 128 * 1024;
+    }
+#endif
+    // a cluster never straddles two erase units
+    if (align > 1) {
+        cluster = MIN(cluster, align * sector_size);
+    }
+    cluster = MAX(cluster, sector_size);
+
+    msc_format_t *f = &s_format[pdrv];
+    *f = (msc_format_t) {
+        .h = h,
+        .base = (align > 1) ? align : 0,
+        .align = align,
+    };
+    f->count = sectors - f->base;
+    uint8_t *workbuf = ff_memalloc(MSC_FORMAT_WORKBUF_SIZE);
+    FATFS *fs = ff_memalloc(sizeof(FATFS));
+    ESP_GOTO_ON_FALSE(workbuf && fs, ESP_ERR_NO_MEM, done, TAG, "could not allocate the formatting buffers");
+    ff_diskio_register(pdrv, &s_format_impl);
+
+    ESP_LOGI(TAG, "LUN %u: formatting %lu sectors from %lu, erase unit %lu B, cluster %lu B", h->lun, f->count,
+             f->base, align * sector_size, cluster);
+    const MKFS_PARM opt = {fmt | FM_SFD, 0, align, 0, cluster};
+    FRESULT fresult = f_mkfs(drv, &opt, workbuf, MSC_FORMAT_WORKBUF_SIZE);
+    ESP_GOTO_ON_FALSE(fresult == FR_OK, ESP_FAIL, done, TAG, "f_mkfs failed (%d)", fresult);
+    fresult = f_mount(fs, drv, 1);
+    ESP_GOTO_ON_FALSE(fresult == FR_OK, ESP_FAIL, done, TAG, "f_mount failed after formatting (%d)", fresult);
+    const BYTE fat_type = fs->fs_type;
+    if (info) {
+        *info = (tinyusb_msc_format_info_t) {
+            .erase_unit = align * sector_size,
+            .partition_lba = f->base,
+            .fat_lba = f->base + (uint32_t)fs->fatbase,
+            .data_lba = f->base + (uint32_t)fs->database,
+            .cluster_size = (uint32_t)fs->csize * sector_size,
+            .fat_type = fat_type,
+        };
+    }
+    f_mount(NULL, drv, 0);
+    if (f->base) {
+        ret = _format_partition(h, f, fat_type, workbuf);
+    }
+    if (ret == ESP_OK && h->flush) {
+        ret = (h->flush)(h);
+    }
+
+done:
+    ff_diskio_unregister(pdrv);
+    memset(f, 0, sizeof(*f));
+    // nothing cached from the old volume is valid
+    _meta_cache_discard(h, 0, UINT32_MAX);
+    _readahead_invalidate(h, 0, 0);
+    h->fat_type = 0;
+    h->free_valid = false;
+    ff_memfree(fs);
+    ff_memfree(workbuf);
+    return ret;
+}
+
+#if !FF_FS_EXFAT
+/**
+ * Looks for the "EXFAT   " file system name of an exFAT boot sector at sector 0 or at the start of
+ * the first partition.
+ */
+static bool _volume_is_exfat(tinyusb_msc_storage_handle_s *h)
+{
+    const uint32_t sector_size = (h->sector_size)(h);
+    uint8_t *buf = malloc(sector_size);
+    bool exfat = false;
+
+    if (buf && msc_storage_read_sector(h, 0, 0, sector_size, buf) == ESP_OK) {
+        exfat = !memcmp(buf + 3, "EXFAT   ", 8);
+        const uint8_t *pte = buf + 446;     // first partition entry
+        if (!exfat && buf[510] == 0x55 && buf[511] == 0xAA && pte[4] == 0x07) {
+            const uint32_t lba = pte[8] | (pte[9] << 8) | (pte[10] << 16) | ((uint32_t)pte[11] << 24);
+            exfat = lba < (h->sector_count)(h) && msc_storage_read_sector(h, lba, 0, sector_size, buf) == ESP_OK &&
+                    !memcmp(buf + 3, "EXFAT   ", 8);
+        }
+    }
+    free(buf);
+    return exfat;
+}
+#endif
+
+/**
+ * Bytes flash pages are erased by, the larger of it and the sector. An SD card reports its
+ * allocation unit in the SD status; MMC and old cards report none and get the largest AU of an
+ * SDHC card.
+ */
+static uint32_t _format_erase_unit(tinyusb_msc_storage_handle_s *h)
+{
+    const uint32_t sector_size = (h->sector_size)(h);
+
+#if SOC_SDMMC_HOST_SUPPORTED
+    if (h->read == &_read_sector_sdmmc) {
+        const uint32_t au = h->card->ssr.alloc_unit_kb * 1024;
+        return MAX(au ? au : MSC_FORMAT_UNIT_DEFAULT, sector_size);
+    }
+#endif
+    if (h->write == &_write_sector_spiflash) {
+        return MAX(MSC_WL_ERASE_SIZE, sector_size);
+    }
+    // RAM disk or storage implemented by the application, no erase unit known
+    return sector_size;
+}
+
+/**
+ * Writes a master boot record with the one partition at `f->base`. The CHS fields hold the "use
+ * LBA" marker, every host since the 90s reads the LBA fields.
+ */
+static esp_err_t _format_partition(tinyusb_msc_storage_handle_s *h, const msc_format_t *f, BYTE fat_type, uint8_t *buf)
+{
+    static const uint8_t chs_lba[3] = {0xFE, 0xFF, 0xFF};
+    const uint32_t sector_size = (h->sector_size)(h);
+    uint8_t *pte = buf + 446;       // first partition entry
+
+    memset(buf, 0, sector_size);
+    memcpy(pte + 1, chs_lba, sizeof(chs_lba));
+    switch (fat_type) {
+    case FS_FAT12:
+        pte[4] = 0x01;
+        break;
+    case FS_FAT16:
+        pte[4] = (f->count < 65536) ? 0x04 : 0x06;
+        break;
+    case FS_FAT32:
+        pte[4] = 0x0C;              // FAT32 with LBA
+        break;
+    default:
+        pte[4] = 0x07;              // exFAT
+        break;
+    }
+    memcpy(pte + 5, chs_lba, sizeof(chs_lba));
+    _put_le32(pte + 8, f->base);
+    _put_le32(pte + 12, f->count);
+    buf[510] = 0x55;
+    buf[511] = 0xAA;
+    ESP_RETURN_ON_ERROR(_app_write(h, 0, 1, buf), TAG, "could not write the partition table");
+    return ESP_OK;
+}
+
+static void _put_le32(uint8_t *p, uint32_t v)
+{
+    p[0] = (uint8_t)v;
+    p[1] = (uint8_t)(v >> 8);
+    p[2] = (uint8_t)(v >> 16);
+    p[3] = (uint8_t)(v >> 24);
+}
+
+static DSTATUS _format_disk_status(BYTE pdrv)
+{
+    return s_format[pdrv].h ? 0 : STA_NOINIT;
+}
+
+static DRESULT _format_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+    const msc_format_t *f = &s_format[pdrv];
+    const size_t size = (size_t)count * (f->h->sector_size)(f->h);
+
+    return (msc_storage_read_sector(f->h, f->base + sector, 0, size, buff) == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT _format_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+    const msc_format_t *f = &s_format[pdrv];
+
+    return (_app_write(f->h, f->base + sector, count, buff) == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT _format_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    const msc_format_t *f = &s_format[pdrv];
+    tinyusb_msc_storage_handle_s *h = f->h;
+
+    switch (cmd) {
+    case CTRL_SYNC:
+        return (!h->flush || (h->flush)(h) == ESP_OK) ? RES_OK : RES_ERROR;
+    case CTRL_TRIM: {
+        // f_mkfs() trims the whole partition: a card erases its AUs, the next writes go faster
+        const LBA_t *range = buff;
+        return (_storage_trim(h, f->base + range[0], range[1] - range[0] + 1) == ESP_OK) ? RES_OK : RES_ERROR;
+    }
+    case GET_SECTOR_COUNT:
+        *((LBA_t *) buff) = f->count;
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *((DWORD *) buff) = f->align;
+        return RES_OK;
+    default:
+        return _disk_ioctl_geometry(h, cmd, buff);
+    }
+}
+
+/* Application mount
+   ********************************************************************* */
+
+/**
+ * FatFs on the application goes through the same backend functions as the host, so that the
+ * sectors it frees are trimmed the way the host's UNMAPs are, flash writes are gathered and card
+ * transfers queued the same way, and a removed medium fails at once instead of timing out. It
+ * replaces the driver registered by the backend's mount function, whose lookup of the drive number
+ * by card or wear levelling handle is kept.
+ */
+static DSTATUS _app_disk_status(BYTE pdrv)
+{
+    if (!s_app[pdrv]) {
+        return STA_NOINIT;
+    }
+    return s_app[pdrv]->absent ? (STA_NOINIT | STA_NODISK) : 0;
+}
+
+static DRESULT _app_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+    tinyusb_msc_storage_handle_s *h = s_app[pdrv];
+    const size_t size = (size_t)count * (h->sector_size)(h);
+
+    if (h->absent) {
+        return RES_NOTRDY;
+    }
+    if (h->mc.enabled) {
+        return (_meta_cache_read(h, sector, count, buff) == ESP_OK) ? RES_OK : RES_ERROR;
+    }
+    return (msc_storage_read_sector(h, sector, 0, size, buff) == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT _app_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+    tinyusb_msc_storage_handle_s *h = s_app[pdrv];
+
+    if (h->absent) {
+        return RES_NOTRDY;
+    }
+    if (h->mc.enabled) {
+        return (_meta_cache_write(h, sector, count, buff) == ESP_OK) ? RES_OK : RES_ERROR;
+    }
+    return (_app_write(h, sector, count, buff) == ESP_OK) ? RES_OK : RES_ERROR;
+}
+
+static DRESULT _app_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    tinyusb_msc_storage_handle_s *h = s_app[pdrv];
+
+    switch (cmd) {
+    case CTRL_SYNC:
+        if (h->absent) {
+            return RES_NOTRDY;
+        }
+        if (_meta_cache_flush(h) != ESP_OK) {
+            return RES_ERROR;
+        }
+        return (!h->flush || (h->flush)(h) == ESP_OK) ? RES_OK : RES_ERROR;
+    case CTRL_TRIM: {
+        const LBA_t *range = buff;      // first and last sector
+        if (h->absent) {
+            return RES_NOTRDY;
+        }
+        _meta_cache_discard(h, range[0], range[1] - range[0] + 1);
+        return (_storage_trim(h, range[0], range[1] - range[0] + 1) == ESP_OK) ? RES_OK : RES_ERROR;
+    }
+    default:
+        return _disk_ioctl_geometry(h, cmd, buff);
+    }
+}
+
+static esp_err_t _app_write(tinyusb_msc_storage_handle_s *h, uint32_t lba, uint32_t count, const void *src)
+{
+    const size_t sector_size = (h->sector_size)(h);
+
+    return (h->write)(h, sector_size, (size_t)lba * sector_size, lba, 0, (size_t)count * sector_size, src);
+}
+
+static DRESULT _disk_ioctl_geometry(tinyusb_msc_storage_handle_s *h, BYTE cmd, void *buff)
+{
+    switch (cmd) {
+    case GET_SECTOR_COUNT:
+        *((LBA_t *) buff) = (h->sector_count)(h);
+        return RES_OK;
+    case GET_SECTOR_SIZE:
+        *((WORD *) buff) = (h->sector_size)(h);
+        return RES_OK;
+    case GET_BLOCK_SIZE:
+        *((DWORD *) buff) = 1;
+        return RES_OK;
+    default:
+        return RES_PARERR;
+    }
+}
+
+/* Read-only view
+   ********************************************************************* */
+
+/**
+ * Reads what the host sees: the media with the sectors still in the write-back cache on top. The
+ * read-ahead cache is bypassed, view reads would break up the sequential stream it detects.
+ */
+static esp_err_t _view_read(tinyusb_msc_storage_handle_s *h, uint32_t lba, size_t size, void *dest)
+{
+    msc_writeback_t *wb = &h->wb;
+
+    if (!wb->enabled) {
+        return msc_storage_read_sector(h, lba, 0, size, dest);
+    }
+    xSemaphoreTake(wb->lock, portMAX_DELAY);
+    esp_err_t err = msc_storage_read_sector(h, lba, 0, size, dest);
+    if (err == ESP_OK) {
+        _writeback_overlay(h, lba, 0, size, dest);
+    }
+    xSemaphoreGive(wb->lock);
+    return err;
+}
+
+static DSTATUS _view_disk_status(BYTE pdrv)
+{
+    if (!s_view[pdrv]) {
+        return STA_NOINIT;
+    }
+    return s_view[pdrv]->absent ? (STA_NOINIT | STA_NODISK) : STA_PROTECT;
+}
+
+/**
+ * FatFs reads FAT and directory sectors one at a time into its window, file data mostly in runs.
+ * A host update of the file system is a burst of writes (FAT, then the directory entry), so single
+ * sector reads of the FAT or the FAT12/16 root directory wait for the host to pause, and single
+ * sector reads that overlapped a host write are repeated. Runs of file data are read as they are.
+ */
+static DRESULT _view_disk_read(BYTE pdrv, BYTE *buff, DWORD sector, UINT count)
+{
+    tinyusb_msc_storage_handle_s *h = s_view[pdrv];
+    const FATFS *fs = h->view_fs;
+    const size_t size = (size_t)count * (h->sector_size)(h);
+    const bool meta = (count == 1);
+    const TickType_t quiet = pdMS_TO_TICKS(MSC_VIEW_QUIET_MS);
+
+    if (h->absent) {
+        return RES_NOTRDY;
+    }
+    for (int attempt = 0; ; attempt++) {
+        // the boot sector is read while fs_type is still 0
+        if (meta && (fs->fs_type == 0 || sector < fs->database)) {
+            const TickType_t idle = xTaskGetTickCount() - h->host_write_tick;
+            if (idle < quiet) {
+                vTaskDelay(quiet - idle);
+            }
+        }
+        const uint32_t host_writes = h->host_write_count;
+        if (_view_read(h, sector, size, buff) != ESP_OK) {
+            return RES_ERROR;
+        }
+        if (!meta || h->host_write_count == host_writes) {
+            return RES_OK;
+        }
+        if (attempt == MSC_VIEW_READ_RETRIES) {
+            ESP_LOGW(TAG, "LUN %u: view read of sector %lu raced with the host", h->lun, (unsigned long)sector);
+            return RES_OK;
+        }
+    }
+}
+
+static DRESULT _view_disk_write(BYTE pdrv, const BYTE *buff, DWORD sector, UINT count)
+{
+    return RES_WRPRT;
+}
+
+static DRESULT _view_disk_ioctl(BYTE pdrv, BYTE cmd, void *buff)
+{
+    tinyusb_msc_storage_handle_s *h = s_view[pdrv];
+
+    switch (cmd) {
+    case CTRL_SYNC:
+        return RES_OK;
+    default:
+        return _disk_ioctl_geometry(h, cmd, buff);
+    }
+}
+
+/* TinyUSB MSC callbacks
+   ********************************************************************* */
+
+/** SCSI ASC/ASCQ codes. **/
+/** User can add and use more codes as per the need of the application **/
+#define SCSI_CODE_ASC_MEDIUM_NOT_PRESENT 0x3A /** SCSI ASC code for 'MEDIUM NOT PRESENT' **/
+#define SCSI_CODE_ASC_INVALID_COMMAND_OPERATION_CODE 0x20 /** SCSI ASC code for 'INVALID COMMAND OPERATION CODE' **/
+#define SCSI_CODE_ASC_WRITE_ERROR 0x0C /** SCSI ASC code for 'WRITE ERROR' **/
+#define SCSI_CODE_ASCQ 0x00
+#define SCSI_CODE_ASC_NOT_READY 0x04 /** SCSI ASC code for 'LOGICAL UNIT NOT READY' **/
+#define SCSI_CODE_ASCQ_BECOMING_READY 0x01 /** SCSI ASCQ code for 'IN PROCESS OF BECOMING READY' **/
+#define SCSI_CODE_ASC_MEDIUM_CHANGED 0x28 /** SCSI ASC code for 'NOT READY TO READY CHANGE, MEDIUM MAY HAVE CHANGED' **/
+
+#define SCSI_CODE_ASC_LBA_OUT_OF_RANGE 0x21 /** SCSI ASC code for 'LOGICAL BLOCK ADDRESS OUT OF RANGE' **/
+#define SCSI_CODE_ASC_INVALID_FIELD_IN_CDB 0x24 /** SCSI ASC code for 'INVALID FIELD IN CDB' **/
+#define SCSI_CODE_ASC_INVALID_FIELD_IN_PARAMETER_LIST 0x26 /** SCSI ASC code for 'INVALID FIELD IN PARAMETER LIST' **/
+
+#define SCSI_CMD_SYNCHRONIZE_CACHE_10 0x35
+#define SCSI_CMD_UNMAP 0x42
+#define SCSI_CMD_SERVICE_ACTION_IN_16 0x9E
+#define SCSI_SA_READ_CAPACITY_16 0x10
+
+#define SCSI_VPD_SUPPORTED_PAGES 0x00
+#define SCSI_VPD_BLOCK_LIMITS 0xB0
+#define SCSI_VPD_LOGICAL_BLOCK_PROVISIONING 0xB2
+
+// Invoked when received GET_MAX_LUN request, return the number of LUNs
+uint8_t tud_msc_get_maxlun_cb(void)
+{
+    return s_lun_count;
+}
+
+// Invoked when received SCSI_CMD_INQUIRY
+// Application fill vendor id, product id and revision with string up to 8, 16, 4 characters respectively
+void tud_msc_inquiry_cb(uint8_t lun, uint8_t vendor_id[8], uint8_t product_id[16], uint8_t product_rev[4])
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    const char vid[] = "TinyUSB";
+    const char *pid = h ? h->product : "Flash Storage";
+    const char rev[] = "0.1";
+
+    memcpy(vendor_id, vid, strlen(vid));
+    memcpy(product_id, pid, MIN(strlen(pid), 16));
+    memcpy(product_rev, rev, strlen(rev));
+}
+
+// Invoked when received Test Unit Ready command.
+// return true allowing host to read/write this LUN e.g SD card inserted
+bool tud_msc_test_unit_ready_cb(uint8_t lun)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+    bool result = false;
+
+    if (!h) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
+        return false;
+    }
+    // polled about once a second, a mount or unmount in progress is reported on the next poll
+    if (xSemaphoreTakeRecursive(h->owner_lock, 0) != pdTRUE) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_NOT_READY, SCSI_CODE_ASCQ_BECOMING_READY);
+        return false;
+    }
+    if (h->absent) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
+        xSemaphoreGiveRecursive(h->owner_lock);
+        return false;
+    }
+    if (h->owner == MSC_OWNER_TRANSITIONING && _owner_grace_over(h)) {
+        if (_owner_host(h) != ESP_OK) {
+            ESP_LOGW(TAG, "tud_msc_test_unit_ready_cb() unmount Fails");
+        }
+    }
+    switch (h->owner) {
+    case MSC_OWNER_APP:
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
+        break;
+    case MSC_OWNER_TRANSITIONING:
+    case MSC_OWNER_BENCHMARK:
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_NOT_READY, SCSI_CODE_ASCQ_BECOMING_READY);
+        break;
+    case MSC_OWNER_HOST:
+        if (h->unit_attention) {
+            // the host drops what it cached of the volume and reads it again
+            h->unit_attention = false;
+            tud_msc_set_sense(lun, SCSI_SENSE_UNIT_ATTENTION, SCSI_CODE_ASC_MEDIUM_CHANGED, SCSI_CODE_ASCQ);
+        } else {
+            result = true;
+        }
+        break;
+    }
+    xSemaphoreGiveRecursive(h->owner_lock);
+    return result;
+}
+
+// Invoked when received SCSI_CMD_READ_CAPACITY_10 and SCSI_CMD_READ_FORMAT_CAPACITY to determine the disk size
+// Application update block count and block size
+void tud_msc_capacity_cb(uint8_t lun, uint32_t *block_count, uint16_t *block_size)
+{
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    *block_count = (h && !h->absent) ? (h->sector_count)(h) : 0;
+    *block_size  = h ? (uint16_t)(h->sector_size)(h) : 512;
+}
+
+// Invoked when received Start Stop Unit command
+// - Start = 0 : stopped power mode, if load_eject = 1 : unload disk storage
+// - Start = 1 : active mode, if load_eject = 1 : load disk storage
+bool tud_msc_start_stop_cb(uint8_t lun, uint8_t power_condition, bool start, bool load_eject)
+{
+    (void) power_condition;
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    if (!h) {
+        return false;
+    }
+    if (!start && _storage_flush(h) != ESP_OK) {
+        ESP_LOGW(TAG, "tud_msc_start_stop_cb() flush Fails");
+    }
+    if (load_eject && !start) {
+        // the host let go of the medium, no grace period
+        if (tinyusb_msc_storage_mount_lun(lun, h->base_path) != ESP_OK) {
+            ESP_LOGW(TAG, "tud_msc_start_stop_cb() mount Fails");
+        }
+    }
+    return true;
+}
+
+// Invoked when received SCSI READ10 command
+// - Address = lba * BLOCK_SIZE + offset
 // - Application fill the buffer (up to bufsize) with address contents and return number of read byte.
 int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buffer, uint32_t bufsize)
 {
-    esp_err_t err = msc_storage_read_sector(lba, offset, bufsize, buffer);
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    if (!h || h->owner != MSC_OWNER_HOST) {
+        return -1;
+    }
+    if (h->absent) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
+        return -1;
+    }
+    // its transfers to the SD card go first
+    h->io.host_task = xTaskGetCurrentTaskHandle();
+    esp_err_t err = _writeback_read(h, lba, offset, bufsize, buffer);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "msc_storage_read_sector failed: 0x%x", err);
         return 0;
@@ -582,11 +4302,128 @@ int32_t tud_msc_read10_cb(uint8_t lun, uint32_t lba, uint32_t offset, void *buff
 // - Application write data from buffer to address contents (up to bufsize) and return number of written byte.
 int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *buffer, uint32_t bufsize)
 {
-    esp_err_t err = msc_storage_write_sector(lba, offset, bufsize, buffer);
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
+
+    if (!h || h->owner != MSC_OWNER_HOST) {
+        return -1;
+    }
+    if (h->absent) {
+        tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
+        return -1;
+    }
+    h->io.host_task = xTaskGetCurrentTaskHandle();
+    esp_err_t err = _writeback_write(h, lba, offset, bufsize, buffer);
     if (err != ESP_OK) {
         ESP_LOGE(TAG, "msc_storage_write_sector failed: 0x%x", err);
         return 0;
     }
+    h->host_write_count++;
+    h->host_write_tick = xTaskGetTickCount();
+    _readahead_invalidate(h, lba, offset + bufsize);
+    return bufsize;
+}
+
+static void _put_be16(uint8_t *p, uint16_t v)
+{
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void _put_be32(uint8_t *p, uint32_t v)
+{
+    _put_be16(p, (uint16_t)(v >> 16));
+    _put_be16(p + 2, (uint16_t)v);
+}
+
+static uint32_t _get_be32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+/**
+ * INQUIRY with EVPD set: the pages hosts read to learn whether, and how, the unit takes UNMAP.
+ */
+static int32_t _scsi_inquiry_vpd(tinyusb_msc_storage_handle_s *h, uint8_t const scsi_cmd[16], uint8_t *buffer, uint16_t bufsize)
+{
+    uint8_t page[64] = {0};
+    uint16_t len;
+
+    page[1] = scsi_cmd[2];
+    switch (scsi_cmd[2]) {
+    case SCSI_VPD_SUPPORTED_PAGES:
+        page[4] = SCSI_VPD_SUPPORTED_PAGES;
+        page[5] = SCSI_VPD_BLOCK_LIMITS;
+        page[6] = SCSI_VPD_LOGICAL_BLOCK_PROVISIONING;
+        len = 3;
+        break;
+    case SCSI_VPD_BLOCK_LIMITS:
+        if (h->trim) {
+            _put_be32(page + 20, h->unmap_max);                                 // MAXIMUM UNMAP LBA COUNT
+            _put_be32(page + 24, (CONFIG_TINYUSB_MSC_BUFSIZE - 8) / 16);        // MAXIMUM UNMAP BLOCK DESCRIPTOR COUNT
+            _put_be32(page + 28, h->unmap_granularity);                         // OPTIMAL UNMAP GRANULARITY
+        }
+        len = 0x3C;
+        break;
+    case SCSI_VPD_LOGICAL_BLOCK_PROVISIONING:
+        page[5] = h->trim ? 0x80 : 0;   // LBPU
+        len = 4;
+        break;
+    default:
+        return -1;
+    }
+    _put_be16(page + 2, len);
+    len += 4;
+    memcpy(buffer, page, MIN(len, bufsize));
+    return MIN(len, bufsize);
+}
+
+static int32_t _scsi_read_capacity_16(tinyusb_msc_storage_handle_s *h, uint8_t *buffer, uint16_t bufsize)
+{
+    uint8_t resp[32] = {0};
+
+    _put_be32(resp + 4, (h->sector_count)(h) - 1);     // last LBA, the high half stays 0
+    _put_be32(resp + 8, (h->sector_size)(h));
+    resp[14] = h->trim ? 0x80 : 0;                      // LBPME
+    memcpy(buffer, resp, MIN(sizeof(resp), bufsize));
+    return MIN(sizeof(resp), bufsize);
+}
+
+/**
+ * UNMAP parameter list: an 8 byte header, then 16 byte descriptors of a 64 bit LBA and a 32 bit count.
+ */
+static int32_t _scsi_unmap(tinyusb_msc_storage_handle_s *h, const uint8_t *buffer, uint16_t bufsize)
+{
+    const uint32_t sector_count = (h->sector_count)(h);
+
+    if (!h->trim) {
+        tud_msc_set_sense(h->lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_CODE_ASC_INVALID_COMMAND_OPERATION_CODE, SCSI_CODE_ASCQ);
+        return -1;
+    }
+    if (h->owner != MSC_OWNER_HOST) {
+        tud_msc_set_sense(h->lun, SCSI_SENSE_NOT_READY, SCSI_CODE_ASC_MEDIUM_NOT_PRESENT, SCSI_CODE_ASCQ);
+        return -1;
+    }
+    if (bufsize < 8) {
+        return 0;
+    }
+    const uint16_t desc_len = MIN((uint16_t)((buffer[2] << 8) | buffer[3]), bufsize - 8) & ~0xF;
+    for (uint16_t off = 8; off < 8 + desc_len; off += 16) {
+        const uint8_t *d = buffer + off;
+        const uint32_t lba = _get_be32(d + 4);
+        const uint32_t count = _get_be32(d + 8);
+        if (_get_be32(d) != 0 || lba > sector_count || count > sector_count - lba) {
+            tud_msc_set_sense(h->lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_CODE_ASC_LBA_OUT_OF_RANGE, SCSI_CODE_ASCQ);
+            return -1;
+        }
+        if (count > h->unmap_max) {
+            tud_msc_set_sense(h->lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_CODE_ASC_INVALID_FIELD_IN_PARAMETER_LIST, SCSI_CODE_ASCQ);
+            return -1;
+        }
+        if (_storage_trim(h, lba, count) != ESP_OK) {
+            tud_msc_set_sense(h->lun, SCSI_SENSE_MEDIUM_ERROR, SCSI_CODE_ASC_WRITE_ERROR, SCSI_CODE_ASCQ);
+            return -1;
+        }
+    }
     return bufsize;
 }
 
@@ -608,6 +4445,7 @@ int32_t tud_msc_write10_cb(uint8_t lun, uint32_t lba, uint32_t offset, uint8_t *
  */
 int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, uint16_t bufsize)
 {
+    tinyusb_msc_storage_handle_s *h = _storage_get(lun);
     int32_t ret;
 
     switch (scsi_cmd[0]) {
@@ -617,6 +4455,32 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, u
         the storage media/partition. */
         ret = 0;
         break;
+    case SCSI_CMD_SYNCHRONIZE_CACHE_10:
+        if (h && _storage_flush(h) == ESP_OK) {
+            ret = 0;
+        } else {
+            tud_msc_set_sense(lun, SCSI_SENSE_MEDIUM_ERROR, SCSI_CODE_ASC_WRITE_ERROR, SCSI_CODE_ASCQ);
+            ret = -1;
+        }
+        break;
+    case SCSI_CMD_INQUIRY:
+        // only vital product data pages, TinyUSB answers the standard INQUIRY
+        ret = h ? _scsi_inquiry_vpd(h, scsi_cmd, buffer, bufsize) : -1;
+        if (ret < 0) {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_CODE_ASC_INVALID_FIELD_IN_CDB, SCSI_CODE_ASCQ);
+        }
+        break;
+    case SCSI_CMD_SERVICE_ACTION_IN_16:
+        if (h && (scsi_cmd[1] & 0x1F) == SCSI_SA_READ_CAPACITY_16) {
+            ret = _scsi_read_capacity_16(h, buffer, bufsize);
+        } else {
+            tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_CODE_ASC_INVALID_FIELD_IN_CDB, SCSI_CODE_ASCQ);
+            ret = -1;
+        }
+        break;
+    case SCSI_CMD_UNMAP:
+        ret = h ? _scsi_unmap(h, buffer, bufsize) : -1;
+        break;
     default:
         ESP_LOGW(TAG, "tud_msc_scsi_cb() invoked: %d", scsi_cmd[0]);
         tud_msc_set_sense(lun, SCSI_SENSE_ILLEGAL_REQUEST, SCSI_CODE_ASC_INVALID_COMMAND_OPERATION_CODE, SCSI_CODE_ASCQ);
@@ -626,17 +4490,138 @@ int32_t tud_msc_scsi_cb(uint8_t lun, uint8_t const scsi_cmd[16], void *buffer, u
     return ret;
 }
 
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+// Invoked at each step of a SCSI command, times the command
+void tud_msc_trace_cb(uint8_t lun, uint8_t const scsi_cmd[16], msc_trace_event_t event, uint32_t value)
+{
+    msc_latency_cmd_t *c = &s_cmd;
+    const int64_t now = esp_timer_get_time();
+
+    if (event == MSC_TRACE_CBW) {
+        memset(c, 0, sizeof(*c));
+        c->active = (lun < TINYUSB_MSC_LUN_MAX);
+        c->start = now;
+        c->e.start_us = (uint32_t)now;
+        c->e.lun = lun;
+        c->e.opcode = scsi_cmd[0];
+        if (scsi_cmd[0] == SCSI_CMD_READ_10 || scsi_cmd[0] == SCSI_CMD_WRITE_10) {
+            c->e.lba = _get_be32(&scsi_cmd[2]);
+        }
+        return;
+    }
+    if (!c->active) {
+        return;
+    }
+    switch (event) {
+    case MSC_TRACE_APP_BEGIN:
+        c->app_start = now;
+        break;
+    case MSC_TRACE_APP_END:
+        if (c->app_start) {
+            c->e.storage_us += (uint32_t)(now - c->app_start);
+            c->app_start = 0;
+        }
+        break;
+    case MSC_TRACE_XFER_QUEUED:
+        c->xfer_start = now;
+        break;
+    case MSC_TRACE_XFER_DONE:
+        // READ10 reports a completion without a transfer when the storage returned no data yet
+        if (c->xfer_start) {
+            c->e.usb_us += (uint32_t)(now - c->xfer_start);
+            c->e.bytes += value;
+            c->xfer_start = 0;
+        }
+        break;
+    case MSC_TRACE_CSW:
+        c->e.total_us = (uint32_t)(now - c->start);
+        c->e.status = (uint8_t)value;
+        c->active = false;
+        _latency_account(&c->e);
+        break;
+    default:
+        break;
+    }
+}
+#endif
+
 // Invoked when device is unmounted
 void tud_umount_cb(void)
 {
-    if (tinyusb_msc_storage_mount(s_storage_handle->base_path) != ESP_OK) {
-        ESP_LOGW(TAG, "tud_umount_cb() mount Fails");
+    for (uint8_t lun = 0; lun < s_lun_count; lun++) {
+        tinyusb_msc_storage_handle_s *h = s_storage[lun];
+        if (h->ra.enabled) {
+            tinyusb_msc_readahead_stats_t st;
+            tinyusb_msc_storage_get_readahead_stats(lun, &st);
+            uint32_t reads = st.hit_sectors + st.miss_sectors;
+            ESP_LOGI(TAG, "LUN %u read-ahead: %lu%% of %lu sectors hit, %lu of %lu prefetched wasted, window %lu", lun,
+                     reads ? (unsigned long)((uint64_t)st.hit_sectors * 100 / reads) : 0UL, reads,
+                     st.wasted_sectors, st.prefetched_sectors, st.window_sectors);
+        }
+        if (h->wb.slots) {
+            tinyusb_msc_writeback_stats_t st;
+            tinyusb_msc_storage_get_writeback_stats(lun, &st);
+            ESP_LOGI(TAG, "LUN %u write-back: %lu sectors cached, %lu overwritten, %lu flushed in %lu writes, %lu direct", lun,
+                     st.cached_sectors, st.merged_sectors, st.flushed_sectors, st.flush_writes, st.direct_sectors);
+        }
+        if (h->wc.enabled) {
+            tinyusb_msc_wl_combine_stats_t st;
+            tinyusb_msc_storage_get_wl_combine_stats(lun, &st);
+            ESP_LOGI(TAG, "LUN %u flash write combining: %lu sectors written with %lu erases, %lu sectors read back", lun,
+                     st.host_sectors, st.erases, st.fill_sectors);
+        }
+        if (h->io.enabled) {
+            tinyusb_msc_io_stats_t st;
+            tinyusb_msc_storage_get_io_stats(lun, &st);
+            const tinyusb_msc_io_class_stats_t *host = &st.cls[TINYUSB_MSC_IO_HOST];
+            const tinyusb_msc_io_class_stats_t *bg = &st.cls[TINYUSB_MSC_IO_BACKGROUND];
+            ESP_LOGI(TAG, "LUN %u SD card queue: %lu transfers, %lu requests merged, wait %llu us host, %llu us background average, depth %lu max",
+                     lun, st.transfers, st.merged, host->requests ? host->wait_us / host->requests : 0ULL,
+                     bg->requests ? bg->wait_us / bg->requests : 0ULL, st.depth_max);
+        }
+#if CONFIG_TINYUSB_MSC_LATENCY_STATS
+        for (tinyusb_msc_cmd_kind_t kind = TINYUSB_MSC_CMD_READ10; kind <= TINYUSB_MSC_CMD_WRITE10; kind++) {
+            tinyusb_msc_latency_stats_t st;
+            tinyusb_msc_storage_get_latency_stats(lun, kind, &st);
+            if (st.commands) {
+                ESP_LOGI(TAG, "LUN %u %s: %lu commands, %llu bytes, %llu us average (storage %llu us, USB %llu us), %lu us max",
+                         lun, (kind == TINYUSB_MSC_CMD_READ10) ? "READ10" : "WRITE10", st.commands, st.bytes,
+                         st.total_us / st.commands, st.storage_us / st.commands, st.usb_us / st.commands, st.total_max_us);
+            }
+        }
+#endif
+
+        if (tinyusb_msc_storage_mount_lun(lun, h->base_path) != ESP_OK) {
+            ESP_LOGW(TAG, "tud_umount_cb() mount Fails");
+        }
+    }
+}
+
+// Invoked when usb bus is suspended, the host may cut the power next
+void tud_suspend_cb(bool remote_wakeup_en)
+{
+    (void) remote_wakeup_en;
+
+    if (tinyusb_msc_storage_flush() != ESP_OK) {
+        ESP_LOGW(TAG, "tud_suspend_cb() flush Fails");
     }
 }
 
 // Invoked when device is mounted (configured)
 void tud_mount_cb(void)
 {
-    tinyusb_msc_storage_unmount();
+    /* a host attaching is a real demand: the default user yields and the grace period of a release
+       is not waited for; a volume other users hold goes to the host when they release it */
+    for (uint8_t lun = 0; lun < s_lun_count; lun++) {
+        tinyusb_msc_storage_handle_s *h = s_storage[lun];
+        xSemaphoreTakeRecursive(h->owner_lock, portMAX_DELAY);
+        h->app_users &= ~(1UL << TINYUSB_MSC_USER_DEFAULT);
+        if (h->app_users == 0 && _owner_host(h) != ESP_OK) {
+            ESP_LOGW(TAG, "tud_mount_cb() unmount Fails");
+        }
+        // the new host has nothing cached to invalidate
+        h->unit_attention = false;
+        xSemaphoreGiveRecursive(h->owner_lock);
+    }
 }
 /*********************************************************************** TinyUSB MSC callbacks*/
@@ -65,6 +65,14 @@ typedef struct
   uint32_t total_len;   // byte to be transferred, can be smaller than total_bytes in cbw
   uint32_t xferred_len; // numbered of bytes transferred so far in the Data Stage
 
+  // READ10/WRITE10 data stage is double buffered: while one buffer is on the bus, the other one
+  // is filled from (READ10) or drained to (WRITE10) the storage
+  uint8_t  buf_idx;     // READ10: buffer queued on IN; WRITE10: buffer being written to storage
+  bool     ahead_busy;  // WRITE10: OUT transfer into the other buffer is in flight
+  int32_t  ahead_len;   // bytes ready in the other buffer, negative if prefetching them failed
+  uint32_t left_off;    // WRITE10: start of the bytes the application has not consumed yet
+  uint32_t left_len;
+
   // Sense Response Data
   uint8_t sense_key;
   uint8_t add_sense_code;
@@ -72,7 +80,11 @@ typedef struct
 }mscd_interface_t;
 
 CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN tu_static mscd_interface_t _mscd_itf;
-CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN tu_static uint8_t _mscd_buf[CFG_TUD_MSC_EP_BUFSIZE];
+CFG_TUSB_MEM_SECTION CFG_TUSB_MEM_ALIGN tu_static uint8_t _mscd_default_buf[2][CFG_TUD_MSC_EP_BUFSIZE];
+
+// data stage buffers, can be replaced by tud_msc_set_buffers()
+tu_static uint8_t* _mscd_buf[2] = { _mscd_default_buf[0], _mscd_default_buf[1] };
+tu_static uint32_t _mscd_bufsize = CFG_TUD_MSC_EP_BUFSIZE;
 
 //--------------------------------------------------------------------+
 // INTERNAL OBJECT & FUNCTION DECLARATION
@@ -82,12 +94,19 @@ static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc);
 
 static void proc_write10_cmd(uint8_t rhport, mscd_interface_t* p_msc);
 static void proc_write10_new_data(uint8_t rhport, mscd_interface_t* p_msc, uint32_t xferred_bytes);
+static void proc_write10_consume(uint8_t rhport, mscd_interface_t* p_msc);
+static void proc_write10_retry(void* param);
 
 TU_ATTR_ALWAYS_INLINE static inline bool is_data_in(uint8_t dir)
 {
   return tu_bit_test(dir, 7);
 }
 
+static inline void trace(mscd_interface_t const* p_msc, msc_trace_event_t event, uint32_t value)
+{
+  if ( tud_msc_trace_cb ) tud_msc_trace_cb(p_msc->cbw.lun, p_msc->cbw.command, event, value);
+}
+
 static inline bool send_csw(uint8_t rhport, mscd_interface_t* p_msc)
 {
   // Data residue is always = host expect - actual transferred
@@ -245,6 +264,24 @@ static inline void set_sense_medium_not_present(uint8_t lun)
   tud_msc_set_sense(lun, SCSI_SENSE_NOT_READY, 0x3A, 0x00);
 }
 
+bool tud_msc_set_buffers(uint8_t* buf0, uint8_t* buf1, uint32_t bufsize)
+{
+  if ( buf0 == NULL || buf1 == NULL )
+  {
+    _mscd_buf[0]  = _mscd_default_buf[0];
+    _mscd_buf[1]  = _mscd_default_buf[1];
+    _mscd_bufsize = CFG_TUD_MSC_EP_BUFSIZE;
+    return true;
+  }
+
+  TU_VERIFY(bufsize >= CFG_TUD_MSC_EP_BUFSIZE && bufsize < UINT16_MAX);
+
+  _mscd_buf[0]  = buf0;
+  _mscd_buf[1]  = buf1;
+  _mscd_bufsize = bufsize;
+  return true;
+}
+
 //--------------------------------------------------------------------+
 // USBD Driver API
 //--------------------------------------------------------------------+
@@ -289,6 +326,9 @@ static void proc_bot_reset(mscd_interface_t* p_msc)
   p_msc->stage       = MSC_STAGE_CMD;
   p_msc->total_len   = 0;
   p_msc->xferred_len = 0;
+  p_msc->ahead_busy  = false;
+  p_msc->ahead_len   = 0;
+  p_msc->left_len    = 0;
 
   p_msc->sense_key           = 0;
   p_msc->add_sense_code      = 0;
@@ -420,10 +460,16 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
       p_csw->data_residue = 0;
       p_csw->status       = MSC_CSW_STATUS_PASSED;
 
+      trace(p_msc, MSC_TRACE_CBW, p_cbw->total_bytes);
+
       /*------------- Parse command and prepare DATA -------------*/
       p_msc->stage = MSC_STAGE_DATA;
       p_msc->total_len = p_cbw->total_bytes;
       p_msc->xferred_len = 0;
+      p_msc->buf_idx = 0;
+      p_msc->ahead_busy = false;
+      p_msc->ahead_len = 0;
+      p_msc->left_len = 0;
 
       // Read10 or Write10
       if ( (SCSI_CMD_READ_10 == p_cbw->command[0]) || (SCSI_CMD_WRITE_10 == p_cbw->command[0]) )
@@ -455,7 +501,7 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
         // 2. IN & Zero: Process if is built-in, else Invoke app callback. Skip DATA if zero length
         if ( (p_cbw->total_bytes > 0 ) && !is_data_in(p_cbw->dir) )
         {
-          if (p_cbw->total_bytes > sizeof(_mscd_buf))
+          if (p_cbw->total_bytes > _mscd_bufsize)
           {
             TU_LOG(MSC_DEBUG, "  SCSI reject non READ10/WRITE10 with large data\r\n");
             fail_scsi_op(rhport, p_msc, MSC_CSW_STATUS_FAILED);
@@ -463,18 +509,21 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
           {
             // Didn't check for case 9 (Ho > Dn), which requires examining scsi command first
             // but it is OK to just receive data then responded with failed status
-            TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf, (uint16_t) p_msc->total_len) );
+            trace(p_msc, MSC_TRACE_XFER_QUEUED, p_msc->total_len);
+            TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[0], (uint16_t) p_msc->total_len) );
           }
         }else
         {
           // First process if it is a built-in commands
-          int32_t resplen = proc_builtin_scsi(p_cbw->lun, p_cbw->command, _mscd_buf, sizeof(_mscd_buf));
+          trace(p_msc, MSC_TRACE_APP_BEGIN, 0);
+          int32_t resplen = proc_builtin_scsi(p_cbw->lun, p_cbw->command, _mscd_buf[0], _mscd_bufsize);
 
           // Invoke user callback if not built-in
           if ( (resplen < 0) && (p_msc->sense_key == 0) )
           {
-            resplen = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf, (uint16_t) p_msc->total_len);
+            resplen = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf[0], (uint16_t) p_msc->total_len);
           }
+          trace(p_msc, MSC_TRACE_APP_END, 0);
 
           if ( resplen < 0 )
           {
@@ -506,7 +555,8 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
             {
               // cannot return more than host expect
               p_msc->total_len = tu_min32((uint32_t) resplen, p_cbw->total_bytes);
-              TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf, (uint16_t) p_msc->total_len) );
+              trace(p_msc, MSC_TRACE_XFER_QUEUED, p_msc->total_len);
+              TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf[0], (uint16_t) p_msc->total_len) );
             }
           }
         }
@@ -516,6 +566,7 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
     case MSC_STAGE_DATA:
       TU_LOG(MSC_DEBUG, "  SCSI Data [Lun%u]\r\n", p_cbw->lun);
       //TU_LOG_MEM(MSC_DEBUG, _mscd_buf, xferred_bytes, 2);
+      trace(p_msc, MSC_TRACE_XFER_DONE, xferred_bytes);
 
       if (SCSI_CMD_READ_10 == p_cbw->command[0])
       {
@@ -541,7 +592,9 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
         // OUT transfer, invoke callback if needed
         if ( !is_data_in(p_cbw->dir) )
         {
-          int32_t cb_result = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf, (uint16_t) p_msc->total_len);
+          trace(p_msc, MSC_TRACE_APP_BEGIN, 0);
+          int32_t cb_result = tud_msc_scsi_cb(p_cbw->lun, p_cbw->command, _mscd_buf[0], (uint16_t) p_msc->total_len);
+          trace(p_msc, MSC_TRACE_APP_END, 0);
 
           if ( cb_result < 0 )
           {
@@ -577,6 +630,7 @@ bool mscd_xfer_cb(uint8_t rhport, uint8_t ep_addr, xfer_result_t event, uint32_t
       {
         TU_LOG(MSC_DEBUG, "  SCSI Status [Lun%u] = %u\r\n", p_cbw->lun, p_csw->status);
         // TU_LOG_MEM(MSC_DEBUG, p_csw, xferred_bytes, 2);
+        trace(p_msc, MSC_TRACE_CSW, p_csw->status);
 
         // Invoke complete callback if defined
         // Note: There is racing issue with samd51 + qspi flash testing with arduino
@@ -748,10 +802,17 @@ static int32_t proc_builtin_scsi(uint8_t lun, uint8_t const scsi_cmd[16], uint8_
 
     case SCSI_CMD_INQUIRY:
     {
+      // vital product data (EVPD) is left to tud_msc_scsi_cb()
+      if ( scsi_cmd[1] & 0x01 )
+      {
+        resplen = -1;
+        break;
+      }
+
       scsi_inquiry_resp_t inquiry_rsp =
       {
           .is_removable         = 1,
-          .version              = 2,
+          .version              = CFG_TUD_MSC_INQUIRY_VERSION,
           .response_data_format = 2,
           .additional_length    = sizeof(scsi_inquiry_resp_t) - 5,
       };
@@ -832,15 +893,29 @@ static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc)
   // block size already verified not zero
   uint16_t const block_sz = rdwr10_get_blocksize(p_cbw);
 
-  // Adjust lba with transferred bytes
-  uint32_t const lba = rdwr10_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
+  int32_t nbytes;
 
-  // remaining bytes capped at class buffer
-  int32_t nbytes = (int32_t) tu_min32(sizeof(_mscd_buf), p_cbw->total_bytes-p_msc->xferred_len);
+  if ( p_msc->ahead_len != 0 )
+  {
+    // next chunk was already read while the previous one was on the bus
+    nbytes = p_msc->ahead_len;
+    p_msc->ahead_len = 0;
+    if ( nbytes > 0 ) p_msc->buf_idx ^= 1;
+  }
+  else
+  {
+    // Adjust lba with transferred bytes
+    uint32_t const lba = rdwr10_get_lba(p_cbw->command) + (p_msc->xferred_len / block_sz);
 
-  // Application can consume smaller bytes
-  uint32_t const offset = p_msc->xferred_len % block_sz;
-  nbytes = tud_msc_read10_cb(p_cbw->lun, lba, offset, _mscd_buf, (uint32_t) nbytes);
+    // remaining bytes capped at class buffer
+    nbytes = (int32_t) tu_min32(_mscd_bufsize, p_cbw->total_bytes-p_msc->xferred_len);
+
+    // Application can consume smaller bytes
+    uint32_t const offset = p_msc->xferred_len % block_sz;
+    trace(p_msc, MSC_TRACE_APP_BEGIN, 0);
+    nbytes = tud_msc_read10_cb(p_cbw->lun, lba, offset, _mscd_buf[p_msc->buf_idx], (uint32_t) nbytes);
+    trace(p_msc, MSC_TRACE_APP_END, 0);
+  }
 
   if ( nbytes < 0 )
   {
@@ -859,7 +934,22 @@ static void proc_read10_cmd(uint8_t rhport, mscd_interface_t* p_msc)
   }
   else
   {
-    TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf, (uint16_t) nbytes), );
+    trace(p_msc, MSC_TRACE_XFER_QUEUED, (uint32_t) nbytes);
+    TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_in, _mscd_buf[p_msc->buf_idx], (uint16_t) nbytes), );
+
+    // While this chunk is sent, read the following one into the other buffer.
+    // A failure is only reported once the host asks for that data.
+    uint32_t const next = p_msc->xferred_len + (uint32_t) nbytes;
+    if ( next < p_cbw->total_bytes )
+    {
+      uint32_t const lba    = rdwr10_get_lba(p_cbw->command) + (next / block_sz);
+      uint32_t const offset = next % block_sz;
+      uint32_t const len    = tu_min32(_mscd_bufsize, p_cbw->total_bytes - next);
+
+      trace(p_msc, MSC_TRACE_APP_BEGIN, 0);
+      p_msc->ahead_len = tud_msc_read10_cb(p_cbw->lun, lba, offset, _mscd_buf[p_msc->buf_idx ^ 1], len);
+      trace(p_msc, MSC_TRACE_APP_END, 0);
+    }
   }
 }
 
@@ -883,10 +973,11 @@ static void proc_write10_cmd(uint8_t rhport, mscd_interface_t* p_msc)
   }
 
   // remaining bytes capped at class buffer
-  uint16_t nbytes = (uint16_t) tu_min32(sizeof(_mscd_buf), p_cbw->total_bytes-p_msc->xferred_len);
+  uint16_t nbytes = (uint16_t) tu_min32(_mscd_bufsize, p_cbw->total_bytes-p_msc->xferred_len);
 
   // Write10 callback will be called later when usb transfer complete
-  TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf, nbytes), );
+  trace(p_msc, MSC_TRACE_XFER_QUEUED, nbytes);
+  TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[p_msc->buf_idx], nbytes), );
 }
 
 // process new data arrived from WRITE10
@@ -894,6 +985,40 @@ static void proc_write10_new_data(uint8_t rhport, mscd_interface_t* p_msc, uint3
 {
   msc_cbw_t const * p_cbw = &p_msc->cbw;
 
+  if ( p_msc->ahead_busy )
+  {
+    // Data landed in the other buffer. Only one OUT transfer is ever queued, so this is it.
+    p_msc->ahead_busy = false;
+    p_msc->ahead_len  = (int32_t) xferred_bytes;
+
+    // still writing the current buffer: it picks the new data up when done
+    if ( p_msc->left_len ) return;
+
+    p_msc->buf_idx  ^= 1;
+    p_msc->ahead_len = 0;
+  }
+
+  p_msc->left_off = 0;
+  p_msc->left_len = xferred_bytes;
+
+  // Receive the next chunk into the other buffer while this one is written to storage
+  uint32_t const next = p_msc->xferred_len + xferred_bytes;
+  if ( next < p_cbw->total_bytes )
+  {
+    uint16_t const nbytes = (uint16_t) tu_min32(_mscd_bufsize, p_cbw->total_bytes - next);
+    p_msc->ahead_busy = true;
+    trace(p_msc, MSC_TRACE_XFER_QUEUED, nbytes);
+    TU_ASSERT( usbd_edpt_xfer(rhport, p_msc->ep_out, _mscd_buf[p_msc->buf_idx ^ 1], nbytes), );
+  }
+
+  proc_write10_consume(rhport, p_msc);
+}
+
+// hand the unconsumed part of the current buffer to the application
+static void proc_write10_consume(uint8_t rhport, mscd_interface_t* p_msc)
+{
+  msc_cbw_t const * p_cbw = &p_msc->cbw;
+
   // block size already verified not zero
   uint16_t const block_sz = rdwr10_get_blocksize(p_cbw);
 
@@ -902,7 +1027,9 @@ static void proc_write10_new_data(uint8_t rhport, mscd_interface_t* p_msc, uint3
 
   // Invoke callback to consume new data
   uint32_t const offset = p_msc->xferred_len % block_sz;
-  int32_t nbytes = tud_msc_write10_cb(p_cbw->lun, lba, offset, _mscd_buf, xferred_bytes);
+  trace(p_msc, MSC_TRACE_APP_BEGIN, 0);
+  int32_t nbytes = tud_msc_write10_cb(p_cbw->lun, lba, offset, _mscd_buf[p_msc->buf_idx] + p_msc->left_off, p_msc->left_len);
+  trace(p_msc, MSC_TRACE_APP_END, 0);
 
   if ( nbytes < 0 )
   {
@@ -910,43 +1037,70 @@ static void proc_write10_new_data(uint8_t rhport, mscd_interface_t* p_msc, uint3
     TU_LOG(MSC_DEBUG, "  tud_msc_write10_cb() return -1\r\n");
 
     // update actual byte before failed
-    p_msc->xferred_len += xferred_bytes;
+    p_msc->xferred_len += p_msc->left_len;
+    p_msc->left_len = 0;
 
     // Set sense
     set_sense_medium_not_present(p_cbw->lun);
 
     fail_scsi_op(rhport, p_msc, MSC_CSW_STATUS_FAILED);
-  }else
+  }
+  else if ( (uint32_t) nbytes < p_msc->left_len )
   {
     // Application consume less than what we got (including zero)
-    if ( (uint32_t) nbytes < xferred_bytes )
-    {
-      uint32_t const left_over = xferred_bytes - (uint32_t) nbytes;
-      if ( nbytes > 0 )
-      {
-        p_msc->xferred_len += (uint16_t) nbytes;
-        memmove(_mscd_buf, _mscd_buf+nbytes, left_over);
-      }
+    p_msc->xferred_len += (uint32_t) nbytes;
+    p_msc->left_off    += (uint32_t) nbytes;
+    p_msc->left_len    -= (uint32_t) nbytes;
 
-      // simulate an transfer complete with adjusted parameters --> callback will be invoked with adjusted parameter
-      dcd_event_xfer_complete(rhport, p_msc->ep_out, left_over, XFER_RESULT_SUCCESS, false);
+    // Call again later. Not through a simulated transfer complete: the OUT transfer into the
+    // other buffer may be in flight and its completion must not be confused with this one.
+    usbd_defer_func(proc_write10_retry, (void*) (uintptr_t) rhport, false);
+  }
+  else
+  {
+    // Application consume all bytes in our buffer
+    p_msc->xferred_len += p_msc->left_len;
+    p_msc->left_len = 0;
+
+    if ( p_msc->ahead_len > 0 )
+    {
+      // next chunk arrived meanwhile
+      uint32_t const len = (uint32_t) p_msc->ahead_len;
+      p_msc->buf_idx  ^= 1;
+      p_msc->ahead_len = 0;
+      proc_write10_new_data(rhport, p_msc, len);
     }
-    else
+    else if ( p_msc->ahead_busy )
     {
-      // Application consume all bytes in our buffer
-      p_msc->xferred_len += xferred_bytes;
-
-      if ( p_msc->xferred_len >= p_msc->total_len )
-      {
-        // Data Stage is complete
-        p_msc->stage = MSC_STAGE_STATUS;
-      }else
-      {
-        // prepare to receive more data from host
-        proc_write10_cmd(rhport, p_msc);
-      }
+      // wait for the OUT transfer into the other buffer
+    }
+    else if ( p_msc->xferred_len >= p_msc->total_len )
+    {
+      // Data Stage is complete
+      p_msc->stage = MSC_STAGE_STATUS;
+    }else
+    {
+      // prepare to receive more data from host
+      proc_write10_cmd(rhport, p_msc);
     }
   }
 }
 
+static void proc_write10_retry(void* param)
+{
+  uint8_t const rhport = (uint8_t) (uintptr_t) param;
+  mscd_interface_t* p_msc = &_mscd_itf;
+
+  // the command may have been aborted by a reset meanwhile
+  if ( (p_msc->stage != MSC_STAGE_DATA) || (p_msc->cbw.command[0] != SCSI_CMD_WRITE_10) || !p_msc->left_len ) return;
+
+  proc_write10_consume(rhport, p_msc);
+
+  // the data stage may have completed, which normally happens in mscd_xfer_cb()
+  if ( p_msc->stage == MSC_STAGE_STATUS && !usbd_edpt_stalled(rhport, p_msc->ep_in) )
+  {
+    TU_ASSERT( send_csw(rhport, p_msc), );
+  }
+}
+
 #endif
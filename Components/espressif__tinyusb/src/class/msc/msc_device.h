@@ -50,6 +50,23 @@
 
 TU_VERIFY_STATIC(CFG_TUD_MSC_EP_BUFSIZE < UINT16_MAX, "Size is not correct");
 
+// Version reported by INQUIRY: 2 (SCSI-2) by default, 5 (SPC-3) makes hosts ask for the vital product
+// data pages and READ CAPACITY (16), which are then answered by tud_msc_scsi_cb()
+#ifndef CFG_TUD_MSC_INQUIRY_VERSION
+  #define CFG_TUD_MSC_INQUIRY_VERSION  2
+#endif
+
+// Points of a SCSI command reported to tud_msc_trace_cb()
+typedef enum
+{
+  MSC_TRACE_CBW = 0,      // command received, value: data stage length expected by the host
+  MSC_TRACE_APP_BEGIN,    // an application callback is invoked for the command
+  MSC_TRACE_APP_END,      // the application callback returned
+  MSC_TRACE_XFER_QUEUED,  // data stage transfer queued on the endpoint, value: bytes
+  MSC_TRACE_XFER_DONE,    // data stage transfer completed, value: bytes transferred
+  MSC_TRACE_CSW,          // status received by the host, value: CSW status
+} msc_trace_event_t;
+
 //--------------------------------------------------------------------+
 // Application API
 //--------------------------------------------------------------------+
@@ -57,6 +74,11 @@ TU_VERIFY_STATIC(CFG_TUD_MSC_EP_BUFSIZE < UINT16_MAX, "Size is not correct");
 // Set SCSI sense response
 bool tud_msc_set_sense(uint8_t lun, uint8_t sense_key, uint8_t add_sense_code, uint8_t add_sense_qualifier);
 
+// Replace the two data stage buffers, e.g. with larger ones allocated at runtime. Must be called before
+// tusb_init(). bufsize is the size of each buffer, a multiple of the block size and less than UINT16_MAX.
+// Passing NULL restores the built-in CFG_TUD_MSC_EP_BUFSIZE buffers.
+bool tud_msc_set_buffers(uint8_t* buf0, uint8_t* buf1, uint32_t bufsize);
+
 //--------------------------------------------------------------------+
 // Application Callbacks (WEAK is optional)
 //--------------------------------------------------------------------+
@@ -146,6 +168,11 @@ TU_ATTR_WEAK void tud_msc_scsi_complete_cb(uint8_t lun, uint8_t const scsi_cmd[1
 // Invoked to check if device is writable as part of SCSI WRITE10
 TU_ATTR_WEAK bool tud_msc_is_writable_cb(uint8_t lun);
 
+// Invoked at each point of a SCSI command listed in msc_trace_event_t, e.g. to measure latencies.
+// READ10/WRITE10 data stages are double buffered: an application callback may run while a transfer
+// is queued. Must return quickly.
+TU_ATTR_WEAK void tud_msc_trace_cb(uint8_t lun, uint8_t const scsi_cmd[16], msc_trace_event_t event, uint32_t value);
+
 //--------------------------------------------------------------------+
 // Internal Class Driver API
 //--------------------------------------------------------------------+
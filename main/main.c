@@ -21,6 +21,8 @@
 #include "esp_mac.h" // for MACSTR
 #include "esp_partition.h"
 #include "esp_check.h"
+#include "esp_timer.h"
+#include "wear_levelling.h"
 
 #include "lwip/dns.h"
 
@@ -34,6 +36,9 @@
 #include <sys/stat.h>
 
 #include "ftp.h"
+#include "tftp.h"
+#include "journal.h"
+#include "fs_worker.h"
 #include "wifi.h"
 #include "nvs_rw.h"
 #include "sd_card.h"
@@ -46,11 +51,24 @@
 #define CONFIG_MDNS_HOSTNAME "ftp-server"
 #define CONFIG_NTP_SERVER	"pool.ntp.org"
 
+// LUN 1: the "storage" FAT partition of the internal flash, mounted here while the host does not use it
+#define CONFIG_MSC_FLASH_MOUNT_POINT "/config"
+
 #define CONFIG_FTP_USER "esp32"
 #define CONFIG_FTP_PASSWORD "esp32"
 
 #define TUSB_DESC_TOTAL_LEN (TUD_CONFIG_DESC_LEN + TUD_MSC_DESC_LEN)
 
+// Boot phases, set in xEventTask once done
+#define BOOT_STORAGE    BIT0    // MSC storages registered, the SD card comes up in the background
+#define BOOT_USB        BIT1
+#define BOOT_WIFI       BIT2    // connected, or given up on
+#define BOOT_MDNS       BIT3
+#define BOOT_TIME       BIT4    // clock set over NTP, or left provisional
+#define BOOT_SERVERS    BIT5    // FTP and TFTP
+#define BOOT_ALL        (BOOT_STORAGE | BOOT_USB | BOOT_WIFI | BOOT_MDNS | BOOT_TIME | BOOT_SERVERS)
+#define BOOT_PHASE_PRIO 5
+
 enum {
     ITF_NUM_MSC = 0,
     ITF_NUM_TOTAL
@@ -64,6 +82,25 @@ enum {
     EDPT_MSC_IN   = 0x81,
 };
 
+/**********************
+ *      TYPEDEFS
+ **********************/
+
+// A step of the boot, run in its own task as soon as the phases it needs are done
+typedef struct
+{
+    const char     *name;
+    void          (*run)(void);
+    EventBits_t     needs;
+    EventBits_t     done;
+    uint32_t        stack;
+} boot_phase_t;
+
+typedef struct
+{
+    uint32_t        start_ms;       // since power-up
+    uint32_t        end_ms;
+} boot_phase_time_t;
 
 /***********************************
  *           DATA
@@ -74,8 +111,7 @@ extern char ftp_pass[FTP_USER_PASS_LEN_MAX + 1];
 
 sdmmc_host_t host = SDMMC_HOST_DEFAULT();
 sdmmc_card_t sd_card;
-
-SemaphoreHandle_t sem_sd_card;
+sd_card_bus_info_t sd_bus_info;
 
 /***********************************
  *   PRIVATE DATA
@@ -130,21 +166,87 @@ static uint8_t const desc_configuration[] = {
  **********************************/
 
 static void _mount(void);
+static void storage_sd_event_cb(sd_card_event_t event, void *arg);
+static void storage_sd_bus_lock(bool lock, void *arg);
+#if CONFIG_STORAGE_BENCH_AT_BOOT
+static void storage_benchmark(void);
+#endif
 static uint64_t mp_hal_ticks_ms();
 static void initialise_mDNS(void);
 static void initialize_sNTP(void);
 static esp_err_t obtain_time(void);
 static void time_sync_notification_cb(struct timeval *tv);
+static uint32_t boot_ms(void);
+static void boot_phase_task(void *arg);
+static void boot_storage(void);
+static void boot_usb(void);
+static void boot_wifi(void);
+static void boot_time(void);
+static void boot_servers(void);
+
+/*
+ * USB only needs the storages registered, not the card: the host sees an empty slot until the SD
+ * manager task brought one up. The servers need the network and the storages; NTP only sets the
+ * clock, the files written before it did get provisional timestamps.
+ */
+static const boot_phase_t boot_phases[] =
+{
+    { "storage", boot_storage,    0,                          BOOT_STORAGE, 1024 * 6 },
+    { "usb",     boot_usb,        BOOT_STORAGE,               BOOT_USB,     1024 * 3 },
+    { "wifi",    boot_wifi,       0,                          BOOT_WIFI,    1024 * 4 },
+    { "mdns",    initialise_mDNS, BOOT_WIFI,                  BOOT_MDNS,    1024 * 4 },
+    { "ntp",     boot_time,       BOOT_WIFI,                  BOOT_TIME,    1024 * 3 },
+    { "servers", boot_servers,    BOOT_WIFI | BOOT_STORAGE,   BOOT_SERVERS, 1024 * 3 },
+};
+
+#define BOOT_PHASES     (sizeof(boot_phases) / sizeof(boot_phases[0]))
+
+static boot_phase_time_t boot_phase_times[BOOT_PHASES];
 
 static void storage_mount_changed_cb(tinyusb_msc_event_t *event)
 {
-    ESP_LOGI("[usb]", "Storage mounted to application: %s", event->mount_changed_data.is_mounted ? "Yes" : "No");
+    ESP_LOGI("[usb]", "Storage LUN %u mounted to application: %s", event->lun, event->mount_changed_data.is_mounted ? "Yes" : "No");
+    // back from the USB host: what it wrote on any LUN is journaled in the background
+    if (event->mount_changed_data.is_mounted) {
+        journal_reconcile_start();
+    }
+}
+
+/**
+ * Tells the MSC storage of LUN 0 and the journal that the SD card came or went. Called from the SD
+ * manager task; FTP and TFTP find out through sd_card_is_attached() and failing file calls, and the
+ * storage waits for them to release a removed card before it unmounts it.
+ */
+static void storage_sd_event_cb(sd_card_event_t event, void *arg)
+{
+    tinyusb_msc_storage_set_present(0, event == SD_CARD_EVENT_ATTACHED);
+    // the journal of the last card does not describe the next one
+    journal_reset();
+    if (event == SD_CARD_EVENT_ATTACHED) {
+        journal_reconcile_start();
+    }
+}
+
+/**
+ * Holds the SD card I/O queue of LUN 0 while the SD manager probes or initializes the card.
+ */
+static void storage_sd_bus_lock(bool lock, void *arg)
+{
+    if (lock) {
+        tinyusb_msc_storage_io_pause(0);
+    } else {
+        tinyusb_msc_storage_io_resume(0);
+    }
 }
 
 static void _mount(void)
 {
     ESP_LOGI(MAIN_TAG, "Mount storage...");
-    ESP_ERROR_CHECK(tinyusb_msc_storage_mount(MOUNT_POINT));
+    if (!sd_card_is_attached() || tinyusb_msc_storage_mount(MOUNT_POINT) != ESP_OK) {
+        // the SD manager task brings the card up whenever it is inserted, the servers mount it on demand
+        ESP_LOGW(MAIN_TAG, "SD card not ready yet, %s mounted later", MOUNT_POINT);
+        goto flash;
+    }
 
     // List all the files in this directory
     ESP_LOGI(MAIN_TAG, "\nls command output:");
@@ -158,15 +260,56 @@ static void _mount(void)
             //If the directory is not readable then throw error and exit
             ESP_LOGE(MAIN_TAG, "Unable to read directory %s", MOUNT_POINT);
         }
+        tinyusb_msc_storage_unmount();
         return;
     }
     //While the next entry is not readable we will print directory files
     while ((d = readdir(dh)) != NULL) {
         printf("%s\n", d->d_name);
     }
+    closedir(dh);
+    // FTP and TFTP hold the card while they use it, the USB host may have it meanwhile
+    tinyusb_msc_storage_unmount();
+
+flash:
+    ESP_LOGI(MAIN_TAG, "Mount flash storage...");
+    if (tinyusb_msc_storage_mount_lun(1, CONFIG_MSC_FLASH_MOUNT_POINT) != ESP_OK) {
+        ESP_LOGW(MAIN_TAG, "Flash storage not available at %s", CONFIG_MSC_FLASH_MOUNT_POINT);
+    }
     return;
 }
 
+#if CONFIG_STORAGE_BENCH_AT_BOOT
+/**
+ * Measures every LUN raw before it is mounted, the results are logged by the MSC storage.
+ */
+static void storage_benchmark(void)
+{
+    static tinyusb_msc_bench_result_t results[TINYUSB_MSC_BENCH_RESULTS_MAX];
+    size_t count;
+
+    for (uint8_t lun = 0; lun < tinyusb_msc_storage_get_lun_count(); lun++) {
+        ESP_LOGI(MAIN_TAG, "Benchmark of storage LUN %u...", lun);
+        if (tinyusb_msc_storage_benchmark(lun, NULL, results, TINYUSB_MSC_BENCH_RESULTS_MAX, &count) != ESP_OK) {
+            ESP_LOGW(MAIN_TAG, "Benchmark of storage LUN %u failed after %u tests", lun, count);
+        }
+    }
+}
+#endif
+
+static esp_err_t storage_init_spiflash(wl_handle_t *wl_handle)
+{
+    ESP_LOGI(MAIN_TAG, "Initializing wear levelling");
+
+    const esp_partition_t *data_partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_DATA_FAT, NULL);
+    if (data_partition == NULL) {
+        ESP_LOGE(MAIN_TAG, "Failed to find FATFS partition. Check the partition table.");
+        return ESP_ERR_NOT_FOUND;
+    }
+
+    return wl_mount(data_partition, wl_handle);
+}
+
 static esp_err_t storage_init_sdmmc(sdmmc_card_t *card)
 {
     esp_err_t ret = ESP_OK;
@@ -175,11 +318,8 @@ static esp_err_t storage_init_sdmmc(sdmmc_card_t *card)
 
     ESP_LOGI(MAIN_TAG, "Initializing SDCard");
 
-    // By default, SD card frequency is initialized to SDMMC_FREQ_DEFAULT (20MHz)
-    // For setting a specific frequency, use host.max_freq_khz (range 400kHz - 40MHz for SDMMC)
-    // Example: for fixed frequency of 10MHz, use host.max_freq_khz = 10000;
-
-	host.max_freq_khz = 400;
+    // The card is brought up by the SD manager task, which negotiates the bus frequency and width
+    // with sd_card_bus_init(), up to 40 MHz 4-bit, see sd_card_manager_start()
 
     // This initializes the slot without card detect (CD) and write protect (WP) signals.
     // Modify slot_config.gpio_cd and slot_config.gpio_wp if your board has these signals.
@@ -190,6 +330,7 @@ static esp_err_t storage_init_sdmmc(sdmmc_card_t *card)
     slot_config.width = 4;
 #else
     slot_config.width = 1;
+    host.flags &= ~SDMMC_HOST_FLAG_4BIT;
 #endif  // CONFIG_EXAMPLE_SDMMC_BUS_WIDTH_4
 
     // On chips where the GPIOs used for SD card can be configured, set the user defined values
@@ -219,14 +360,6 @@ static esp_err_t storage_init_sdmmc(sdmmc_card_t *card)
     ESP_GOTO_ON_ERROR(sdmmc_host_init_slot(host.slot, (const sdmmc_slot_config_t *) &slot_config),
                       clean, MAIN_TAG, "Host init slot fail");
 
-    while (sdmmc_card_init(&host, card)) {
-        ESP_LOGE(MAIN_TAG, "The detection pin of the slot is disconnected(Insert uSD card). Retrying...");
-        vTaskDelay(pdMS_TO_TICKS(3000));
-    }
-
-    // Card has been initialized, print its properties
-    sdmmc_card_print_info(stdout, card);
-
     return ESP_OK;
 
 clean:
@@ -289,86 +422,69 @@ void ftp_task(void *pvParameters)
 	vTaskDelete(NULL);
 }
 
+void tftp_task(void *pvParameters)
+{
+	ESP_LOGI(TFTP_TAG, "tftp_task start");
+
+	// Open the TFTP port and allocate the transfer window
+	if (!tftp_init())
+	{
+		ESP_LOGE(TFTP_TAG, "Init Error");
+		vTaskDelete(NULL);
+	}
+
+	while (1)
+	{
+		// Each call waits for one request and serves the whole transfer
+		if (tftp_run(1000) < 0)
+		{
+			ESP_LOGE(TFTP_TAG, "Run Error");
+			break;
+		}
+	}
+
+	tftp_deinit();
+	ESP_LOGW(TFTP_TAG, "Task terminated!");
+	vTaskDelete(NULL);
+}
+
 void usb_device_task(void *pvParameters)
 {
+    bool enumerated = false;
+
     ESP_LOGI("[usb_device]", "usb_device_task start");
     while (1)
     {
-        // if (xSemaphoreTake(sem_sd_card, 10) == pdTRUE)
-        // {
-        //     tud_task();
-        //     xSemaphoreGive(sem_sd_card);          
-        // }
         tud_task();
+        if (!enumerated && tud_mounted())
+        {
+            enumerated = true;
+            ESP_LOGI("[usb_device]", "Enumerated %lu ms after power-up", boot_ms());
+        }
         vTaskDelay(1);
     }
 }
 
 void app_main(void)
 {
-	esp_err_t ret;
-
-	NVS_Init();
-	WIFI_StaInit();
-	WIFI_Connect((uint8_t *)ssid, (uint8_t *)pass);
-
-	initialise_mDNS();
-
-	// obtain time over NTP
-	ESP_LOGI(MAIN_TAG, "Getting time over NTP.");
-	ret = obtain_time();
-	if (ret != ESP_OK)
-	{
-		ESP_LOGE(MAIN_TAG, "Fail to getting time over NTP.");
-		while (1)
-		{
-			vTaskDelay(10);
-		}
-	}
-
-	// Show current date & time
-	time_t now;
-	struct tm timeinfo;
-	char strftime_buf[64];
-	time(&now);
-	now = now + (0 * 60 * 60);
-	localtime_r(&now, &timeinfo);
-	strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
-	ESP_LOGI(MAIN_TAG, "The local date/time is: %s", strftime_buf);
-	ESP_LOGW(MAIN_TAG, "This server manages file timestamps in GMT.");
+    // the SD bus profile and the WiFi credentials are kept in NVS
+    NVS_Init();
+    xEventTask = xEventGroupCreate();
 
-	ESP_ERROR_CHECK(storage_init_sdmmc(&sd_card));
-
-    const tinyusb_msc_sdmmc_config_t config_sdmmc = 
+    for (size_t i = 0; i < BOOT_PHASES; i++)
     {
-        .card = &sd_card,
-        .callback_mount_changed = storage_mount_changed_cb,  /* First way to register the callback. This is while initializing the storage. */
-        .mount_config.max_files = 5,
-    };
-    ESP_ERROR_CHECK(tinyusb_msc_storage_init_sdmmc(&config_sdmmc));
-    ESP_ERROR_CHECK(tinyusb_msc_register_callback(TINYUSB_MSC_EVENT_MOUNT_CHANGED, storage_mount_changed_cb));
-
-	_mount();
+        if (xTaskCreate(boot_phase_task, boot_phases[i].name, boot_phases[i].stack, (void *)&boot_phases[i],
+                        BOOT_PHASE_PRIO, NULL) != pdPASS)
+            ESP_LOGE(MAIN_TAG, "Boot phase %s could not start", boot_phases[i].name);
+    }
 
-    ESP_LOGI("[usb]", "USB MSC initialization");
-    const tinyusb_config_t tusb_cfg = 
+    xEventGroupWaitBits(xEventTask, BOOT_ALL, pdFALSE, pdTRUE, portMAX_DELAY);
+    ESP_LOGI(MAIN_TAG, "Boot done %lu ms after power-up:", boot_ms());
+    for (size_t i = 0; i < BOOT_PHASES; i++)
     {
-        .device_descriptor = &descriptor_config,
-        .string_descriptor = string_desc_arr,
-        .string_descriptor_count = 
-                sizeof(string_desc_arr) / sizeof(string_desc_arr[0]),
-        .external_phy = false,
-        .configuration_descriptor = desc_configuration,
-    };
-    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
-
-    sem_sd_card = xSemaphoreCreateMutex();
-
-    ESP_LOGI("[usb]", "USB MSC initialization DONE");
-
-	xEventTask = xEventGroupCreate();
-    xTaskCreate(usb_device_task, "usb_device", 1024*6, NULL, 6, NULL);
-	xTaskCreate(ftp_task, "FTP", 1024*6, NULL, 5, NULL);
+        ESP_LOGI(MAIN_TAG, "  %-8s %6lu .. %6lu ms", boot_phases[i].name,
+                 boot_phase_times[i].start_ms, boot_phase_times[i].end_ms);
+    }
 }
 
 /***********************************
@@ -422,4 +538,126 @@ static esp_err_t obtain_time(void)
 static void time_sync_notification_cb(struct timeval *tv)
 {
 	ESP_LOGI(MAIN_TAG, "Notification of a time synchronization event");
+}
+
+static uint32_t boot_ms(void)
+{
+    return (uint32_t)(esp_timer_get_time() / 1000);
+}
+
+/**
+ * Waits for the phases `arg` needs, runs it and marks it done for the ones waiting on it.
+ */
+static void boot_phase_task(void *arg)
+{
+    const boot_phase_t *phase = arg;
+    boot_phase_time_t *when = &boot_phase_times[phase - boot_phases];
+
+    if (phase->needs)
+        xEventGroupWaitBits(xEventTask, phase->needs, pdFALSE, pdTRUE, portMAX_DELAY);
+    when->start_ms = boot_ms();
+    phase->run();
+    when->end_ms = boot_ms();
+    ESP_LOGI(MAIN_TAG, "Boot phase %s took %lu ms", phase->name, when->end_ms - when->start_ms);
+    xEventGroupSetBits(xEventTask, phase->done);
+    vTaskDelete(NULL);
+}
+
+static void boot_storage(void)
+{
+    ESP_ERROR_CHECK(storage_init_sdmmc(&sd_card));
+
+    const tinyusb_msc_sdmmc_config_t config_sdmmc = 
+    {
+        .card = &sd_card,
+        .callback_mount_changed = storage_mount_changed_cb,  /* First way to register the callback. This is while initializing the storage. */
+        .mount_config.max_files = 5,
+    };
+    ESP_ERROR_CHECK(tinyusb_msc_storage_init_sdmmc(&config_sdmmc));
+    ESP_ERROR_CHECK(tinyusb_msc_register_callback_lun(0, TINYUSB_MSC_EVENT_MOUNT_CHANGED, storage_mount_changed_cb));
+
+    // no card until the SD manager task brought one up: the host sees an empty slot meanwhile
+    tinyusb_msc_storage_set_present(0, false);
+    ESP_ERROR_CHECK(sd_card_add_listener(storage_sd_event_cb, NULL));
+    const sd_card_manager_config_t config_sd_manager =
+    {
+        .host = &host,
+        .card = &sd_card,
+        .info = &sd_bus_info,
+        .gpio_cd = CONFIG_EXAMPLE_PIN_CD,
+        .bus_lock = storage_sd_bus_lock,
+    };
+    ESP_ERROR_CHECK(sd_card_manager_start(&config_sd_manager));
+
+    // the SD card stays LUN 0, the flash partition is exposed next to it as LUN 1
+    static wl_handle_t wl_handle = WL_INVALID_HANDLE;
+    if (storage_init_spiflash(&wl_handle) == ESP_OK) {
+        const tinyusb_msc_spiflash_config_t config_spi =
+        {
+            .wl_handle = wl_handle,
+            .callback_mount_changed = storage_mount_changed_cb,
+            .mount_config.max_files = 5,
+        };
+        ESP_ERROR_CHECK(tinyusb_msc_storage_init_spiflash(&config_spi));
+    }
+
+#if CONFIG_STORAGE_BENCH_AT_BOOT
+    storage_benchmark();
+#endif
+    _mount();
+
+    journal_init();
+    fs_worker_init();
+}
+
+static void boot_usb(void)
+{
+    ESP_LOGI("[usb]", "USB MSC initialization");
+    const tinyusb_config_t tusb_cfg = 
+    {
+        .device_descriptor = &descriptor_config,
+        .string_descriptor = string_desc_arr,
+        .string_descriptor_count = 
+                sizeof(string_desc_arr) / sizeof(string_desc_arr[0]),
+        .external_phy = false,
+        .configuration_descriptor = desc_configuration,
+    };
+    ESP_ERROR_CHECK(tinyusb_driver_install(&tusb_cfg));
+    xTaskCreate(usb_device_task, "usb_device", 1024*6, NULL, 6, NULL);
+    ESP_LOGI("[usb]", "USB MSC initialization DONE");
+}
+
+static void boot_wifi(void)
+{
+    WIFI_StaInit();
+    if (WIFI_Connect((uint8_t *)ssid, (uint8_t *)pass) != CONNECT_OK)
+        ESP_LOGW(MAIN_TAG, "WiFi not connected, the servers start anyway");
+}
+
+static void boot_time(void)
+{
+    ESP_LOGI(MAIN_TAG, "Getting time over NTP.");
+    if (obtain_time() != ESP_OK)
+    {
+        // SNTP keeps polling, time_sync_notification_cb() tells when the clock is finally set
+        ESP_LOGW(MAIN_TAG, "Fail to getting time over NTP, file timestamps are provisional until then.");
+        return;
+    }
+
+    // Show current date & time
+    time_t now;
+    struct tm timeinfo;
+    char strftime_buf[64];
+    time(&now);
+    now = now + (0 * 60 * 60);
+    localtime_r(&now, &timeinfo);
+    strftime(strftime_buf, sizeof(strftime_buf), "%c", &timeinfo);
+    ESP_LOGI(MAIN_TAG, "The local date/time is: %s", strftime_buf);
+    ESP_LOGW(MAIN_TAG, "This server manages file timestamps in GMT.");
+}
+
+static void boot_servers(void)
+{
+    xTaskCreate(ftp_task, "FTP", 1024*6, NULL, 5, NULL);
+    xTaskCreate(tftp_task, "TFTP", 1024*4, NULL, 5, NULL);
 }
\ No newline at end of file